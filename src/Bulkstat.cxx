@@ -0,0 +1,110 @@
+// SPDX-License-Identifier: BSD-2-Clause OR GPL-2.0-or-later
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#include "Bulkstat.hxx"
+#include "system/Error.hxx"
+#include "config.h"
+
+#include <algorithm> // for std::lower_bound()
+#include <cassert>
+#include <stdexcept>
+
+#include <linux/magic.h> // for XFS_SUPER_MAGIC
+#include <sys/stat.h> // for S_ISREG()
+#include <sys/vfs.h> // for fstatfs()
+
+#ifdef HAVE_XFS
+#include <xfs/xfs.h>
+#include <sys/ioctl.h>
+#endif
+
+/**
+ * The number of inodes requested with one XFS_IOC_BULKSTAT call.
+ */
+static constexpr std::size_t BULKSTAT_BATCH = 4096;
+
+void
+InodeTable::Append(const Inode &inode) noexcept
+{
+	assert(inodes.empty() || inode.ino > inodes.back().ino);
+
+	inodes.push_back(inode);
+}
+
+const InodeTable::Inode *
+InodeTable::Find(uint_least64_t ino) const noexcept
+{
+	const auto i = std::lower_bound(inodes.begin(), inodes.end(), ino,
+					[](const Inode &inode, uint_least64_t value){
+						return inode.ino < value;
+					});
+	if (i == inodes.end() || i->ino != ino)
+		return nullptr;
+
+	return &*i;
+}
+
+bool
+IsXFS(FileDescriptor fd) noexcept
+{
+	struct statfs s;
+	return fstatfs(fd.Get(), &s) == 0 && s.f_type == XFS_SUPER_MAGIC;
+}
+
+#ifdef HAVE_XFS
+
+BulkstatReader::BulkstatReader(FileDescriptor _fd)
+	:fd(_fd),
+	 buffer(std::make_unique<std::byte[]>(XFS_BULKSTAT_REQ_SIZE(BULKSTAT_BATCH)))
+{
+}
+
+bool
+BulkstatReader::ReadBatch(InodeTable &table)
+{
+	auto &request = *reinterpret_cast<struct xfs_bulkstat_req *>(buffer.get());
+	request.hdr = {};
+	request.hdr.ino = next_ino;
+	request.hdr.icount = BULKSTAT_BATCH;
+
+	if (ioctl(fd.Get(), XFS_IOC_BULKSTAT, &request) < 0)
+		throw MakeErrno("XFS_IOC_BULKSTAT failed");
+
+	if (request.hdr.ocount == 0)
+		return false;
+
+	for (std::size_t i = 0; i < request.hdr.ocount; ++i) {
+		const auto &bs = request.bulkstat[i];
+		if (!S_ISREG(bs.bs_mode))
+			continue;
+
+		table.Append({
+			.ino = bs.bs_ino,
+			.atime = FileTime{bs.bs_atime},
+			/* bs_blocks is in filesystem blocks */
+			.size = bs.bs_blocks * bs.bs_blksize,
+		});
+	}
+
+	/* the kernel has advanced hdr.ino past the last inode it
+	   returned */
+	next_ino = request.hdr.ino;
+	return true;
+}
+
+#else
+
+BulkstatReader::BulkstatReader(FileDescriptor _fd)
+	:fd(_fd)
+{
+	throw std::runtime_error{"XFS support is disabled"};
+}
+
+bool
+BulkstatReader::ReadBatch(InodeTable &)
+{
+	return false;
+}
+
+#endif
@@ -0,0 +1,97 @@
+// SPDX-License-Identifier: BSD-2-Clause OR GPL-2.0-or-later
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#pragma once
+
+#include "WHistogram.hxx" // for FileTime
+#include "io/FileDescriptor.hxx"
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+/**
+ * Metadata of all regular files on a filesystem, indexed by inode
+ * number.  It is filled by #BulkstatReader.
+ */
+class InodeTable {
+public:
+	struct Inode {
+		uint_least64_t ino;
+
+		FileTime atime;
+
+		/**
+		 * The allocated size [bytes].
+		 */
+		uint_least64_t size;
+	};
+
+private:
+	/**
+	 * Sorted by inode number.
+	 */
+	std::vector<Inode> inodes;
+
+public:
+	bool empty() const noexcept {
+		return inodes.empty();
+	}
+
+	std::size_t size() const noexcept {
+		return inodes.size();
+	}
+
+	void clear() noexcept {
+		inodes.clear();
+		inodes.shrink_to_fit();
+	}
+
+	/**
+	 * Add an inode.  Its number must be larger than all inode
+	 * numbers added so far.
+	 */
+	void Append(const Inode &inode) noexcept;
+
+	[[gnu::pure]]
+	const Inode *Find(uint_least64_t ino) const noexcept;
+};
+
+/**
+ * Is the given file on an XFS filesystem?
+ */
+[[gnu::pure]]
+bool
+IsXFS(FileDescriptor fd) noexcept;
+
+/**
+ * Collects inode metadata in large batches using the
+ * XFS_IOC_BULKSTAT ioctl, which is much cheaper than one statx()
+ * per file.  This requires CAP_SYS_ADMIN.
+ */
+class BulkstatReader {
+	const FileDescriptor fd;
+
+	/**
+	 * The buffer for the struct xfs_bulkstat_req.
+	 */
+	const std::unique_ptr<std::byte[]> buffer;
+
+	uint_least64_t next_ino = 0;
+
+public:
+	/**
+	 * @param _fd any file on the XFS filesystem
+	 */
+	explicit BulkstatReader(FileDescriptor _fd);
+
+	/**
+	 * Read the next batch of inodes and append all regular files
+	 * to the #InodeTable.  Throws on error.
+	 *
+	 * @return false if all inodes have been read
+	 */
+	bool ReadBatch(InodeTable &table);
+};
@@ -0,0 +1,107 @@
+// SPDX-License-Identifier: BSD-2-Clause OR GPL-2.0-or-later
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#include "BulkstatThread.hxx"
+#include "io/FileAt.hxx"
+#include "io/Open.hxx"
+#include "system/Error.hxx"
+#include "config.h"
+
+#ifdef HAVE_LIBCAP
+#include "lib/cap/State.hxx"
+#endif
+
+#include <cassert>
+#include <thread>
+
+#include <sys/eventfd.h>
+#include <unistd.h> // for read(), write()
+
+static UniqueFileDescriptor
+CreateEventFD()
+{
+	const int fd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+	if (fd < 0)
+		throw MakeErrno("eventfd() failed");
+
+	return UniqueFileDescriptor{fd};
+}
+
+CoBulkstatThread::CoBulkstatThread(EventLoop &event_loop, FileDescriptor fd)
+	:shared(std::make_shared<Shared>(OpenDirectory({fd, "."}),
+					 CreateEventFD())),
+	 event(event_loop, BIND_THIS_METHOD(OnEventReady), shared->event_fd)
+{
+	std::thread{Run, shared}.detach();
+}
+
+CoBulkstatThread::~CoBulkstatThread() noexcept
+{
+	/* the eventfd is owned by #shared; don't close it, only
+	   unregister it */
+	event.Cancel();
+
+	shared->canceled.store(true, std::memory_order_relaxed);
+}
+
+InodeTable
+CoBulkstatThread::await_resume()
+{
+	assert(shared->done.load(std::memory_order_acquire));
+
+	if (shared->error)
+		std::rethrow_exception(shared->error);
+
+	return std::move(shared->table);
+}
+
+inline void
+CoBulkstatThread::OnEventReady(unsigned) noexcept
+{
+	event.Cancel();
+
+	/* resuming may destroy this object */
+	continuation.resume();
+}
+
+#ifdef HAVE_LIBCAP
+
+/**
+ * Raise CAP_SYS_ADMIN (which XFS_IOC_BULKSTAT needs) in the
+ * effective set of the calling thread.  The other threads are not
+ * affected.
+ */
+static void
+RaiseSysAdmin()
+{
+	auto capabilities = CapabilityState::Current();
+	static constexpr cap_value_t values[]{CAP_SYS_ADMIN};
+	capabilities.SetFlag(CAP_EFFECTIVE, values, CAP_SET);
+	capabilities.Install();
+}
+
+#endif // HAVE_LIBCAP
+
+void
+CoBulkstatThread::Run(std::shared_ptr<Shared> shared) noexcept
+{
+	try {
+#ifdef HAVE_LIBCAP
+		RaiseSysAdmin();
+#endif
+
+		BulkstatReader r{shared->fd};
+		while (!shared->canceled.load(std::memory_order_relaxed) &&
+		       r.ReadBatch(shared->table)) {}
+	} catch (...) {
+		shared->error = std::current_exception();
+	}
+
+	shared->done.store(true, std::memory_order_release);
+
+	/* wake up the EventLoop thread */
+	static constexpr uint64_t value = 1;
+	[[maybe_unused]] ssize_t nbytes = write(shared->event_fd.Get(),
+						&value, sizeof(value));
+}
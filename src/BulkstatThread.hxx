@@ -0,0 +1,97 @@
+// SPDX-License-Identifier: BSD-2-Clause OR GPL-2.0-or-later
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#pragma once
+
+#include "Bulkstat.hxx"
+#include "event/PipeEvent.hxx"
+#include "io/UniqueFileDescriptor.hxx"
+
+#include <atomic>
+#include <coroutine>
+#include <exception>
+#include <memory>
+
+/**
+ * Fills an #InodeTable with #BulkstatReader in a separate thread.
+ * XFS_IOC_BULKSTAT reads the inode clusters from disk synchronously,
+ * which would block the #EventLoop for a long time.
+ *
+ * CAP_SYS_ADMIN is raised only in this thread's effective set (see
+ * Main.cxx); it disappears when the thread exits.
+ *
+ * This is an awaitable which returns the #InodeTable (or throws).
+ * It may be destroyed at any time; the thread is then detached and
+ * stops after the current batch.
+ */
+class CoBulkstatThread final {
+	/**
+	 * State shared with the thread.
+	 */
+	struct Shared {
+		/**
+		 * A (duplicate) file descriptor on the filesystem.
+		 */
+		const UniqueFileDescriptor fd;
+
+		/**
+		 * An eventfd which wakes up the #EventLoop thread when
+		 * the thread has finished.
+		 */
+		const UniqueFileDescriptor event_fd;
+
+		/**
+		 * Set by the #EventLoop thread to stop the thread
+		 * early.
+		 */
+		std::atomic_bool canceled{false};
+
+		/**
+		 * Set by the thread after it has written #table or
+		 * #error.
+		 */
+		std::atomic_bool done{false};
+
+		InodeTable table;
+		std::exception_ptr error;
+
+		Shared(UniqueFileDescriptor &&_fd,
+		       UniqueFileDescriptor &&_event_fd) noexcept
+			:fd(std::move(_fd)), event_fd(std::move(_event_fd)) {}
+	};
+
+	std::shared_ptr<Shared> shared;
+
+	PipeEvent event;
+
+	std::coroutine_handle<> continuation;
+
+public:
+	/**
+	 * Throws on error.
+	 *
+	 * @param fd any directory on the XFS filesystem
+	 */
+	CoBulkstatThread(EventLoop &event_loop, FileDescriptor fd);
+	~CoBulkstatThread() noexcept;
+
+	CoBulkstatThread(const CoBulkstatThread &) = delete;
+	CoBulkstatThread &operator=(const CoBulkstatThread &) = delete;
+
+	bool await_ready() const noexcept {
+		return shared->done.load(std::memory_order_acquire);
+	}
+
+	void await_suspend(std::coroutine_handle<> _continuation) noexcept {
+		continuation = _continuation;
+		event.ScheduleRead();
+	}
+
+	InodeTable await_resume();
+
+private:
+	static void Run(std::shared_ptr<Shared> shared) noexcept;
+
+	void OnEventReady(unsigned events) noexcept;
+};
@@ -0,0 +1,509 @@
+// SPDX-License-Identifier: BSD-2-Clause OR GPL-2.0-or-later
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#include "Cache.hxx"
+#include "Config.hxx"
+#include "WCheckpointFile.hxx"
+#include "system/Error.hxx"
+#include "io/FileAt.hxx"
+#include "io/Open.hxx"
+#include "io/uring/Queue.hxx"
+#include "lib/fmt/ExceptionFormatter.hxx"
+#include "util/PrintException.hxx"
+#include "util/SpanCast.hxx"
+#include "event/Loop.hxx"
+#include "config.h"
+
+#include <fmt/core.h>
+
+#ifdef HAVE_LIBSYSTEMD
+#include <systemd/sd-daemon.h>
+#endif
+
+#include <bit> // for std::bit_ceil()
+#include <stdexcept>
+#include <system_error>
+
+#include <errno.h>
+#include <fcntl.h> // for O_RDWR
+#include <string.h> // for strerror()
+#include <unistd.h> // for unlink()
+#include <sys/statvfs.h>
+#include <time.h> // for time()
+
+#ifdef HAVE_MALLOC_TRIM
+#include <malloc.h> // for malloc_trim()
+#endif
+
+using std::string_view_literals::operator""sv;
+
+static UniqueFileDescriptor
+OpenDevCachefiles(const CacheConfig &config)
+{
+	UniqueFileDescriptor fd;
+	if (!fd.Open("/dev/cachefiles", O_RDWR))
+		throw MakeErrno("Failed to open /dev/cachefiles");
+
+	for (const auto &line : config.kernel_config)
+		fd.FullWrite(AsBytes(line));
+
+	fd.FullWrite(AsBytes("bind"sv));
+
+	return fd;
+}
+
+/**
+ * Add 2% to the configured BRUN / FRUN values to compensate for files
+ * being added while we're culling.
+ *
+ * If each Cull operation attempts to reach exactly BRUN / FRUN, it
+ * will fail to meet that goal because new files are being added
+ * during the Cull, and another Cull will be started right after that,
+ * which will again fail to meet the goal, leaving the daemon in an
+ * endless culling loop.
+ */
+static constexpr uint_least8_t RUN_PERCENT_OFFSET = 2;
+
+/**
+ * How often does the #FillPredictor sample the free space?
+ */
+static constexpr Event::Duration PREDICT_INTERVAL = std::chrono::seconds{30};
+
+/**
+ * A #WalkCheckpoint older than this is discarded, because too much
+ * has changed in the cache since it was taken.
+ */
+static constexpr Event::Duration MAX_CHECKPOINT_AGE = std::chrono::minutes{10};
+
+static std::string
+MakeLogPrefix(std::string_view name)
+{
+	return name.empty()
+		? std::string{"Cull"}
+		: fmt::format("Cull [{}]", name);
+}
+
+Cache::Cache(EventLoop &_event_loop, Chdir &_chdir, const CacheConfig &config)
+	:event_loop(_event_loop), chdir(_chdir),
+	 name(config.name), log_prefix(MakeLogPrefix(name)),
+	 dev_cachefiles(event_loop, OpenDevCachefiles(config), *this),
+	 snapshot_path(config.snapshot_path),
+	 checkpoint_path(config.checkpoint_path),
+	 trace_directory(config.trace_directory),
+	 trace_keep(config.trace_keep),
+	 predict_timer(event_loop, BIND_THIS_METHOD(OnPredictTimer)),
+	 lag_monitor(event_loop),
+	 walk_config(config.walk),
+	 brun(config.brun + RUN_PERCENT_OFFSET),
+	 frun(config.frun + RUN_PERCENT_OFFSET),
+	 bcull(config.bcull), fcull(config.fcull),
+	 cull_lead(config.cull_lead),
+	 culling_disabled(config.culling_disabled)
+{
+	const auto fscache_fd = OpenPath(config.dir.c_str(), O_DIRECTORY);
+	cache_fd = OpenPath({fscache_fd, "cache"}, O_DIRECTORY);
+	graveyard_fd = OpenPath({fscache_fd, "graveyard"}, O_DIRECTORY);
+
+	if (config.track_changes) {
+		/* this needs CAP_SYS_ADMIN which we have only during
+		   startup */
+		try {
+			tracker = std::make_unique<DirectoryTracker>(event_loop, cache_fd);
+		} catch (...) {
+			fmt::print(stderr, "Failed to enable change tracking: {}\n",
+				   std::current_exception());
+		}
+	}
+
+	if (tracker && !snapshot_path.empty()) {
+		try {
+			tracker->LoadSnapshot(snapshot_path.c_str());
+		} catch (...) {
+			fmt::print(stderr, "Failed to load snapshot: {}\n",
+				   std::current_exception());
+		}
+	}
+
+	LoadCheckpoint();
+
+	// TODO implement graveyeard reaper
+
+	dev_cachefiles.Enable();
+
+	if (cull_lead > Event::Duration{} && !culling_disabled)
+		predict_timer.Schedule(PREDICT_INTERVAL);
+}
+
+Cache::~Cache() noexcept
+{
+}
+
+void
+Cache::Shutdown() noexcept
+{
+	/* remember how far the walk got, so the next process
+	   doesn't start all over again */
+	TakeCheckpoint();
+	AbortCull();
+	SaveCheckpoint();
+	SaveSnapshot(true);
+	tracker.reset();
+	predict_timer.Cancel();
+	dev_cachefiles.Disable();
+}
+
+void
+Cache::Reload(const CacheConfig &config) noexcept
+{
+	walk_config = config.walk;
+	brun = config.brun + RUN_PERCENT_OFFSET;
+	frun = config.frun + RUN_PERCENT_OFFSET;
+	cull_lead = config.cull_lead;
+	culling_disabled = config.culling_disabled;
+	trace_directory = config.trace_directory;
+	trace_keep = config.trace_keep;
+
+	/* the checkpoint may not match the new settings */
+	checkpoint.reset();
+	saved_checkpoint.reset();
+
+	if (cull)
+		cull->Reconfigure(walk_config);
+	else
+		/* polling may have been disabled by a cull request
+		   while "nocull" was set; if culling is still
+		   needed, the kernel will ask again */
+		dev_cachefiles.Enable();
+
+	if (cull_lead > Event::Duration{} && !culling_disabled) {
+		if (!predict_timer.IsPending())
+			predict_timer.Schedule(PREDICT_INTERVAL);
+	} else {
+		predict_timer.Cancel();
+		predictor.Reset();
+	}
+}
+
+inline void
+Cache::StartCull(uint_least8_t brun_percent, uint_least8_t frun_percent,
+		    uint_least64_t extra_blocks, uint_least64_t extra_files)
+{
+	uint_least64_t cull_files = 0;
+	uint_least64_t cull_bytes = 1024 * 1024;
+
+	struct statvfs s;
+	if (fstatvfs(cache_fd.Get(), &s) == 0) {
+		uint_least64_t target_files = (s.f_files * frun_percent + 99) / 100 + extra_files;
+		if (target_files > s.f_ffree)
+			cull_files = target_files - s.f_ffree;
+
+		uint_least64_t target_blocks = (s.f_blocks * brun_percent + 99) / 100 + extra_blocks;
+		if (target_blocks > s.f_bfree)
+			cull_bytes = static_cast<uint_least64_t>(target_blocks - s.f_bfree) * s.f_bsize;
+	} else {
+		fmt::print(stderr, "fstatvfs() failed: %s\n", strerror(errno));
+	}
+
+	LaunchCull(cull_files, cull_bytes);
+}
+
+void
+Cache::RequestCull(uint_least64_t cull_files, uint_least64_t cull_bytes)
+{
+	if (culling_disabled)
+		throw std::runtime_error{"Culling is disabled"};
+
+	if (paused)
+		throw std::runtime_error{"Culling is paused"};
+
+	if (cull)
+		throw std::runtime_error{"Already culling"};
+
+	LaunchCull(cull_files, cull_bytes);
+}
+
+inline void
+Cache::LaunchCull(uint_least64_t cull_files, uint_least64_t cull_bytes)
+{
+	fmt::print(stderr, "{}: start files={} bytes={}\n",
+		   log_prefix, cull_files, cull_bytes);
+
+	cull.emplace(event_loop, *event_loop.GetUring(),
+		     dev_cachefiles, chdir, walk_config, log_prefix,
+		     cull_files, cull_bytes, BIND_THIS_METHOD(OnCullComplete));
+	if (tracker)
+		cull->SetTracker(*tracker);
+
+	const FileTime now{time(nullptr)};
+
+	if (walk_config.frequency_sketch > 0) {
+		if (!frequency ||
+		    frequency->GetWidth() != std::bit_ceil(walk_config.frequency_sketch))
+			/* (re)create the sketch after the setting has
+			   been changed */
+			frequency = std::make_unique<AccessSketch>(walk_config.frequency_sketch);
+
+		cull->SetFrequency(*frequency, last_walk_time);
+	} else
+		frequency.reset();
+
+	last_walk_time = now;
+
+	if (checkpoint && event_loop.SteadyNow() >= checkpoint_time + MAX_CHECKPOINT_AGE)
+		checkpoint.reset();
+
+	if (saved_checkpoint &&
+	    std::chrono::system_clock::now() >= saved_checkpoint_time + MAX_CHECKPOINT_AGE)
+		saved_checkpoint.reset();
+
+	/* a resumed walk skips the subtrees completed before, so
+	   its trace would be incomplete */
+	if (!trace_directory.empty() && !checkpoint && !saved_checkpoint) {
+		try {
+			trace = std::make_unique<WalkTraceWriter>(fmt::format("{}/{}.trace",
+									      trace_directory,
+									      now.count()),
+								  now);
+			cull->SetTrace(*trace);
+		} catch (...) {
+			fmt::print(stderr, "Failed to create walk trace: {}\n",
+				   std::current_exception());
+		}
+	}
+
+	lag_monitor.Start();
+	if (checkpoint) {
+		fmt::print(stderr, "{}: resuming the interrupted walk\n", log_prefix);
+		cull->Resume(cache_fd, std::move(*checkpoint));
+		checkpoint.reset();
+		saved_checkpoint.reset();
+	} else if (saved_checkpoint) {
+		fmt::print(stderr, "{}: resuming the walk interrupted by shutdown\n",
+			   log_prefix);
+		cull->Resume(cache_fd, std::move(*saved_checkpoint));
+		saved_checkpoint.reset();
+	} else
+		cull->Start(cache_fd);
+}
+
+void
+Cache::AbortCull() noexcept
+{
+	cull.reset();
+	trace.reset();
+	lag_monitor.Stop();
+}
+
+void
+Cache::Pause() noexcept
+{
+	if (paused)
+		return;
+
+	paused = true;
+
+	if (cull) {
+		fmt::print(stderr, "{}: paused, aborting the running cull\n",
+			   log_prefix);
+
+		/* remember how far the walk got, so the next cull
+		   after Resume() doesn't start all over again */
+		TakeCheckpoint();
+		AbortCull();
+	} else
+		fmt::print(stderr, "{}: paused\n", log_prefix);
+}
+
+void
+Cache::Resume() noexcept
+{
+	if (!paused)
+		return;
+
+	paused = false;
+	fmt::print(stderr, "{}: resumed\n", log_prefix);
+
+	/* polling may have been disabled by a cull request while
+	   paused */
+	dev_cachefiles.Enable();
+}
+
+void
+Cache::TakeCheckpoint() noexcept
+{
+	if (!cull)
+		return;
+
+	if (auto c = cull->TakeCheckpoint()) {
+		checkpoint.emplace(std::move(*c));
+		checkpoint_time = event_loop.SteadyNow();
+	}
+}
+
+void
+Cache::LoadCheckpoint() noexcept
+{
+	if (checkpoint_path.empty())
+		return;
+
+	try {
+		saved_checkpoint.emplace(LoadWalkCheckpoint(checkpoint_path.c_str(),
+							    saved_checkpoint_time));
+	} catch (const std::system_error &e) {
+		/* no file means the previous process was not
+		   culling at shutdown */
+		if (!IsErrno(e, ENOENT))
+			fmt::print(stderr, "Failed to load checkpoint: {}\n",
+				   std::current_exception());
+		return;
+	} catch (...) {
+		fmt::print(stderr, "Failed to load checkpoint: {}\n",
+			   std::current_exception());
+	}
+
+	/* a checkpoint is used only once; after a crash, the next
+	   start must not resume from an obsolete one */
+	unlink(checkpoint_path.c_str());
+}
+
+void
+Cache::SaveCheckpoint() noexcept
+{
+	if (checkpoint_path.empty())
+		return;
+
+	const auto now = event_loop.SteadyNow();
+	if (!checkpoint || now >= checkpoint_time + MAX_CHECKPOINT_AGE)
+		return;
+
+	try {
+		SaveWalkCheckpoint(checkpoint_path, *checkpoint,
+				   std::chrono::system_clock::now() - (now - checkpoint_time));
+	} catch (...) {
+		fmt::print(stderr, "Failed to save checkpoint: {}\n",
+			   std::current_exception());
+	}
+}
+
+void
+Cache::SaveSnapshot(bool sync) noexcept
+{
+	if (!tracker || snapshot_path.empty())
+		return;
+
+	try {
+		tracker->SaveSnapshot(snapshot_path, sync);
+	} catch (...) {
+		fmt::print(stderr, "Failed to save snapshot: {}\n",
+			   std::current_exception());
+	}
+}
+
+inline void
+Cache::OnCullComplete() noexcept
+{
+	cull.reset();
+
+	if (trace) {
+		/* after a write error, the #Walk has stopped adding
+		   to the trace; an incomplete one would mislead the
+		   simulation, so it is discarded */
+		if (!trace->IsFailed()) {
+			/* the trace thread writes the rest and
+			   deletes old traces */
+			trace->SetRetention(trace_directory, trace_keep);
+			trace->Commit();
+		}
+
+		trace.reset();
+	}
+
+	lag_monitor.Stop();
+
+	const auto max_lag_ms = std::chrono::duration_cast<std::chrono::milliseconds>(lag_monitor.GetMaxLag()).count();
+	fmt::print(stderr, "{}: max event loop lag {}ms\n",
+		   log_prefix, max_lag_ms);
+
+#ifdef HAVE_LIBSYSTEMD
+	sd_notifyf(0, "STATUS=Last cull: max event loop lag %lldms",
+		   static_cast<long long>(max_lag_ms));
+#endif
+
+	if (tracker)
+		tracker->LogStats();
+
+	/* no fsync() here, it would block the event loop; the
+	   snapshot is synced at shutdown, and after a crash, a
+	   truncated one is rejected by LoadSnapshot() */
+	SaveSnapshot(false);
+
+#ifdef HAVE_MALLOC_TRIM
+	malloc_trim(0);
+#endif
+
+	/* the cull has freed space; the next sample would look like
+	   negative consumption */
+	predictor.Reset();
+
+	/* re-enable polling /dev/cachefiles */
+	dev_cachefiles.Enable();
+}
+
+inline void
+Cache::OnPredictTimer() noexcept
+{
+	predict_timer.Schedule(PREDICT_INTERVAL);
+
+	if (cull || paused)
+		/* don't sample while culling (the numbers would be
+		   meaningless) or while culling is paused */
+		return;
+
+	struct statvfs s;
+	if (fstatvfs(cache_fd.Get(), &s) < 0) {
+		fmt::print(stderr, "fstatvfs() failed: {}\n", strerror(errno));
+		return;
+	}
+
+	predictor.Update(event_loop.SteadyNow(), s.f_bfree, s.f_ffree);
+
+	const uint_least64_t lead_blocks = predictor.PredictBlocks(cull_lead);
+	const uint_least64_t lead_files = predictor.PredictFiles(cull_lead);
+
+	const uint_least64_t bcull_blocks = (s.f_blocks * bcull + 99) / 100;
+	const uint_least64_t fcull_files = (s.f_files * fcull + 99) / 100;
+
+	if (s.f_bfree >= bcull_blocks + lead_blocks &&
+	    s.f_ffree >= fcull_files + lead_files)
+		/* we're not going to reach the kernel's culling
+		   threshold within the lead time */
+		return;
+
+	/* start a small cull which only keeps us above "bcull" /
+	   "fcull" for the lead time; the kernel will ask for a full
+	   cull (up to "brun" / "frun") when it reaches its threshold */
+	fmt::print(stderr, "{}: predicted to reach threshold\n", log_prefix);
+	StartCull(bcull + RUN_PERCENT_OFFSET, fcull + RUN_PERCENT_OFFSET,
+		  lead_blocks, lead_files);
+}
+
+void
+Cache::OnDevCachefilesStartCull() noexcept
+{
+	/* disable polling /dev/cachefiles while we're culling */
+	dev_cachefiles.Disable();
+
+	if (!cull && !culling_disabled && !paused)
+		StartCull(brun, frun);
+}
+
+void
+Cache::OnDevCachefilesError(std::exception_ptr &&error) noexcept
+{
+	PrintException(std::move(error));
+
+	/* /dev/cachefiles errors are fatal because we're effectively
+	   defunct now */
+	std::terminate();
+}
@@ -0,0 +1,268 @@
+// SPDX-License-Identifier: BSD-2-Clause OR GPL-2.0-or-later
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#pragma once
+
+#include "DevCachefiles.hxx"
+#include "Cull.hxx"
+#include "Frequency.hxx"
+#include "LagMonitor.hxx"
+#include "Predictor.hxx"
+#include "Tracker.hxx"
+#include "WTrace.hxx"
+#include "WConfig.hxx"
+#include "event/CoarseTimerEvent.hxx"
+#include "io/UniqueFileDescriptor.hxx"
+
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+
+struct CacheConfig;
+class Chdir;
+class EventLoop;
+
+/**
+ * One cache binding: a /dev/cachefiles file descriptor bound to one
+ * cache directory, and the culling state for it.  Multiple instances
+ * share one #EventLoop (and its io_uring).
+ */
+class Cache final : DevCachefilesHandler {
+	EventLoop &event_loop;
+
+	/**
+	 * Shared by the culls of all caches, because the working
+	 * directory belongs to the whole process.
+	 */
+	Chdir &chdir;
+
+	/**
+	 * The name of the configuration section (for log messages).
+	 */
+	const std::string name;
+
+	/**
+	 * The prefix of cull log messages: "Cull" or "Cull [NAME]".
+	 */
+	const std::string log_prefix;
+
+	UniqueFileDescriptor cache_fd, graveyard_fd;
+
+	DevCachefiles dev_cachefiles;
+
+	/**
+	 * Access frequency estimates collected by all culls (only if
+	 * WalkConfig::frequency_sketch is enabled).  Declared before
+	 * #cull because the #Cull uses it.
+	 */
+	std::unique_ptr<AccessSketch> frequency;
+
+	/**
+	 * The start time of the previous walk; files accessed since
+	 * then are counted in #frequency.
+	 */
+	FileTime last_walk_time = FileTime::max();
+
+	std::optional<Cull> cull;
+
+	/**
+	 * The progress of a #cull which was interrupted by Pause();
+	 * the next #Cull resumes from here (see Cull::Resume()).
+	 */
+	std::optional<WalkCheckpoint> checkpoint;
+
+	/**
+	 * When was #checkpoint taken?
+	 */
+	Event::TimePoint checkpoint_time;
+
+	/**
+	 * A checkpoint loaded from #checkpoint_path at startup; the
+	 * first #Cull resumes from here (unless #checkpoint is set).
+	 */
+	std::optional<SavedWalkCheckpoint> saved_checkpoint;
+
+	/**
+	 * When was #saved_checkpoint taken?
+	 */
+	std::chrono::system_clock::time_point saved_checkpoint_time;
+
+	/**
+	 * Only set if CacheConfig::track_changes is enabled and
+	 * fanotify could be initialized.
+	 */
+	std::unique_ptr<DirectoryTracker> tracker;
+
+	/**
+	 * See CacheConfig::snapshot_path.
+	 */
+	const std::string snapshot_path;
+
+	/**
+	 * See CacheConfig::checkpoint_path.
+	 */
+	const std::string checkpoint_path;
+
+	/**
+	 * See CacheConfig::trace_directory.
+	 */
+	std::string trace_directory;
+
+	/**
+	 * See CacheConfig::trace_keep.
+	 */
+	std::size_t trace_keep;
+
+	/**
+	 * The trace of the current #cull (if #trace_directory is
+	 * set).
+	 */
+	std::unique_ptr<WalkTraceWriter> trace;
+
+	/**
+	 * Periodically samples the free space on the cache partition
+	 * for #predictor.
+	 */
+	CoarseTimerEvent predict_timer;
+
+	FillPredictor predictor;
+
+	/**
+	 * Measures the #EventLoop lag while culling.
+	 */
+	LagMonitor lag_monitor;
+
+	WalkConfig walk_config;
+
+	uint_least8_t brun, frun;
+	const uint_least8_t bcull, fcull;
+
+	/**
+	 * See CacheConfig::cull_lead.
+	 */
+	Event::Duration cull_lead;
+
+	bool culling_disabled;
+
+	/**
+	 * Has culling been paused with Pause()?
+	 */
+	bool paused = false;
+
+public:
+	/**
+	 * Throws on error.
+	 */
+	Cache(EventLoop &_event_loop, Chdir &_chdir, const CacheConfig &config);
+	~Cache() noexcept;
+
+	Cache(const Cache &) = delete;
+	Cache &operator=(const Cache &) = delete;
+
+	/**
+	 * Cancel all pending operations and unregister all events.
+	 */
+	void Shutdown() noexcept;
+
+	/**
+	 * Apply a new configuration which has been verified with
+	 * CheckReloadConfig().  A running #Cull is reconfigured (see
+	 * Cull::Reconfigure()).
+	 */
+	void Reload(const CacheConfig &config) noexcept;
+
+	const std::string &GetName() const noexcept {
+		return name;
+	}
+
+	/**
+	 * The "cache" directory which is walked by #Cull.
+	 */
+	FileDescriptor GetCacheDirectory() const noexcept {
+		return cache_fd;
+	}
+
+	const WalkConfig &GetWalkConfig() const noexcept {
+		return walk_config;
+	}
+
+	/**
+	 * Start a cull which frees the given number of files and
+	 * bytes (requested by the control socket), regardless of the
+	 * "brun" / "frun" thresholds.
+	 *
+	 * Throws std::runtime_error if no cull can be started now.
+	 */
+	void RequestCull(uint_least64_t cull_files, uint_least64_t cull_bytes);
+
+	/**
+	 * Abort the running cull (the files it has already culled
+	 * stay deleted) and ignore all cull requests until Resume().
+	 */
+	void Pause() noexcept;
+
+	/**
+	 * Undo Pause().  If the kernel still needs space, it will ask
+	 * for another cull.
+	 */
+	void Resume() noexcept;
+
+private:
+	/**
+	 * Start a cull which attempts to free enough space to reach
+	 * the given percentages plus the given number of blocks and
+	 * files.
+	 */
+	void StartCull(uint_least8_t brun_percent, uint_least8_t frun_percent,
+		       uint_least64_t extra_blocks=0, uint_least64_t extra_files=0);
+
+	/**
+	 * Start a cull which frees the given number of files and
+	 * bytes.
+	 */
+	void LaunchCull(uint_least64_t cull_files, uint_least64_t cull_bytes);
+
+	/**
+	 * Destroy the running #cull without committing its trace.
+	 */
+	void AbortCull() noexcept;
+	void OnCullComplete() noexcept;
+
+	void OnPredictTimer() noexcept;
+
+	/**
+	 * Interrupt the running #cull and store its progress in
+	 * #checkpoint (if the #Walk supports it).
+	 */
+	void TakeCheckpoint() noexcept;
+
+	/**
+	 * Load #saved_checkpoint from #checkpoint_path (if
+	 * configured) and delete the file.  Errors are logged.
+	 */
+	void LoadCheckpoint() noexcept;
+
+	/**
+	 * Save #checkpoint to #checkpoint_path (if configured).
+	 * This blocks; it is only called at shutdown.  Errors are
+	 * logged.
+	 */
+	void SaveCheckpoint() noexcept;
+
+	/**
+	 * Save the #tracker listings to #snapshot_path (if
+	 * configured).  Errors are logged.
+	 *
+	 * @param sync see SnapshotWriter::Commit()
+	 */
+	void SaveSnapshot(bool sync) noexcept;
+
+	// virtual methods from DevCachefilesHandler
+	void OnDevCachefilesStartCull() noexcept override;
+
+	[[noreturn]]
+	void OnDevCachefilesError(std::exception_ptr &&error) noexcept override;
+};
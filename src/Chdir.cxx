@@ -3,6 +3,7 @@
 // author: Max Kellermann <max.kellermann@ionos.com>
 
 #include "Chdir.hxx"
+#include "Probe.hxx"
 
 #include <unistd.h>
 
@@ -48,7 +49,15 @@ Chdir::Next() noexcept
 
 	auto &list = current->second;
 
-	if (need_chdir && fchdir(current->first.Get()) < 0) {
+	bool chdir_failed = false;
+	if (need_chdir) {
+		CASH_PROBE(chdir_begin, current->first.Get());
+		++n_chdir;
+		chdir_failed = fchdir(current->first.Get()) < 0;
+		CASH_PROBE(chdir_end, current->first.Get(), chdir_failed);
+	}
+
+	if (chdir_failed) {
 		// error
 
 		/* move the list to the stack and erase the failed
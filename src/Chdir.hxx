@@ -90,6 +90,11 @@ class Chdir final : SharedAnchor {
 	 */
 	WaiterMap::iterator current = map.end();
 
+	/**
+	 * The number of fchdir() calls (for statistics).
+	 */
+	std::size_t n_chdir = 0;
+
 public:
 	explicit Chdir(EventLoop &event_loop) noexcept;
 	~Chdir() noexcept;
@@ -107,6 +112,10 @@ public:
 	 */
 	Awaitable Add(FileDescriptor directory) noexcept;
 
+	std::size_t GetChdirCount() const noexcept {
+		return n_chdir;
+	}
+
 private:
 	void Next() noexcept;
 
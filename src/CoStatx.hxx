@@ -0,0 +1,106 @@
+// SPDX-License-Identifier: BSD-2-Clause OR GPL-2.0-or-later
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#pragma once
+
+#include "io/FileDescriptor.hxx"
+#include "io/uring/Operation.hxx"
+#include "io/uring/Queue.hxx"
+
+#include <coroutine>
+#include <memory>
+
+#include <sys/stat.h>
+
+namespace Uring {
+
+/**
+ * Awaitable io_uring statx() operation.  Unlike Uring::CoStatx(),
+ * it does not throw on failure: the result is zero on success (see
+ * GetResult()) or a negative errno value.  This avoids the cost of
+ * throwing and catching an exception for each file which has
+ * vanished meanwhile.
+ *
+ * This object may be destroyed while the operation is still in
+ * flight; the buffer the kernel writes to is freed only after the
+ * completion.
+ */
+class CoTryStatx final {
+	struct Request final : Operation {
+		struct statx buffer;
+
+		std::coroutine_handle<> continuation;
+
+		int result;
+
+		/**
+		 * Has the #CoTryStatx been destroyed?  Then this
+		 * object deletes itself upon completion.
+		 */
+		bool orphaned = false;
+
+		void OnUringCompletion(int res) noexcept override {
+			if (orphaned) {
+				delete this;
+				return;
+			}
+
+			result = res;
+
+			if (continuation)
+				continuation.resume();
+		}
+	};
+
+	Request *request;
+
+public:
+	/**
+	 * Throws if the submission queue is full.
+	 *
+	 * @param path the path relative to #directory; it only needs
+	 * to be valid until the constructor returns
+	 */
+	CoTryStatx(Queue &queue, FileDescriptor directory, const char *path,
+		   int flags, unsigned mask) {
+		auto r = std::make_unique<Request>();
+		auto &s = queue.RequireSubmitEntry();
+		io_uring_prep_statx(&s, directory.Get(), path, flags, mask,
+				    &r->buffer);
+		queue.Push(s, *r);
+		request = r.release();
+	}
+
+	~CoTryStatx() noexcept {
+		if (request->IsUringPending())
+			request->orphaned = true;
+		else
+			delete request;
+	}
+
+	CoTryStatx(const CoTryStatx &) = delete;
+	CoTryStatx &operator=(const CoTryStatx &) = delete;
+
+	bool await_ready() const noexcept {
+		return !request->IsUringPending();
+	}
+
+	void await_suspend(std::coroutine_handle<> _continuation) noexcept {
+		request->continuation = _continuation;
+	}
+
+	int await_resume() const noexcept {
+		return request->result;
+	}
+
+	/**
+	 * Returns the statx() result.  Only valid after the
+	 * operation has completed successfully.
+	 */
+	const struct statx &GetResult() const noexcept {
+		return request->buffer;
+	}
+};
+
+} // namespace Uring
@@ -0,0 +1,59 @@
+// SPDX-License-Identifier: BSD-2-Clause OR GPL-2.0-or-later
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#pragma once
+
+#include "io/FileDescriptor.hxx"
+#include "io/uring/Operation.hxx"
+#include "io/uring/Queue.hxx"
+
+#include <coroutine>
+
+namespace Uring {
+
+/**
+ * Awaitable io_uring unlinkat() operation.  The result is zero on
+ * success or a negative errno value.
+ */
+class CoUnlink final : Operation {
+	std::coroutine_handle<> continuation;
+
+	int result;
+
+public:
+	/**
+	 * Throws if the submission queue is full.
+	 *
+	 * @param path the path to be deleted; it must remain valid
+	 * until the operation completes
+	 */
+	CoUnlink(Queue &queue, FileDescriptor directory, const char *path,
+		 int flags) {
+		auto &s = queue.RequireSubmitEntry();
+		io_uring_prep_unlinkat(&s, directory.Get(), path, flags);
+		queue.Push(s, *this);
+	}
+
+	bool await_ready() const noexcept {
+		return !IsUringPending();
+	}
+
+	void await_suspend(std::coroutine_handle<> _continuation) noexcept {
+		continuation = _continuation;
+	}
+
+	int await_resume() const noexcept {
+		return result;
+	}
+
+private:
+	void OnUringCompletion(int res) noexcept override {
+		result = res;
+
+		if (continuation)
+			continuation.resume();
+	}
+};
+
+} // namespace Uring
@@ -10,15 +10,52 @@
 #include "util/CharUtil.hxx"
 #include "util/StringStrip.hxx"
 
+#include <fmt/core.h>
+
+#include <algorithm> // for std::ranges::equal()
 #include <charconv>
+#include <ranges>
 #include <stdexcept>
 
 using std::string_view_literals::operator""sv;
 
+/**
+ * The upper limit for "cull_workers"; the systemd unit has
+ * "TasksMax=40".
+ */
+static constexpr std::size_t MAX_CULL_WORKERS = 32;
+
+/**
+ * The lower limit for "walk_queue_depth".  Each directory being
+ * scanned occupies one slot until its subtree is complete, so a tiny
+ * queue would leave no room for the statx() calls on the files.
+ */
+static constexpr unsigned MIN_WALK_QUEUE_DEPTH = 64;
+
+/**
+ * The lower limit for "walk_approx_resolution" (except 0, which
+ * disables it).  The histogram has one bucket per step between
+ * Walk::DISCARD_OLDER_THAN and now, i.e. this allows about 173k
+ * buckets.
+ */
+static constexpr std::chrono::seconds MIN_WALK_APPROX_RESOLUTION{60};
+
+/**
+ * The upper limit for "walk_frequency_sketch".  The sketch has 4
+ * rows of std::bit_ceil(width) one-byte counters, i.e. this limits
+ * it to 64 MiB.
+ */
+static constexpr std::size_t MAX_WALK_FREQUENCY_SKETCH = 1 << 24;
+
+/**
+ * The kernel's limit for the io_uring submission queue size.
+ */
+static constexpr unsigned MAX_URING_ENTRIES = 32768;
+
 static constexpr bool
 IsCommandChar(char ch) noexcept
 {
-	return IsLowerAlphaASCII(ch);
+	return IsLowerAlphaASCII(ch) || ch == '_';
 }
 
 static std::pair<std::string_view, std::string_view>
@@ -57,11 +94,272 @@ ParsePercent(std::string_view s)
 	return value;
 }
 
+static unsigned
+ParseUnsigned(std::string_view s)
+{
+	const char *const first = s.data(), *const last = first + s.size();
+
+	unsigned value;
+	auto [ptr, ec] = std::from_chars(first, last, value, 10);
+	if (ptr == first || ptr != last || ec != std::errc{})
+		throw std::runtime_error{"Malformed number"};
+
+	return value;
+}
+
+static unsigned
+ParsePositive(std::string_view s)
+{
+	const unsigned value = ParseUnsigned(s);
+	if (value == 0)
+		throw std::runtime_error{"Value must be positive"};
+
+	return value;
+}
+
+static std::chrono::seconds
+ParseSeconds(std::string_view s)
+{
+	return std::chrono::seconds{ParseUnsigned(s)};
+}
+
+/**
+ * Split a "NAME VALUE" pair (used by the per-volume settings).
+ */
+static std::pair<std::string_view, std::string_view>
+SplitNameValue(std::string_view s)
+{
+	const auto space = std::ranges::find_if(s, IsWhitespaceNotNull);
+	const std::string_view name{s.begin(), space};
+	if (name.empty() || space == s.end())
+		throw std::runtime_error{"Expected volume name and value"};
+
+	return {name, StripLeft(std::string_view{space, s.end()})};
+}
+
+static VolumeShare &
+MakeVolume(WalkConfig &config, std::string_view name)
+{
+	for (auto &i : config.volumes)
+		if (i.name == name)
+			return i;
+
+	auto &volume = config.volumes.emplace_back();
+	volume.name = name;
+	return volume;
+}
+
+/**
+ * Parse a "[NAME]" section header.  Returns an empty string if this
+ * is not a section header.
+ */
+static std::string_view
+ParseSectionHeader(const char *line)
+{
+	if (*line != '[')
+		return {};
+
+	const std::string_view s = StripRight(std::string_view{line + 1});
+	if (!s.ends_with(']'))
+		throw std::runtime_error{"Malformed section header"};
+
+	const auto name = s.substr(0, s.size() - 1);
+	if (name.empty())
+		throw std::runtime_error{"Empty section name"};
+
+	return name;
+}
+
+/**
+ * Parse a global (process-wide) setting.  Returns false if this is
+ * not a global setting.
+ */
+static bool
+ParseGlobalLine(Config &global, const char *line)
+{
+	auto &config = global.uring;
+
+	const auto [command, value] = ExtractCommandValue(line);
+	if (command == "control_socket"sv) {
+		if (value.empty())
+			throw std::runtime_error{"Socket path expected"};
+
+		global.control_socket = value;
+	} else if (command == "uring_entries"sv) {
+		config.entries = ParsePositive(value);
+		if (config.entries > MAX_URING_ENTRIES)
+			throw std::runtime_error{"Too many io_uring entries"};
+	} else if (command == "uring_bounded_workers"sv)
+		config.max_bounded_workers = ParseUnsigned(value);
+	else if (command == "uring_unbounded_workers"sv)
+		config.max_unbounded_workers = ParseUnsigned(value);
+	else if (command == "uring_sqpoll"sv)
+		config.sqpoll = true;
+	else if (command == "uring_sqpoll_idle"sv) {
+		config.sqpoll_idle_ms = ParseUnsigned(value);
+		config.sqpoll = true;
+	} else if (command == "uring_sqpoll_cpu"sv) {
+		config.sqpoll_cpu = static_cast<int>(ParseUnsigned(value));
+		if (config.sqpoll_cpu < 0)
+			throw std::runtime_error{"CPU number out of range"};
+		config.sqpoll = true;
+	} else if (command == "uring_defer_taskrun"sv)
+		config.defer_taskrun = true;
+	else
+		return false;
+
+	if (config.sqpoll && config.defer_taskrun)
+		throw std::runtime_error{"'uring_defer_taskrun' cannot be combined with SQPOLL"};
+
+	return true;
+}
+
+static void
+ParseLine(CacheConfig &config,
+	  std::forward_list<std::string>::iterator &kernel_config_iterator,
+	  const char *line)
+{
+	const auto [command, value] = ExtractCommandValue(line);
+	if (command == "dir"sv)
+		config.dir = value;
+	else if (command == "brun"sv)
+		config.brun = ParsePercent(value);
+	else if (command == "frun"sv)
+		config.frun = ParsePercent(value);
+	else if (command == "bcull"sv)
+		config.bcull = ParsePercent(value);
+	else if (command == "fcull"sv)
+		config.fcull = ParsePercent(value);
+	else if (command == "bind"sv)
+		throw std::runtime_error{"'bind' command not permitted"};
+	else if (command == "nocull"sv) {
+		config.culling_disabled = true;
+		return;
+	} else if (command == "cull_lead"sv) {
+		config.cull_lead = ParseSeconds(value);
+		return;
+	} else if (command == "walk_pressure"sv) {
+		config.walk.pressure_threshold = ParsePercent(value);
+		return;
+	} else if (command == "walk_memory_pressure"sv) {
+		config.walk.memory_pressure_threshold = ParsePercent(value);
+		return;
+	} else if (command == "walk_fd_budget"sv) {
+		config.walk.fd_budget = ParseUnsigned(value);
+		return;
+	} else if (command == "walk_queue_depth"sv) {
+		config.walk.walk_queue_depth = ParseUnsigned(value);
+		if (config.walk.walk_queue_depth < MIN_WALK_QUEUE_DEPTH)
+			throw std::runtime_error{"Walk queue depth too small"};
+		return;
+	} else if (command == "cull_queue_depth"sv) {
+		config.walk.cull_queue_depth = ParsePositive(value);
+		return;
+	} else if (command == "cull_workers"sv) {
+		config.walk.cull_workers = ParseUnsigned(value);
+		if (config.walk.cull_workers > MAX_CULL_WORKERS)
+			throw std::runtime_error{"Too many cull workers"};
+		return;
+	} else if (command == "walk_approx_resolution"sv) {
+		config.walk.approx_resolution = ParseSeconds(value);
+		if (config.walk.approx_resolution.count() > 0 &&
+		    config.walk.approx_resolution < MIN_WALK_APPROX_RESOLUTION)
+			throw std::runtime_error{"Walk histogram resolution too fine"};
+		return;
+	} else if (command == "walk_bulkstat"sv) {
+		config.walk.bulkstat = true;
+		return;
+	} else if (command == "walk_frequency_sketch"sv) {
+		config.walk.frequency_sketch = ParseUnsigned(value);
+		if (config.walk.frequency_sketch > MAX_WALK_FREQUENCY_SKETCH)
+			throw std::runtime_error{"Frequency sketch too large"};
+		return;
+	} else if (command == "walk_inode_order"sv) {
+		config.walk.inode_order = true;
+		return;
+	} else if (command == "fair_share"sv) {
+		config.walk.fair_share = true;
+		return;
+	} else if (command == "volume_weight"sv) {
+		const auto [name, weight] = SplitNameValue(value);
+		MakeVolume(config.walk, name).weight = ParsePositive(weight);
+		config.walk.fair_share = true;
+		return;
+	} else if (command == "volume_min_share"sv) {
+		const auto [name, share] = SplitNameValue(value);
+		const auto percent = ParsePercent(share);
+		if (percent > 100)
+			throw std::runtime_error{"Percentage out of range"};
+
+		MakeVolume(config.walk, name).min_share = percent;
+		config.walk.fair_share = true;
+		return;
+	} else if (command == "prune_empty_directories"sv) {
+		config.walk.prune_empty_directories = true;
+		return;
+	} else if (command == "track_changes"sv) {
+		config.track_changes = true;
+		return;
+	} else if (command == "snapshot"sv) {
+		config.snapshot_path = value;
+		return;
+	} else if (command == "checkpoint"sv) {
+		config.checkpoint_path = value;
+		return;
+	} else if (command == "walk_trace"sv) {
+		config.trace_directory = value;
+		return;
+	} else if (command == "walk_trace_keep"sv) {
+		config.trace_keep = ParsePositive(value);
+		return;
+	} else if (command == "culltable"sv ||
+		   command == "resume_thresholds"sv) {
+		// ignore (for cachefilesd compatbility)
+		return;
+	}
+
+	kernel_config_iterator =
+		config.kernel_config.emplace_after(kernel_config_iterator,
+						   command.begin(), value.end());
+}
+
+/**
+ * Extract the command name from a kernel configuration line.
+ */
+static constexpr std::string_view
+GetCommandName(std::string_view line) noexcept
+{
+	const char *p = line.data(), *const end = p + line.size();
+	while (p != end && IsCommandChar(*p))
+		++p;
+
+	return {line.data(), p};
+}
+
+/**
+ * May this kernel configuration line be shared by all sections
+ * (i.e. appear before the first section)?  This is true for the
+ * thresholds, but e.g. each cache needs its own "tag".
+ */
+static constexpr bool
+IsSharedKernelLine(std::string_view line) noexcept
+{
+	const auto command = GetCommandName(line);
+	return command == "brun"sv || command == "frun"sv ||
+		command == "bcull"sv || command == "fcull"sv ||
+		command == "bstop"sv || command == "fstop"sv;
+}
+
 Config
 LoadConfigFile(const char *path)
 {
+	/* settings before the first section (or all settings if
+	   there are no sections) */
+	CacheConfig defaults;
+	auto kernel_config_iterator = defaults.kernel_config.before_begin();
+
 	Config config;
-	auto kernel_config_iterator = config.kernel_config.before_begin();
+	CacheConfig *current = &defaults;
 
 	const auto fd = OpenReadOnly(path);
 	FdReader fd_reader{fd};
@@ -72,31 +370,113 @@ LoadConfigFile(const char *path)
 		if (*line == 0 || *line == '#')
 			continue;
 
-		const auto [command, value] = ExtractCommandValue(line);
-		if (command == "dir"sv)
-			config.dir = value;
-		else if (command == "brun"sv)
-			config.brun = ParsePercent(value);
-		else if (command == "frun"sv)
-			config.frun = ParsePercent(value);
-		else if (command == "bind"sv)
-			throw std::runtime_error{"'bind' command not permitted"};
-		else if (command == "nocull"sv) {
-			config.culling_disabled = true;
+		if (const auto name = ParseSectionHeader(line); !name.empty()) {
+			if (!defaults.dir.empty())
+				throw std::runtime_error{"'dir' not allowed outside of sections"};
+
+			for (const auto &i : defaults.kernel_config)
+				if (!IsSharedKernelLine(i))
+					throw std::runtime_error{fmt::format("'{}' not allowed outside of sections",
+									     GetCommandName(i))};
+
+			for (const auto &i : config.caches)
+				if (i.name == name)
+					throw std::runtime_error{"Duplicate section name"};
+
+			current = &config.caches.emplace_back(defaults);
+			current->name = name;
+
+			kernel_config_iterator = current->kernel_config.before_begin();
+			while (std::next(kernel_config_iterator) != current->kernel_config.end())
+				++kernel_config_iterator;
 			continue;
-		} else if (command == "culltable"sv ||
-			   command == "resume_thresholds"sv) {
-			// ignore (for cachefilesd compatbility)
+		}
+
+		if (ParseGlobalLine(config, line)) {
+			if (current != &defaults)
+				throw std::runtime_error{"Global settings not allowed in sections"};
 			continue;
 		}
 
-		kernel_config_iterator =
-			config.kernel_config.emplace_after(kernel_config_iterator,
-							   command.begin(), value.end());
+		ParseLine(*current, kernel_config_iterator, line);
 	}
 
-	if (config.dir.empty())
-		throw std::runtime_error{"No 'dir' setting"};
+	if (config.caches.empty())
+		config.caches.emplace_back(std::move(defaults));
+
+	for (const auto &i : config.caches)
+		if (i.dir.empty())
+			throw std::runtime_error{"No 'dir' setting"};
 
 	return config;
 }
+
+/**
+ * Is this kernel configuration line evaluated by the kernel only
+ * when binding the cache?  The kernel calculates its absolute
+ * thresholds from the percentages once in "bind", but "brun" and
+ * "frun" are also the targets of our #Cull, so changing them
+ * affects the daemon.
+ */
+static bool
+IsKernelBound(std::string_view line) noexcept
+{
+	const auto command = GetCommandName(line);
+	return command != "brun"sv && command != "frun"sv;
+}
+
+static void
+CheckReloadCacheConfig(const CacheConfig &old_config,
+		       const CacheConfig &new_config)
+{
+	if (new_config.dir != old_config.dir)
+		throw std::runtime_error{"Cannot change 'dir' without restart"};
+
+	if (!std::ranges::equal(old_config.kernel_config | std::views::filter(IsKernelBound),
+				new_config.kernel_config | std::views::filter(IsKernelBound)))
+		throw std::runtime_error{"Cannot change kernel settings without restart"};
+
+	/* these need CAP_SYS_ADMIN which has been dropped after
+	   startup */
+	if (new_config.track_changes != old_config.track_changes)
+		throw std::runtime_error{"Cannot change 'track_changes' without restart"};
+
+	if (new_config.walk.bulkstat != old_config.walk.bulkstat)
+		throw std::runtime_error{"Cannot change 'walk_bulkstat' without restart"};
+
+	if (new_config.snapshot_path != old_config.snapshot_path)
+		throw std::runtime_error{"Cannot change 'snapshot' without restart"};
+
+	if (new_config.checkpoint_path != old_config.checkpoint_path)
+		throw std::runtime_error{"Cannot change 'checkpoint' without restart"};
+}
+
+void
+CheckReloadConfig(const Config &old_config, const Config &new_config)
+{
+	if (new_config.uring != old_config.uring)
+		throw std::runtime_error{"Cannot change 'uring_*' settings without restart"};
+
+	if (new_config.control_socket != old_config.control_socket)
+		throw std::runtime_error{"Cannot change 'control_socket' without restart"};
+
+	if (new_config.caches.size() != old_config.caches.size())
+		throw std::runtime_error{"Cannot add or remove sections without restart"};
+
+	for (std::size_t i = 0; i < new_config.caches.size(); ++i) {
+		const auto &o = old_config.caches[i];
+		const auto &n = new_config.caches[i];
+
+		if (n.name != o.name)
+			throw std::runtime_error{"Cannot rename sections without restart"};
+
+		try {
+			CheckReloadCacheConfig(o, n);
+		} catch (...) {
+			if (n.name.empty())
+				throw;
+
+			std::throw_with_nested(std::runtime_error{"In section [" + n.name + "]"});
+		}
+	}
+}
@@ -4,19 +4,131 @@
 
 #pragma once
 
+#include "UringConfig.hxx"
+#include "WConfig.hxx"
+
+#include <chrono>
 #include <cstdint>
 #include <forward_list>
 #include <string>
+#include <vector>
+
+/**
+ * The configuration of one cache binding (one /dev/cachefiles
+ * file descriptor).
+ */
+struct CacheConfig {
+	/**
+	 * The name of the configuration section (empty if the file
+	 * has no sections).
+	 */
+	std::string name;
 
-struct Config {
 	std::string dir;
 
 	std::forward_list<std::string> kernel_config;
 
 	uint_least8_t brun = 10, frun = 10;
 
+	/**
+	 * The kernel's culling thresholds; they are passed to the
+	 * kernel, but we need them for predictive culling.
+	 */
+	uint_least8_t bcull = 7, fcull = 7;
+
+	/**
+	 * Start a cull if the partition is predicted to reach
+	 * #bcull / #fcull within this duration.  Zero disables
+	 * predictive culling.
+	 */
+	std::chrono::seconds cull_lead{};
+
+	WalkConfig walk;
+
+	/**
+	 * Track changes with fanotify to avoid reading unmodified
+	 * directories again (see #DirectoryTracker).
+	 */
+	bool track_changes = false;
+
+	/**
+	 * If non-empty, then the #DirectoryTracker listings are saved
+	 * to this file after each cull and on shutdown, and loaded
+	 * at startup.  Only the listings are saved, not the atimes
+	 * or the cull candidates, so the first cull after a restart
+	 * still needs to stat all files; it is only useful with
+	 * #track_changes.
+	 */
+	std::string snapshot_path;
+
+	/**
+	 * If non-empty, then the progress of a cull which is
+	 * interrupted by shutdown is saved to this file (see
+	 * SaveWalkCheckpoint()), and the first cull after the next
+	 * start resumes from it.
+	 */
+	std::string checkpoint_path;
+
+	/**
+	 * If non-empty, then each cull writes a #WalkTraceWriter
+	 * file to this directory.
+	 */
+	std::string trace_directory;
+
+	/**
+	 * Keep only this number of traces in #trace_directory; older
+	 * ones are deleted after each cull.
+	 */
+	std::size_t trace_keep = 100;
+
 	bool culling_disabled = false;
 };
 
+struct Config {
+	/**
+	 * Global settings ("uring_*", "control_socket"); they are
+	 * only allowed before the first section.
+	 */
+	UringConfig uring;
+
+	/**
+	 * If non-empty, then listen for control requests (see
+	 * #ControlServer) on a local socket with this path.  Global
+	 * setting.
+	 */
+	std::string control_socket;
+
+	/**
+	 * One item per "[NAME]" section; settings before the first
+	 * section apply to all sections.  If there are no sections,
+	 * this contains just one item.
+	 */
+	std::vector<CacheConfig> caches;
+
+	/**
+	 * Is WalkConfig::bulkstat enabled in any cache?
+	 */
+	[[gnu::pure]]
+	bool NeedsBulkstat() const noexcept {
+		for (const auto &i : caches)
+			if (i.walk.bulkstat)
+				return true;
+		return false;
+	}
+};
+
 Config
 LoadConfigFile(const char *path);
+
+/**
+ * Check whether #new_config can be applied to a running daemon
+ * which was started with #old_config.  Settings which were passed
+ * to the kernel when binding the cache (except "brun" and "frun",
+ * which are interpreted by the daemon) and settings which need
+ * capabilities we have dropped cannot be changed.
+ *
+ * Throws std::runtime_error describing the first setting which
+ * cannot be changed without a restart.
+ */
+void
+CheckReloadConfig(const Config &old_config, const Config &new_config);
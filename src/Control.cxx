@@ -0,0 +1,411 @@
+// SPDX-License-Identifier: BSD-2-Clause OR GPL-2.0-or-later
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#include "Control.hxx"
+#include "ControlCommand.hxx"
+#include "Cache.hxx"
+#include "Walk.hxx"
+#include "WHandler.hxx"
+#include "WResult.hxx"
+#include "Pressure.hxx"
+#include "event/Loop.hxx"
+#include "net/AllocatedSocketAddress.hxx"
+#include "net/SocketError.hxx"
+#include "net/UniqueSocketDescriptor.hxx"
+#include "system/Error.hxx"
+#include "lib/fmt/ExceptionFormatter.hxx"
+#include "util/DeleteDisposer.hxx"
+#include "util/SpanCast.hxx"
+
+#include <fmt/format.h>
+
+#include <algorithm> // for std::sort_heap(), std::min()
+#include <cassert>
+#include <cerrno>
+#include <iterator> // for std::back_inserter()
+#include <memory>
+#include <optional>
+#include <span>
+#include <stdexcept>
+
+#include <sys/socket.h>
+#include <sys/stat.h> // for chmod()
+#include <string.h> // for strerror()
+#include <unistd.h> // for unlink()
+
+/**
+ * Connections beyond this number are rejected.
+ */
+static constexpr std::size_t MAX_CONNECTIONS = 8;
+
+/**
+ * Limits for the #Walk of a dry run; it competes with real culls for
+ * I/O and memory, but nobody is waiting for disk space to be freed.
+ */
+static constexpr std::size_t DRY_RUN_QUEUE_DEPTH = 1024;
+static constexpr std::size_t DRY_RUN_FD_BUDGET = 1024;
+
+class ControlServer::Connection final
+	: public IntrusiveListHook<>, WalkHandler
+{
+	ControlServer &server;
+
+	SocketEvent event;
+
+	/**
+	 * The walk of a "dry_run" request; the reply is sent when it
+	 * finishes.
+	 */
+	std::unique_ptr<Walk> walk;
+
+	/**
+	 * Throttle the #walk like a #Cull does (only set while the
+	 * #walk is running and if enabled in the #WalkConfig).
+	 */
+	std::optional<PressureThrottle> pressure_throttle;
+	std::optional<MemoryGovernor> memory_governor;
+
+	/**
+	 * The maximum number of #walk statx() calls (before
+	 * throttling).
+	 */
+	std::size_t walk_queue_depth;
+
+	/**
+	 * The number of files requested by the "dry_run" command; the
+	 * #walk may return more if they are empty.
+	 */
+	std::size_t dry_run_files;
+
+	/**
+	 * The "ancient" files found by #walk; a cull would delete
+	 * them unconditionally.
+	 */
+	std::size_t n_ancient = 0;
+	uint_least64_t ancient_bytes = 0;
+
+public:
+	Connection(ControlServer &_server, UniqueSocketDescriptor &&fd) noexcept
+		:server(_server),
+		 event(server.event_loop, BIND_THIS_METHOD(OnSocketReady), fd.Release())
+	{
+		event.ScheduleRead();
+	}
+
+	~Connection() noexcept {
+		if (walk)
+			StopDryRun();
+		event.Close();
+	}
+
+	Connection(const Connection &) = delete;
+	Connection &operator=(const Connection &) = delete;
+
+private:
+	void Destroy() noexcept {
+		server.connections.erase(server.connections.iterator_to(*this));
+		--server.n_connections;
+		delete this;
+	}
+
+	/**
+	 * Send a reply datagram.  If that fails (e.g. because it is
+	 * too large), send an "ERROR" reply instead; if that fails,
+	 * too, shut down the socket, and the next read will see
+	 * end-of-file and destroy this connection.
+	 */
+	void Reply(std::string_view text) noexcept {
+		const auto s = event.GetSocket();
+		if (s.Send(AsBytes(text), MSG_NOSIGNAL) >= 0)
+			return;
+
+		char error[128];
+		*fmt::format_to_n(error, sizeof(error) - 1,
+				  "ERROR Failed to send reply: {}\n",
+				  strerror(errno)).out = 0;
+		if (s.Send(AsBytes(std::string_view{error}), MSG_NOSIGNAL) < 0)
+			s.Shutdown();
+	}
+
+	/**
+	 * Throws on error.
+	 */
+	void HandleCommand(std::string_view line);
+
+	void StartDryRun(Cache &cache, std::size_t n);
+	void StopDryRun() noexcept;
+
+	[[gnu::pure]]
+	std::size_t GetWalkMaxStat() const noexcept;
+
+	void OnPressureWindow(std::size_t window) noexcept;
+	void OnMemoryShift() noexcept;
+
+	void OnSocketReady(unsigned events) noexcept;
+
+	// virtual methods from WalkHandler
+	void OnWalkAncient([[maybe_unused]] WalkDirectory &directory,
+			   [[maybe_unused]] std::string &&filename,
+			   uint_least64_t size) noexcept override {
+		++n_ancient;
+		ancient_bytes += size;
+	}
+
+	void OnWalkFinished(WalkResult &&result) noexcept override;
+};
+
+static UniqueSocketDescriptor
+CreateControlSocket(const char *path)
+{
+	/* remove the stale socket left by a previous process */
+	unlink(path);
+
+	UniqueSocketDescriptor fd;
+	if (!fd.CreateNonBlock(AF_LOCAL, SOCK_SEQPACKET, 0))
+		throw MakeSocketError("Failed to create control socket");
+
+	AllocatedSocketAddress address;
+	address.SetLocal(path);
+
+	if (!fd.Bind(address))
+		throw MakeSocketError("Failed to bind control socket");
+
+	/* only root may control the daemon */
+	if (chmod(path, 0600) < 0)
+		throw MakeErrno("Failed to chmod control socket");
+
+	if (!fd.Listen(MAX_CONNECTIONS))
+		throw MakeSocketError("Failed to listen on control socket");
+
+	return fd;
+}
+
+ControlServer::ControlServer(EventLoop &_event_loop, const char *_path,
+			     ControlHandler &_handler)
+	:event_loop(_event_loop), handler(_handler), path(_path),
+	 listener(event_loop, BIND_THIS_METHOD(OnListenerReady),
+		  CreateControlSocket(_path).Release())
+{
+	listener.ScheduleRead();
+}
+
+ControlServer::~ControlServer() noexcept
+{
+	connections.clear_and_dispose(DeleteDisposer{});
+	listener.Close();
+	unlink(path.c_str());
+}
+
+void
+ControlServer::OnListenerReady(unsigned) noexcept
+{
+	auto fd = listener.GetSocket().AcceptNonBlock();
+	if (!fd.IsDefined()) {
+		if (errno != EAGAIN)
+			fmt::print(stderr, "Failed to accept control connection: {}\n",
+				   strerror(errno));
+		return;
+	}
+
+	if (n_connections >= MAX_CONNECTIONS)
+		/* too many; close the new one */
+		return;
+
+	auto *connection = new Connection(*this, std::move(fd));
+	connections.push_back(*connection);
+	++n_connections;
+}
+
+inline void
+ControlServer::Connection::HandleCommand(std::string_view line)
+{
+	const auto command = ParseControlCommand(line);
+	auto &cache = server.handler.GetControlCache(command.section);
+
+	switch (command.type) {
+	case ControlCommand::Type::CULL:
+		cache.RequestCull(command.files, command.bytes);
+		Reply("OK\n");
+		break;
+
+	case ControlCommand::Type::DRY_RUN:
+		StartDryRun(cache, command.files);
+		break;
+
+	case ControlCommand::Type::PAUSE:
+		cache.Pause();
+		Reply("OK\n");
+		break;
+
+	case ControlCommand::Type::RESUME:
+		cache.Resume();
+		Reply("OK\n");
+		break;
+	}
+}
+
+inline void
+ControlServer::Connection::StartDryRun(Cache &cache, std::size_t n)
+{
+	/* only one at a time, so dry runs cannot add up to more
+	   load than a real cull */
+	if (server.dry_run_running)
+		throw std::runtime_error{"Another dry run is running"};
+
+	/* the plain LRU selection; the fair-share selection would
+	   not return the oldest files */
+	WalkConfig config = cache.GetWalkConfig();
+	config.fair_share = false;
+	config.walk_queue_depth = std::min(config.walk_queue_depth,
+					   DRY_RUN_QUEUE_DEPTH);
+	config.fd_budget = std::min(config.fd_budget, DRY_RUN_FD_BUDGET);
+
+	walk_queue_depth = config.walk_queue_depth;
+	dry_run_files = n;
+	n_ancient = 0;
+	ancient_bytes = 0;
+
+	walk.reset(new Walk(server.event_loop, *server.event_loop.GetUring(),
+			    config, n, 0, *this));
+
+	try {
+		walk->Start(cache.GetCacheDirectory());
+	} catch (...) {
+		walk.reset();
+		throw;
+	}
+
+	server.dry_run_running = true;
+
+	if (config.pressure_threshold > 0)
+		pressure_throttle.emplace(server.event_loop,
+					  config.pressure_threshold,
+					  walk_queue_depth,
+					  BIND_THIS_METHOD(OnPressureWindow));
+
+	if (config.memory_pressure_threshold > 0)
+		memory_governor.emplace(server.event_loop,
+					config.memory_pressure_threshold,
+					BIND_THIS_METHOD(OnMemoryShift));
+}
+
+void
+ControlServer::Connection::StopDryRun() noexcept
+{
+	assert(walk);
+	assert(server.dry_run_running);
+
+	memory_governor.reset();
+	pressure_throttle.reset();
+	walk.reset();
+	server.dry_run_running = false;
+}
+
+std::size_t
+ControlServer::Connection::GetWalkMaxStat() const noexcept
+{
+	std::size_t max_stat = walk_queue_depth;
+	if (memory_governor)
+		max_stat = memory_governor->Scale(max_stat);
+
+	if (pressure_throttle)
+		max_stat = std::min(max_stat, pressure_throttle->GetWindow());
+
+	return max_stat;
+}
+
+void
+ControlServer::Connection::OnPressureWindow([[maybe_unused]] std::size_t window) noexcept
+{
+	assert(walk);
+
+	walk->SetMaxStat(GetWalkMaxStat());
+}
+
+void
+ControlServer::Connection::OnMemoryShift() noexcept
+{
+	assert(walk);
+
+	walk->SetMaxStat(GetWalkMaxStat());
+}
+
+void
+ControlServer::Connection::OnSocketReady(unsigned) noexcept
+{
+	char buffer[256];
+	const auto nbytes = event.GetSocket().Receive(std::as_writable_bytes(std::span{buffer}));
+	if (nbytes < 0) {
+		if (errno == EAGAIN)
+			return;
+
+		Destroy();
+		return;
+	}
+
+	if (nbytes == 0) {
+		/* the peer has closed the connection */
+		Destroy();
+		return;
+	}
+
+	if (walk) {
+		Reply("ERROR Busy\n");
+		return;
+	}
+
+	try {
+		HandleCommand({buffer, static_cast<std::size_t>(nbytes)});
+	} catch (...) {
+		Reply(fmt::format("ERROR {}\n", std::current_exception()));
+	}
+}
+
+/**
+ * Append the path of the given directory relative to the walk root
+ * (with a trailing slash unless it is the root).
+ */
+static void
+AppendPath(fmt::memory_buffer &out, const WalkDirectory &directory) noexcept
+{
+	if (directory.parent == nullptr)
+		return;
+
+	AppendPath(out, *directory.parent);
+	fmt::format_to(std::back_inserter(out), "{}/", directory.name);
+}
+
+void
+ControlServer::Connection::OnWalkFinished(WalkResult &&result) noexcept
+{
+	/* oldest first */
+	std::sort_heap(result.files.begin(), result.files.end());
+
+	/* with empty files, the byte limit is never reached and
+	   the #Walk keeps more than the requested number */
+	const std::span files{result.files.begin(),
+		std::min(result.files.size(), dry_run_files)};
+
+	uint_least64_t total_bytes = 0;
+	for (const auto &i : files)
+		total_bytes += i.size;
+
+	fmt::memory_buffer out;
+	fmt::format_to(std::back_inserter(out),
+		       "OK files={} bytes={} ancient_files={} ancient_bytes={}\n",
+		       files.size(), total_bytes,
+		       n_ancient, ancient_bytes);
+
+	for (const auto &i : files) {
+		fmt::format_to(std::back_inserter(out), "{} {} ",
+			       i.time.count(), i.size);
+		AppendPath(out, *i.parent);
+		fmt::format_to(std::back_inserter(out), "{}\n", i.name);
+	}
+
+	/* this invalidates #result */
+	StopDryRun();
+
+	Reply({out.data(), out.size()});
+}
@@ -0,0 +1,71 @@
+// SPDX-License-Identifier: BSD-2-Clause OR GPL-2.0-or-later
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#pragma once
+
+#include "event/SocketEvent.hxx"
+#include "util/IntrusiveList.hxx"
+
+#include <cstddef>
+#include <string>
+#include <string_view>
+
+class Cache;
+
+/**
+ * Handler class for #ControlServer.
+ */
+class ControlHandler {
+public:
+	/**
+	 * Look up the cache addressed by a control request.  An empty
+	 * section name selects the only cache.
+	 *
+	 * Throws std::runtime_error if there is no such cache.
+	 */
+	virtual Cache &GetControlCache(std::string_view section) = 0;
+};
+
+/**
+ * Listens on a local SOCK_SEQPACKET socket for control requests
+ * (see #ControlCommand) which start culls or dry runs, or pause
+ * culling.  Each request datagram gets one reply datagram starting
+ * with "OK" or "ERROR".
+ */
+class ControlServer final {
+	EventLoop &event_loop;
+
+	ControlHandler &handler;
+
+	/**
+	 * The socket path; it is deleted by the destructor.
+	 */
+	const std::string path;
+
+	SocketEvent listener;
+
+	class Connection;
+	IntrusiveList<Connection> connections;
+
+	std::size_t n_connections = 0;
+
+	/**
+	 * Is a connection running a dry run currently?
+	 */
+	bool dry_run_running = false;
+
+public:
+	/**
+	 * Throws on error.
+	 */
+	ControlServer(EventLoop &_event_loop, const char *_path,
+		      ControlHandler &_handler);
+	~ControlServer() noexcept;
+
+	ControlServer(const ControlServer &) = delete;
+	ControlServer &operator=(const ControlServer &) = delete;
+
+private:
+	void OnListenerReady(unsigned events) noexcept;
+};
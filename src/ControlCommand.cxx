@@ -0,0 +1,84 @@
+// SPDX-License-Identifier: BSD-2-Clause OR GPL-2.0-or-later
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#include "ControlCommand.hxx"
+#include "util/CharUtil.hxx"
+#include "util/StringStrip.hxx"
+
+#include <algorithm> // for std::ranges::find_if()
+#include <charconv>
+#include <stdexcept>
+
+using std::string_view_literals::operator""sv;
+
+/**
+ * Split the first whitespace-separated word from the (left-stripped)
+ * string.  Returns an empty string if there is none.
+ */
+static std::string_view
+NextWord(std::string_view &s) noexcept
+{
+	const auto space = std::ranges::find_if(s, IsWhitespaceNotNull);
+	const std::string_view word{s.begin(), space};
+	s = StripLeft(std::string_view{space, s.end()});
+	return word;
+}
+
+static uint_least64_t
+ParseNumber(std::string_view s)
+{
+	const char *const first = s.data(), *const last = first + s.size();
+
+	uint_least64_t value;
+	auto [ptr, ec] = std::from_chars(first, last, value, 10);
+	if (ptr == first || ptr != last || ec != std::errc{})
+		throw std::runtime_error{"Malformed number"};
+
+	return value;
+}
+
+static uint_least64_t
+ParseNumberArgument(std::string_view &s)
+{
+	const auto word = NextWord(s);
+	if (word.empty())
+		throw std::runtime_error{"Missing argument"};
+
+	return ParseNumber(word);
+}
+
+ControlCommand
+ParseControlCommand(std::string_view line)
+{
+	line = Strip(line);
+
+	ControlCommand command;
+
+	const auto name = NextWord(line);
+	if (name == "cull"sv) {
+		command.type = ControlCommand::Type::CULL;
+		command.files = ParseNumberArgument(line);
+		command.bytes = ParseNumberArgument(line);
+		if (command.files == 0 && command.bytes == 0)
+			throw std::runtime_error{"Nothing to cull"};
+	} else if (name == "dry_run"sv) {
+		command.type = ControlCommand::Type::DRY_RUN;
+		command.files = ParseNumberArgument(line);
+		if (command.files == 0 || command.files > MAX_DRY_RUN_FILES)
+			throw std::runtime_error{"Number of files out of range"};
+	} else if (name == "pause"sv)
+		command.type = ControlCommand::Type::PAUSE;
+	else if (name == "resume"sv)
+		command.type = ControlCommand::Type::RESUME;
+	else if (name.empty())
+		throw std::runtime_error{"No command"};
+	else
+		throw std::runtime_error{"Unknown command"};
+
+	command.section = NextWord(line);
+	if (!line.empty())
+		throw std::runtime_error{"Too many arguments"};
+
+	return command;
+}
@@ -0,0 +1,65 @@
+// SPDX-License-Identifier: BSD-2-Clause OR GPL-2.0-or-later
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#pragma once
+
+#include <cstdint>
+#include <string_view>
+
+/**
+ * A parsed request received on the control socket (see
+ * #ControlServer).  Each request is one datagram containing one
+ * line of text:
+ *
+ * - "cull FILES BYTES [SECTION]": start a cull which frees the
+ *   given number of files and bytes
+ * - "dry_run N [SECTION]": walk the cache without culling and reply
+ *   with the N least recently used files
+ * - "pause [SECTION]": abort the running cull and ignore cull
+ *   requests until "resume"
+ * - "resume [SECTION]"
+ *
+ * The section name may only be omitted if there is just one cache.
+ */
+struct ControlCommand {
+	enum class Type : uint_least8_t {
+		CULL,
+		DRY_RUN,
+		PAUSE,
+		RESUME,
+	};
+
+	Type type;
+
+	/**
+	 * The configuration section name (empty if not specified).
+	 * Points into the request buffer.
+	 */
+	std::string_view section;
+
+	/**
+	 * The number of files to be culled (#CULL) or listed
+	 * (#DRY_RUN).
+	 */
+	uint_least64_t files = 0;
+
+	/**
+	 * The number of bytes to be culled (#CULL).
+	 */
+	uint_least64_t bytes = 0;
+};
+
+/**
+ * The upper limit for "dry_run"; the whole listing is sent in one
+ * datagram, which must fit into the socket buffer.
+ */
+static constexpr uint_least64_t MAX_DRY_RUN_FILES = 256;
+
+/**
+ * Parse a control request.
+ *
+ * Throws std::runtime_error on error.
+ */
+ControlCommand
+ParseControlCommand(std::string_view line);
@@ -3,23 +3,54 @@
 // author: Max Kellermann <max.kellermann@ionos.com>
 
 #include "Cull.hxx"
+#include "Chdir.hxx"
 #include "Walk.hxx"
+#include "WConfig.hxx"
 #include "DevCachefiles.hxx"
+#include "CoUnlink.hxx"
+#include "Probe.hxx"
+#include "lib/fmt/ExceptionFormatter.hxx"
+#include "io/FileAt.hxx"
+#include "io/Open.hxx"
 #include "io/uring/CoOperation.hxx"
 #include "system/Error.hxx"
 #include "co/InvokeTask.hxx"
 #include "util/DeleteDisposer.hxx"
 
+#include <algorithm> // for std::min()
 #include <cassert>
 
+#include <fcntl.h> // for O_DIRECTORY
+
 #include <fmt/core.h> // TODO
 
+/**
+ * While cull commands are in flight, the #Walk is limited to
+ * WalkConfig::walk_queue_depth divided by this number, to let the
+ * cull commands (which free space) get ahead of scanning (which
+ * only finds more candidates).  Both share one io_uring and their
+ * system calls (statx(), openat() and writes to a character device)
+ * do not honor the per-SQE ioprio field, so limiting the number of
+ * submissions is the only way to prioritize.
+ */
+static constexpr std::size_t WALK_BACKOFF_DIVISOR = 16;
+
+/**
+ * The maximum number of files in Cull::ancient (before scaling down
+ * under memory pressure).  Beyond that, the #Walk is paused until
+ * the cull commands have caught up.
+ */
+static constexpr std::size_t MAX_ANCIENT = 64 * 1024;
+
 inline Co::InvokeTask
 Cull::CullFile(WalkDirectoryRef directory, std::string name,
 	       uint_least64_t size) noexcept
 {
-	const auto chdir_lease = co_await chdir.Add(directory->fd);
-	if (!chdir_lease) {
+	/* the file descriptor must remain open (and must not be
+	   reused for another directory) as long as the Chdir lease
+	   or the CullWorkerPool job exists */
+	const WalkDirectoryPin pin{*directory};
+	if (!pin) {
 		++n_errors;
 		co_return;
 	}
@@ -31,13 +62,34 @@ Cull::CullFile(WalkDirectoryRef directory, std::string name,
 		co_return;
 	}
 
-	const auto nbytes = co_await Uring::CoTryWrite(uring,
-						       dev_cachefiles.GetFileDescriptor(),
-						       w, 0);
+	int nbytes;
+	if (workers) {
+		/* the worker changes its own working directory */
+		CASH_PROBE(cull_submit, name.c_str(), size);
+		nbytes = co_await workers->CullFile(pin.GetFileDescriptor(), w);
+	} else {
+		const auto chdir_lease = co_await chdir.Add(pin.GetFileDescriptor());
+		if (!chdir_lease) {
+			++n_errors;
+			co_return;
+		}
+
+		CASH_PROBE(cull_submit, name.c_str(), size);
+
+		if (auto *backend = dev_cachefiles.GetBackend())
+			nbytes = co_await backend->CullFile(w);
+		else
+			nbytes = co_await Uring::CoTryWrite(uring,
+							    dev_cachefiles.GetFileDescriptor(),
+							    w, 0);
+	}
+
+	CASH_PROBE(cull_result, name.c_str(), nbytes);
 	switch (dev_cachefiles.CheckCullFileResult(name, nbytes)) {
 	case DevCachefiles::CullResult::SUCCESS:
 		++n_deleted_files;
 		n_deleted_bytes += size;
+		OnEntryRemoved(*directory);
 		break;
 
 	case DevCachefiles::CullResult::BUSY:
@@ -50,6 +102,54 @@ Cull::CullFile(WalkDirectoryRef directory, std::string name,
 	}
 }
 
+inline void
+Cull::OnEntryRemoved(WalkDirectory &directory) noexcept
+{
+	assert(directory.n_entries > 0);
+
+	--directory.n_entries;
+
+	/* the root directory is never removed */
+	if (directory.parent == nullptr ||
+	    !walk_config.prune_empty_directories)
+		return;
+
+	if (!directory.complete)
+		/* the #Walk may still count more entries (or
+		   uncount vanished ones) in a directory which is
+		   still being walked; decide in
+		   OnWalkDirectoryComplete() */
+		directory.culled = true;
+	else if (directory.n_entries == 0)
+		AddOperation(PruneDirectory(WalkDirectoryRef{directory}));
+}
+
+Co::InvokeTask
+Cull::PruneDirectory(WalkDirectoryRef directory) noexcept
+{
+	WalkDirectory &parent = *directory->parent;
+
+	const WalkDirectoryPin pin{parent};
+	if (!pin) {
+		++n_errors;
+		co_return;
+	}
+
+	/* this is safe against concurrent creates by the kernel:
+	   rmdir() fails with ENOTEMPTY if a new file has been
+	   created meanwhile, and with EBUSY if the kernel has marked
+	   the directory as being in use (S_KERNEL_FILE, e.g. the
+	   fan-out directories of an active volume) */
+	const int result = co_await Uring::CoUnlink(uring, pin.GetFileDescriptor(),
+						     directory->name.c_str(),
+						     AT_REMOVEDIR);
+	if (result < 0)
+		co_return;
+
+	++n_pruned;
+	OnEntryRemoved(parent);
+}
+
 class Cull::Operation final
 	: public IntrusiveListHook<>
 {
@@ -73,29 +173,142 @@ private:
 	}
 };
 
-Cull::Cull(EventLoop &event_loop, Uring::Queue &_uring,
-	   DevCachefiles &_dev_cachefiles,
+Cull::Cull(EventLoop &_event_loop, Uring::Queue &_uring,
+	   DevCachefiles &_dev_cachefiles, Chdir &_chdir,
+	   const WalkConfig &_walk_config, std::string_view _log_prefix,
 	   uint_least64_t _cull_files, std::size_t _cull_bytes,
 	   Callback _callback)
-	:uring(_uring), dev_cachefiles(_dev_cachefiles),
+	:event_loop(_event_loop), uring(_uring), dev_cachefiles(_dev_cachefiles),
+	 walk_config(_walk_config), log_prefix(_log_prefix),
+	 cull_files(_cull_files), cull_bytes(_cull_bytes),
 	 callback(_callback),
-	 walk(new Walk(_uring, _cull_files, _cull_bytes, *this)),
-	 chdir(event_loop),
-	 defer_start(event_loop, BIND_THIS_METHOD(OnDeferredStart))
+	 walk(new Walk(_event_loop, _uring, walk_config, _cull_files, _cull_bytes, *this)),
+	 chdir(_chdir), chdir_count_start(chdir.GetChdirCount()),
+	 defer_start(_event_loop, BIND_THIS_METHOD(OnDeferredStart))
 {
 	assert(callback);
+
+	walk->SetLogPrefix(log_prefix);
+
+	if (walk_config.fair_share)
+		/* the fair-share selection needs all candidates of
+		   all volumes; it is not compatible with the
+		   approximate selection mode */
+		walk_config.approx_resolution = {};
+
+	if (walk_config.approx_resolution > std::chrono::seconds{})
+		walk->EnableHistogram(walk_config.approx_resolution);
+
+	/* the fake backend (for testing) is not thread-safe and
+	   does not need a working directory per thread */
+	if (walk_config.cull_workers > 0 && dev_cachefiles.GetBackend() == nullptr) {
+		try {
+			workers.emplace(event_loop, dev_cachefiles.GetFileDescriptor(),
+					walk_config.cull_workers);
+		} catch (...) {
+			/* fall back to culling from the main thread */
+			fmt::print(stderr, "{}: failed to start workers: {}\n",
+				   log_prefix, std::current_exception());
+		}
+	}
+
+	if (walk_config.pressure_threshold > 0)
+		pressure_throttle.emplace(event_loop, walk_config.pressure_threshold,
+					  walk_config.walk_queue_depth,
+					  BIND_THIS_METHOD(OnPressureWindow));
+
+	if (walk_config.memory_pressure_threshold > 0)
+		memory_governor.emplace(event_loop, walk_config.memory_pressure_threshold,
+					BIND_THIS_METHOD(OnMemoryShift));
 }
 
 Cull::~Cull() noexcept
 {
+	/* this cancels the cull commands queued in #workers */
 	operations.clear_and_dispose(DeleteDisposer{});
 	new_operations.clear_and_dispose(DeleteDisposer{});
 }
 
 void
-Cull::Start(FileDescriptor root_fd)
+Cull::SetTracker(DirectoryTracker &_tracker) noexcept
 {
-	walk->Start(root_fd);
+	tracker = &_tracker;
+	walk->SetTracker(_tracker);
+}
+
+void
+Cull::SetFrequency(AccessSketch &sketch, FileTime since) noexcept
+{
+	frequency = &sketch;
+	frequency_since = since;
+	walk->SetFrequency(sketch, since, true);
+}
+
+void
+Cull::SetTrace(WalkTraceWriter &trace) noexcept
+{
+	walk->SetTrace(trace);
+}
+
+void
+Cull::Start(FileDescriptor _root_fd)
+{
+	if (walk_config.approx_resolution > std::chrono::seconds{})
+		root_fd = OpenPath({_root_fd, "."}, O_DIRECTORY);
+
+	walk->Start(_root_fd);
+}
+
+void
+Cull::Resume(FileDescriptor _root_fd, WalkCheckpoint &&checkpoint)
+{
+	if (!CanCheckpoint()) {
+		Start(_root_fd);
+		return;
+	}
+
+	walk->Resume(_root_fd, std::move(checkpoint));
+}
+
+void
+Cull::Resume(FileDescriptor _root_fd, SavedWalkCheckpoint &&checkpoint)
+{
+	if (!CanCheckpoint()) {
+		Start(_root_fd);
+		return;
+	}
+
+	walk->Resume(_root_fd, std::move(checkpoint));
+}
+
+std::optional<WalkCheckpoint>
+Cull::TakeCheckpoint() noexcept
+{
+	if (!walk || !CanCheckpoint())
+		return std::nullopt;
+
+	return walk->TakeCheckpoint();
+}
+
+std::size_t
+Cull::GetChdirCount() const noexcept
+{
+	return chdir.GetChdirCount() - chdir_count_start +
+		(workers ? workers->GetChdirCount() : 0);
+}
+
+void
+Cull::Reconfigure(const WalkConfig &new_config) noexcept
+{
+	walk_config.walk_queue_depth = new_config.walk_queue_depth;
+	walk_config.cull_queue_depth = new_config.cull_queue_depth;
+	walk_config.prune_empty_directories = new_config.prune_empty_directories;
+
+	if (walk)
+		walk->SetMaxStat(GetWalkMaxStat());
+
+	if (HasPending())
+		defer_start.Schedule();
 }
 
 void
@@ -103,36 +316,224 @@ Cull::OnWalkAncient(WalkDirectory &directory,
 		    std::string &&filename,
 		    uint_least64_t size) noexcept
 {
-	AddOperation(CullFile(WalkDirectoryRef{directory}, std::move(filename), size));
+	/* no coroutine yet; OnDeferredStart() creates it when the
+	   cull queue has room */
+	ancient.emplace_back(WalkDirectoryRef{directory}, std::move(filename), size);
+	defer_start.Schedule();
+
+	if (ancient.size() >= GetMaxAncient())
+		/* pause the walk until the queue has been drained */
+		walk->SetMaxStat(GetWalkMaxStat());
+}
+
+inline void
+Cull::StartSecondWalk(const WalkHistogram::Boundary &boundary) noexcept
+try {
+	const uint_least64_t remaining_files = cull_files > boundary.files_below
+		? cull_files - boundary.files_below
+		: 0;
+	const uint_least64_t remaining_bytes = cull_bytes > boundary.bytes_below
+		? cull_bytes - boundary.bytes_below
+		: 0;
+
+	fmt::print(stderr, "{}: delete {} files, {} bytes older than {}; select {} files, {} bytes\n",
+		   log_prefix, boundary.files_below, boundary.bytes_below,
+		   boundary.older.count(),
+		   remaining_files, remaining_bytes);
+
+	walk.reset(new Walk(event_loop, uring, walk_config,
+			    remaining_files, remaining_bytes,
+			    *this));
+	walk->SetLogPrefix(log_prefix);
+	walk->SetTimeWindow(boundary.older, boundary.newer);
+
+	if (tracker != nullptr)
+		walk->SetTracker(*tracker);
+
+	if (frequency != nullptr)
+		/* the first walk has already counted the accesses */
+		walk->SetFrequency(*frequency, frequency_since, false);
+
+	walk->SetMaxStat(GetWalkMaxStat());
+	walk->SetMaxCandidates(GetWalkMaxCandidates());
+
+	walk->Start(root_fd);
+} catch (...) {
+	fmt::print(stderr, "{}: failed to start second walk: {}\n",
+		   log_prefix, std::current_exception());
+	walk.reset();
+	OnWalkComplete();
 }
 
 void
-Cull::OnWalkFinished(WalkResult &&result) noexcept
+Cull::OnWalkDirectoryComplete(WalkDirectory &directory) noexcept
 {
-	fmt::print(stderr, "Cull: delete {} files, {} bytes\n",
-		   result.files.size(), result.total_bytes);
+	if (directory.culled && directory.n_entries == 0 &&
+	    walk_config.prune_empty_directories)
+		AddOperation(PruneDirectory(WalkDirectoryRef{directory}));
+}
 
-	for (auto &file : result.files) {
-		AddOperation(CullFile(std::move(file.parent), std::move(file.name), file.size));
+void
+Cull::OnWalkFinished(WalkResult &&result) noexcept
+{
+	if (result.histogram) {
+		/* the first walk of the approximate selection mode
+		   has finished */
+		const auto boundary = result.histogram->FindBoundary(cull_files, cull_bytes);
+		ResetWalk();
+		StartSecondWalk(boundary);
+		return;
 	}
 
-	walk.reset();
+	fmt::print(stderr, "{}: delete {} files, {} bytes\n",
+		   log_prefix, result.files.size(), result.total_bytes);
 
-	if (!new_operations.empty())
+	/* no coroutines yet; OnDeferredStart() creates them when
+	   the cull queue has room */
+	selected = std::move(result.files);
+
+	ResetWalk();
+	OnWalkComplete();
+}
+
+inline void
+Cull::OnWalkComplete() noexcept
+{
+	if (pressure_throttle) {
+		fmt::print(stderr, "{}: walk throttled for {}s\n", log_prefix,
+			   std::chrono::duration_cast<std::chrono::seconds>(pressure_throttle->GetThrottledDuration()).count());
+		pressure_throttle.reset();
+	}
+
+	if (HasPending())
 		defer_start.Schedule();
 	else if (operations.empty())
 		Finish();
 }
 
+inline bool
+Cull::StartNext() noexcept
+{
+	if (!new_operations.empty()) {
+		auto &op = new_operations.front();
+		new_operations.pop_front();
+		operations.push_back(op);
+		++n_running;
+		op.Start();
+	} else if (!ancient.empty()) {
+		auto c = std::move(ancient.front());
+		ancient.pop_front();
+		StartOperation(CullFile(std::move(c.directory), std::move(c.name), c.size));
+	} else if (!selected.empty()) {
+		auto &file = selected.back();
+		auto task = CullFile(std::move(file.parent), std::move(file.name), file.size);
+		selected.pop_back();
+		StartOperation(std::move(task));
+	} else
+		return false;
+
+	return true;
+}
+
 inline void
 Cull::OnDeferredStart() noexcept
 {
-	assert(!new_operations.empty());
+	const std::size_t queue_depth = GetCullQueueDepth();
+	while (n_running < queue_depth && StartNext()) {}
+
+	peak_cull = std::max(peak_cull, n_running);
+
+	if (selected.empty())
+		/* return the memory of the drained queue */
+		selected = PageVector<WalkResult::File>{0};
+
+	if (walk)
+		/* cull commands get ahead of scanning, and a paused
+		   walk may continue after #ancient has been
+		   drained */
+		walk->SetMaxStat(GetWalkMaxStat());
+	else if (n_running == 0 && !HasPending())
+		/* all operations have finished synchronously (or
+		   OperationFinished() has deferred the end to
+		   here) */
+		Finish();
+}
+
+void
+Cull::OnPressureWindow([[maybe_unused]] std::size_t window) noexcept
+{
+	assert(walk);
+
+	walk->SetMaxStat(GetWalkMaxStat());
+}
+
+void
+Cull::OnMemoryShift() noexcept
+{
+	if (walk) {
+		walk->SetMaxStat(GetWalkMaxStat());
+		walk->SetMaxCandidates(GetWalkMaxCandidates());
+	}
 
-	new_operations.clear_and_dispose([this](auto *op){
-		operations.push_back(*op);
-		op->Start();
-	});
+	/* the cull queue may grow again */
+	if (HasPending())
+		defer_start.Schedule();
+}
+
+std::size_t
+Cull::GetWalkMaxStat() const noexcept
+{
+	if (ancient.size() >= GetMaxAncient())
+		/* paused until OnDeferredStart() has drained
+		   #ancient */
+		return 0;
+
+	std::size_t max_stat = walk_config.walk_queue_depth;
+	if (memory_governor)
+		max_stat = memory_governor->Scale(max_stat);
+
+	if (pressure_throttle)
+		max_stat = std::min(max_stat, pressure_throttle->GetWindow());
+
+	if (n_running > 0)
+		max_stat = std::min(max_stat,
+				    std::max<std::size_t>(walk_config.walk_queue_depth / WALK_BACKOFF_DIVISOR, 1));
+
+	return max_stat;
+}
+
+std::size_t
+Cull::GetWalkMaxCandidates() const noexcept
+{
+	return memory_governor
+		? memory_governor->Scale(WalkResult::MAX_FILES)
+		: WalkResult::MAX_FILES;
+}
+
+std::size_t
+Cull::GetMaxAncient() const noexcept
+{
+	const std::size_t max_ancient = std::max(MAX_ANCIENT, walk_config.cull_queue_depth);
+	return memory_governor
+		? memory_governor->Scale(max_ancient)
+		: max_ancient;
+}
+
+std::size_t
+Cull::GetCullQueueDepth() const noexcept
+{
+	return memory_governor
+		? memory_governor->Scale(walk_config.cull_queue_depth)
+		: walk_config.cull_queue_depth;
+}
+
+void
+Cull::ResetWalk() noexcept
+{
+	assert(walk);
+
+	peak_walk = std::max(peak_walk, walk->GetPeakStat());
+	walk.reset();
 }
 
 inline void
@@ -143,19 +544,46 @@ Cull::AddOperation(Co::InvokeTask &&task) noexcept
 	defer_start.Schedule();
 }
 
+inline void
+Cull::StartOperation(Co::InvokeTask &&task) noexcept
+{
+	auto *op = new Operation(*this, std::move(task));
+	operations.push_back(*op);
+	++n_running;
+	op->Start();
+}
+
 void
 Cull::OperationFinished(Operation &op) noexcept
 {
 	assert(!operations.empty());
 
+	assert(n_running > 0);
+
 	operations.erase_and_dispose(operations.iterator_to(op), DeleteDisposer{});
-	if (!walk && operations.empty() && new_operations.empty())
-		Finish();
+	--n_running;
+
+	if (HasPending())
+		defer_start.Schedule();
+	else if (n_running == 0 && walk)
+		/* no more cull commands in flight: let the walk run
+		   at full speed again */
+		walk->SetMaxStat(GetWalkMaxStat());
+	else if (!walk && operations.empty())
+		/* finish in OnDeferredStart(), because this may be
+		   called synchronously from StartNext() */
+		defer_start.Schedule();
 }
 
 void
 Cull::Finish() noexcept
 {
-	fmt::print(stderr, "Cull: deleted {} files, {} bytes; {} in use; {} errors\n", n_deleted_files, n_deleted_bytes, n_busy, n_errors);
+	fmt::print(stderr, "{}: deleted {} files, {} bytes; {} in use; {} errors; pruned {} directories\n", log_prefix, n_deleted_files, n_deleted_bytes, n_busy, n_errors, n_pruned);
+	fmt::print(stderr, "{}: peak queue depth walk={} cull={}; {} fchdir calls\n",
+		   log_prefix, peak_walk, peak_cull, GetChdirCount());
+
+	if (memory_governor && memory_governor->GetPeakShift() > 0)
+		fmt::print(stderr, "{}: scaled down by up to {} under memory pressure\n",
+			   log_prefix, 1U << memory_governor->GetPeakShift());
 	callback();
 }
@@ -5,23 +5,35 @@
 #pragma once
 
 #include "WHandler.hxx"
-#include "Chdir.hxx"
+#include "CullWorker.hxx"
+#include "Pressure.hxx"
+#include "WCheckpoint.hxx"
+#include "WConfig.hxx"
+#include "WHistogram.hxx"
+#include "WResult.hxx"
+#include "PageVector.hxx"
 #include "event/DeferEvent.hxx"
 #include "io/UniqueFileDescriptor.hxx"
 #include "util/BindMethod.hxx"
 #include "util/IntrusiveList.hxx"
 
 #include <cstdint>
+#include <deque>
 #include <memory>
+#include <optional>
 #include <string>
+#include <string_view>
 
 #include <time.h> // for time_t
 
 namespace Co { class InvokeTask; }
 namespace Uring { class Queue; }
 class DevCachefiles;
+class Chdir;
 class Walk;
-class WalkDirectoryRef;
+class DirectoryTracker;
+class AccessSketch;
+class WalkTraceWriter;
 
 /**
  * This class represents the cachefiles "cull" operation.  It walks
@@ -29,15 +41,75 @@ class WalkDirectoryRef;
  * the longest time.  Upon completion, the given callback is invoked.
  */
 class Cull final : WalkHandler {
+	EventLoop &event_loop;
 	Uring::Queue &uring;
 	DevCachefiles &dev_cachefiles;
 
+	WalkConfig walk_config;
+
+	/**
+	 * The prefix of log messages, e.g. "Cull [disk1]"; the
+	 * string is owned by the caller.
+	 */
+	const std::string_view log_prefix;
+
+	const uint_least64_t cull_files, cull_bytes;
+
 	using Callback = BoundMethod<void() noexcept>;
 	const Callback callback;
 
 	std::unique_ptr<Walk> walk;
 
-	Chdir chdir;
+	/**
+	 * Passed to Walk::SetTracker() (optional).
+	 */
+	DirectoryTracker *tracker = nullptr;
+
+	/**
+	 * Passed to Walk::SetFrequency() (optional).
+	 */
+	AccessSketch *frequency = nullptr;
+	FileTime frequency_since;
+
+	/**
+	 * The root directory; only used by the approximate selection
+	 * mode (see WalkConfig::approx_resolution) to start the
+	 * second #Walk.
+	 */
+	UniqueFileDescriptor root_fd;
+
+	/**
+	 * Throttles the #walk under I/O pressure; only set while the
+	 * #walk is running and if WalkConfig::pressure_threshold is
+	 * non-zero.
+	 */
+	std::optional<PressureThrottle> pressure_throttle;
+
+	/**
+	 * Scales down the #walk and the cull queue under memory
+	 * pressure (only if WalkConfig::memory_pressure_threshold is
+	 * non-zero).
+	 */
+	std::optional<MemoryGovernor> memory_governor;
+
+	/**
+	 * Changes the working directory of the process; it is shared
+	 * by all #Cull instances.
+	 */
+	Chdir &chdir;
+
+	/**
+	 * The Chdir::GetChdirCount() value when this #Cull was
+	 * created (for statistics).
+	 */
+	const std::size_t chdir_count_start;
+
+	/**
+	 * Sends the cull commands in separate threads instead of
+	 * using #chdir (only if WalkConfig::cull_workers is
+	 * non-zero).
+	 */
+	std::optional<CullWorkerPool> workers;
 
 	/**
 	 * A coroutine running asynchronously.
@@ -46,37 +118,232 @@ class Cull final : WalkHandler {
 	IntrusiveList<Operation> operations, new_operations;
 
 	/**
-	 * Start #new_operations and move them to #operations.
+	 * A file reported by OnWalkAncient() which has no
+	 * CullFile() operation yet.
+	 */
+	struct Candidate {
+		WalkDirectoryRef directory;
+		std::string name;
+		uint_least64_t size;
+	};
+
+	/**
+	 * Files below the boundary of the approximate selection mode
+	 * (see OnWalkAncient()) waiting for a slot in the cull queue.
+	 * The #walk is paused while this queue is full (see
+	 * GetMaxAncient()).
+	 */
+	std::deque<Candidate> ancient;
+
+	/**
+	 * The files selected by the (last) #walk (moved from
+	 * WalkResult::files) waiting for a slot in the cull queue.
+	 * They are consumed from the back; the heap order does not
+	 * matter here.
+	 */
+	PageVector<WalkResult::File> selected{0};
+
+	/**
+	 * Start #new_operations and CullFile() operations for
+	 * #ancient and #selected and move them to #operations (up to
+	 * WalkConfig::cull_queue_depth).  Only the running
+	 * operations have a coroutine frame; the other candidates
+	 * wait in their compact queues.
 	 */
 	DeferEvent defer_start;
 
-	std::size_t n_deleted_files = 0, n_busy = 0;
+	/**
+	 * The number of items in #operations.
+	 */
+	std::size_t n_running = 0;
+
+	/**
+	 * The highest values of #n_running and Walk::GetPeakStat(),
+	 * reported by Finish().
+	 */
+	std::size_t peak_cull = 0, peak_walk = 0;
+
+	std::size_t n_deleted_files = 0, n_busy = 0, n_pruned = 0;
 	uint_least64_t n_deleted_bytes = 0, n_errors = 0;
 
 public:
 	[[nodiscard]]
 	Cull(EventLoop &event_loop, Uring::Queue &_uring,
-	     DevCachefiles &_dev_cachefiles,
+	     DevCachefiles &_dev_cachefiles, Chdir &_chdir,
+	     const WalkConfig &walk_config, std::string_view _log_prefix,
 	     std::size_t _cull_files, uint_least64_t _cull_bytes,
 	     Callback _callback);
 	~Cull() noexcept;
 
+	/**
+	 * See Walk::SetTracker().  Must be called before Start().
+	 */
+	void SetTracker(DirectoryTracker &_tracker) noexcept;
+
+	/**
+	 * See Walk::SetFrequency().  Accesses are counted only by the
+	 * first #Walk.  Must be called before Start().
+	 */
+	void SetFrequency(AccessSketch &sketch, FileTime since) noexcept;
+
+	/**
+	 * See Walk::SetTrace().  Only the first #Walk (which sees all
+	 * files even in the approximate selection mode) is traced.
+	 * Must be called before Start().
+	 */
+	void SetTrace(WalkTraceWriter &trace) noexcept;
+
 	void Start(FileDescriptor root_fd);
 
+	/**
+	 * Like Start(), but resume the #Walk from a checkpoint
+	 * obtained by TakeCheckpoint() from an earlier #Cull (see
+	 * Walk::Resume()).  The checkpoint is ignored if this #Cull
+	 * cannot resume it (in the fair-share or approximate
+	 * selection mode).
+	 */
+	void Resume(FileDescriptor root_fd, WalkCheckpoint &&checkpoint);
+
+	/**
+	 * Like Resume(), but with a checkpoint saved by an earlier
+	 * process.
+	 */
+	void Resume(FileDescriptor root_fd, SavedWalkCheckpoint &&checkpoint);
+
+	/**
+	 * Interrupt this #Cull and return the progress of its #Walk
+	 * (see Walk::TakeCheckpoint()).  Returns std::nullopt if the
+	 * #Walk has finished already or if the selection mode does
+	 * not support checkpoints.  After this call, the only legal
+	 * operation on this object is destruction.
+	 */
+	std::optional<WalkCheckpoint> TakeCheckpoint() noexcept;
+
+	std::size_t GetDeletedFiles() const noexcept {
+		return n_deleted_files;
+	}
+
+	/**
+	 * The number of fchdir() calls since this #Cull was created;
+	 * this includes calls made by concurrent culls of other
+	 * caches sharing the #Chdir.
+	 */
+	[[gnu::pure]]
+	std::size_t GetChdirCount() const noexcept;
+
+	/**
+	 * Apply a new configuration to this running cull.  Only the
+	 * queue depths and WalkConfig::prune_empty_directories take
+	 * effect immediately; the other settings are used by the
+	 * next #Cull.
+	 */
+	void Reconfigure(const WalkConfig &new_config) noexcept;
+
 private:
+	/**
+	 * Can the #walk be checkpointed and resumed?
+	 */
+	[[gnu::pure]]
+	bool CanCheckpoint() const noexcept {
+		return !walk_config.fair_share &&
+			walk_config.approx_resolution <= std::chrono::seconds{};
+	}
+
+	/**
+	 * Are there operations or candidates which have not been
+	 * started yet?
+	 */
+	[[gnu::pure]]
+	bool HasPending() const noexcept {
+		return !new_operations.empty() || !ancient.empty() ||
+			!selected.empty();
+	}
+
+	/**
+	 * Start the next pending operation (see HasPending()).
+	 *
+	 * @return false if there was nothing to start
+	 */
+	bool StartNext() noexcept;
+
 	void OnDeferredStart() noexcept;
 
+	void OnPressureWindow(std::size_t window) noexcept;
+
+	void OnMemoryShift() noexcept;
+
+	/**
+	 * Calculate the #walk's statx() limit from the
+	 * #pressure_throttle window and from whether cull commands
+	 * are in flight.
+	 */
+	[[gnu::pure]]
+	std::size_t GetWalkMaxStat() const noexcept;
+
+	/**
+	 * The limit for Walk::SetMaxCandidates(), scaled down by the
+	 * #memory_governor.
+	 */
+	[[gnu::pure]]
+	std::size_t GetWalkMaxCandidates() const noexcept;
+
+	/**
+	 * The maximum size of #ancient, scaled down by the
+	 * #memory_governor.
+	 */
+	[[gnu::pure]]
+	std::size_t GetMaxAncient() const noexcept;
+
+	/**
+	 * WalkConfig::cull_queue_depth, scaled down by the
+	 * #memory_governor.
+	 */
+	[[gnu::pure]]
+	std::size_t GetCullQueueDepth() const noexcept;
+
+	/**
+	 * Destroy the #walk after recording its peak queue depth.
+	 */
+	void ResetWalk() noexcept;
+
+	/**
+	 * Start the second #Walk of the approximate selection mode.
+	 */
+	void StartSecondWalk(const WalkHistogram::Boundary &boundary) noexcept;
+
+	/**
+	 * The (last) #Walk has finished.
+	 */
+	void OnWalkComplete() noexcept;
+
 	/**
 	 * Sends a "cull" command to /dev/cachefilesd.
 	 */
 	Co::InvokeTask CullFile(WalkDirectoryRef directory, std::string name,
 				uint_least64_t size) noexcept;
 
+	/**
+	 * A file has been culled from the given directory; if it is
+	 * empty now, remove it (see
+	 * WalkConfig::prune_empty_directories).
+	 */
+	void OnEntryRemoved(WalkDirectory &directory) noexcept;
+
+	/**
+	 * Remove an empty directory.
+	 */
+	Co::InvokeTask PruneDirectory(WalkDirectoryRef directory) noexcept;
+
 	/**
 	 * Asynchronously start a coroutine.
 	 */
 	void AddOperation(Co::InvokeTask &&task) noexcept;
 
+	/**
+	 * Start a coroutine right now (called by StartNext()).
+	 */
+	void StartOperation(Co::InvokeTask &&task) noexcept;
+
 	/**
 	 * Called by #Operation after it finishes execution.
 	 */
@@ -87,5 +354,6 @@ private:
 	void OnWalkAncient(WalkDirectory &directory,
 			   std::string &&filename,
 			   uint_least64_t size) noexcept override;
+	void OnWalkDirectoryComplete(WalkDirectory &directory) noexcept override;
 	void OnWalkFinished(WalkResult &&result) noexcept override;
 };
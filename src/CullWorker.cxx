@@ -0,0 +1,249 @@
+// SPDX-License-Identifier: BSD-2-Clause OR GPL-2.0-or-later
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#include "CullWorker.hxx"
+#include "system/Error.hxx"
+
+#include <cerrno>
+
+#include <fcntl.h> // for F_DUPFD_CLOEXEC
+#include <sched.h> // for unshare()
+#include <sys/eventfd.h>
+#include <unistd.h> // for fchdir(), write(), close()
+
+static FileDescriptor
+CreateEventFD()
+{
+	const int fd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+	if (fd < 0)
+		throw MakeErrno("eventfd() failed");
+
+	return FileDescriptor{fd};
+}
+
+CullWorkerPool::CullWorkerPool(EventLoop &event_loop, FileDescriptor _device,
+			       std::size_t _n_workers)
+	:device(_device),
+	 event(event_loop, BIND_THIS_METHOD(OnEventReady), CreateEventFD()),
+	 n_workers(_n_workers),
+	 workers(std::make_unique<std::unique_ptr<Worker>[]>(n_workers))
+{
+	assert(n_workers > 0);
+
+	try {
+		for (std::size_t i = 0; i < n_workers; ++i)
+			workers[i] = std::make_unique<Worker>(*this);
+	} catch (...) {
+		/* stop the threads which have already been
+		   started */
+		StopWorkers();
+		event.Close();
+		throw;
+	}
+
+	event.ScheduleRead();
+}
+
+CullWorkerPool::~CullWorkerPool() noexcept
+{
+	StopWorkers();
+
+	/* only detached jobs can be left over, because all
+	   #Awaitable instances are gone */
+	completed.clear_and_dispose([](Job *job){
+		assert(job->state == State::CANCELED);
+		delete job;
+	});
+
+	event.Close();
+}
+
+void
+CullWorkerPool::StopWorkers() noexcept
+{
+	{
+		const std::scoped_lock lock{mutex};
+		for (std::size_t i = 0; i < n_workers; ++i) {
+			if (!workers[i])
+				continue;
+
+			assert(workers[i]->queue.empty());
+			workers[i]->stop = true;
+			workers[i]->cond.notify_one();
+		}
+	}
+
+	for (std::size_t i = 0; i < n_workers; ++i)
+		if (workers[i])
+			workers[i]->thread.join();
+}
+
+void
+CullWorkerPool::Submit(Job &job) noexcept
+{
+	assert(job.state == State::NEW);
+
+	const std::scoped_lock lock{mutex};
+	job.state = State::QUEUED;
+	job.worker.queue.push_back(job);
+	job.worker.cond.notify_one();
+}
+
+void
+CullWorkerPool::Cancel(Job &job) noexcept
+{
+	const std::scoped_lock lock{mutex};
+
+	switch (job.state) {
+	case State::NEW:
+	case State::RESUMED:
+		break;
+
+	case State::QUEUED:
+		job.worker.queue.erase(job.worker.queue.iterator_to(job));
+		break;
+
+	case State::RUNNING:
+		/* the worker thread is using this object; don't wait
+		   for its write() to finish, but detach it; it will
+		   be freed by OnEventReady() */
+		job.state = State::CANCELED;
+		return;
+
+	case State::CANCELED:
+		/* impossible: the #Awaitable which owned it is
+		   gone */
+		assert(false);
+		return;
+
+	case State::COMPLETE:
+		/* this may be in #completed or in OnEventReady()'s
+		   local list */
+		job.unlink();
+		break;
+	}
+
+	delete &job;
+}
+
+void
+CullWorkerPool::OnEventReady(unsigned) noexcept
+{
+	uint64_t value;
+	[[maybe_unused]] ssize_t nbytes = read(event.GetFileDescriptor().Get(),
+					       &value, sizeof(value));
+
+	/* move all completed jobs to a local list; resuming the last
+	   one may destroy this object (e.g. when it completes the
+	   #Cull), therefore the loop below must not touch "this" */
+	JobList ready;
+
+	{
+		const std::scoped_lock lock{mutex};
+		ready.splice(ready.end(), completed);
+	}
+
+	/* no locking needed from here on: jobs in the COMPLETE state
+	   are only accessed by the EventLoop thread; resuming one may
+	   destroy others, which unlinks them from this list (see
+	   Cancel()) */
+	while (!ready.empty()) {
+		auto &job = ready.front();
+		ready.pop_front();
+
+		if (job.state == State::CANCELED) {
+			/* nobody waits for this one */
+			delete &job;
+			continue;
+		}
+
+		job.state = State::RESUMED;
+		job.continuation.resume();
+	}
+}
+
+void
+CullWorkerPool::Worker::Run() noexcept
+{
+	/* get a working directory which is independent of the other
+	   threads */
+	const int unshare_error = unshare(CLONE_FS) < 0 ? errno : 0;
+
+	std::unique_lock lock{pool.mutex};
+
+	while (true) {
+		cond.wait(lock, [this]{ return stop || !queue.empty(); });
+		if (stop)
+			break;
+
+		/* take all queued jobs for the directory at the front
+		   of the queue; the directory file descriptor is
+		   duplicated while the lock is held, because a
+		   canceled RUNNING job doesn't keep it open */
+		const FileDescriptor directory = queue.front().directory;
+		const int directory_copy = fcntl(directory.Get(), F_DUPFD_CLOEXEC, 0);
+		const int dup_error = directory_copy < 0 ? errno : 0;
+
+		JobList batch;
+		for (auto i = queue.begin(); i != queue.end();) {
+			auto &job = *i;
+			if (job.directory == directory) {
+				i = queue.erase(i);
+				job.state = State::RUNNING;
+				batch.push_back(job);
+			} else
+				++i;
+		}
+
+		lock.unlock();
+
+		int error = unshare_error != 0 ? unshare_error : dup_error;
+		if (error == 0) {
+			if (fchdir(directory_copy) == 0)
+				pool.n_chdir.fetch_add(1, std::memory_order_relaxed);
+			else
+				error = errno;
+		}
+
+		if (directory_copy >= 0)
+			close(directory_copy);
+
+		for (auto &job : batch) {
+			if (error != 0) {
+				job.result = -error;
+				continue;
+			}
+
+			const ssize_t nbytes = write(pool.device.Get(),
+						     job.command.data(),
+						     job.command.size());
+			job.result = nbytes < 0 ? -errno : static_cast<int>(nbytes);
+		}
+
+		lock.lock();
+
+		const bool was_empty = pool.completed.empty();
+
+		while (!batch.empty()) {
+			auto &job = batch.front();
+			batch.pop_front();
+
+			/* canceled jobs are passed to OnEventReady()
+			   as well, which frees them */
+			if (job.state == State::RUNNING)
+				job.state = State::COMPLETE;
+			else
+				assert(job.state == State::CANCELED);
+
+			pool.completed.push_back(job);
+		}
+
+		if (was_empty) {
+			/* wake up the EventLoop thread */
+			static constexpr uint64_t value = 1;
+			[[maybe_unused]] ssize_t nbytes = write(pool.event.GetFileDescriptor().Get(),
+								&value, sizeof(value));
+		}
+	}
+}
@@ -0,0 +1,258 @@
+// SPDX-License-Identifier: BSD-2-Clause OR GPL-2.0-or-later
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#pragma once
+
+#include "event/PipeEvent.hxx"
+#include "io/FileDescriptor.hxx"
+#include "util/IntrusiveList.hxx"
+
+#include <atomic>
+#include <cassert>
+#include <condition_variable>
+#include <coroutine>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <thread>
+#include <vector>
+
+/**
+ * A pool of threads which send "cull" commands to /dev/cachefiles.
+ * The "cull" command is relative to the current working directory;
+ * each worker calls unshare(CLONE_FS) to get its own, so files in
+ * different directories are culled concurrently instead of being
+ * serialized by #Chdir.
+ *
+ * Each directory is assigned to one worker (by its file
+ * descriptor), and a worker handles all queued commands for one
+ * directory after a single fchdir().
+ *
+ * Completions are delivered to the #EventLoop thread through an
+ * eventfd; coroutines are only ever resumed in that thread.
+ */
+class CullWorkerPool final {
+	struct Worker;
+
+	enum class State : uint_least8_t {
+		/**
+		 * Not yet submitted.
+		 */
+		NEW,
+
+		/**
+		 * In Worker::queue.
+		 */
+		QUEUED,
+
+		/**
+		 * Owned by a worker thread which is executing it.
+		 */
+		RUNNING,
+
+		/**
+		 * The #Awaitable was destroyed while the job was
+		 * #RUNNING; the job has been detached from it and
+		 * will be freed by OnEventReady().
+		 */
+		CANCELED,
+
+		/**
+		 * In #completed or in the local list of
+		 * OnEventReady().
+		 */
+		COMPLETE,
+
+		/**
+		 * The coroutine has been resumed.
+		 */
+		RESUMED,
+	};
+
+	/**
+	 * The state of one "cull" command.  It lives on the heap
+	 * (owned by the #Awaitable), so it can be detached from a
+	 * canceled #Awaitable while a worker thread is still using
+	 * it.
+	 */
+	struct Job final : IntrusiveListHook<> {
+		Worker &worker;
+
+		const FileDescriptor directory;
+
+		/**
+		 * A copy of the command, because the caller's buffer
+		 * may be gone before a detached job finishes.
+		 */
+		const std::vector<std::byte> command;
+
+		std::coroutine_handle<> continuation;
+
+		State state = State::NEW;
+
+		int result;
+
+		Job(Worker &_worker, FileDescriptor _directory,
+		    std::span<const std::byte> _command)
+			:worker(_worker), directory(_directory),
+			 command(_command.begin(), _command.end()) {}
+	};
+
+	class Awaitable final {
+		friend class CullWorkerPool;
+
+		CullWorkerPool &pool;
+
+		Job *job;
+
+	public:
+		/**
+		 * Throws std::bad_alloc.
+		 */
+		Awaitable(CullWorkerPool &_pool, Worker &_worker,
+			  FileDescriptor _directory,
+			  std::span<const std::byte> _command)
+			:pool(_pool),
+			 job(new Job(_worker, _directory, _command)) {}
+
+		~Awaitable() noexcept {
+			pool.Cancel(*job);
+		}
+
+		Awaitable(const Awaitable &) = delete;
+		Awaitable &operator=(const Awaitable &) = delete;
+
+		[[nodiscard]]
+		bool await_ready() const noexcept {
+			return false;
+		}
+
+		void await_suspend(std::coroutine_handle<> _continuation) noexcept {
+			assert(_continuation);
+			assert(!job->continuation);
+
+			job->continuation = _continuation;
+			pool.Submit(*job);
+		}
+
+		int await_resume() const noexcept {
+			assert(job->state == State::RESUMED);
+
+			return job->result;
+		}
+	};
+
+	using JobList = IntrusiveList<Job>;
+
+	struct Worker {
+		CullWorkerPool &pool;
+
+		/**
+		 * Signalled when #queue becomes non-empty or when
+		 * #stop is set.  Protected by CullWorkerPool::mutex.
+		 */
+		std::condition_variable cond;
+
+		/**
+		 * Protected by CullWorkerPool::mutex.
+		 */
+		JobList queue;
+
+		/**
+		 * Protected by CullWorkerPool::mutex.
+		 */
+		bool stop = false;
+
+		std::thread thread;
+
+		explicit Worker(CullWorkerPool &_pool)
+			:pool(_pool), thread(&Worker::Run, this) {}
+
+		void Run() noexcept;
+	};
+
+	/**
+	 * The /dev/cachefiles file descriptor (not owned by this
+	 * class).
+	 */
+	const FileDescriptor device;
+
+	/**
+	 * An eventfd which wakes up the #EventLoop thread when
+	 * #completed becomes non-empty.
+	 */
+	PipeEvent event;
+
+	/**
+	 * Protects all job lists and the #State of all jobs.
+	 */
+	std::mutex mutex;
+
+	/**
+	 * Finished jobs waiting to be resumed in the #EventLoop
+	 * thread.  Protected by #mutex.
+	 */
+	JobList completed;
+
+	const std::size_t n_workers;
+	const std::unique_ptr<std::unique_ptr<Worker>[]> workers;
+
+	/**
+	 * The number of fchdir() calls (for statistics).
+	 */
+	std::atomic_size_t n_chdir{0};
+
+public:
+	/**
+	 * Throws on error.
+	 *
+	 * @param _device the /dev/cachefiles file descriptor; it
+	 * must remain open as long as this object exists
+	 */
+	CullWorkerPool(EventLoop &event_loop, FileDescriptor _device,
+		       std::size_t _n_workers);
+	~CullWorkerPool() noexcept;
+
+	CullWorkerPool(const CullWorkerPool &) = delete;
+	CullWorkerPool &operator=(const CullWorkerPool &) = delete;
+
+	/**
+	 * Send a "cull" command (see DevCachefiles::FormatCullFile())
+	 * relative to the given directory.  The awaitable returns
+	 * the write() result (or a negative errno value), like
+	 * Uring::CoTryWrite().  Destroying the awaitable never
+	 * blocks; a command which is already being written is
+	 * detached and finishes in the background.
+	 *
+	 * Throws std::bad_alloc.
+	 *
+	 * @param directory the directory containing the file; it
+	 * must remain open (and must not be reused for another
+	 * directory) until the awaitable is destroyed
+	 * @param command the formatted command (copied)
+	 */
+	[[nodiscard]]
+	Awaitable CullFile(FileDescriptor directory,
+			   std::span<const std::byte> command) {
+		return Awaitable{
+			*this,
+			*workers[static_cast<std::size_t>(directory.Get()) % n_workers],
+			directory, command,
+		};
+	}
+
+	std::size_t GetChdirCount() const noexcept {
+		return n_chdir.load(std::memory_order_relaxed);
+	}
+
+private:
+	void StopWorkers() noexcept;
+
+	void Submit(Job &job) noexcept;
+	void Cancel(Job &job) noexcept;
+
+	void OnEventReady(unsigned events) noexcept;
+};
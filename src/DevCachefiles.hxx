@@ -5,6 +5,7 @@
 #pragma once
 
 #include "event/PipeEvent.hxx"
+#include "co/Task.hxx"
 #include "util/StringBuffer.hxx"
 
 #include <cstddef>
@@ -22,6 +23,24 @@ public:
 	virtual void OnDevCachefilesError(std::exception_ptr &&error) noexcept = 0;
 };
 
+/**
+ * An alternative implementation of the "cull" command, e.g. a
+ * stand-in for the kernel in benchmarks and tests (see
+ * DevCachefiles::SetBackend()).
+ */
+class DevCachefilesBackend {
+public:
+	/**
+	 * Execute a "cull" command (formatted by
+	 * DevCachefiles::FormatCullFile()) relative to the current
+	 * working directory.
+	 *
+	 * @return the number of bytes consumed or a negative errno
+	 * value (like write() on /dev/cachefiles)
+	 */
+	virtual Co::Task<int> CullFile(std::span<const std::byte> command) noexcept = 0;
+};
+
 /**
  * OO wrapper for a /dev/cachefiles file descriptor (non-owning).
  */
@@ -30,6 +49,12 @@ class DevCachefiles {
 
 	DevCachefilesHandler &handler;
 
+	/**
+	 * If set, then "cull" commands are passed to this object
+	 * instead of being written to the file descriptor.
+	 */
+	DevCachefilesBackend *backend = nullptr;
+
 public:
 	[[nodiscard]]
 	DevCachefiles(EventLoop &event_loop, UniqueFileDescriptor _fd,
@@ -52,6 +77,14 @@ public:
 		device.Cancel();
 	}
 
+	void SetBackend(DevCachefilesBackend &_backend) noexcept {
+		backend = &_backend;
+	}
+
+	DevCachefilesBackend *GetBackend() const noexcept {
+		return backend;
+	}
+
 	using Buffer = StringBuffer<NAME_MAX + 8>;
 
 	static std::span<const std::byte> FormatCullFile(Buffer &buffer, std::string_view filename) noexcept;
@@ -0,0 +1,57 @@
+// SPDX-License-Identifier: BSD-2-Clause OR GPL-2.0-or-later
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#include "Dirent.hxx"
+#include "system/Error.hxx"
+
+#include <algorithm> // for std::ranges::sort()
+
+/**
+ * The size of the getdents64() buffer.
+ */
+static constexpr std::size_t GETDENTS_BUFFER = 32768;
+
+[[gnu::pure]]
+static bool
+IsSpecialFilename(const char *s) noexcept
+{
+	return s[0] == '.' && (s[1] == 0 || (s[1] == '.' && s[2] == 0));
+}
+
+DirentReader::DirentReader(FileDescriptor _fd)
+	:fd(_fd),
+	 buffer(std::make_unique<std::byte[]>(GETDENTS_BUFFER))
+{
+}
+
+const struct dirent64 *
+DirentReader::Read()
+{
+	while (true) {
+		if (position >= fill) {
+			const ssize_t nbytes = getdents64(fd.Get(), buffer.get(),
+							  GETDENTS_BUFFER);
+			if (nbytes < 0)
+				throw MakeErrno("Failed to read directory");
+
+			if (nbytes == 0)
+				return nullptr;
+
+			position = 0;
+			fill = static_cast<std::size_t>(nbytes);
+		}
+
+		const auto &entry = *reinterpret_cast<const struct dirent64 *>(buffer.get() + position);
+		position += entry.d_reclen;
+
+		if (!IsSpecialFilename(entry.d_name))
+			return &entry;
+	}
+}
+
+void
+SortByInode(std::vector<InodeName> &entries) noexcept
+{
+	std::ranges::sort(entries, {}, &InodeName::ino);
+}
@@ -0,0 +1,64 @@
+// SPDX-License-Identifier: BSD-2-Clause OR GPL-2.0-or-later
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#pragma once
+
+#include "io/FileDescriptor.hxx"
+
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <dirent.h> // for struct dirent64
+
+/**
+ * Reads directory entries with getdents64().  Unlike
+ * #DirectoryReader, this exposes the inode number and the file type
+ * of each entry.
+ */
+class DirentReader {
+	const FileDescriptor fd;
+
+	const std::unique_ptr<std::byte[]> buffer;
+
+	/**
+	 * The position of the next entry in #buffer and the number
+	 * of bytes filled by the last getdents64() call.
+	 */
+	std::size_t position = 0, fill = 0;
+
+public:
+	/**
+	 * @param _fd a directory opened for reading; it is owned by
+	 * the caller
+	 */
+	explicit DirentReader(FileDescriptor _fd);
+
+	/**
+	 * Read the next entry, skipping "." and "..".  Throws on
+	 * error.
+	 *
+	 * @return the entry (valid until the next call) or nullptr
+	 * at the end of the directory
+	 */
+	const struct dirent64 *Read();
+};
+
+/**
+ * A directory entry name with its inode number.
+ */
+struct InodeName {
+	ino64_t ino;
+	std::string name;
+};
+
+/**
+ * Sort directory entries by inode number.  On ext4 and XFS, the
+ * inode number determines the position in the inode table;
+ * accessing the inodes in this order turns random metadata reads
+ * into (mostly) sequential ones.
+ */
+void
+SortByInode(std::vector<InodeName> &entries) noexcept;
@@ -0,0 +1,66 @@
+// SPDX-License-Identifier: BSD-2-Clause OR GPL-2.0-or-later
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#include "Frequency.hxx"
+#include "WDirectory.hxx"
+#include "Hash.hxx"
+
+#include <algorithm> // for std::min()
+#include <bit> // for std::bit_ceil()
+
+/**
+ * Halve all counters after (width * SAMPLE_FACTOR) increments.
+ */
+static constexpr std::size_t SAMPLE_FACTOR = 10;
+
+AccessSketch::AccessSketch(std::size_t width)
+	:mask(std::bit_ceil(std::max<std::size_t>(width, 1)) - 1),
+	 counters(new uint_least8_t[DEPTH * GetWidth()]()),
+	 sample_size(GetWidth() * SAMPLE_FACTOR)
+{
+}
+
+uint_least64_t
+AccessSketch::MakeKey(const WalkDirectory &parent, std::string_view name) noexcept
+{
+	return FNV1aHash(name, FNV1aHash("/", parent.path_hash));
+}
+
+void
+AccessSketch::Increment(uint_least64_t key) noexcept
+{
+	/* conservative update: increment only the smallest
+	   counters, which reduces the overestimation caused by
+	   collisions */
+	const uint_least8_t estimate = Estimate(key);
+	if (estimate >= MAX_COUNT)
+		return;
+
+	for (std::size_t row = 0; row < DEPTH; ++row) {
+		auto &counter = counters[GetIndex(key, row)];
+		if (counter == estimate)
+			++counter;
+	}
+
+	if (++n_increments >= sample_size)
+		Age();
+}
+
+uint_least8_t
+AccessSketch::Estimate(uint_least64_t key) const noexcept
+{
+	uint_least8_t result = MAX_COUNT;
+	for (std::size_t row = 0; row < DEPTH; ++row)
+		result = std::min(result, counters[GetIndex(key, row)]);
+	return result;
+}
+
+inline void
+AccessSketch::Age() noexcept
+{
+	for (std::size_t i = 0; i < DEPTH * GetWidth(); ++i)
+		counters[i] >>= 1;
+
+	n_increments /= 2;
+}
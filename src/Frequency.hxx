@@ -0,0 +1,107 @@
+// SPDX-License-Identifier: BSD-2-Clause OR GPL-2.0-or-later
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#pragma once
+
+#include "WHistogram.hxx" // for FileTime
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string_view>
+
+struct WalkDirectory;
+
+/**
+ * Estimates how often each file is accessed, based on successive
+ * walks: a file whose access time is newer than the previous walk
+ * has been accessed in between, and this is counted in a count-min
+ * sketch (with conservative update).  The sketch has a fixed size;
+ * it does not store any per-file state.
+ *
+ * Counters saturate at #MAX_COUNT and all of them are halved after
+ * a number of increments proportional to the sketch width (as in
+ * TinyLFU), so old accesses fade out.
+ */
+class AccessSketch {
+	static constexpr std::size_t DEPTH = 4;
+
+public:
+	static constexpr uint_least8_t MAX_COUNT = 15;
+
+private:
+	const std::size_t mask;
+
+	/**
+	 * #DEPTH rows of (#mask + 1) counters.
+	 */
+	const std::unique_ptr<uint_least8_t[]> counters;
+
+	/**
+	 * Halve all counters after this many increments.
+	 */
+	const std::size_t sample_size;
+
+	std::size_t n_increments = 0;
+
+public:
+	/**
+	 * @param width the number of counters per row; it is
+	 * rounded up to a power of two
+	 */
+	explicit AccessSketch(std::size_t width);
+
+	AccessSketch(const AccessSketch &) = delete;
+	AccessSketch &operator=(const AccessSketch &) = delete;
+
+	std::size_t GetWidth() const noexcept {
+		return mask + 1;
+	}
+
+	/**
+	 * Calculate the key of a file, which identifies it across
+	 * walks.
+	 */
+	[[gnu::pure]]
+	static uint_least64_t MakeKey(const WalkDirectory &parent,
+				      std::string_view name) noexcept;
+
+	/**
+	 * Count one access to the given file.
+	 */
+	void Increment(uint_least64_t key) noexcept;
+
+	/**
+	 * Estimate the number of accesses (an upper bound, subject
+	 * to aging).
+	 */
+	[[gnu::pure]]
+	uint_least8_t Estimate(uint_least64_t key) const noexcept;
+
+	/**
+	 * Make a file appear more recently accessed according to its
+	 * estimated access count: its age is divided by the count
+	 * plus one.  This is the time used for selecting cull
+	 * candidates.
+	 */
+	[[gnu::const]]
+	static constexpr FileTime Adjust(FileTime atime, uint_least8_t count,
+					 FileTime now) noexcept {
+		if (count == 0 || atime >= now)
+			return atime;
+
+		return now - (now - atime) / (count + 1);
+	}
+
+private:
+	[[gnu::pure]]
+	std::size_t GetIndex(uint_least64_t key, std::size_t row) const noexcept {
+		/* derive DEPTH hash functions from one 64 bit hash
+		   (Kirsch/Mitzenmacher) */
+		const uint_least64_t h1 = key, h2 = (key >> 32) | 1;
+		return row * GetWidth() + ((h1 + row * h2) & mask);
+	}
+
+	void Age() noexcept;
+};
@@ -0,0 +1,26 @@
+// SPDX-License-Identifier: BSD-2-Clause OR GPL-2.0-or-later
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#pragma once
+
+#include <cstdint>
+#include <string_view>
+
+constexpr uint_least64_t FNV1A_BASIS = 0xcbf29ce484222325;
+
+/**
+ * FNV-1a.  Pass the result of a previous call as #hash to hash the
+ * concatenation of several strings.
+ */
+[[gnu::pure]]
+constexpr uint_least64_t
+FNV1aHash(std::string_view s, uint_least64_t hash=FNV1A_BASIS) noexcept
+{
+	for (const char ch : s) {
+		hash ^= static_cast<unsigned char>(ch);
+		hash *= 0x100000001b3;
+	}
+
+	return hash;
+}
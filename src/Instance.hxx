@@ -4,62 +4,69 @@
 
 #pragma once
 
-#include "DevCachefiles.hxx"
-#include "Cull.hxx"
+#include "Cache.hxx"
+#include "Chdir.hxx"
+#include "Config.hxx"
+#include "Control.hxx"
 #include "event/Loop.hxx"
-#include "event/PipeEvent.hxx"
 #include "event/ShutdownListener.hxx"
-#include "io/UniqueFileDescriptor.hxx"
+#include "event/SignalEvent.hxx"
 #include "config.h"
 
 #ifdef HAVE_LIBSYSTEMD
 #include "event/systemd/Watchdog.hxx"
 #endif
 
-#include <cstdint>
+#include <forward_list>
+#include <optional>
 
-struct Config;
+class Instance final : ControlHandler {
+	/**
+	 * The configuration file; it is loaded again on SIGHUP.
+	 */
+	const char *const config_path;
+
+	/**
+	 * The currently applied configuration.
+	 */
+	Config config;
 
-class Instance final : DevCachefilesHandler {
 	EventLoop event_loop;
 	ShutdownListener shutdown_listener{event_loop, BIND_THIS_METHOD(OnShutdown)};
+	SignalEvent reload_event{event_loop, BIND_THIS_METHOD(OnReload)};
 
 #ifdef HAVE_LIBSYSTEMD
 	Systemd::Watchdog systemd_watchdog{event_loop};
 #endif
 
-	UniqueFileDescriptor cache_fd, graveyard_fd;
-
-	DevCachefiles dev_cachefiles;
+	/**
+	 * The working directory is per process, therefore all
+	 * #caches share one #Chdir.
+	 */
+	Chdir chdir{event_loop};
 
-	std::optional<Cull> cull;
+	/**
+	 * One item per CacheConfig, in the same order as
+	 * Config::caches.
+	 */
+	std::forward_list<Cache> caches;
 
-	const uint_least8_t brun, frun;
-
-	const bool culling_disabled;
+	/**
+	 * Only set if Config::control_socket is set.  Declared after
+	 * #caches because it refers to them.
+	 */
+	std::optional<ControlServer> control;
 
 public:
-	explicit Instance(const Config &config);
+	Instance(const char *_config_path, const Config &_config);
 	~Instance() noexcept;
 
 	void Run();
 
 private:
-	void StartCull();
-	void OnCullComplete() noexcept;
-
-	void OnShutdown() noexcept {
-		cull.reset();
-		dev_cachefiles.Disable();
-
-#ifdef HAVE_LIBSYSTEMD
-		systemd_watchdog.Disable();
-#endif
-	}
-
-	// virtual methods from DevCachefilesHandler
-	void OnDevCachefilesStartCull() noexcept override;
+	void OnShutdown() noexcept;
+	void OnReload(int) noexcept;
 
-	[[noreturn]]
-	void OnDevCachefilesError(std::exception_ptr &&error) noexcept override;
+	// virtual methods from ControlHandler
+	Cache &GetControlCache(std::string_view section) override;
 };
@@ -0,0 +1,39 @@
+// SPDX-License-Identifier: BSD-2-Clause OR GPL-2.0-or-later
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#include "LagMonitor.hxx"
+#include "event/Loop.hxx"
+
+#include <algorithm> // for std::max()
+
+static constexpr Event::Duration LAG_INTERVAL = std::chrono::milliseconds{100};
+
+LagMonitor::LagMonitor(EventLoop &event_loop) noexcept
+	:timer(event_loop, BIND_THIS_METHOD(OnTimer))
+{
+}
+
+void
+LagMonitor::Start() noexcept
+{
+	max_lag = {};
+	Schedule();
+}
+
+inline void
+LagMonitor::Schedule() noexcept
+{
+	due = timer.GetEventLoop().SteadyNow() + LAG_INTERVAL;
+	timer.Schedule(LAG_INTERVAL);
+}
+
+inline void
+LagMonitor::OnTimer() noexcept
+{
+	const auto now = timer.GetEventLoop().SteadyNow();
+	if (now > due)
+		max_lag = std::max(max_lag, now - due);
+
+	Schedule();
+}
@@ -0,0 +1,45 @@
+// SPDX-License-Identifier: BSD-2-Clause OR GPL-2.0-or-later
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#pragma once
+
+#include "event/FineTimerEvent.hxx"
+
+/**
+ * Measures the #EventLoop lag, i.e. how late a periodic timer fires,
+ * to see how long other work (e.g. a #Walk) blocks the #EventLoop.
+ */
+class LagMonitor final {
+	FineTimerEvent timer;
+
+	/**
+	 * When the #timer is supposed to fire.
+	 */
+	Event::TimePoint due;
+
+	Event::Duration max_lag{};
+
+public:
+	explicit LagMonitor(EventLoop &event_loop) noexcept;
+
+	/**
+	 * Start measuring (and reset the maximum).
+	 */
+	void Start() noexcept;
+
+	void Stop() noexcept {
+		timer.Cancel();
+	}
+
+	/**
+	 * Returns the largest lag measured since Start().
+	 */
+	Event::Duration GetMaxLag() const noexcept {
+		return max_lag;
+	}
+
+private:
+	void Schedule() noexcept;
+	void OnTimer() noexcept;
+};
@@ -5,13 +5,9 @@
 #include "Instance.hxx"
 #include "Config.hxx"
 #include "Options.hxx"
-#include "system/Error.hxx"
 #include "system/SetupProcess.hxx"
-#include "io/FileAt.hxx"
-#include "io/Open.hxx"
-#include "io/uring/Queue.hxx"
+#include "lib/fmt/ExceptionFormatter.hxx"
 #include "util/PrintException.hxx"
-#include "util/SpanCast.hxx"
 #include "config.h"
 
 #include <fmt/core.h>
@@ -24,68 +20,31 @@
 #include "lib/cap/State.hxx"
 #endif // HAVE_LIBCAP
 
-#ifdef HAVE_LIBSYSTEMD
-#endif
-
-#include <optional>
-#include <string>
-
-#include <errno.h>
-#include <fcntl.h> // for O_RDWR
-#include <string.h> // for strerror()
-#include <sys/statvfs.h>
-
-#ifdef HAVE_MALLOC_TRIM
-#include <malloc.h> // for malloc_trim()
-#endif
-
-using std::string_view_literals::operator""sv;
-
-static UniqueFileDescriptor
-OpenDevCachefiles(const Config &config)
-{
-	UniqueFileDescriptor fd;
-	if (!fd.Open("/dev/cachefiles", O_RDWR))
-		throw MakeErrno("Failed to open /dev/cachefiles");
+#include <iterator> // for std::next()
+#include <stdexcept>
 
-	for (const auto &line : config.kernel_config)
-		fd.FullWrite(AsBytes(line));
-
-	fd.FullWrite(AsBytes("bind"sv));
-
-	return fd;
-}
-
-/**
- * Add 2% to the configured BRUN / FRUN values to compensate for files
- * being added while we're culling.
- *
- * If each Cull operation attempts to reach exactly BRUN / FRUN, it
- * will fail to meet that goal because new files are being added
- * during the Cull, and another Cull will be started right after that,
- * which will again fail to meet the goal, leaving the daemon in an
- * endless culling loop.
- */
-static constexpr uint_least8_t RUN_PERCENT_OFFSET = 2;
+#include <signal.h> // for SIGHUP
+#include <stdlib.h> // for EXIT_SUCCESS
 
 inline
-Instance::Instance(const Config &config)
-	:dev_cachefiles(event_loop, OpenDevCachefiles(config), *this),
-	 brun(config.brun + RUN_PERCENT_OFFSET),
-	 frun(config.frun + RUN_PERCENT_OFFSET),
-	 culling_disabled(config.culling_disabled)
+Instance::Instance(const char *_config_path, const Config &_config)
+	:config_path(_config_path), config(_config)
 {
-	event_loop.EnableUring(16384, IORING_SETUP_SINGLE_ISSUER|IORING_SETUP_COOP_TASKRUN);
-	event_loop.GetUring()->SetMaxWorkers(16, 16);
+	/* all caches share one io_uring */
+	EnableUring(event_loop, config.uring);
 
-	const auto fscache_fd = OpenPath(config.dir.c_str(), O_DIRECTORY);
-	cache_fd = OpenPath({fscache_fd, "cache"}, O_DIRECTORY);
-	graveyard_fd = OpenPath({fscache_fd, "graveyard"}, O_DIRECTORY);
+	auto cache_i = caches.before_begin();
+	for (const auto &i : config.caches)
+		cache_i = caches.emplace_after(cache_i, event_loop, chdir, i);
 
-	// TODO implement graveyeard reaper
+	if (!config.control_socket.empty())
+		control.emplace(event_loop, config.control_socket.c_str(),
+				static_cast<ControlHandler &>(*this));
 
 	shutdown_listener.Enable();
-	dev_cachefiles.Enable();
+
+	reload_event.Add(SIGHUP);
+	reload_event.Enable();
 }
 
 inline
@@ -93,64 +52,54 @@ Instance::~Instance() noexcept
 {
 }
 
-inline void
-Instance::StartCull()
+void
+Instance::OnShutdown() noexcept
 {
-	uint_least64_t cull_files = 0;
-	uint_least64_t cull_bytes = 1024 * 1024;
-
-	struct statvfs s;
-	if (fstatvfs(cache_fd.Get(), &s) == 0) {
-		uint_least64_t target_files = (s.f_files * frun + 99) / 100;
-		if (target_files > s.f_ffree)
-			cull_files = target_files - s.f_ffree;
-
-		uint_least64_t target_blocks = (s.f_blocks * brun + 99) / 100;
-		if (target_blocks > s.f_bfree)
-			cull_bytes = static_cast<uint_least64_t>(target_blocks - s.f_bfree) * s.f_bsize;
-	} else {
-		fmt::print(stderr, "fstatvfs() failed: %s\n", strerror(errno));
-	}
+	control.reset();
 
-	fmt::print(stderr, "Cull: start files={} bytes={}\n", cull_files, cull_bytes);
+	for (auto &i : caches)
+		i.Shutdown();
 
-	cull.emplace(event_loop, *event_loop.GetUring(),
-		     dev_cachefiles,
-		     cull_files, cull_bytes, BIND_THIS_METHOD(OnCullComplete));
-	cull->Start(cache_fd);
-}
+	reload_event.Disable();
 
-inline void
-Instance::OnCullComplete() noexcept
-{
-	cull.reset();
-
-#ifdef HAVE_MALLOC_TRIM
-	malloc_trim(0);
+#ifdef HAVE_LIBSYSTEMD
+	systemd_watchdog.Disable();
 #endif
-
-	/* re-enable polling /dev/cachefiles */
-	dev_cachefiles.Enable();
 }
 
 void
-Instance::OnDevCachefilesStartCull() noexcept
-{
-	/* disable polling /dev/cachefiles while we're culling */
-	dev_cachefiles.Disable();
+Instance::OnReload(int) noexcept
+try {
+	auto new_config = LoadConfigFile(config_path);
+	CheckReloadConfig(config, new_config);
+
+	auto config_i = new_config.caches.begin();
+	for (auto &i : caches)
+		i.Reload(*config_i++);
 
-	if (!cull && !culling_disabled)
-		StartCull();
+	config = std::move(new_config);
+
+	fmt::print(stderr, "Configuration reloaded\n");
+} catch (...) {
+	fmt::print(stderr, "Failed to reload configuration: {}\n",
+		   std::current_exception());
 }
 
-void
-Instance::OnDevCachefilesError(std::exception_ptr &&error) noexcept
+Cache &
+Instance::GetControlCache(std::string_view section)
 {
-	PrintException(std::move(error));
+	if (section.empty()) {
+		if (std::next(caches.begin()) != caches.end())
+			throw std::runtime_error{"Section name required"};
+
+		return caches.front();
+	}
+
+	for (auto &i : caches)
+		if (i.GetName() == section)
+			return i;
 
-	/* /dev/cachefiles errors are fatal because we're effectively
-	   defunct now */
-	std::terminate();
+	throw std::runtime_error{"No such section"};
 }
 
 inline void
@@ -162,13 +111,23 @@ Instance::Run()
 static int
 Run(const Options &options)
 {
-	Instance instance{
-		LoadConfigFile(options.configfile),
-	};
+	const auto config = LoadConfigFile(options.configfile);
+	Instance instance{options.configfile, config};
 
 #ifdef HAVE_LIBCAP
 	/* drop all capabilities, we don't need them anymore */
-	CapabilityState::Empty().Install();
+	auto capabilities = CapabilityState::Empty();
+
+	if (config.NeedsBulkstat()) {
+		/* ... except for XFS_IOC_BULKSTAT which needs
+		   CAP_SYS_ADMIN; it is only kept in the permitted set
+		   and is raised only by the thread which builds the
+		   inode table (see CoBulkstatThread) */
+		static constexpr cap_value_t keep_capabilities[]{CAP_SYS_ADMIN};
+		capabilities.SetFlag(CAP_PERMITTED, keep_capabilities, CAP_SET);
+	}
+
+	capabilities.Install();
 #endif // HAVE_LIBCAP
 
 #ifdef HAVE_LIBSYSTEMD
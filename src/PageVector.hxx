@@ -0,0 +1,185 @@
+// SPDX-License-Identifier: BSD-2-Clause OR GPL-2.0-or-later
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#pragma once
+
+#include <cassert>
+#include <cstddef>
+#include <new> // for std::bad_alloc
+#include <utility> // for std::exchange(), std::forward()
+
+#include <sys/mman.h>
+#include <unistd.h> // for sysconf()
+
+/**
+ * A vector with a fixed maximum size whose storage is a private
+ * anonymous memory mapping.  Only the address space is reserved
+ * upfront; physical pages are allocated by the kernel as the vector
+ * grows, so a vector which is used only partially does not occupy
+ * more memory than needed.  Transparent huge pages are requested to
+ * reduce TLB misses.  The mapping is returned to the kernel with
+ * munmap() in the destructor (instead of going through the heap).
+ *
+ * Unlike std::vector, elements never move, and there is no
+ * reallocation.
+ */
+template<typename T>
+class PageVector {
+	T *data_ = nullptr;
+
+	std::size_t size_ = 0, capacity_ = 0;
+
+public:
+	using value_type = T;
+	using size_type = std::size_t;
+	using reference = T &;
+	using const_reference = const T &;
+	using iterator = T *;
+	using const_iterator = const T *;
+
+	/**
+	 * Throws std::bad_alloc if the address space cannot be
+	 * reserved.
+	 */
+	explicit PageVector(size_type max_size)
+		:capacity_(max_size)
+	{
+		if (capacity_ == 0)
+			return;
+
+		void *p = mmap(nullptr, GetMappedSize(),
+			       PROT_READ|PROT_WRITE,
+			       MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE,
+			       -1, 0);
+		if (p == MAP_FAILED)
+			throw std::bad_alloc{};
+
+		/* this is only a hint; ignore errors */
+		madvise(p, GetMappedSize(), MADV_HUGEPAGE);
+
+		data_ = static_cast<T *>(p);
+	}
+
+	PageVector(PageVector &&src) noexcept
+		:data_(std::exchange(src.data_, nullptr)),
+		 size_(std::exchange(src.size_, 0)),
+		 capacity_(std::exchange(src.capacity_, 0)) {}
+
+	~PageVector() noexcept {
+		if (data_ != nullptr) {
+			clear();
+			munmap(data_, GetMappedSize());
+		}
+	}
+
+	PageVector &operator=(PageVector &&src) noexcept {
+		using std::swap;
+		swap(data_, src.data_);
+		swap(size_, src.size_);
+		swap(capacity_, src.capacity_);
+		return *this;
+	}
+
+	constexpr size_type size() const noexcept {
+		return size_;
+	}
+
+	constexpr size_type max_size() const noexcept {
+		return capacity_;
+	}
+
+	constexpr bool empty() const noexcept {
+		return size_ == 0;
+	}
+
+	constexpr bool full() const noexcept {
+		return size_ == capacity_;
+	}
+
+	void clear() noexcept {
+		while (!empty())
+			pop_back();
+	}
+
+	reference front() noexcept {
+		assert(!empty());
+		return data_[0];
+	}
+
+	const_reference front() const noexcept {
+		assert(!empty());
+		return data_[0];
+	}
+
+	reference back() noexcept {
+		assert(!empty());
+		return data_[size_ - 1];
+	}
+
+	reference operator[](size_type i) noexcept {
+		assert(i < size_);
+		return data_[i];
+	}
+
+	const_reference operator[](size_type i) const noexcept {
+		assert(i < size_);
+		return data_[i];
+	}
+
+	iterator begin() noexcept {
+		return data_;
+	}
+
+	const_iterator begin() const noexcept {
+		return data_;
+	}
+
+	iterator end() noexcept {
+		return data_ + size_;
+	}
+
+	const_iterator end() const noexcept {
+		return data_ + size_;
+	}
+
+	template<typename... Args>
+	reference emplace_back(Args&&... args) {
+		assert(!full());
+
+		T *p = new(data_ + size_) T(std::forward<Args>(args)...);
+		++size_;
+		return *p;
+	}
+
+	void pop_back() noexcept {
+		assert(!empty());
+
+		data_[--size_].~T();
+	}
+
+	/**
+	 * Return the physical pages behind the unused part of the
+	 * mapping to the kernel (e.g. after many pop_back() calls).
+	 * The address space remains reserved.
+	 */
+	void ShrinkToFit() noexcept {
+		if (data_ == nullptr)
+			return;
+
+		static const std::size_t page_size = sysconf(_SC_PAGESIZE);
+
+		const std::size_t used = (size_ * sizeof(T) + page_size - 1) / page_size * page_size;
+		if (used >= GetMappedSize())
+			return;
+
+		/* this is only an optimization; ignore errors */
+		madvise(reinterpret_cast<std::byte *>(data_) + used,
+			GetMappedSize() - used, MADV_DONTNEED);
+	}
+
+private:
+	constexpr std::size_t GetMappedSize() const noexcept {
+		return capacity_ * sizeof(T);
+	}
+};
@@ -0,0 +1,61 @@
+// SPDX-License-Identifier: BSD-2-Clause OR GPL-2.0-or-later
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#include "Predictor.hxx"
+
+/**
+ * The weight of a new sample in the exponential moving average.
+ */
+static constexpr double SMOOTHING = 0.25;
+
+static constexpr double
+Smooth(double old_rate, double new_rate) noexcept
+{
+	return old_rate + SMOOTHING * (new_rate - old_rate);
+}
+
+void
+FillPredictor::Update(Event::TimePoint now,
+		      uint_least64_t free_blocks, uint_least64_t free_files) noexcept
+{
+	if (have_sample && now > last_time) {
+		const double seconds = std::chrono::duration<double>(now - last_time).count();
+
+		/* if free space has grown (because something was
+		   deleted), this sample says nothing about the fill
+		   rate; count it as "no consumption" */
+		const double consumed_blocks = free_blocks < last_free_blocks
+			? static_cast<double>(last_free_blocks - free_blocks)
+			: 0.;
+		const double consumed_files = free_files < last_free_files
+			? static_cast<double>(last_free_files - free_files)
+			: 0.;
+
+		block_rate = Smooth(block_rate, consumed_blocks / seconds);
+		file_rate = Smooth(file_rate, consumed_files / seconds);
+	}
+
+	last_time = now;
+	last_free_blocks = free_blocks;
+	last_free_files = free_files;
+	have_sample = true;
+}
+
+static constexpr uint_least64_t
+Predict(double rate, Event::Duration lead) noexcept
+{
+	return static_cast<uint_least64_t>(rate * std::chrono::duration<double>(lead).count());
+}
+
+uint_least64_t
+FillPredictor::PredictBlocks(Event::Duration lead) const noexcept
+{
+	return Predict(block_rate, lead);
+}
+
+uint_least64_t
+FillPredictor::PredictFiles(Event::Duration lead) const noexcept
+{
+	return Predict(file_rate, lead);
+}
@@ -0,0 +1,55 @@
+// SPDX-License-Identifier: BSD-2-Clause OR GPL-2.0-or-later
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#pragma once
+
+#include "event/Chrono.hxx"
+
+#include <cstdint>
+
+/**
+ * Estimates how fast the cache partition fills up by sampling the
+ * number of free blocks and files periodically (see fstatvfs()).
+ * This allows starting a cull before the kernel reaches its "bcull"
+ * / "fcull" threshold.
+ */
+class FillPredictor {
+	Event::TimePoint last_time;
+
+	uint_least64_t last_free_blocks, last_free_files;
+
+	/**
+	 * Smoothed consumption rates [blocks/files per second].
+	 */
+	double block_rate = 0, file_rate = 0;
+
+	bool have_sample = false;
+
+public:
+	/**
+	 * Forget the previous sample, e.g. because a cull has just
+	 * freed space, which would distort the next measurement.
+	 * The smoothed rates are kept.
+	 */
+	void Reset() noexcept {
+		have_sample = false;
+	}
+
+	void Update(Event::TimePoint now,
+		    uint_least64_t free_blocks, uint_least64_t free_files) noexcept;
+
+	/**
+	 * Estimate how many blocks will be consumed within the given
+	 * duration.
+	 */
+	[[gnu::pure]]
+	uint_least64_t PredictBlocks(Event::Duration lead) const noexcept;
+
+	/**
+	 * Estimate how many files will be created within the given
+	 * duration.
+	 */
+	[[gnu::pure]]
+	uint_least64_t PredictFiles(Event::Duration lead) const noexcept;
+};
@@ -0,0 +1,290 @@
+// SPDX-License-Identifier: BSD-2-Clause OR GPL-2.0-or-later
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#include "Pressure.hxx"
+#include "event/Loop.hxx"
+#include "util/IterableSplitString.hxx"
+#include "util/StringSplit.hxx"
+
+#include <algorithm> // for std::max()
+#include <charconv>
+#include <string>
+#include <utility> // for std::exchange()
+
+#include <fcntl.h> // for O_RDONLY
+#include <unistd.h> // for pread()
+
+#include <fmt/core.h>
+
+using std::string_view_literals::operator""sv;
+
+/**
+ * How often is the pressure sampled?
+ */
+static constexpr Event::Duration PRESSURE_INTERVAL = std::chrono::seconds{1};
+
+/**
+ * The smallest window while the pressure is above the threshold (but
+ * not yet twice the threshold, which pauses the #Walk).
+ */
+static constexpr std::size_t MIN_WINDOW = 64;
+
+int_least64_t
+ParsePressureSomeTotal(std::string_view contents) noexcept
+{
+	for (const std::string_view line : IterableSplitString(contents, '\n')) {
+		const auto [type, rest] = Split(line, ' ');
+		if (type != "some"sv)
+			continue;
+
+		for (const std::string_view i : IterableSplitString(rest, ' ')) {
+			const auto [name, value] = Split(i, '=');
+			if (name != "total"sv)
+				continue;
+
+			const char *const first = value.data(), *const last = first + value.size();
+			int_least64_t total;
+			auto [ptr, ec] = std::from_chars(first, last, total, 10);
+			if (ptr == first || ptr != last || ec != std::errc{})
+				return -1;
+
+			return total;
+		}
+	}
+
+	return -1;
+}
+
+static int_least64_t
+ReadPressureTotal(FileDescriptor fd) noexcept
+{
+	if (!fd.IsDefined())
+		return -1;
+
+	char buffer[256];
+	const ssize_t nbytes = pread(fd.Get(), buffer, sizeof(buffer), 0);
+	if (nbytes <= 0)
+		return -1;
+
+	return ParsePressureSomeTotal({buffer, static_cast<std::size_t>(nbytes)});
+}
+
+/**
+ * Open a file (e.g. "io.pressure") of the cgroup this process
+ * belongs to (cgroup2 only).
+ */
+static UniqueFileDescriptor
+OpenCgroupFile(std::string_view name) noexcept
+{
+	UniqueFileDescriptor fd;
+	if (!fd.Open("/proc/self/cgroup", O_RDONLY))
+		return {};
+
+	char buffer[4096];
+	const ssize_t nbytes = fd.Read(std::as_writable_bytes(std::span{buffer}));
+	if (nbytes <= 0)
+		return {};
+
+	const std::string_view contents{buffer, static_cast<std::size_t>(nbytes)};
+	for (const std::string_view line : IterableSplitString(contents, '\n')) {
+		if (!line.starts_with("0::/"sv))
+			continue;
+
+		std::string path{"/sys/fs/cgroup"sv};
+		path.append(line.substr(3));
+		path.push_back('/');
+		path.append(name);
+
+		UniqueFileDescriptor pressure_fd;
+		if (pressure_fd.Open(path.c_str(), O_RDONLY))
+			return pressure_fd;
+		break;
+	}
+
+	return {};
+}
+
+PressureThrottle::PressureThrottle(EventLoop &event_loop, unsigned _threshold,
+				   std::size_t _max_window, Callback _callback) noexcept
+	:timer(event_loop, BIND_THIS_METHOD(OnTimer)),
+	 cgroup_fd(OpenCgroupFile("io.pressure"sv)),
+	 last_time(event_loop.SteadyNow()),
+	 threshold(_threshold),
+	 max_window(_max_window), window(_max_window),
+	 callback(_callback)
+{
+	(void)system_fd.Open("/proc/pressure/io", O_RDONLY);
+
+	last_system_total = ReadPressureTotal(system_fd);
+	last_cgroup_total = ReadPressureTotal(cgroup_fd);
+
+	if (last_system_total < 0 && last_cgroup_total < 0) {
+		fmt::print(stderr, "I/O pressure information not available\n");
+		return;
+	}
+
+	timer.Schedule(PRESSURE_INTERVAL);
+}
+
+PressureThrottle::~PressureThrottle() noexcept = default;
+
+Event::Duration
+PressureThrottle::GetThrottledDuration() const noexcept
+{
+	Event::Duration result = throttled_duration;
+	if (throttled_since != Event::TimePoint{})
+		result += timer.GetEventLoop().SteadyNow() - throttled_since;
+	return result;
+}
+
+/**
+ * Calculate the percentage of the given duration in which some tasks
+ * were stalled and update the "last" value.
+ */
+static unsigned
+CalcPressurePercent(FileDescriptor fd, int_least64_t &last_total,
+		    std::chrono::microseconds elapsed) noexcept
+{
+	if (last_total < 0)
+		return 0;
+
+	const int_least64_t total = ReadPressureTotal(fd);
+	if (total < last_total || elapsed.count() <= 0)
+		return 0;
+
+	const auto stalled = total - std::exchange(last_total, total);
+	return static_cast<unsigned>(std::min<int_least64_t>(stalled * 100 / elapsed.count(), 100));
+}
+
+inline void
+PressureThrottle::OnTimer() noexcept
+{
+	timer.Schedule(PRESSURE_INTERVAL);
+
+	const auto now = timer.GetEventLoop().SteadyNow();
+	const auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(now - last_time);
+	last_time = now;
+
+	const unsigned pressure =
+		std::max(CalcPressurePercent(system_fd, last_system_total, elapsed),
+			 CalcPressurePercent(cgroup_fd, last_cgroup_total, elapsed));
+
+	std::size_t new_window;
+	if (pressure >= threshold * 2)
+		/* very high pressure: pause the walk */
+		new_window = 0;
+	else if (pressure >= threshold)
+		new_window = std::max(window / 2, MIN_WINDOW);
+	else if (window < MIN_WINDOW)
+		new_window = MIN_WINDOW;
+	else
+		new_window = std::min(window * 2, max_window);
+
+	if (new_window == window)
+		return;
+
+	if (new_window < max_window && throttled_since == Event::TimePoint{})
+		throttled_since = now;
+	else if (new_window == max_window && throttled_since != Event::TimePoint{})
+		throttled_duration += now - std::exchange(throttled_since, Event::TimePoint{});
+
+	window = new_window;
+	callback(window);
+}
+
+MemoryEvents
+ParseMemoryEvents(std::string_view contents) noexcept
+{
+	MemoryEvents events;
+
+	for (const std::string_view line : IterableSplitString(contents, '\n')) {
+		const auto [name, value] = Split(line, ' ');
+
+		uint_least64_t *dest;
+		if (name == "high"sv)
+			dest = &events.high;
+		else if (name == "max"sv)
+			dest = &events.max;
+		else if (name == "oom"sv)
+			dest = &events.oom;
+		else
+			continue;
+
+		const char *const first = value.data(), *const last = first + value.size();
+		auto [ptr, ec] = std::from_chars(first, last, *dest, 10);
+		if (ptr == first || ptr != last || ec != std::errc{})
+			*dest = 0;
+	}
+
+	return events;
+}
+
+static MemoryEvents
+ReadMemoryEvents(FileDescriptor fd) noexcept
+{
+	if (!fd.IsDefined())
+		return {};
+
+	char buffer[512];
+	const ssize_t nbytes = pread(fd.Get(), buffer, sizeof(buffer), 0);
+	if (nbytes <= 0)
+		return {};
+
+	return ParseMemoryEvents({buffer, static_cast<std::size_t>(nbytes)});
+}
+
+MemoryGovernor::MemoryGovernor(EventLoop &event_loop, unsigned _threshold,
+			       Callback _callback) noexcept
+	:timer(event_loop, BIND_THIS_METHOD(OnTimer)),
+	 pressure_fd(OpenCgroupFile("memory.pressure"sv)),
+	 events_fd(OpenCgroupFile("memory.events"sv)),
+	 last_pressure_total(ReadPressureTotal(pressure_fd)),
+	 last_events(ReadMemoryEvents(events_fd)),
+	 last_time(event_loop.SteadyNow()),
+	 threshold(_threshold),
+	 callback(_callback)
+{
+	if (last_pressure_total < 0 && !events_fd.IsDefined()) {
+		fmt::print(stderr, "Memory pressure information not available\n");
+		return;
+	}
+
+	timer.Schedule(PRESSURE_INTERVAL);
+}
+
+MemoryGovernor::~MemoryGovernor() noexcept = default;
+
+inline void
+MemoryGovernor::OnTimer() noexcept
+{
+	timer.Schedule(PRESSURE_INTERVAL);
+
+	const auto now = timer.GetEventLoop().SteadyNow();
+	const auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(now - last_time);
+	last_time = now;
+
+	const unsigned pressure = CalcPressurePercent(pressure_fd, last_pressure_total,
+						      elapsed);
+
+	const auto events = ReadMemoryEvents(events_fd);
+	const auto old_events = std::exchange(last_events, events);
+
+	MemoryShift::Level level;
+	if (events.max > old_events.max || events.oom > old_events.oom)
+		level = MemoryShift::Level::LIMIT;
+	else if (events.high > old_events.high || pressure >= threshold)
+		level = MemoryShift::Level::PRESSURE;
+	else
+		level = MemoryShift::Level::NORMAL;
+
+	if (shift.Update(level)) {
+		if (shift.shift > 0)
+			fmt::print(stderr, "Memory pressure: scaling down by {}\n",
+				   1U << shift.shift);
+		else
+			fmt::print(stderr, "Memory pressure: back to normal\n");
+
+		callback();
+	}
+}
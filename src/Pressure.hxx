@@ -0,0 +1,259 @@
+// SPDX-License-Identifier: BSD-2-Clause OR GPL-2.0-or-later
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#pragma once
+
+#include "event/CoarseTimerEvent.hxx"
+#include "io/UniqueFileDescriptor.hxx"
+#include "util/BindMethod.hxx"
+
+#include <algorithm> // for std::min(), std::max()
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+/**
+ * Parse the "total" value [microseconds] of the "some" line of a PSI
+ * file (e.g. /proc/pressure/io).  Returns -1 on error.
+ */
+[[gnu::pure]]
+int_least64_t
+ParsePressureSomeTotal(std::string_view contents) noexcept;
+
+/**
+ * Watches the I/O pressure (PSI) of the whole system and of our
+ * cgroup and adjusts the number of concurrent statx() calls of a
+ * #Walk: the window is shrunk (or the #Walk is paused completely)
+ * while the pressure is above the threshold, and grown back when it
+ * drops.
+ */
+class PressureThrottle final {
+	CoarseTimerEvent timer;
+
+	/**
+	 * /proc/pressure/io and our cgroup's "io.pressure"; each of
+	 * them may be undefined if the kernel doesn't support it.
+	 */
+	UniqueFileDescriptor system_fd, cgroup_fd;
+
+	int_least64_t last_system_total, last_cgroup_total;
+
+	Event::TimePoint last_time;
+
+	/**
+	 * The time when the window was shrunk below the maximum, or
+	 * Event::TimePoint{} if we're not throttled currently.
+	 */
+	Event::TimePoint throttled_since{};
+
+	/**
+	 * The accumulated duration in which the window was shrunk.
+	 */
+	Event::Duration throttled_duration{};
+
+	/**
+	 * See WalkConfig::pressure_threshold.
+	 */
+	const unsigned threshold;
+
+	const std::size_t max_window;
+
+	std::size_t window;
+
+	using Callback = BoundMethod<void(std::size_t window) noexcept>;
+	const Callback callback;
+
+public:
+	/**
+	 * @param _max_window the default (and maximum) window size
+	 * @param _callback invoked whenever the window size changes;
+	 * zero means the #Walk shall pause
+	 */
+	[[nodiscard]]
+	PressureThrottle(EventLoop &event_loop, unsigned _threshold,
+			 std::size_t _max_window, Callback _callback) noexcept;
+	~PressureThrottle() noexcept;
+
+	std::size_t GetWindow() const noexcept {
+		return window;
+	}
+
+	/**
+	 * Returns the total time in which the window was shrunk.
+	 */
+	[[gnu::pure]]
+	Event::Duration GetThrottledDuration() const noexcept;
+
+private:
+	void OnTimer() noexcept;
+};
+
+/**
+ * The counters of a cgroup's "memory.events" file which indicate
+ * that the cgroup has hit one of its limits.
+ */
+struct MemoryEvents {
+	/**
+	 * The number of times the cgroup was throttled and reclaimed
+	 * because it exceeded "memory.high".
+	 */
+	uint_least64_t high = 0;
+
+	/**
+	 * The number of times the cgroup was about to exceed
+	 * "memory.max".
+	 */
+	uint_least64_t max = 0;
+
+	/**
+	 * The number of times the OOM killer was invoked (or was
+	 * about to be).
+	 */
+	uint_least64_t oom = 0;
+};
+
+/**
+ * Parse the contents of a "memory.events" file.  Missing counters
+ * are zero.
+ */
+[[gnu::pure]]
+MemoryEvents
+ParseMemoryEvents(std::string_view contents) noexcept;
+
+/**
+ * How much shall memory consumers scale down?  Each step halves
+ * the limits (see Scale()).  Steps up immediately on pressure and
+ * steps down slowly after the pressure is gone, so the limits don't
+ * oscillate.
+ */
+struct MemoryShift {
+	enum class Level : uint_least8_t {
+		/**
+		 * No memory pressure.
+		 */
+		NORMAL,
+
+		/**
+		 * Memory pressure above the threshold, or
+		 * "memory.high" was exceeded.
+		 */
+		PRESSURE,
+
+		/**
+		 * "memory.max" was reached or the OOM killer was
+		 * invoked.
+		 */
+		LIMIT,
+	};
+
+	static constexpr unsigned MAX_SHIFT = 6;
+
+	/**
+	 * After this number of #NORMAL samples in a row, the shift
+	 * is decremented.
+	 */
+	static constexpr unsigned CALM_SAMPLES = 5;
+
+	unsigned shift = 0;
+
+	/**
+	 * The number of #NORMAL samples since the last change.
+	 */
+	unsigned calm = 0;
+
+	/**
+	 * The highest #shift so far (for statistics).
+	 */
+	unsigned peak = 0;
+
+	/**
+	 * Apply one sample.  Returns true if the #shift has changed.
+	 */
+	constexpr bool Update(Level level) noexcept {
+		const unsigned old_shift = shift;
+
+		switch (level) {
+		case Level::NORMAL:
+			if (shift > 0 && ++calm >= CALM_SAMPLES) {
+				--shift;
+				calm = 0;
+			}
+			break;
+
+		case Level::PRESSURE:
+			shift = std::min(shift + 1, MAX_SHIFT);
+			calm = 0;
+			break;
+
+		case Level::LIMIT:
+			shift = std::min(shift + 2, MAX_SHIFT);
+			calm = 0;
+			break;
+		}
+
+		peak = std::max(peak, shift);
+		return shift != old_shift;
+	}
+
+	/**
+	 * Scale down the given limit (but not below 1).
+	 */
+	constexpr std::size_t Scale(std::size_t value) const noexcept {
+		return std::max<std::size_t>(value >> shift, 1);
+	}
+};
+
+/**
+ * Watches the memory pressure (PSI) and the "memory.events"
+ * counters of our cgroup and tells the #Cull how much to scale down
+ * the statx() window, the number of candidate files and the cull
+ * queue depth (see #MemoryShift), so a #Walk over a huge tree
+ * finishes with less precision instead of being throttled by
+ * "memory.high" or killed by "memory.max".
+ */
+class MemoryGovernor final {
+	CoarseTimerEvent timer;
+
+	/**
+	 * Our cgroup's "memory.pressure" and "memory.events"; each
+	 * of them may be undefined if the kernel doesn't support it.
+	 */
+	UniqueFileDescriptor pressure_fd, events_fd;
+
+	int_least64_t last_pressure_total;
+
+	MemoryEvents last_events;
+
+	Event::TimePoint last_time;
+
+	/**
+	 * See WalkConfig::memory_pressure_threshold.
+	 */
+	const unsigned threshold;
+
+	MemoryShift shift;
+
+	using Callback = BoundMethod<void() noexcept>;
+	const Callback callback;
+
+public:
+	/**
+	 * @param _callback invoked whenever the shift changes
+	 */
+	[[nodiscard]]
+	MemoryGovernor(EventLoop &event_loop, unsigned _threshold,
+		       Callback _callback) noexcept;
+	~MemoryGovernor() noexcept;
+
+	std::size_t Scale(std::size_t value) const noexcept {
+		return shift.Scale(value);
+	}
+
+	unsigned GetPeakShift() const noexcept {
+		return shift.peak;
+	}
+
+private:
+	void OnTimer() noexcept;
+};
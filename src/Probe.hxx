@@ -0,0 +1,29 @@
+// SPDX-License-Identifier: BSD-2-Clause OR GPL-2.0-or-later
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#pragma once
+
+#include "config.h"
+
+/*
+ * Static tracepoints (SDT/USDT) for perf and bpftrace.  Disabled
+ * probes are just a "nop" instruction; their arguments are evaluated
+ * anyway, so they should be cheap.
+ *
+ * Example:
+ *
+ *   bpftrace -e 'usdt:/usr/sbin/cm4all-cash:cash:statx_submit { ... }'
+ */
+
+#ifdef HAVE_SDT
+
+#include <sys/sdt.h>
+
+#define CASH_PROBE(name, ...) STAP_PROBEV(cash, name __VA_OPT__(,) __VA_ARGS__)
+
+#else
+
+#define CASH_PROBE(name, ...) do {} while (false)
+
+#endif
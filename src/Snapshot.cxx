@@ -0,0 +1,123 @@
+// SPDX-License-Identifier: BSD-2-Clause OR GPL-2.0-or-later
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#include "Snapshot.hxx"
+#include "system/Error.hxx"
+#include "io/Open.hxx"
+
+#include <algorithm> // for std::copy_n()
+#include <stdexcept>
+
+#include <fcntl.h> // for O_CREAT
+#include <stdio.h> // for rename()
+#include <unistd.h> // for fsync(), unlink()
+
+SnapshotWriter::SnapshotWriter(std::string_view _path)
+	:path(_path), tmp_path(path + ".tmp"),
+	 fd(OpenWriteOnly(tmp_path.c_str(), O_CREAT|O_TRUNC))
+{
+}
+
+SnapshotWriter::~SnapshotWriter() noexcept
+{
+	if (fd.IsDefined())
+		/* not committed: discard the partial file */
+		unlink(tmp_path.c_str());
+}
+
+void
+SnapshotWriter::Flush()
+{
+	fd.FullWrite(std::span{buffer}.first(fill));
+	fill = 0;
+}
+
+void
+SnapshotWriter::Write(const void *data, std::size_t size)
+{
+	const auto *src = static_cast<const std::byte *>(data);
+
+	while (size > 0) {
+		if (fill == buffer.size())
+			Flush();
+
+		const std::size_t n = std::min(size, buffer.size() - fill);
+		std::copy_n(src, n, buffer.data() + fill);
+		fill += n;
+		src += n;
+		size -= n;
+	}
+}
+
+void
+SnapshotWriter::Commit(bool sync)
+{
+	Flush();
+
+	if (sync && fsync(fd.Get()) < 0)
+		throw MakeErrno("Failed to write snapshot");
+
+	fd.Close();
+
+	if (rename(tmp_path.c_str(), path.c_str()) < 0) {
+		const int e = errno;
+		unlink(tmp_path.c_str());
+		throw MakeErrno(e, "Failed to rename snapshot");
+	}
+}
+
+SnapshotReader::SnapshotReader(const char *path)
+	:fd(OpenReadOnly(path))
+{
+}
+
+bool
+SnapshotReader::Fill()
+{
+	if (position < fill)
+		return true;
+
+	const auto nbytes = fd.Read(buffer);
+	if (nbytes < 0)
+		throw MakeErrno("Failed to read snapshot");
+
+	position = 0;
+	fill = nbytes;
+	return nbytes > 0;
+}
+
+bool
+SnapshotReader::IsEnd()
+{
+	return !Fill();
+}
+
+void
+SnapshotReader::Read(void *data, std::size_t size)
+{
+	auto *dest = static_cast<std::byte *>(data);
+
+	while (size > 0) {
+		if (!Fill())
+			throw std::runtime_error{"Truncated snapshot"};
+
+		const std::size_t n = std::min(size, fill - position);
+		std::copy_n(buffer.data() + position, n, dest);
+		position += n;
+		dest += n;
+		size -= n;
+	}
+}
+
+std::string
+SnapshotReader::ReadString(std::size_t max_length)
+{
+	const std::size_t length = ReadU32();
+	if (length > max_length)
+		throw std::runtime_error{"Malformed snapshot"};
+
+	std::string s(length, '\0');
+	Read(s.data(), length);
+	return s;
+}
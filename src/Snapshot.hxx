@@ -0,0 +1,113 @@
+// SPDX-License-Identifier: BSD-2-Clause OR GPL-2.0-or-later
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#pragma once
+
+#include "io/UniqueFileDescriptor.hxx"
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+/**
+ * Writes a binary snapshot file.  Integers are stored in host byte
+ * order; snapshots are not meant to be portable.  The new file
+ * replaces the old one atomically in Commit().
+ */
+class SnapshotWriter {
+	const std::string path, tmp_path;
+
+	UniqueFileDescriptor fd;
+
+	std::array<std::byte, 65536> buffer;
+	std::size_t fill = 0;
+
+public:
+	/**
+	 * Throws on error.
+	 */
+	explicit SnapshotWriter(std::string_view _path);
+	~SnapshotWriter() noexcept;
+
+	SnapshotWriter(const SnapshotWriter &) = delete;
+	SnapshotWriter &operator=(const SnapshotWriter &) = delete;
+
+	void WriteU32(uint_least32_t value) {
+		const uint32_t v = value;
+		Write(&v, sizeof(v));
+	}
+
+	void WriteU64(uint_least64_t value) {
+		const uint64_t v = value;
+		Write(&v, sizeof(v));
+	}
+
+	void WriteString(std::string_view s) {
+		WriteU32(s.size());
+		Write(s.data(), s.size());
+	}
+
+	/**
+	 * Flush all buffered data and replace the old snapshot file.
+	 * Throws on error.
+	 *
+	 * @param sync call fsync() before replacing the old file;
+	 * this blocks for a while, but without it, a crash may leave
+	 * a truncated file behind (which the #SnapshotReader
+	 * rejects)
+	 */
+	void Commit(bool sync);
+
+private:
+	void Write(const void *data, std::size_t size);
+	void Flush();
+};
+
+/**
+ * Reads a binary snapshot file written by #SnapshotWriter.  All
+ * methods throw on error, including premature end of file.
+ */
+class SnapshotReader {
+	UniqueFileDescriptor fd;
+
+	std::array<std::byte, 65536> buffer;
+	std::size_t position = 0, fill = 0;
+
+public:
+	explicit SnapshotReader(const char *path);
+
+	uint_least32_t ReadU32() {
+		uint32_t v;
+		Read(&v, sizeof(v));
+		return v;
+	}
+
+	uint_least64_t ReadU64() {
+		uint64_t v;
+		Read(&v, sizeof(v));
+		return v;
+	}
+
+	/**
+	 * @param max_length throw if the string is longer than this
+	 */
+	std::string ReadString(std::size_t max_length);
+
+	/**
+	 * Has the end of the file been reached?
+	 */
+	[[nodiscard]]
+	bool IsEnd();
+
+private:
+	/**
+	 * Refill the #buffer if it is empty.  Returns false at the
+	 * end of the file.
+	 */
+	bool Fill();
+
+	void Read(void *data, std::size_t size);
+};
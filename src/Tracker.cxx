@@ -0,0 +1,253 @@
+// SPDX-License-Identifier: BSD-2-Clause OR GPL-2.0-or-later
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#include "Tracker.hxx"
+#include "Snapshot.hxx"
+#include "system/Error.hxx"
+#include "io/FileDescriptor.hxx"
+
+#include <fmt/core.h>
+
+#include <stdexcept>
+
+#include <fcntl.h> // for name_to_handle_at()
+#include <limits.h> // for NAME_MAX
+#include <sys/fanotify.h>
+#include <string.h> // for strerror()
+#include <unistd.h> // for read()
+
+/**
+ * Convert a file handle to a key for DirectoryTracker::directories.
+ */
+static std::string
+MakeKey(const struct file_handle &fh) noexcept
+{
+	std::string key{reinterpret_cast<const char *>(&fh.handle_type), sizeof(fh.handle_type)};
+	key.append(reinterpret_cast<const char *>(fh.f_handle), fh.handle_bytes);
+	return key;
+}
+
+/**
+ * Identifies a snapshot file (and its format version).
+ */
+static constexpr uint_least32_t SNAPSHOT_MAGIC = 0x63736e31;
+
+/**
+ * Refuse to load snapshots with more directories than this.
+ */
+static constexpr uint_least64_t MAX_SNAPSHOT_DIRECTORIES = 16 * 1024 * 1024;
+
+/**
+ * Refuse to load snapshots with more entries in one directory than
+ * this (larger listings are never saved).
+ */
+static constexpr uint_least64_t MAX_SNAPSHOT_NAMES = DirectoryListingBuilder::MAX_NAMES;
+
+static FileDescriptor
+InitFanotify(FileDescriptor directory)
+{
+	const int fd = fanotify_init(FAN_CLASS_NOTIF|FAN_REPORT_DFID_NAME|FAN_CLOEXEC|FAN_NONBLOCK,
+				     O_RDONLY|O_LARGEFILE);
+	if (fd < 0)
+		throw MakeErrno("fanotify_init() failed");
+
+	if (fanotify_mark(fd, FAN_MARK_ADD|FAN_MARK_FILESYSTEM,
+			  FAN_CREATE|FAN_DELETE|FAN_MOVED_FROM|FAN_MOVED_TO|FAN_ONDIR,
+			  directory.Get(), ".") < 0) {
+		const int e = errno;
+		close(fd);
+		throw MakeErrno(e, "fanotify_mark() failed");
+	}
+
+	return FileDescriptor{fd};
+}
+
+DirectoryTracker::DirectoryTracker(EventLoop &event_loop, FileDescriptor directory)
+	:event(event_loop, BIND_THIS_METHOD(OnFanotifyReady), InitFanotify(directory)),
+	 root_key(GetKey(directory))
+{
+	event.ScheduleRead();
+}
+
+DirectoryTracker::~DirectoryTracker() noexcept
+{
+	event.Close();
+}
+
+std::string
+DirectoryTracker::GetKey(FileDescriptor directory) noexcept
+{
+	union {
+		struct file_handle fh;
+		char buffer[sizeof(struct file_handle) + MAX_HANDLE_SZ];
+	} u;
+
+	u.fh.handle_bytes = MAX_HANDLE_SZ;
+
+	int mount_id;
+	if (name_to_handle_at(directory.Get(), "", &u.fh, &mount_id, AT_EMPTY_PATH) < 0)
+		return {};
+
+	return MakeKey(u.fh);
+}
+
+std::shared_ptr<const DirectoryTracker::Listing>
+DirectoryTracker::Lookup(const std::string &key, DirectoryTime mtime) noexcept
+{
+	if (auto i = directories.find(key);
+	    i != directories.end() && i->second.listing &&
+	    i->second.mtime == mtime) {
+		++n_hits;
+		return i->second.listing;
+	}
+
+	++n_misses;
+	return nullptr;
+}
+
+void
+DirectoryTracker::BeginScan(const std::string &key) noexcept
+{
+	directories[key].listing.reset();
+}
+
+void
+DirectoryTracker::EndScan(const std::string &key, DirectoryTime mtime,
+			  Listing &&listing) noexcept
+{
+	auto i = directories.find(key);
+	if (i == directories.end())
+		/* the directory was modified while we were scanning
+		   it */
+		return;
+
+	i->second.mtime = mtime;
+	i->second.listing = std::make_shared<const Listing>(std::move(listing));
+}
+
+void
+DirectoryTracker::SaveSnapshot(std::string_view path, bool sync) const
+{
+	SnapshotWriter w{path};
+	w.WriteU32(SNAPSHOT_MAGIC);
+	w.WriteString(root_key);
+
+	std::size_t n = 0;
+	for (const auto &[key, entry] : directories)
+		if (entry.listing)
+			++n;
+
+	w.WriteU64(n);
+
+	for (const auto &[key, entry] : directories) {
+		if (!entry.listing)
+			continue;
+
+		w.WriteString(key);
+		w.WriteU64(entry.mtime.sec);
+		w.WriteU32(entry.mtime.nsec);
+		w.WriteU64(entry.listing->size());
+		for (const auto &name : *entry.listing)
+			w.WriteString(name);
+	}
+
+	w.Commit(sync);
+}
+
+void
+DirectoryTracker::LoadSnapshot(const char *path)
+{
+	SnapshotReader r{path};
+	if (r.ReadU32() != SNAPSHOT_MAGIC)
+		throw std::runtime_error{"Not a snapshot file"};
+
+	if (r.ReadString(MAX_HANDLE_SZ + sizeof(int)) != root_key)
+		throw std::runtime_error{"Snapshot belongs to a different filesystem"};
+
+	const auto n = r.ReadU64();
+	if (n > MAX_SNAPSHOT_DIRECTORIES)
+		throw std::runtime_error{"Malformed snapshot"};
+
+	decltype(directories) new_directories;
+
+	for (uint_least64_t i = 0; i < n; ++i) {
+		auto key = r.ReadString(MAX_HANDLE_SZ + sizeof(int));
+
+		Entry entry;
+		entry.mtime.sec = r.ReadU64();
+		entry.mtime.nsec = r.ReadU32();
+
+		const auto n_names = r.ReadU64();
+		if (n_names > MAX_SNAPSHOT_NAMES)
+			throw std::runtime_error{"Malformed snapshot"};
+
+		/* no reserve(): the count is not trusted; a
+		   truncated file throws before much memory is
+		   allocated */
+		Listing listing;
+		for (uint_least64_t j = 0; j < n_names; ++j)
+			listing.emplace_back(r.ReadString(NAME_MAX));
+
+		entry.listing = std::make_shared<const Listing>(std::move(listing));
+		new_directories.emplace(std::move(key), std::move(entry));
+	}
+
+	/* the modification times of the loaded listings will be
+	   verified by Lookup(); entries which exist already take
+	   precedence */
+	directories.merge(new_directories);
+}
+
+void
+DirectoryTracker::LogStats() noexcept
+{
+	fmt::print(stderr, "Tracker: {} directory listings reused, {} scanned, {} overflows, {} tracked\n",
+		   n_hits, n_misses, n_overflows, directories.size());
+	n_hits = n_misses = n_overflows = 0;
+}
+
+inline void
+DirectoryTracker::OnFanotifyReady(unsigned) noexcept
+{
+	alignas(struct fanotify_event_metadata) char buffer[16384];
+
+	ssize_t nbytes = read(event.GetFileDescriptor().Get(), buffer, sizeof(buffer));
+	if (nbytes < 0) {
+		if (errno != EAGAIN)
+			fmt::print(stderr, "Failed to read fanotify events: {}\n",
+				   strerror(errno));
+		return;
+	}
+
+	for (auto *m = reinterpret_cast<struct fanotify_event_metadata *>(buffer);
+	     FAN_EVENT_OK(m, nbytes); m = FAN_EVENT_NEXT(m, nbytes)) {
+		if (m->mask & FAN_Q_OVERFLOW) {
+			/* we have lost events and don't know which
+			   directories have been modified; forget
+			   everything, the next walk will be a full
+			   one */
+			directories.clear();
+			++n_overflows;
+			continue;
+		}
+
+		const char *p = reinterpret_cast<const char *>(m) + m->metadata_len;
+		const char *const end = reinterpret_cast<const char *>(m) + m->event_len;
+
+		while (p + sizeof(struct fanotify_event_info_header) <= end) {
+			const auto &header = *reinterpret_cast<const struct fanotify_event_info_header *>(p);
+			if (header.len == 0 || p + header.len > end)
+				break;
+
+			if (header.info_type == FAN_EVENT_INFO_TYPE_DFID_NAME ||
+			    header.info_type == FAN_EVENT_INFO_TYPE_DFID) {
+				const auto &info = *reinterpret_cast<const struct fanotify_event_info_fid *>(p);
+				const auto &fh = *reinterpret_cast<const struct file_handle *>(info.handle);
+				Invalidate(MakeKey(fh));
+			}
+
+			p += header.len;
+		}
+	}
+}
@@ -0,0 +1,223 @@
+// SPDX-License-Identifier: BSD-2-Clause OR GPL-2.0-or-later
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#pragma once
+
+#include "event/PipeEvent.hxx"
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+class FileDescriptor;
+
+/**
+ * The modification time of a directory (from statx()).  It changes
+ * whenever an entry is added, removed or renamed.
+ */
+struct DirectoryTime {
+	int_least64_t sec = 0;
+	uint_least32_t nsec = 0;
+
+	constexpr bool operator==(const DirectoryTime &) const noexcept = default;
+};
+
+/**
+ * Collects the names of a directory while it is being scanned, for
+ * DirectoryTracker::EndScan().  To bound the memory used by
+ * listings, it gives up on directories with more than #MAX_NAMES
+ * entries; those are read again by each #Walk.
+ */
+class DirectoryListingBuilder {
+	std::vector<std::string> names;
+
+	bool overflow = false;
+
+public:
+	static constexpr std::size_t MAX_NAMES = 64 * 1024;
+
+	/**
+	 * Has this directory exceeded #MAX_NAMES?  Then the listing
+	 * is empty and shall not be passed to EndScan().
+	 */
+	bool IsOverflow() const noexcept {
+		return overflow;
+	}
+
+	/**
+	 * Prepare for adding the given number of names.
+	 */
+	void Reserve(std::size_t n) {
+		if (overflow)
+			return;
+
+		if (names.size() + n > MAX_NAMES)
+			SetOverflow();
+		else
+			names.reserve(names.size() + n);
+	}
+
+	void Add(std::string &&name) {
+		if (overflow)
+			return;
+
+		if (names.size() >= MAX_NAMES) {
+			SetOverflow();
+			return;
+		}
+
+		names.emplace_back(std::move(name));
+	}
+
+	void Add(const char *name) {
+		Add(std::string{name});
+	}
+
+	std::vector<std::string> Release() noexcept {
+		assert(!overflow);
+
+		return std::move(names);
+	}
+
+private:
+	void SetOverflow() noexcept {
+		overflow = true;
+		names.clear();
+		names.shrink_to_fit();
+	}
+};
+
+/**
+ * Tracks changes (creates, deletes, renames) in the cache filesystem
+ * using fanotify (#FAN_REPORT_DFID_NAME) and remembers the listings
+ * of all directories which have not changed since the last #Walk
+ * scanned them.  This allows the next #Walk to skip the getdents()
+ * calls for those directories.
+ *
+ * Directories are identified by their file handle (see
+ * name_to_handle_at()), the same way fanotify reports them.  Since
+ * fanotify events are lost while the daemon is not running, each
+ * listing also carries the directory's modification time which is
+ * verified before the listing is used; this allows saving the
+ * listings to a snapshot file and loading it after a restart.
+ */
+class DirectoryTracker final {
+	PipeEvent event;
+
+	using Listing = std::vector<std::string>;
+
+	struct Entry {
+		/**
+		 * The modification time of the directory when it
+		 * was scanned.
+		 */
+		DirectoryTime mtime;
+
+		/**
+		 * The names in this directory or nullptr if the
+		 * directory is currently being scanned.
+		 */
+		std::shared_ptr<const Listing> listing;
+	};
+
+	/**
+	 * Maps directory file handles (see GetKey()) to listings.
+	 * A change event removes the directory from this map.
+	 */
+	std::unordered_map<std::string, Entry> directories;
+
+	/**
+	 * The key of the cache root directory; used to verify that a
+	 * snapshot belongs to this filesystem.
+	 */
+	const std::string root_key;
+
+	std::size_t n_hits = 0, n_misses = 0, n_overflows = 0;
+
+public:
+	/**
+	 * Throws on error (e.g. if the kernel doesn't support
+	 * fanotify or if we lack CAP_SYS_ADMIN).
+	 *
+	 * @param directory a directory on the cache filesystem
+	 */
+	DirectoryTracker(EventLoop &event_loop, FileDescriptor directory);
+	~DirectoryTracker() noexcept;
+
+	DirectoryTracker(const DirectoryTracker &) = delete;
+	DirectoryTracker &operator=(const DirectoryTracker &) = delete;
+
+	/**
+	 * Determine the key of the specified directory.  Returns an
+	 * empty string on error.
+	 */
+	static std::string GetKey(FileDescriptor directory) noexcept;
+
+	/**
+	 * Look up the listing of a directory which has not changed
+	 * since it was last scanned.
+	 *
+	 * @param mtime the current modification time of the
+	 * directory
+	 * @return the listing or nullptr if the directory needs to
+	 * be scanned
+	 */
+	std::shared_ptr<const Listing> Lookup(const std::string &key, DirectoryTime mtime) noexcept;
+
+	/**
+	 * A #Walk is about to scan the specified directory.  Change
+	 * events which arrive from now on cancel the following
+	 * EndScan() call.
+	 */
+	void BeginScan(const std::string &key) noexcept;
+
+	/**
+	 * A #Walk has finished scanning the specified directory.  If
+	 * there was no change event since BeginScan(), the listing
+	 * is remembered.
+	 *
+	 * @param mtime the modification time of the directory
+	 * obtained before it was read
+	 */
+	void EndScan(const std::string &key, DirectoryTime mtime,
+		     Listing &&listing) noexcept;
+
+	/**
+	 * A #Walk has finished scanning the specified directory, but
+	 * has no listing for it (see
+	 * DirectoryListingBuilder::IsOverflow()).
+	 */
+	void AbortScan(const std::string &key) noexcept {
+		Invalidate(key);
+	}
+
+	/**
+	 * Write all listings to a snapshot file.  Throws on error.
+	 *
+	 * @param sync see SnapshotWriter::Commit()
+	 */
+	void SaveSnapshot(std::string_view path, bool sync) const;
+
+	/**
+	 * Load listings from a snapshot file written by
+	 * SaveSnapshot().  Throws on error.
+	 */
+	void LoadSnapshot(const char *path);
+
+	/**
+	 * Log statistics and reset them.
+	 */
+	void LogStats() noexcept;
+
+private:
+	void Invalidate(const std::string &key) noexcept {
+		directories.erase(key);
+	}
+
+	void OnFanotifyReady(unsigned events) noexcept;
+};
@@ -0,0 +1,42 @@
+// SPDX-License-Identifier: BSD-2-Clause OR GPL-2.0-or-later
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#include "UringConfig.hxx"
+#include "event/Loop.hxx"
+#include "io/uring/Queue.hxx"
+
+#include <liburing.h>
+
+void
+EnableUring(EventLoop &event_loop, const UringConfig &config)
+{
+	struct io_uring_params params{};
+	params.flags = IORING_SETUP_SINGLE_ISSUER;
+
+	if (config.sqpoll) {
+		/* the kernel rejects the task work flags in SQPOLL
+		   mode; completions are posted by the SQPOLL
+		   thread */
+		params.flags |= IORING_SETUP_SQPOLL;
+		params.sq_thread_idle = config.sqpoll_idle_ms;
+
+		if (config.sqpoll_cpu >= 0) {
+			params.flags |= IORING_SETUP_SQ_AFF;
+			params.sq_thread_cpu = static_cast<unsigned>(config.sqpoll_cpu);
+		}
+	} else if (config.defer_taskrun)
+		/* with IORING_SETUP_TASKRUN_FLAG, the kernel flags
+		   pending deferred work in the SQ ring, which makes
+		   liburing enter the kernel to run it while reaping
+		   completions */
+		params.flags |= IORING_SETUP_DEFER_TASKRUN|IORING_SETUP_TASKRUN_FLAG;
+	else
+		params.flags |= IORING_SETUP_COOP_TASKRUN;
+
+	event_loop.EnableUring(config.entries, params);
+
+	if (config.max_bounded_workers > 0 || config.max_unbounded_workers > 0)
+		event_loop.GetUring()->SetMaxWorkers(config.max_bounded_workers,
+						     config.max_unbounded_workers);
+}
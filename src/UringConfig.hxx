@@ -0,0 +1,66 @@
+// SPDX-License-Identifier: BSD-2-Clause OR GPL-2.0-or-later
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#pragma once
+
+class EventLoop;
+
+/**
+ * Settings for the io_uring which is shared by all caches.  They
+ * apply to the whole process, not to one cache section.
+ */
+struct UringConfig {
+	/**
+	 * The number of submission queue entries.
+	 */
+	unsigned entries = 16384;
+
+	/**
+	 * The limits for the kernel's io-wq worker threads (see
+	 * IORING_REGISTER_IOWQ_MAX_WORKERS): "bounded" workers run
+	 * regular file and block device I/O (including statx()),
+	 * "unbounded" workers run everything else.  Zero keeps the
+	 * kernel default.
+	 */
+	unsigned max_bounded_workers = 16, max_unbounded_workers = 16;
+
+	/**
+	 * Let a kernel thread poll the submission queue
+	 * (IORING_SETUP_SQPOLL), which saves the io_uring_enter()
+	 * system calls at the cost of a (mostly) busy CPU while the
+	 * walk runs.
+	 */
+	bool sqpoll = false;
+
+	/**
+	 * Defer completion work until the #EventLoop thread asks for
+	 * completions (IORING_SETUP_DEFER_TASKRUN), instead of
+	 * interrupting it (IORING_SETUP_COOP_TASKRUN).  Requires
+	 * Linux 6.1; cannot be combined with #sqpoll.
+	 */
+	bool defer_taskrun = false;
+
+	/**
+	 * The #sqpoll thread goes to sleep after being idle for this
+	 * number of milliseconds.  Zero keeps the kernel default.
+	 */
+	unsigned sqpoll_idle_ms = 0;
+
+	/**
+	 * Pin the #sqpoll thread to this CPU.  A negative value lets
+	 * the scheduler choose.
+	 */
+	int sqpoll_cpu = -1;
+
+	friend bool operator==(const UringConfig &, const UringConfig &) noexcept = default;
+};
+
+/**
+ * Enable io_uring in the #EventLoop according to the given
+ * settings.
+ *
+ * Throws on error.
+ */
+void
+EnableUring(EventLoop &event_loop, const UringConfig &config);
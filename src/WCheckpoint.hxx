@@ -0,0 +1,68 @@
+// SPDX-License-Identifier: BSD-2-Clause OR GPL-2.0-or-later
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#pragma once
+
+#include "WResult.hxx"
+
+#include <cstdint>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+/**
+ * The progress of an interrupted #Walk (see Walk::TakeCheckpoint()),
+ * which can be resumed by Walk::Resume().
+ */
+struct WalkCheckpoint {
+	/**
+	 * The paths (relative to the root) of directories whose
+	 * subtrees have been scanned completely.  Only the top
+	 * levels of the tree are recorded here.
+	 */
+	std::unordered_set<std::string> completed;
+
+	/**
+	 * The files collected from the #completed subtrees.
+	 */
+	WalkResult result;
+};
+
+/**
+ * A #WalkCheckpoint which has been saved to a file by a previous
+ * process (see SaveWalkCheckpoint()), to be resumed by
+ * Walk::Resume().  Directories are referred to by their paths
+ * relative to the root, because the #WalkDirectory instances are
+ * gone.
+ */
+struct SavedWalkCheckpoint {
+	/**
+	 * See WalkCheckpoint::completed.
+	 */
+	std::unordered_set<std::string> completed;
+
+	/**
+	 * The paths (relative to the root) of all directories
+	 * containing #files.
+	 */
+	std::vector<std::string> directories;
+
+	struct File {
+		/**
+		 * An index into #directories.
+		 */
+		uint_least32_t directory;
+
+		FileTime time;
+
+		uint_least64_t size;
+
+		std::string name;
+	};
+
+	/**
+	 * The files collected from the #completed subtrees.
+	 */
+	std::vector<File> files;
+};
@@ -0,0 +1,136 @@
+// SPDX-License-Identifier: BSD-2-Clause OR GPL-2.0-or-later
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#include "WCheckpointFile.hxx"
+#include "WCheckpoint.hxx"
+#include "Snapshot.hxx"
+
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <limits.h> // for NAME_MAX, PATH_MAX
+
+/**
+ * Identifies a checkpoint file (and its format version).
+ */
+static constexpr uint_least32_t CHECKPOINT_MAGIC = 0x63636b31;
+
+/**
+ * Refuse to load checkpoints with more completed subtrees or
+ * directories than this.
+ */
+static constexpr uint_least64_t MAX_CHECKPOINT_DIRECTORIES = 16 * 1024 * 1024;
+
+[[gnu::pure]]
+static bool
+IsValidName(std::string_view name) noexcept
+{
+	return !name.empty() && name != "." && name != ".." &&
+		name.find('/') == name.npos;
+}
+
+/**
+ * Build the path of a directory relative to the root.
+ */
+static std::string
+GetPath(const WalkDirectory &directory) noexcept
+{
+	std::string path;
+
+	for (const WalkDirectory *i = &directory; i->parent != nullptr; i = i->parent) {
+		if (!path.empty())
+			path.insert(0, 1, '/');
+		path.insert(0, i->name);
+	}
+
+	return path;
+}
+
+void
+SaveWalkCheckpoint(std::string_view path, const WalkCheckpoint &checkpoint,
+		   std::chrono::system_clock::time_point taken)
+{
+	/* assign an index to each directory, so its path is
+	   written only once */
+	std::unordered_map<const WalkDirectory *, uint_least32_t> indexes;
+	for (const auto &i : checkpoint.result.files)
+		indexes.emplace(&*i.parent, indexes.size());
+
+	std::vector<const WalkDirectory *> directories(indexes.size());
+	for (const auto &[directory, index] : indexes)
+		directories[index] = directory;
+
+	SnapshotWriter w{path};
+	w.WriteU32(CHECKPOINT_MAGIC);
+	w.WriteU64(std::chrono::system_clock::to_time_t(taken));
+
+	w.WriteU64(checkpoint.completed.size());
+	for (const auto &i : checkpoint.completed)
+		w.WriteString(i);
+
+	w.WriteU64(directories.size());
+	for (const auto *i : directories)
+		w.WriteString(GetPath(*i));
+
+	w.WriteU64(checkpoint.result.files.size());
+	for (const auto &i : checkpoint.result.files) {
+		w.WriteU32(indexes.find(&*i.parent)->second);
+		w.WriteU64(i.time.count());
+		w.WriteU64(i.size);
+		w.WriteString(i.name);
+	}
+
+	w.Commit(true);
+}
+
+SavedWalkCheckpoint
+LoadWalkCheckpoint(const char *path,
+		   std::chrono::system_clock::time_point &taken_r)
+{
+	SnapshotReader r{path};
+	if (r.ReadU32() != CHECKPOINT_MAGIC)
+		throw std::runtime_error{"Not a checkpoint file"};
+
+	taken_r = std::chrono::system_clock::from_time_t(r.ReadU64());
+
+	SavedWalkCheckpoint checkpoint;
+
+	/* no reserve(): the counts are not trusted; a truncated
+	   file throws before much memory is allocated */
+
+	const auto n_completed = r.ReadU64();
+	if (n_completed > MAX_CHECKPOINT_DIRECTORIES)
+		throw std::runtime_error{"Malformed checkpoint"};
+
+	for (uint_least64_t i = 0; i < n_completed; ++i)
+		checkpoint.completed.emplace(r.ReadString(PATH_MAX));
+
+	const auto n_directories = r.ReadU64();
+	if (n_directories > MAX_CHECKPOINT_DIRECTORIES)
+		throw std::runtime_error{"Malformed checkpoint"};
+
+	for (uint_least64_t i = 0; i < n_directories; ++i)
+		checkpoint.directories.emplace_back(r.ReadString(PATH_MAX));
+
+	const auto n_files = r.ReadU64();
+	if (n_files > WalkResult::MAX_FILES)
+		throw std::runtime_error{"Malformed checkpoint"};
+
+	for (uint_least64_t i = 0; i < n_files; ++i) {
+		auto &file = checkpoint.files.emplace_back();
+		file.directory = r.ReadU32();
+		if (file.directory >= n_directories)
+			throw std::runtime_error{"Malformed checkpoint"};
+
+		file.time = FileTime(r.ReadU64());
+		file.size = r.ReadU64();
+		file.name = r.ReadString(NAME_MAX);
+		if (!IsValidName(file.name))
+			throw std::runtime_error{"Malformed checkpoint"};
+	}
+
+	return checkpoint;
+}
@@ -0,0 +1,32 @@
+// SPDX-License-Identifier: BSD-2-Clause OR GPL-2.0-or-later
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#pragma once
+
+#include <chrono>
+#include <string_view>
+
+struct WalkCheckpoint;
+struct SavedWalkCheckpoint;
+
+/**
+ * Write a #WalkCheckpoint to a file, so the next process can resume
+ * the interrupted #Walk.  This blocks (including fsync()), and is
+ * meant to be called at shutdown.  Throws on error.
+ *
+ * @param taken the (wall clock) time the checkpoint was taken
+ */
+void
+SaveWalkCheckpoint(std::string_view path, const WalkCheckpoint &checkpoint,
+		   std::chrono::system_clock::time_point taken);
+
+/**
+ * Load a checkpoint file written by SaveWalkCheckpoint().  Throws on
+ * error.
+ *
+ * @param taken_r receives the time the checkpoint was taken
+ */
+SavedWalkCheckpoint
+LoadWalkCheckpoint(const char *path,
+		   std::chrono::system_clock::time_point &taken_r);
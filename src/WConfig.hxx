@@ -0,0 +1,146 @@
+// SPDX-License-Identifier: BSD-2-Clause OR GPL-2.0-or-later
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/**
+ * Fair-share settings for one fscache volume (see
+ * WalkConfig::fair_share).
+ */
+struct VolumeShare {
+	/**
+	 * The name of the volume directory below the cache root.
+	 */
+	std::string name;
+
+	/**
+	 * The volume's share of the cache relative to the other
+	 * volumes (which have the weight 1 unless configured).
+	 */
+	unsigned weight = 1;
+
+	/**
+	 * Never cull this volume below this percentage of the
+	 * total cache size.
+	 */
+	unsigned min_share = 0;
+};
+
+/**
+ * Tuning settings for #Walk and #Cull.
+ */
+struct WalkConfig {
+	/**
+	 * If the I/O pressure (PSI "some" of the whole system or of
+	 * our cgroup) exceeds this percentage, the #Walk is
+	 * throttled.  Zero disables throttling.
+	 */
+	unsigned pressure_threshold = 0;
+
+	/**
+	 * If the memory pressure (PSI "some") of our cgroup exceeds
+	 * this percentage, or if the cgroup hits "memory.high" or
+	 * "memory.max", then #Cull scales down the statx() window,
+	 * the number of candidate files and the cull queue depth
+	 * (see #MemoryGovernor).  Zero disables this.
+	 */
+	unsigned memory_pressure_threshold = 0;
+
+	/**
+	 * Keep at most this number of idle directory file descriptors
+	 * open (see #WalkDirectoryCache).
+	 */
+	std::size_t fd_budget = 65536;
+
+	/**
+	 * Limit on the number of concurrent statx() system calls
+	 * submitted by #Walk.  While #Cull has cull commands in
+	 * flight, the #Walk is limited to a fraction of this, so the
+	 * commands which actually free space get ahead of scanning.
+	 */
+	std::size_t walk_queue_depth = 16 * 1024;
+
+	/**
+	 * Limit on the number of concurrent cull commands (and
+	 * directory removals) submitted by #Cull.  Each one pins a
+	 * directory file descriptor (see #WalkDirectoryPin).
+	 */
+	std::size_t cull_queue_depth = 256;
+
+	/**
+	 * If non-zero, then #Cull uses the approximate selection
+	 * mode with bounded memory: a first #Walk builds a histogram
+	 * of access times with this resolution, and a second #Walk
+	 * culls all files below the boundary bucket and collects only
+	 * the files inside that bucket.  The files below the boundary
+	 * are queued in a bounded queue; the second #Walk pauses
+	 * while the cull commands catch up.
+	 */
+	std::chrono::seconds approx_resolution{};
+
+	/**
+	 * The number of threads sending cull commands, each with its
+	 * own working directory (see #CullWorkerPool).  Zero sends
+	 * all cull commands from the main thread, one directory at a
+	 * time (see #Chdir).
+	 */
+	std::size_t cull_workers = 0;
+
+	/**
+	 * Remove directories which have been emptied by #Cull?
+	 */
+	bool prune_empty_directories = false;
+
+	/**
+	 * On XFS, collect the atime and size of all files with
+	 * XFS_IOC_BULKSTAT instead of submitting one statx() per
+	 * file.  This requires CAP_SYS_ADMIN.
+	 */
+	bool bulkstat = false;
+
+	/**
+	 * Read each directory completely and submit statx() in inode
+	 * number order instead of readdir() order.  On ext4 and XFS,
+	 * this makes metadata reads on a cold cache mostly
+	 * sequential, at the cost of buffering one directory's names.
+	 */
+	bool inode_order = false;
+
+	/**
+	 * If non-zero, then estimate each file's access frequency
+	 * from successive walks in an #AccessSketch with this many
+	 * counters per row, and protect frequently accessed files
+	 * from culling (see AccessSketch::Adjust()).
+	 */
+	std::size_t frequency_sketch = 0;
+
+	/**
+	 * Select files per volume (directory below the cache root)
+	 * instead of globally by access time, so one volume cannot
+	 * push out the working set of all others (see
+	 * SelectFairShare()).  The approximate selection mode is not
+	 * used in this mode.
+	 */
+	bool fair_share = false;
+
+	/**
+	 * Per-volume settings for #fair_share; volumes which are not
+	 * listed here have the weight 1 and no minimum share.
+	 */
+	std::vector<VolumeShare> volumes{};
+
+	[[gnu::pure]]
+	const VolumeShare *FindVolume(std::string_view name) const noexcept {
+		for (const auto &i : volumes)
+			if (i.name == name)
+				return &i;
+		return nullptr;
+	}
+};
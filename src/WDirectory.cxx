@@ -0,0 +1,140 @@
+// SPDX-License-Identifier: BSD-2-Clause OR GPL-2.0-or-later
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#include "WDirectory.hxx"
+#include "Hash.hxx"
+#include "io/uring/Close.hxx"
+#include "io/UniqueFileDescriptor.hxx"
+#include "system/linux/openat2.h"
+
+#include <fcntl.h> // for O_PATH
+
+WalkDirectory::WalkDirectory(Uring::Queue &uring, std::size_t fd_budget, RootTag,
+			     UniqueFileDescriptor &&_fd) noexcept
+	:cache(*new WalkDirectoryCache(uring, fd_budget)),
+	 parent(nullptr), path_hash(FNV1aHash({})), fd(_fd.Release()),
+	 /* the root directory is pinned forever */
+	 pins(1)
+{
+}
+
+WalkDirectory::WalkDirectory(WalkDirectory &_parent, std::string &&_name,
+			     UniqueFileDescriptor &&_fd) noexcept
+	:cache(_parent.cache),
+	 parent(&_parent.Ref()), name(std::move(_name)),
+	 /* the '/' separates the parent's hash from the name */
+	 path_hash(FNV1aHash(name, FNV1aHash("/", _parent.path_hash))),
+	 fd(_fd.Release())
+{
+	if (!fd.IsDefined())
+		/* will be opened by Pin() */
+		return;
+
+	/* it will be trimmed by the next Unpin() call if we're over
+	   budget; doing it here would close the file descriptor
+	   before the caller gets a chance to use it */
+	cache.idle.push_back(*this);
+	++cache.n_open;
+}
+
+WalkDirectory::~WalkDirectory() noexcept
+{
+	assert(pins == (parent == nullptr ? 1U : 0U));
+
+	if (is_linked())
+		cache.idle.erase(cache.idle.iterator_to(*this));
+
+	if (fd.IsDefined()) {
+		Uring::Close(&cache.uring, fd);
+
+		if (parent != nullptr)
+			--cache.n_open;
+	}
+
+	if (parent != nullptr)
+		parent->Unref();
+	else
+		/* the root directory is destroyed last, after all
+		   other instances have been released */
+		delete &cache;
+}
+
+inline bool
+WalkDirectory::Reopen() noexcept
+{
+	assert(!fd.IsDefined());
+	assert(parent != nullptr);
+
+	/* build the path relative to the nearest ancestor which has
+	   an open file descriptor (the root directory always has
+	   one) */
+	std::string path = name;
+	const WalkDirectory *ancestor = parent;
+	while (!ancestor->fd.IsDefined()) {
+		assert(ancestor->parent != nullptr);
+
+		path.insert(0, 1, '/');
+		path.insert(0, ancestor->name);
+		ancestor = ancestor->parent;
+	}
+
+	/* O_NOFOLLOW only protects the last path component;
+	   RESOLVE_NO_SYMLINKS refuses a symlink anywhere in the path
+	   (e.g. a directory which has been replaced by a symlink
+	   after its file descriptor was closed) */
+	static constexpr struct open_how how{
+		.flags = O_PATH|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC,
+		.mode = 0,
+		.resolve = RESOLVE_BENEATH|RESOLVE_NO_SYMLINKS,
+	};
+
+	const int new_fd = openat2(ancestor->fd.Get(), path.c_str(),
+				   &how, sizeof(how));
+	if (new_fd < 0)
+		return false;
+
+	fd = FileDescriptor{new_fd};
+	++cache.n_open;
+	return true;
+}
+
+FileDescriptor
+WalkDirectory::Pin() noexcept
+{
+	if (pins++ == 0 && is_linked())
+		cache.idle.erase(cache.idle.iterator_to(*this));
+
+	if (!fd.IsDefined() && !Reopen())
+		return FileDescriptor::Undefined();
+
+	return fd;
+}
+
+void
+WalkDirectory::Unpin() noexcept
+{
+	assert(pins > 0);
+
+	if (--pins > 0 || !fd.IsDefined())
+		return;
+
+	cache.idle.push_back(*this);
+	cache.Trim();
+}
+
+void
+WalkDirectoryCache::Trim() noexcept
+{
+	while (n_open > fd_budget && !idle.empty()) {
+		auto &directory = idle.front();
+		idle.pop_front();
+
+		assert(directory.pins == 0);
+		assert(directory.fd.IsDefined());
+
+		Uring::Close(&uring, directory.fd);
+		directory.fd = FileDescriptor::Undefined();
+		--n_open;
+	}
+}
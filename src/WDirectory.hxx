@@ -0,0 +1,285 @@
+// SPDX-License-Identifier: BSD-2-Clause OR GPL-2.0-or-later
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#pragma once
+
+#include "io/FileDescriptor.hxx"
+#include "util/IntrusiveList.hxx"
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <utility> // for std::exchange()
+
+class UniqueFileDescriptor;
+namespace Uring { class Queue; }
+struct WalkDirectoryCache;
+
+/**
+ * Represents a directory inside "/var/cache/fscache/cache".  It is
+ * kept around because it manages an O_PATH file descriptor for
+ * efficient file access inside this directory.
+ *
+ * To limit the number of open file descriptors, the O_PATH file
+ * descriptor of an idle directory may be closed (see
+ * #WalkDirectoryCache); it is reopened (relative to the nearest
+ * ancestor which still has one) when it is needed again.  Use
+ * #WalkDirectoryPin to access the file descriptor.
+ *
+ * Instances of this object are reference-counted (except for the
+ * #root instance).  Use #WalkDirectoryRef to use these reference
+ * counts safely.
+ */
+struct WalkDirectory final : IntrusiveListHook<IntrusiveHookMode::TRACK> {
+	WalkDirectoryCache &cache;
+
+	WalkDirectory *const parent;
+
+	/**
+	 * The name of this directory relative to #parent (empty for
+	 * the root directory).
+	 */
+	const std::string name;
+
+	/**
+	 * A hash of the path relative to the root directory (see
+	 * FNV1aHash()); it identifies this directory across walks.
+	 */
+	const uint_least64_t path_hash;
+
+	/**
+	 * An O_PATH file descriptor.  It is undefined if it has been
+	 * closed by WalkDirectoryCache::Trim().
+	 */
+	FileDescriptor fd;
+
+	unsigned ref = 1;
+
+	/**
+	 * The number of #WalkDirectoryPin instances.  As long as this
+	 * is non-zero, #fd must not be closed.  The root directory
+	 * holds one pin forever, i.e. its #fd is never closed.
+	 */
+	unsigned pins = 0;
+
+	/**
+	 * The number of pending #Walk operations in this directory's
+	 * subtree: reading the directory itself, statx() calls on
+	 * its entries and subdirectories which have not yet been
+	 * scanned completely.
+	 */
+	unsigned pending = 0;
+
+	/**
+	 * Has this directory's subtree been scanned completely (i.e.
+	 * #pending has dropped to zero)?
+	 */
+	bool complete = false;
+
+	/**
+	 * The number of entries found in this directory by the #Walk
+	 * which have not been culled (or pruned) since.  Entries
+	 * which have vanished before statx() and entries which are
+	 * neither regular files nor directories are not counted.  If
+	 * this drops to zero, the directory is (probably) empty and
+	 * may be removed.
+	 */
+	std::size_t n_entries = 0;
+
+	/**
+	 * Has #Cull removed entries from this directory before it
+	 * was #complete?  Then it may be removed once it becomes
+	 * complete if #n_entries is zero.
+	 */
+	bool culled = false;
+
+	struct RootTag {};
+	WalkDirectory(Uring::Queue &uring, std::size_t fd_budget, RootTag,
+		      UniqueFileDescriptor &&_fd) noexcept;
+
+	/**
+	 * @param _fd an O_PATH file descriptor or an undefined one
+	 * (to be opened by Pin())
+	 */
+	WalkDirectory(WalkDirectory &_parent, std::string &&_name,
+		      UniqueFileDescriptor &&_fd) noexcept;
+
+	~WalkDirectory() noexcept;
+
+	WalkDirectory(const WalkDirectory &) = delete;
+	WalkDirectory &operator=(const WalkDirectory &) = delete;
+
+	WalkDirectory &Ref() noexcept {
+		++ref;
+		return *this;
+	}
+
+	void Unref() noexcept {
+		if (--ref == 0)
+			delete this;
+	}
+
+	/**
+	 * Ensure that #fd is open (reopening it if necessary) and
+	 * protect it from being closed until Unpin() is called.
+	 * Unpin() must be called even if this method fails.
+	 *
+	 * @return the file descriptor or an undefined one on error
+	 * (with errno set)
+	 */
+	FileDescriptor Pin() noexcept;
+
+	void Unpin() noexcept;
+
+private:
+	/**
+	 * Reopen #fd relative to the nearest ancestor which still
+	 * has an open file descriptor.
+	 */
+	bool Reopen() noexcept;
+};
+
+/**
+ * Manages the O_PATH file descriptors of all #WalkDirectory instances
+ * below one root.  It is owned by the root #WalkDirectory.
+ */
+struct WalkDirectoryCache {
+	Uring::Queue &uring;
+
+	/**
+	 * Close idle file descriptors if more than this number are
+	 * open.
+	 */
+	const std::size_t fd_budget;
+
+	/**
+	 * The number of open file descriptors (not including the
+	 * root directory's), including those counted by
+	 * #WalkDirectoryFdLease.
+	 */
+	std::size_t n_open = 0;
+
+	/**
+	 * Directories with an open file descriptor which is not
+	 * pinned, the least recently used one at the front.
+	 */
+	IntrusiveList<WalkDirectory> idle;
+
+	WalkDirectoryCache(Uring::Queue &_uring, std::size_t _fd_budget) noexcept
+		:uring(_uring), fd_budget(_fd_budget) {}
+
+	~WalkDirectoryCache() noexcept {
+		assert(idle.empty());
+	}
+
+	/**
+	 * Close idle file descriptors until we're within the budget
+	 * (or until there are no idle ones left).
+	 */
+	void Trim() noexcept;
+};
+
+class WalkDirectoryRef {
+	WalkDirectory *directory = nullptr;
+
+public:
+	[[nodiscard]]
+	explicit WalkDirectoryRef(WalkDirectory &_directory) noexcept
+		:directory(&_directory.Ref()) {}
+
+	struct Adopt {};
+
+	[[nodiscard]]
+	WalkDirectoryRef(Adopt, WalkDirectory &_directory) noexcept
+		:directory(&_directory) {}
+
+	WalkDirectoryRef(WalkDirectoryRef &&src) noexcept
+		:directory(std::exchange(src.directory, nullptr)) {}
+
+	~WalkDirectoryRef() noexcept {
+		if (directory != nullptr)
+			directory->Unref();
+	}
+
+	WalkDirectoryRef &operator=(WalkDirectoryRef &&src) noexcept {
+		using std::swap;
+		swap(directory, src.directory);
+		return *this;
+	}
+
+	[[nodiscard]]
+	WalkDirectory &operator*() const noexcept{
+		assert(directory != nullptr);
+
+		return *directory;
+	}
+
+	[[nodiscard]]
+	WalkDirectory *operator->() const noexcept{
+		assert(directory != nullptr);
+
+		return directory;
+	}
+};
+
+/**
+ * Pins the O_PATH file descriptor of a #WalkDirectory (see
+ * WalkDirectory::Pin()) during the lifetime of this object.
+ */
+class WalkDirectoryPin {
+	WalkDirectory &directory;
+
+	const FileDescriptor fd;
+
+public:
+	[[nodiscard]]
+	explicit WalkDirectoryPin(WalkDirectory &_directory) noexcept
+		:directory(_directory), fd(directory.Pin()) {}
+
+	~WalkDirectoryPin() noexcept {
+		directory.Unpin();
+	}
+
+	WalkDirectoryPin(const WalkDirectoryPin &) = delete;
+	WalkDirectoryPin &operator=(const WalkDirectoryPin &) = delete;
+
+	/**
+	 * Was the file descriptor opened successfully?
+	 */
+	explicit operator bool() const noexcept {
+		return fd.IsDefined();
+	}
+
+	FileDescriptor GetFileDescriptor() const noexcept {
+		return fd;
+	}
+};
+
+/**
+ * Counts a file descriptor which is not managed by
+ * #WalkDirectoryCache (e.g. one which is being read with
+ * getdents()) against WalkDirectoryCache::fd_budget during the
+ * lifetime of this object.
+ */
+class WalkDirectoryFdLease {
+	WalkDirectoryCache &cache;
+
+public:
+	[[nodiscard]]
+	explicit WalkDirectoryFdLease(WalkDirectory &directory) noexcept
+		:cache(directory.cache)
+	{
+		++cache.n_open;
+		cache.Trim();
+	}
+
+	~WalkDirectoryFdLease() noexcept {
+		assert(cache.n_open > 0);
+		--cache.n_open;
+	}
+
+	WalkDirectoryFdLease(const WalkDirectoryFdLease &) = delete;
+	WalkDirectoryFdLease &operator=(const WalkDirectoryFdLease &) = delete;
+};
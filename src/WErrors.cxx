@@ -0,0 +1,102 @@
+// SPDX-License-Identifier: BSD-2-Clause OR GPL-2.0-or-later
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#include "WErrors.hxx"
+#include "lib/fmt/ExceptionFormatter.hxx"
+#include "system/Error.hxx"
+
+#include <fmt/core.h>
+
+#include <cerrno>
+
+#include <string.h> // for strerror()
+
+/**
+ * Returns ENOENT or ESTALE if the given exception is a
+ * #std::system_error with this errno value, 0 otherwise.
+ */
+static int
+GetExpectedErrno(std::exception_ptr error) noexcept
+{
+	try {
+		std::rethrow_exception(std::move(error));
+	} catch (const std::system_error &e) {
+		if (IsErrno(e, ENOENT))
+			return ENOENT;
+
+		if (IsErrno(e, ESTALE))
+			return ESTALE;
+	} catch (...) {
+	}
+
+	return 0;
+}
+
+inline bool
+WalkErrors::CountExpected(int e) noexcept
+{
+	switch (e) {
+	case ENOENT:
+		++n_vanished;
+		return true;
+
+	case ESTALE:
+		++n_stale;
+		return true;
+
+	default:
+		return false;
+	}
+}
+
+inline bool
+WalkErrors::CountUnexpected(Event::TimePoint now) noexcept
+{
+	++n_unexpected;
+
+	if (now - interval_start >= LOG_INTERVAL) {
+		interval_start = now;
+		interval_logged = 0;
+	}
+
+	if (interval_logged >= MAX_LOGGED) {
+		++n_suppressed;
+		return false;
+	}
+
+	++interval_logged;
+	return true;
+}
+
+void
+WalkErrors::Add(const char *what, std::exception_ptr error,
+		Event::TimePoint now) noexcept
+{
+	if (CountExpected(GetExpectedErrno(error)))
+		return;
+
+	if (CountUnexpected(now))
+		fmt::print(stderr, "{}: {}: {}\n", log_prefix, what, std::move(error));
+}
+
+void
+WalkErrors::AddErrno(const char *what, int e,
+		     Event::TimePoint now) noexcept
+{
+	if (CountExpected(e))
+		return;
+
+	if (CountUnexpected(now))
+		fmt::print(stderr, "{}: {}: {}\n", log_prefix, what, strerror(e));
+}
+
+void
+WalkErrors::LogSummary() const noexcept
+{
+	if (n_vanished == 0 && n_stale == 0 && n_unexpected == 0)
+		return;
+
+	fmt::print(stderr, "{}: {} vanished, {} stale, {} other errors ({} not logged)\n",
+		   log_prefix, n_vanished, n_stale, n_unexpected, n_suppressed);
+}
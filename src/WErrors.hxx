@@ -0,0 +1,124 @@
+// SPDX-License-Identifier: BSD-2-Clause OR GPL-2.0-or-later
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#pragma once
+
+#include "event/Chrono.hxx"
+
+#include <cstddef>
+#include <exception>
+#include <string_view>
+
+/**
+ * Error accounting for one #Walk.  The kernel creates and deletes
+ * cache files all the time, so files and directories vanishing
+ * between getdents() and statx()/openat() (ENOENT, ESTALE) are
+ * expected; they are only counted.  Other errors are logged, but
+ * at most #MAX_LOGGED per #LOG_INTERVAL, and a summary is logged
+ * at the end of the walk.
+ */
+class WalkErrors {
+	static constexpr Event::Duration LOG_INTERVAL = std::chrono::seconds{1};
+	static constexpr unsigned MAX_LOGGED = 10;
+
+	/**
+	 * ENOENT: the file or directory was deleted while we were
+	 * walking.
+	 */
+	std::size_t n_vanished = 0;
+
+	/**
+	 * ESTALE: the file or directory was deleted and its inode
+	 * reused (or the cache was withdrawn).
+	 */
+	std::size_t n_stale = 0;
+
+	/**
+	 * All other errors.
+	 */
+	std::size_t n_unexpected = 0;
+
+	/**
+	 * The number of unexpected errors which were not logged
+	 * because of the rate limit.
+	 */
+	std::size_t n_suppressed = 0;
+
+	/**
+	 * The beginning of the current rate limit interval.
+	 */
+	Event::TimePoint interval_start{};
+
+	/**
+	 * The number of errors logged in the current interval.
+	 */
+	unsigned interval_logged = 0;
+
+	/**
+	 * The prefix of log messages (see SetLogPrefix()).
+	 */
+	std::string_view log_prefix = "Walk";
+
+public:
+	/**
+	 * @param _log_prefix the prefix of log messages, e.g. "Cull
+	 * [disk1]"; the string is owned by the caller
+	 */
+	void SetLogPrefix(std::string_view _log_prefix) noexcept {
+		log_prefix = _log_prefix;
+	}
+
+	/**
+	 * Account for an error.
+	 *
+	 * @param what describes the failed operation (for the log)
+	 * @param now the current time (for rate limiting)
+	 */
+	void Add(const char *what, std::exception_ptr error,
+		 Event::TimePoint now) noexcept;
+
+	/**
+	 * Like Add(), but for a system call which has failed with
+	 * the given errno value.  This is cheaper, because no
+	 * exception needs to be thrown to classify the error.
+	 */
+	void AddErrno(const char *what, int e,
+		      Event::TimePoint now) noexcept;
+
+	std::size_t GetVanished() const noexcept {
+		return n_vanished;
+	}
+
+	std::size_t GetStale() const noexcept {
+		return n_stale;
+	}
+
+	std::size_t GetUnexpected() const noexcept {
+		return n_unexpected;
+	}
+
+	std::size_t GetSuppressed() const noexcept {
+		return n_suppressed;
+	}
+
+	/**
+	 * Log a summary (if there were any errors).
+	 */
+	void LogSummary() const noexcept;
+
+private:
+	/**
+	 * Count an expected error.
+	 *
+	 * @return true if this errno value is expected
+	 */
+	bool CountExpected(int e) noexcept;
+
+	/**
+	 * Count an unexpected error and check the rate limit.
+	 *
+	 * @return true if the error shall be logged
+	 */
+	bool CountUnexpected(Event::TimePoint now) noexcept;
+};
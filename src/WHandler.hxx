@@ -24,6 +24,13 @@ public:
 				   std::string &&filename,
 				   uint_least64_t size) noexcept = 0;
 
+	/**
+	 * The subtree of the given directory has been scanned
+	 * completely (see WalkDirectory::complete).  This is not
+	 * called for the root directory.
+	 */
+	virtual void OnWalkDirectoryComplete([[maybe_unused]] WalkDirectory &directory) noexcept {}
+
 	/**
 	 * The #Walk has finished completely.  This method is allowed
 	 * destruct the #Walk instance (which will invalidate the
@@ -0,0 +1,107 @@
+// SPDX-License-Identifier: BSD-2-Clause OR GPL-2.0-or-later
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <vector>
+
+#include <time.h> // for time_t
+
+using FileTime = std::chrono::duration<time_t>;
+
+/**
+ * A histogram of file access times with a fixed number of buckets.
+ * It is used by the approximate selection mode of #Cull: the first
+ * #Walk fills the histogram, and FindBoundary() determines which
+ * buckets need to be culled completely and which bucket needs an
+ * exact selection.
+ */
+class WalkHistogram {
+	struct Bucket {
+		uint_least64_t files = 0, bytes = 0;
+	};
+
+	const FileTime begin, resolution;
+
+	std::vector<Bucket> buckets;
+
+public:
+	/**
+	 * @param _begin the oldest access time (older files are
+	 * counted in the first bucket)
+	 * @param end the newest access time (newer files are counted
+	 * in the last bucket)
+	 * @param _resolution the width of each bucket
+	 */
+	WalkHistogram(FileTime _begin, FileTime end, FileTime _resolution)
+		:begin(_begin), resolution(_resolution),
+		 buckets(static_cast<std::size_t>((end - begin) / resolution) + 1) {}
+
+	void Add(FileTime time, uint_least64_t size) noexcept {
+		auto &bucket = buckets[ToIndex(time)];
+		++bucket.files;
+		bucket.bytes += size;
+	}
+
+	struct Boundary {
+		/**
+		 * All files accessed before this time shall be culled.
+		 */
+		FileTime older;
+
+		/**
+		 * Files accessed between #older and this time are
+		 * candidates for an exact selection; newer files
+		 * shall be kept.
+		 */
+		FileTime newer;
+
+		/**
+		 * The number of files/bytes older than #older, i.e.
+		 * the amount which will be culled unconditionally.
+		 */
+		uint_least64_t files_below = 0, bytes_below = 0;
+	};
+
+	/**
+	 * Find the bucket in which the given cull target is reached.
+	 * This follows the semantics of #Walk: the oldest files are
+	 * selected until there are more than the given number of
+	 * files and more than the given number of bytes.
+	 */
+	[[gnu::pure]]
+	Boundary FindBoundary(uint_least64_t files, uint_least64_t bytes) const noexcept {
+		Boundary b;
+
+		for (std::size_t i = 0; i < buckets.size(); ++i) {
+			const auto &bucket = buckets[i];
+			if (b.files_below + bucket.files > files &&
+			    b.bytes_below + bucket.bytes > bytes) {
+				b.older = begin + resolution * static_cast<time_t>(i);
+				b.newer = b.older + resolution;
+				return b;
+			}
+
+			b.files_below += bucket.files;
+			b.bytes_below += bucket.bytes;
+		}
+
+		/* the target exceeds everything we have - cull all
+		   files which existed during the histogram walk */
+		b.older = b.newer = begin + resolution * static_cast<time_t>(buckets.size());
+		return b;
+	}
+
+private:
+	[[gnu::pure]]
+	std::size_t ToIndex(FileTime time) const noexcept {
+		if (time < begin)
+			return 0;
+
+		const auto i = static_cast<std::size_t>((time - begin) / resolution);
+		return i < buckets.size() ? i : buckets.size() - 1;
+	}
+};
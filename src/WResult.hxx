@@ -4,114 +4,15 @@
 
 #pragma once
 
-#include "io/uring/Close.hxx"
-#include "io/UniqueFileDescriptor.hxx"
-#include "util/DeleteDisposer.hxx"
-#include "util/StaticVector.hxx"
+#include "WDirectory.hxx"
+#include "WHistogram.hxx"
+#include "PageVector.hxx"
 
-#include <algorithm> // for std::push_heap(), std::pop_heap()
+#include <algorithm> // for std::push_heap(), std::pop_heap(), std::remove_if(), std::min()
 #include <cassert>
-#include <chrono>
-#include <utility> // for std::exchange()
-
-#include <time.h> // for time_t
-
-using FileTime = std::chrono::duration<time_t>;
-
-/**
- * Represents a directory inside "/var/cache/fscache/cache".  It is
- * kept around because it manages an O_PATH file descriptor for
- * efficient file access inside this directory.
- *
- * Instances of this object are reference-counted (except for the
- * #root instance).  Use #WalkDirectoryRef to use these reference
- * counts safely.
- */
-struct WalkDirectory {
-	Uring::Queue &uring;
-
-	WalkDirectory *const parent;
-
-	/**
-	 * An O_PATH file descriptor.
-	 */
-	const FileDescriptor fd;
-
-	unsigned ref = 1;
-
-	struct RootTag {};
-	WalkDirectory(Uring::Queue &_uring, RootTag,
-		      UniqueFileDescriptor &&_fd) noexcept
-		:uring(_uring), parent(nullptr), fd(_fd.Release()) {}
-
-	WalkDirectory(Uring::Queue &_uring, WalkDirectory &_parent,
-		      UniqueFileDescriptor &&_fd)
-		:uring(_uring),
-		 parent(&_parent.Ref()), fd(_fd.Release()) {}
-
-	~WalkDirectory() noexcept {
-		Uring::Close(&uring, fd);
-
-		if (parent != nullptr)
-			parent->Unref();
-	}
-
-	WalkDirectory(const WalkDirectory &) = delete;
-	WalkDirectory &operator=(const WalkDirectory &) = delete;
-
-	WalkDirectory &Ref() noexcept {
-		++ref;
-		return *this;
-	}
-
-	void Unref() noexcept {
-		if (--ref == 0)
-			delete this;
-	}
-};
-
-class WalkDirectoryRef {
-	WalkDirectory *directory = nullptr;
-
-public:
-	[[nodiscard]]
-	explicit WalkDirectoryRef(WalkDirectory &_directory) noexcept
-		:directory(&_directory.Ref()) {}
-
-	struct Adopt {};
-
-	[[nodiscard]]
-	WalkDirectoryRef(Adopt, WalkDirectory &_directory) noexcept
-		:directory(&_directory) {}
-
-	WalkDirectoryRef(WalkDirectoryRef &&src) noexcept
-		:directory(std::exchange(src.directory, nullptr)) {}
-
-	~WalkDirectoryRef() noexcept {
-		if (directory != nullptr)
-			directory->Unref();
-	}
-
-	WalkDirectoryRef &operator=(WalkDirectoryRef &&src) noexcept {
-		using std::swap;
-		swap(directory, src.directory);
-		return *this;
-	}
-
-	[[nodiscard]]
-	WalkDirectory &operator*() const noexcept{
-		assert(directory != nullptr);
-
-		return *directory;
-	}
-
-	[[nodiscard]]
-	WalkDirectory *operator->() const noexcept{
-		assert(directory != nullptr);
-
-		return directory;
-	}
-};
+#include <cstdint>
+#include <optional>
+#include <string>
 
 /**
  * The result struct for #Walk, passed to #WalkHandler.
@@ -147,14 +48,31 @@ struct WalkResult {
 	 * the top.  This is where we collect files that were just
 	 * scanned.  At the end of the scan, all files that remain in
 	 * this list will be deleted.
+	 *
+	 * This lives in its own memory mapping which is populated only
+	 * as far as the heap grows; a small cull occupies only a few
+	 * pages.
+	 */
+	PageVector<File> files{MAX_FILES};
+
+	/**
+	 * The maximum number of #files; it may be lowered under
+	 * memory pressure (see SetCapacity()).
 	 */
-	StaticVector<File, MAX_FILES> files;
+	std::size_t capacity = MAX_FILES;
 
 	/**
 	 * The total size of all #files [bytes].
 	 */
 	uint_least64_t total_bytes = 0;
 
+	/**
+	 * If Walk::EnableHistogram() was called, then this is the
+	 * histogram of all files that were found (and #files is
+	 * empty).
+	 */
+	std::optional<WalkHistogram> histogram;
+
 	/**
 	 * Pop the most recently accessed file from the heap.
 	 */
@@ -173,7 +91,7 @@ struct WalkResult {
 	 */
 	[[nodiscard]]
 	bool PreparePush(FileTime new_time) noexcept {
-		if (files.full()) {
+		if (files.size() >= capacity) {
 			if (new_time >= files.front().time)
 				return false;
 
@@ -183,6 +101,42 @@ struct WalkResult {
 		return true;
 	}
 
+	/**
+	 * Change the maximum number of #files.  If the heap is
+	 * larger, the most recently accessed files are evicted and
+	 * their memory is returned to the kernel.
+	 */
+	void SetCapacity(std::size_t _capacity) noexcept {
+		assert(_capacity > 0);
+
+		capacity = std::min(_capacity, files.max_size());
+
+		if (files.size() <= capacity)
+			return;
+
+		while (files.size() > capacity)
+			Pop();
+
+		files.ShrinkToFit();
+	}
+
+	/**
+	 * Remove all files matching the given predicate from the
+	 * heap.
+	 */
+	template<typename P>
+	void RemoveIf(P &&p) noexcept {
+		const auto end = std::remove_if(files.begin(), files.end(), p);
+		while (files.end() != end)
+			files.pop_back();
+
+		std::make_heap(files.begin(), files.end());
+
+		total_bytes = 0;
+		for (const auto &i : files)
+			total_bytes += i.size;
+	}
+
 	/**
 	 * Construct a file in-place on the heap.
 	 */
@@ -0,0 +1,320 @@
+// SPDX-License-Identifier: BSD-2-Clause OR GPL-2.0-or-later
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#include "WTrace.hxx"
+#include "WDirectory.hxx"
+#include "Hash.hxx"
+#include "lib/fmt/ExceptionFormatter.hxx"
+#include "io/DirectoryReader.hxx"
+#include "io/Open.hxx"
+
+#include <fmt/core.h>
+
+#include <algorithm> // for std::sort()
+#include <cassert>
+#include <condition_variable>
+#include <deque>
+#include <functional> // for std::greater
+#include <mutex>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility> // for std::exchange()
+
+#include <errno.h>
+#include <stdlib.h> // for strtoull()
+#include <string.h> // for strcmp(), strerror()
+#include <unistd.h> // for unlinkat()
+
+static constexpr uint_least32_t TRACE_MAGIC = 0x63777431; // "cwt1"
+
+/**
+ * The number of 64 bit words per #WalkTraceRecord.
+ */
+static constexpr std::size_t RECORD_WORDS = 4;
+
+/**
+ * The number of words in one chunk passed to the thread (8192
+ * records).
+ */
+static constexpr std::size_t CHUNK_WORDS = 8192 * RECORD_WORDS;
+
+/**
+ * Discard the trace if the thread falls behind by more than this
+ * number of chunks (8 MiB).
+ */
+static constexpr std::size_t MAX_PENDING_CHUNKS = 32;
+
+struct WalkTraceWriter::Shared {
+	std::mutex mutex;
+	std::condition_variable cond;
+
+	/**
+	 * Chunks submitted to the thread.  Protected by #mutex.
+	 */
+	std::deque<std::vector<uint_least64_t>> chunks;
+
+	enum class State {
+		RUNNING,
+
+		/**
+		 * Write the remaining #chunks and replace the
+		 * trace file.
+		 */
+		COMMIT,
+
+		/**
+		 * Discard everything.
+		 */
+		ABORT,
+	} state = State::RUNNING;
+
+	/**
+	 * Has the thread exited?  Protected by #mutex.
+	 */
+	bool done = false;
+
+	/**
+	 * Was the trace committed successfully?  Protected by
+	 * #mutex.
+	 */
+	bool committed = false;
+
+	/**
+	 * The write error which has stopped the thread (before
+	 * Commit()).  Protected by #mutex.
+	 */
+	std::exception_ptr error;
+
+	/**
+	 * See SetRetention().  Protected by #mutex.
+	 */
+	std::string retention_directory;
+	std::size_t retention_keep = 0;
+
+	/**
+	 * Only used by the thread after the constructor.
+	 */
+	SnapshotWriter writer;
+
+	const std::string path;
+
+	explicit Shared(std::string_view _path)
+		:writer(_path), path(_path) {}
+
+	void Run() noexcept;
+
+private:
+	void Write(const std::vector<uint_least64_t> &chunk) {
+		for (const auto i : chunk)
+			writer.WriteU64(i);
+	}
+};
+
+inline void
+WalkTraceWriter::Shared::Run() noexcept
+{
+	std::unique_lock lock{mutex};
+
+	try {
+		while (true) {
+			cond.wait(lock, [this]{
+				return !chunks.empty() || state != State::RUNNING;
+			});
+
+			if (state == State::ABORT)
+				break;
+
+			if (chunks.empty()) {
+				assert(state == State::COMMIT);
+
+				const std::string directory = retention_directory;
+				const std::size_t keep = retention_keep;
+				lock.unlock();
+
+				/* no fsync(); losing a trace in a
+				   crash is harmless */
+				writer.Commit(false);
+
+				if (!directory.empty())
+					DeleteOldTraces(directory.c_str(), keep);
+
+				lock.lock();
+				committed = true;
+				break;
+			}
+
+			const auto chunk = std::move(chunks.front());
+			chunks.pop_front();
+
+			lock.unlock();
+			Write(chunk);
+			lock.lock();
+		}
+	} catch (...) {
+		if (!lock.owns_lock())
+			lock.lock();
+
+		if (state == State::COMMIT)
+			/* nobody will look at #error */
+			fmt::print(stderr, "Failed to save walk trace {:?}: {}\n",
+				   path, std::current_exception());
+		else
+			error = std::current_exception();
+	}
+
+	chunks.clear();
+	done = true;
+	cond.notify_all();
+
+	/* the #SnapshotWriter deletes the uncommitted temporary
+	   file when the last reference to this object is
+	   released */
+}
+
+WalkTraceWriter::WalkTraceWriter(std::string_view path, FileTime now)
+	:shared(std::make_shared<Shared>(path))
+{
+	shared->writer.WriteU32(TRACE_MAGIC);
+	shared->writer.WriteU64(now.count());
+
+	chunk.reserve(CHUNK_WORDS);
+
+	std::thread{[s = shared]{ s->Run(); }}.detach();
+}
+
+WalkTraceWriter::~WalkTraceWriter() noexcept
+{
+	const std::scoped_lock lock{shared->mutex};
+	if (shared->state == Shared::State::RUNNING) {
+		shared->state = Shared::State::ABORT;
+		shared->cond.notify_all();
+	}
+}
+
+void
+WalkTraceWriter::SetRetention(std::string_view directory, std::size_t keep) noexcept
+{
+	const std::scoped_lock lock{shared->mutex};
+	shared->retention_directory = directory;
+	shared->retention_keep = keep;
+}
+
+void
+WalkTraceWriter::Submit()
+{
+	const std::scoped_lock lock{shared->mutex};
+
+	if (shared->error)
+		std::rethrow_exception(shared->error);
+
+	if (shared->chunks.size() >= MAX_PENDING_CHUNKS) {
+		shared->state = Shared::State::ABORT;
+		shared->cond.notify_all();
+		throw std::runtime_error{"Trace writer is too slow"};
+	}
+
+	shared->chunks.emplace_back(std::exchange(chunk, {}));
+	shared->cond.notify_all();
+
+	chunk.reserve(CHUNK_WORDS);
+}
+
+void
+WalkTraceWriter::Add(const WalkDirectory &parent, std::string_view name,
+		     FileTime atime, uint_least64_t size)
+try {
+	chunk.push_back(parent.path_hash);
+	chunk.push_back(FNV1aHash(name));
+	chunk.push_back(atime.count());
+	chunk.push_back(size);
+
+	if (chunk.size() >= CHUNK_WORDS)
+		Submit();
+} catch (...) {
+	failed = true;
+	throw;
+}
+
+void
+WalkTraceWriter::Commit() noexcept
+{
+	assert(!failed);
+
+	const std::scoped_lock lock{shared->mutex};
+
+	if (shared->error) {
+		fmt::print(stderr, "Failed to save walk trace {:?}: {}\n",
+			   shared->path, shared->error);
+		return;
+	}
+
+	if (!chunk.empty())
+		shared->chunks.emplace_back(std::move(chunk));
+
+	shared->state = Shared::State::COMMIT;
+	shared->cond.notify_all();
+}
+
+bool
+WalkTraceWriter::Wait() noexcept
+{
+	std::unique_lock lock{shared->mutex};
+	shared->cond.wait(lock, [this]{ return shared->done; });
+	return shared->committed;
+}
+
+void
+DeleteOldTraces(const char *directory, std::size_t keep) noexcept
+try {
+	DirectoryReader r{OpenDirectory(directory)};
+
+	std::vector<uint_least64_t> times;
+	while (const char *name = r.Read()) {
+		char *endptr;
+		const auto t = strtoull(name, &endptr, 10);
+		if (endptr != name && strcmp(endptr, ".trace") == 0)
+			times.push_back(t);
+	}
+
+	if (times.size() <= keep)
+		return;
+
+	/* the newest ones first */
+	std::sort(times.begin(), times.end(), std::greater{});
+
+	for (const auto t : std::span{times}.subspan(keep)) {
+		const auto name = fmt::format("{}.trace", t);
+		if (unlinkat(r.GetFileDescriptor().Get(), name.c_str(), 0) < 0 &&
+		    errno != ENOENT)
+			fmt::print(stderr, "Failed to delete walk trace {:?}: {}\n",
+				   name, strerror(errno));
+	}
+} catch (...) {
+	fmt::print(stderr, "Failed to delete old walk traces: {}\n",
+		   std::current_exception());
+}
+
+WalkTraceReader::WalkTraceReader(const char *path)
+	:reader(path)
+{
+	if (reader.ReadU32() != TRACE_MAGIC)
+		throw std::runtime_error{"Not a walk trace"};
+
+	time = FileTime{static_cast<time_t>(reader.ReadU64())};
+}
+
+bool
+WalkTraceReader::Read(WalkTraceRecord &record)
+{
+	if (reader.IsEnd())
+		return false;
+
+	record.directory = reader.ReadU64();
+	record.name = reader.ReadU64();
+	record.atime = FileTime{static_cast<time_t>(reader.ReadU64())};
+	record.size = reader.ReadU64();
+	return true;
+}
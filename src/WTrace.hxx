@@ -0,0 +1,142 @@
+// SPDX-License-Identifier: BSD-2-Clause OR GPL-2.0-or-later
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#pragma once
+
+#include "Snapshot.hxx"
+#include "WHistogram.hxx" // for FileTime
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string_view>
+#include <vector>
+
+struct WalkDirectory;
+
+/**
+ * One file seen by a #Walk.  Directory and file names are stored
+ * only as hashes; together, they identify the file across traces.
+ */
+struct WalkTraceRecord {
+	uint_least64_t directory, name;
+
+	FileTime atime;
+
+	uint_least64_t size;
+};
+
+/**
+ * Writes a compact binary trace of all files seen by a #Walk (see
+ * Walk::SetTrace()), to be replayed by the "SimulateCull" program.
+ *
+ * Records are collected in chunks which are written by a separate
+ * thread, so disk writes never block the #EventLoop.  If the thread
+ * falls too far behind, the trace is discarded.
+ */
+class WalkTraceWriter {
+	struct Shared;
+	std::shared_ptr<Shared> shared;
+
+	/**
+	 * Records which have not yet been passed to the thread.
+	 */
+	std::vector<uint_least64_t> chunk;
+
+	/**
+	 * Has Add() failed?  Then the trace is incomplete and must not
+	 * be committed.
+	 */
+	bool failed = false;
+
+public:
+	/**
+	 * Throws on error.
+	 *
+	 * @param now the time of the walk
+	 */
+	WalkTraceWriter(std::string_view path, FileTime now);
+
+	/**
+	 * Discards the trace unless Commit() has been called.  This
+	 * does not wait for the thread.
+	 */
+	~WalkTraceWriter() noexcept;
+
+	WalkTraceWriter(const WalkTraceWriter &) = delete;
+	WalkTraceWriter &operator=(const WalkTraceWriter &) = delete;
+
+	/**
+	 * After the trace has been committed, delete all but the
+	 * newest #keep traces in the given directory (see
+	 * DeleteOldTraces()).  Must be called before Commit().
+	 */
+	void SetRetention(std::string_view directory, std::size_t keep) noexcept;
+
+	/**
+	 * Throws on error (including an earlier error in the
+	 * thread); after that, the trace is marked as failed (see
+	 * IsFailed()).
+	 */
+	void Add(const WalkDirectory &parent, std::string_view name,
+		 FileTime atime, uint_least64_t size);
+
+	bool IsFailed() const noexcept {
+		return failed;
+	}
+
+	/**
+	 * Let the thread flush and replace the old trace file.  This
+	 * does not wait for the thread; errors are logged by it.
+	 * Must not be called if IsFailed().
+	 */
+	void Commit() noexcept;
+
+	/**
+	 * Wait until the thread has finished (after Commit()).
+	 * Returns true if the trace was committed successfully.
+	 * This blocks; it is meant for tools and tests.
+	 */
+	bool Wait() noexcept;
+
+private:
+	/**
+	 * Pass #chunk to the thread.
+	 */
+	void Submit();
+};
+
+/**
+ * Delete all but the newest #keep trace files (named
+ * "TIMESTAMP.trace") in the given directory.  Other files are
+ * ignored.  Errors are logged.
+ */
+void
+DeleteOldTraces(const char *directory, std::size_t keep) noexcept;
+
+/**
+ * Reads a trace file written by #WalkTraceWriter.  All methods throw
+ * on error.
+ */
+class WalkTraceReader {
+	SnapshotReader reader;
+
+	FileTime time;
+
+public:
+	explicit WalkTraceReader(const char *path);
+
+	/**
+	 * The time of the walk.
+	 */
+	FileTime GetTime() const noexcept {
+		return time;
+	}
+
+	/**
+	 * Read the next record.  Returns false at the end of the
+	 * file.
+	 */
+	bool Read(WalkTraceRecord &record);
+};
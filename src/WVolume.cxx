@@ -0,0 +1,266 @@
+// SPDX-License-Identifier: BSD-2-Clause OR GPL-2.0-or-later
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#include "WVolume.hxx"
+#include "WConfig.hxx"
+
+#include <fmt/core.h>
+
+#include <algorithm> // for std::sort_heap()
+#include <functional> // for std::greater
+#include <queue>
+#include <vector>
+
+WalkVolume::WalkVolume(WalkDirectory &_directory,
+		       const VolumeShare *share) noexcept
+	:directory(_directory)
+{
+	if (share != nullptr) {
+		weight = std::max(share->weight, 1U);
+		min_share = share->min_share;
+	}
+}
+
+void
+WalkVolume::Add(WalkDirectory &parent, std::string &&name,
+		FileTime atime, uint_least64_t size,
+		uint_least64_t collect_files, uint_least64_t collect_bytes) noexcept
+{
+	++total_files;
+	total_bytes += size;
+
+	if (!result.PreparePush(atime))
+		return;
+
+	result.Emplace(parent, std::move(name), atime, size);
+
+	while (result.files.size() > collect_files && result.total_bytes > collect_bytes)
+		result.Pop();
+}
+
+namespace {
+
+/**
+ * The global cull target, following the semantics of
+ * Walk::AddFile(): the oldest files are selected as long as the
+ * selection does not exceed both the file and the byte limit.
+ */
+struct CullTarget {
+	const uint_least64_t files, bytes;
+
+	uint_least64_t selected_files = 0, selected_bytes = 0;
+
+	[[gnu::pure]]
+	bool CanTake(uint_least64_t size) const noexcept {
+		return selected_files < files || selected_bytes + size <= bytes;
+	}
+
+	void Take(uint_least64_t size) noexcept {
+		++selected_files;
+		selected_bytes += size;
+	}
+};
+
+/**
+ * The selection state of one #WalkVolume.
+ */
+struct VolumeSelection {
+	WalkVolume &volume;
+
+	/**
+	 * The candidates, oldest first.
+	 */
+	PageVector<WalkResult::File> &files;
+
+	/**
+	 * Culling must leave at least this number of bytes in the
+	 * volume.
+	 */
+	const uint_least64_t floor;
+
+	/**
+	 * Index of the next candidate in #files.
+	 */
+	std::size_t next = 0;
+
+	uint_least64_t selected_files = 0, selected_bytes = 0;
+
+	/**
+	 * The number of bytes a plain global LRU selection would
+	 * cull from this volume.
+	 */
+	uint_least64_t lru_bytes = 0;
+
+	VolumeSelection(WalkVolume &_volume, uint_least64_t _floor) noexcept
+		:volume(_volume), files(volume.result.files), floor(_floor)
+	{
+		std::sort_heap(files.begin(), files.end());
+	}
+
+	[[gnu::pure]]
+	bool HasNext() const noexcept {
+		return next < files.size() &&
+			volume.total_bytes - selected_bytes >= floor + files[next].size;
+	}
+
+	const WalkResult::File &Peek() const noexcept {
+		assert(next < files.size());
+
+		return files[next];
+	}
+
+	/**
+	 * The time by which candidates of different volumes are
+	 * compared: the file's age divided by the volume weight.
+	 */
+	[[gnu::pure]]
+	FileTime GetWeightedTime(FileTime now) const noexcept {
+		const FileTime time = Peek().time;
+		if (time >= now)
+			return time;
+
+		return now - (now - time) / volume.weight;
+	}
+
+	void Take(CullTarget &target, WalkResult &dest) noexcept {
+		auto &file = files[next++];
+
+		++selected_files;
+		selected_bytes += file.size;
+		target.Take(file.size);
+
+		dest.Emplace(*file.parent, std::move(file.name), file.time, file.size);
+	}
+};
+
+using VolumeQueue = std::priority_queue<std::pair<FileTime, std::size_t>,
+					std::vector<std::pair<FileTime, std::size_t>>,
+					std::greater<>>;
+
+/**
+ * Calculate VolumeSelection::lru_bytes.
+ */
+static void
+SimulateLRU(std::span<VolumeSelection> selections,
+	    uint_least64_t cull_files, uint_least64_t cull_bytes) noexcept
+{
+	CullTarget target{cull_files, cull_bytes};
+	std::vector<std::size_t> position(selections.size(), 0);
+
+	VolumeQueue queue;
+	for (std::size_t i = 0; i < selections.size(); ++i)
+		if (!selections[i].files.empty())
+			queue.emplace(selections[i].files[0].time, i);
+
+	while (!queue.empty()) {
+		const std::size_t i = queue.top().second;
+		queue.pop();
+
+		auto &s = selections[i];
+		const auto &file = s.files[position[i]];
+		if (!target.CanTake(file.size))
+			break;
+
+		target.Take(file.size);
+		s.lru_bytes += file.size;
+
+		if (++position[i] < s.files.size())
+			queue.emplace(s.files[position[i]].time, i);
+	}
+}
+
+} // anonymous namespace
+
+void
+SelectFairShare(std::span<WalkVolume *const> volumes,
+		uint_least64_t cull_files, uint_least64_t cull_bytes,
+		FileTime now,
+		WalkResult &dest, std::string_view log_prefix) noexcept
+{
+	assert(dest.files.empty());
+
+	uint_least64_t total_bytes = 0, total_weight = 0;
+	for (const auto *volume : volumes) {
+		total_bytes += volume->total_bytes;
+		total_weight += volume->weight;
+	}
+
+	if (total_weight == 0)
+		return;
+
+	std::vector<VolumeSelection> selections;
+	selections.reserve(volumes.size());
+	for (auto *volume : volumes)
+		selections.emplace_back(*volume,
+					static_cast<uint_least64_t>(static_cast<long double>(total_bytes) * volume->min_share / 100));
+
+	SimulateLRU(selections, cull_files, cull_bytes);
+
+	CullTarget target{cull_files, cull_bytes};
+
+	/* phase 1: volumes exceeding their fair share of what
+	   remains after the cull give up their oldest files, in
+	   proportion to their excess */
+	const long double remaining = total_bytes > cull_bytes
+		? total_bytes - cull_bytes
+		: 0;
+
+	std::vector<long double> excess;
+	excess.reserve(selections.size());
+	long double total_excess = 0;
+	for (const auto &s : selections) {
+		const long double fair = remaining * s.volume.weight / total_weight;
+		const long double e = s.volume.total_bytes > fair
+			? s.volume.total_bytes - fair
+			: 0;
+		excess.push_back(e);
+		total_excess += e;
+	}
+
+	if (total_excess > 0) {
+		const long double phase1 = std::min<long double>(cull_bytes, total_excess);
+
+		for (std::size_t i = 0; i < selections.size(); ++i) {
+			auto &s = selections[i];
+			const auto quota = static_cast<uint_least64_t>(phase1 * excess[i] / total_excess);
+
+			while (s.selected_bytes < quota && s.HasNext() &&
+			       target.CanTake(s.Peek().size) && !dest.files.full())
+				s.Take(target, dest);
+		}
+	}
+
+	/* phase 2: select the rest from all volumes, oldest
+	   (weighted) first */
+	VolumeQueue queue;
+	for (std::size_t i = 0; i < selections.size(); ++i)
+		if (selections[i].HasNext())
+			queue.emplace(selections[i].GetWeightedTime(now), i);
+
+	while (!queue.empty() && !dest.files.full()) {
+		const std::size_t i = queue.top().second;
+		queue.pop();
+
+		auto &s = selections[i];
+		if (!target.CanTake(s.Peek().size))
+			break;
+
+		s.Take(target, dest);
+
+		if (s.HasNext())
+			queue.emplace(s.GetWeightedTime(now), i);
+	}
+
+	for (const auto &s : selections) {
+		const auto protected_bytes = s.lru_bytes > s.selected_bytes
+			? s.lru_bytes - s.selected_bytes
+			: 0;
+
+		fmt::print(stderr, "{}: volume {:?}: {} files, {} bytes; cull {} files, {} bytes; protected {} bytes\n",
+			   log_prefix, s.volume.directory->name,
+			   s.volume.total_files, s.volume.total_bytes,
+			   s.selected_files, s.selected_bytes,
+			   protected_bytes);
+	}
+}
@@ -0,0 +1,88 @@
+// SPDX-License-Identifier: BSD-2-Clause OR GPL-2.0-or-later
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#pragma once
+
+#include "WDirectory.hxx"
+#include "WResult.hxx"
+
+#include <cstdint>
+#include <span>
+#include <string_view>
+
+struct VolumeShare;
+
+/**
+ * The cull candidates of one fscache volume (a directory directly
+ * below the cache root) for the fair-share selection (see
+ * WalkConfig::fair_share).
+ */
+struct WalkVolume {
+	/**
+	 * The volume directory (or the root directory for files
+	 * which are not inside a volume).
+	 */
+	WalkDirectoryRef directory;
+
+	/**
+	 * The oldest files of this volume, bounded by the same cull
+	 * target as the global #WalkResult; its capacity is this
+	 * volume's (weighted) share of Walk::SetMaxCandidates().
+	 */
+	WalkResult result;
+
+	/**
+	 * All files of this volume which were seen by the #Walk.
+	 */
+	uint_least64_t total_files = 0, total_bytes = 0;
+
+	/**
+	 * See VolumeShare::weight.
+	 */
+	unsigned weight = 1;
+
+	/**
+	 * See VolumeShare::min_share.
+	 */
+	unsigned min_share = 0;
+
+	WalkVolume(WalkDirectory &_directory,
+		   const VolumeShare *share) noexcept;
+
+	WalkVolume(const WalkVolume &) = delete;
+	WalkVolume &operator=(const WalkVolume &) = delete;
+
+	/**
+	 * Add a file to #result, following the semantics of
+	 * Walk::AddFile().
+	 */
+	void Add(WalkDirectory &parent, std::string &&name,
+		 FileTime atime, uint_least64_t size,
+		 uint_least64_t collect_files, uint_least64_t collect_bytes) noexcept;
+};
+
+/**
+ * Select files to be culled from all volumes and move them to the
+ * given (empty) #WalkResult.
+ *
+ * Each volume has a fair share of the bytes remaining after the
+ * cull, proportional to its weight.  First, volumes which exceed
+ * their fair share give up their oldest files, in proportion to
+ * their excess.  The rest is selected from all volumes, oldest
+ * (scaled by weight) first.  No volume is culled below its
+ * minimum share.
+ *
+ * The per-volume results are logged, including the number of bytes
+ * protected compared to a plain global LRU selection.
+ *
+ * @param volumes the volumes; their #WalkVolume::result heaps are
+ * consumed
+ * @param now the current time (for weighting file ages)
+ * @param log_prefix the prefix of log messages, e.g. "Cull [disk1]"
+ */
+void
+SelectFairShare(std::span<WalkVolume *const> volumes,
+		uint_least64_t cull_files, uint_least64_t cull_bytes,
+		FileTime now,
+		WalkResult &dest, std::string_view log_prefix) noexcept;
@@ -4,6 +4,14 @@
 
 #include "Walk.hxx"
 #include "WHandler.hxx"
+#include "Tracker.hxx"
+#include "WTrace.hxx"
+#include "Frequency.hxx"
+#include "Probe.hxx"
+#include "Dirent.hxx"
+#include "BulkstatThread.hxx"
+#include "CoStatx.hxx"
+#include "event/Loop.hxx"
 #include "lib/fmt/ExceptionFormatter.hxx"
 #include "io/DirectoryReader.hxx"
 #include "io/FileAt.hxx"
@@ -11,30 +19,80 @@
 #include "io/uring/CoOperation.hxx"
 #include "co/InvokeTask.hxx"
 #include "co/Task.hxx"
+#include "system/Error.hxx"
 #include "util/DeleteDisposer.hxx"
 
+#include <algorithm> // for std::max()
+#include <cassert>
+#include <cerrno>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
 #include <fcntl.h> // for O_DIRECTORY
 #include <time.h> // for time()
 
 #include <fmt/core.h> // TODO
 
 /**
- * Limit on the number of concurrent statx() system calls.  Scanning
- * new directories is suspended until we're below #RESUME_STAT.
+ * Resume submitting new statx() system calls when the number of
+ * pending calls goes below #max_stat divided by this number.
  */
-static constexpr std::size_t MAX_STAT = 16 * 1024;
+static constexpr std::size_t RESUME_STAT_DIVISOR = 4;
 
 /**
- * Resume submitting new statx() system calls when the number of
- * pending calls goes below this number.
+ * Calculate Walk::resume_stat_threshold.  It is zero only if the
+ * #Walk is paused; otherwise, a small limit would round it down to
+ * zero, and coroutines waiting for Walk::resume_stat would never be
+ * resumed.
+ */
+static constexpr std::size_t
+CalcResumeStatThreshold(std::size_t max_stat) noexcept
+{
+	if (max_stat == 0)
+		/* paused until SetMaxStat() raises the limit */
+		return 0;
+
+	return std::max<std::size_t>(max_stat / RESUME_STAT_DIVISOR, 1);
+}
+
+/**
+ * Yield to the #EventLoop after scanning this number of directory
+ * entries in one #EventLoop iteration.  This (together with
+ * #SLICE_DURATION) puts an upper bound on the time the walk blocks
+ * other events (e.g. the systemd watchdog or /dev/cachefiles).
+ */
+static constexpr std::size_t SLICE_ENTRIES = 4096;
+
+/**
+ * Yield to the #EventLoop after scanning for this duration in one
+ * #EventLoop iteration.
+ */
+static constexpr Event::Duration SLICE_DURATION = std::chrono::milliseconds{10};
+
+/**
+ * Check the clock only after this number of directory entries.
+ */
+static constexpr std::size_t SLICE_CHECK_INTERVAL = 64;
+
+/**
+ * Record completed subtrees (see WalkCheckpoint::completed) down to
+ * this depth.  In the cachefiles layout, this is the volume and the
+ * fan-out directory.
  */
-static constexpr std::size_t RESUME_STAT = 4 * 1024;
+static constexpr std::size_t CHECKPOINT_DEPTH = 2;
 
 /**
- * While walking the filesystem, discard all files that were accessed
- * at least this time ago.
+ * Undo the StartStat() increment of WalkDirectory::n_entries for an
+ * entry which will never be culled.
  */
-static constexpr FileTime DISCARD_OLDER_THAN = std::chrono::hours{120 * 24};
+static void
+ForgetEntry(WalkDirectory &directory) noexcept
+{
+	assert(directory.n_entries > 0);
+
+	--directory.n_entries;
+}
 
 class Walk::StatItem : public IntrusiveListHook<> {
 	Walk &walk;
@@ -45,6 +103,12 @@ class Walk::StatItem : public IntrusiveListHook<> {
 
 	Co::InvokeTask invoke_task;
 
+	/**
+	 * Has statx() failed?  (Those errors are not reported as an
+	 * exception, see CoStatx().)
+	 */
+	bool failed = false;
+
 public:
 	[[nodiscard]]
 	StatItem(Walk &_walk, WalkDirectory &_directory, const char *_name) noexcept
@@ -55,45 +119,111 @@ public:
 		invoke_task.Start(BIND_THIS_METHOD(OnCompletion));
 	}
 
+	WalkDirectory &GetDirectory() const noexcept {
+		return *directory;
+	}
+
 private:
 	[[nodiscard]]
 	Co::InvokeTask Run(Uring::Queue &uring);
 
+	/**
+	 * @return 0 on success or an errno value
+	 */
+	[[nodiscard]]
+	Co::Task<int> CoStatx(Uring::Queue &uring, struct statx &stx);
+
 	void OnCompletion(std::exception_ptr &&error) noexcept {
+		CASH_PROBE(statx_complete, this, failed || error != nullptr);
+
 		if (error)
-			fmt::print(stderr, "Stat error: {}\n", std::move(error)); // TODO handle properly
+			walk.errors.Add("Stat error", std::move(error),
+					walk.event_loop.SteadyNow());
 
 		walk.OnStatCompletion(*this);
 	}
 };
 
+inline Co::Task<int>
+Walk::StatItem::CoStatx(Uring::Queue &uring_, struct statx &stx)
+{
+	/* keep the directory's file descriptor open while the statx()
+	   is in flight */
+	const WalkDirectoryPin pin{*directory};
+	if (!pin)
+		co_return errno;
+
+	CASH_PROBE(statx_submit, this, name.c_str());
+
+	Uring::CoTryStatx op{
+		uring_, pin.GetFileDescriptor(), name.c_str(),
+		AT_NO_AUTOMOUNT|AT_SYMLINK_NOFOLLOW|AT_STATX_DONT_SYNC,
+		STATX_TYPE|STATX_ATIME|STATX_MTIME|STATX_BLOCKS,
+	};
+
+	if (const int result = co_await op; result < 0)
+		co_return -result;
+
+	stx = op.GetResult();
+	co_return 0;
+}
+
 inline Co::InvokeTask
 Walk::StatItem::Run(Uring::Queue &uring_)
 {
-	const auto stx = co_await Uring::CoStatx(uring_, directory->fd, name.c_str(),
-						 AT_NO_AUTOMOUNT|AT_SYMLINK_NOFOLLOW|AT_STATX_DONT_SYNC,
-						 STATX_TYPE|STATX_ATIME|STATX_BLOCKS);
+	struct statx stx;
+	if (const int e = co_await CoStatx(uring_, stx); e != 0) {
+		/* no exception here: files vanishing during the walk
+		   are common, and this is the hot path */
+		failed = true;
+		walk.errors.AddErrno("Stat error", e, walk.event_loop.SteadyNow());
+
+		if (e == ENOENT || e == ESTALE)
+			/* it has vanished; don't let it keep the
+			   directory from being pruned */
+			ForgetEntry(*directory);
+
+		co_return;
+	}
+
 	if (S_ISDIR(stx.stx_mode)) {
+		if (walk.IsCompleted(*directory, name))
+			/* already scanned before the checkpoint */
+			co_return;
+
 		/* before we scan another directory, make sure our
 		   "stat" list isn't over-full (to put a cap on our
 		   memory usage) */
-		while (walk.stat.size() > MAX_STAT)
+		while (walk.stat.size() > walk.max_stat)
 			co_await walk.resume_stat;
 
-		co_await walk.AddDirectory(*directory, std::move(name));
+		DirectoryTime mtime{};
+		if (stx.stx_mask & STATX_MTIME)
+			mtime = {stx.stx_mtime.tv_sec, stx.stx_mtime.tv_nsec};
+
+		co_await walk.AddDirectory(*directory, std::move(name), mtime);
 	} else if (S_ISREG(stx.stx_mode)) {
 		walk.AddFile(*directory, std::move(name), FileTime{stx.stx_atime.tv_sec},
 			     stx.stx_blocks * 512ULL);
+	} else {
+		/* never culled */
+		ForgetEntry(*directory);
 	}
 }
 
-Walk::Walk(Uring::Queue &_uring,
+Walk::Walk(EventLoop &_event_loop, Uring::Queue &_uring,
+	   const WalkConfig &_config,
 	   uint_least64_t _collect_files, std::size_t _collect_bytes,
 	   WalkHandler &_handler)
-	:uring(_uring),
+	:event_loop(_event_loop), uring(_uring),
 	 handler(_handler),
+	 config(_config),
+	 start_time(FileTime{time(nullptr)}),
+	 max_stat(_config.walk_queue_depth),
+	 resume_stat_threshold(CalcResumeStatThreshold(max_stat)),
+	 defer_resume_slice(_event_loop, BIND_THIS_METHOD(OnResumeSlice)),
 	 collect_files(_collect_files), collect_bytes(_collect_bytes),
-	 discard_older_than(FileTime{time(nullptr)} - DISCARD_OLDER_THAN)
+	 discard_older_than(start_time - DISCARD_OLDER_THAN)
 {
 }
 
@@ -102,29 +232,227 @@ Walk::~Walk() noexcept
 	stat.clear_and_dispose(DeleteDisposer{});
 }
 
+inline WalkDirectoryRef
+Walk::OpenRoot(FileDescriptor root_fd)
+{
+	return WalkDirectoryRef{WalkDirectoryRef::Adopt{}, *new WalkDirectory(uring, config.fd_budget, WalkDirectory::RootTag{}, OpenPath({root_fd, "."}, O_DIRECTORY))};
+}
+
+inline void
+Walk::StartRoot(WalkDirectoryRef &&root, FileDescriptor root_fd)
+{
+	if (config.bulkstat) {
+		use_bulkstat = IsXFS(root_fd);
+		if (!use_bulkstat)
+			fmt::print(stderr, "{}: not an XFS filesystem, bulkstat disabled\n",
+				   log_prefix);
+	}
+
+	root_scanning = true;
+	root_task = ScanRoot(std::move(root), OpenDirectory({root_fd, "."}));
+	root_task.Start(BIND_THIS_METHOD(OnRootScanned));
+}
+
 void
 Walk::Start(FileDescriptor root_fd)
 {
-	WalkDirectoryRef root{WalkDirectoryRef::Adopt{}, *new WalkDirectory(uring, WalkDirectory::RootTag{}, OpenPath({root_fd, "."}, O_DIRECTORY))};
-	ScanDirectory(*root, OpenDirectory({root_fd, "."}));
+	StartRoot(OpenRoot(root_fd), root_fd);
+}
 
-	if (stat.empty())
-		/* ScanDirectory() has left the "stat" list empty
-		   (because the given directory was empty), thus
-		   OnStatCompletion() will never be called and we have
-		   to invoke OnWalkFinished() from here */
-		handler.OnWalkFinished(std::move(result));
+inline void
+Walk::TrimResult() noexcept
+{
+	/* the new #Walk may collect less than the interrupted one */
+	while (result.files.size() > collect_files && result.total_bytes > collect_bytes)
+		result.Pop();
+}
+
+void
+Walk::Resume(FileDescriptor root_fd, WalkCheckpoint &&checkpoint)
+{
+	assert(!result.histogram);
+	assert(!checkpoint.result.histogram);
+
+	completed = std::move(checkpoint.completed);
+	result.files = std::move(checkpoint.result.files);
+	result.total_bytes = checkpoint.result.total_bytes;
+
+	TrimResult();
+	Start(root_fd);
+}
+
+/**
+ * Look up (or create) the #WalkDirectory with the specified path
+ * relative to the root.
+ */
+static WalkDirectory &
+MakeDirectory(std::unordered_map<std::string, WalkDirectoryRef> &directories,
+	      WalkDirectory &root, std::string_view path) noexcept
+{
+	if (path.empty())
+		return root;
+
+	if (auto i = directories.find(std::string{path}); i != directories.end())
+		return *i->second;
+
+	const auto slash = path.rfind('/');
+	WalkDirectory &parent = slash == path.npos
+		? root
+		: MakeDirectory(directories, root, path.substr(0, slash));
+
+	auto *directory = new WalkDirectory(parent, std::string{path.substr(slash + 1)},
+					    UniqueFileDescriptor{});
+	directories.emplace(std::string{path},
+			    WalkDirectoryRef{WalkDirectoryRef::Adopt{}, *directory});
+	return *directory;
+}
+
+void
+Walk::Resume(FileDescriptor root_fd, SavedWalkCheckpoint &&checkpoint)
+{
+	assert(!result.histogram);
+
+	auto root = OpenRoot(root_fd);
+
+	std::unordered_map<std::string, WalkDirectoryRef> directories;
+	std::vector<WalkDirectory *> indexed;
+	indexed.reserve(checkpoint.directories.size());
+	for (const auto &i : checkpoint.directories)
+		indexed.push_back(&MakeDirectory(directories, *root, i));
+
+	for (auto &i : checkpoint.files) {
+		if (!result.PreparePush(i.time))
+			continue;
+
+		/* the entry counts of recreated directories are
+		   incomplete, and they are never marked complete,
+		   so they are not pruned (see
+		   Cull::OnEntryRemoved()) */
+		WalkDirectory &directory = *indexed[i.directory];
+		++directory.n_entries;
+
+		result.Emplace(directory, std::move(i.name), i.time, i.size);
+	}
+
+	/* the #WalkResult holds references to all directories which
+	   are still needed */
+	directories.clear();
+	checkpoint.files.clear();
+
+	completed = std::move(checkpoint.completed);
+
+	TrimResult();
+	StartRoot(std::move(root), root_fd);
+}
+
+/**
+ * Does this file belong to a subtree which has been recorded in
+ * WalkCheckpoint::completed?  Deeper complete subtrees don't count,
+ * because the resumed #Walk will scan them again.
+ */
+[[gnu::pure]]
+static bool
+IsInCompleteSubtree(const WalkResult::File &file) noexcept
+{
+	std::size_t depth = 0;
+	for (const WalkDirectory *i = &*file.parent; i->parent != nullptr; i = i->parent)
+		++depth;
+
+	for (const WalkDirectory *i = &*file.parent; i->parent != nullptr; i = i->parent, --depth)
+		if (depth <= CHECKPOINT_DEPTH && i->complete)
+			return true;
+
+	return false;
+}
+
+WalkCheckpoint
+Walk::TakeCheckpoint() noexcept
+{
+	assert(!result.histogram);
+	assert(!config.fair_share);
+
+	checkpoint_taken = true;
+
+	/* files from incomplete subtrees will be found again when
+	   the checkpoint is resumed */
+	result.RemoveIf([](const File &file){
+		return !IsInCompleteSubtree(file);
+	});
+
+	return {std::move(completed), std::move(result)};
+}
+
+void
+Walk::SetMaxStat(std::size_t _max_stat) noexcept
+{
+	const bool grow = _max_stat > max_stat;
+
+	max_stat = _max_stat;
+	resume_stat_threshold = CalcResumeStatThreshold(max_stat);
+
+	if (grow)
+		resume_stat.ResumeAll();
+}
+
+void
+Walk::SetMaxCandidates(std::size_t _max_candidates) noexcept
+{
+	max_candidates = _max_candidates;
+	result.SetCapacity(max_candidates);
+	UpdateVolumeCapacities();
+}
+
+void
+Walk::EnableHistogram(FileTime resolution)
+{
+	result.histogram.emplace(discard_older_than, FileTime{time(nullptr)}, resolution);
+}
+
+void
+Walk::SetTimeWindow(FileTime older, FileTime newer) noexcept
+{
+	discard_older_than = std::max(discard_older_than, older);
+	ignore_newer_than = newer;
 }
 
 inline void
 Walk::AddFile(WalkDirectory &parent, std::string &&name,
 	      FileTime atime, uint_least64_t size)
 {
+	if (trace != nullptr) [[unlikely]] {
+		try {
+			trace->Add(parent, name, atime, size);
+		} catch (...) {
+			fmt::print(stderr, "{}: failed to write walk trace: {}\n",
+				   log_prefix, std::current_exception());
+			trace = nullptr;
+		}
+	}
+
+	if (frequency != nullptr)
+		/* from here on, frequently accessed files appear
+		   younger than they are */
+		atime = ApplyFrequency(parent, name, atime);
+
 	if (atime < discard_older_than) {
 		handler.OnWalkAncient(parent, std::move(name), size);
 		return;
 	}
 
+	if (atime >= ignore_newer_than)
+		return;
+
+	if (result.histogram) {
+		result.histogram->Add(atime, size);
+		return;
+	}
+
+	if (config.fair_share) {
+		GetVolume(parent).Add(parent, std::move(name), atime, size,
+				      collect_files, collect_bytes);
+		return;
+	}
+
 	if (!result.PreparePush(atime))
 		/* heap is full and this file is more recent than the
 		   newest on the heap - not a candidate */
@@ -136,6 +464,52 @@ Walk::AddFile(WalkDirectory &parent, std::string &&name,
 		result.Pop();
 }
 
+inline FileTime
+Walk::ApplyFrequency(const WalkDirectory &parent, std::string_view name,
+		     FileTime atime) noexcept
+{
+	const auto key = AccessSketch::MakeKey(parent, name);
+
+	if (update_frequency && atime >= frequency_since)
+		frequency->Increment(key);
+
+	return AccessSketch::Adjust(atime, frequency->Estimate(key), start_time);
+}
+
+inline WalkVolume &
+Walk::GetVolume(WalkDirectory &directory) noexcept
+{
+	/* the volume is the ancestor directly below the root */
+	WalkDirectory *v = &directory;
+	while (v->parent != nullptr && v->parent->parent != nullptr)
+		v = v->parent;
+
+	if (v == last_volume_directory) [[likely]]
+		return *last_volume;
+
+	const auto [i, inserted] = volumes.try_emplace(v, *v, config.FindVolume(v->name));
+	if (inserted) {
+		/* the new volume gets its share of the candidate
+		   limit, and the others' shares shrink */
+		total_weight += i->second.weight;
+		UpdateVolumeCapacities();
+	}
+
+	last_volume_directory = v;
+	last_volume = &i->second;
+	return i->second;
+}
+
+void
+Walk::UpdateVolumeCapacities() noexcept
+{
+	/* together, all volumes keep no more candidates than the
+	   global #result would; this also makes them subject to
+	   the memory governor */
+	for (auto &[directory, volume] : volumes)
+		volume.result.SetCapacity(std::max<std::size_t>(max_candidates * volume.weight / total_weight, 1));
+}
+
 [[gnu::pure]]
 static bool
 IsSpecialFilename(const char *s) noexcept
@@ -143,26 +517,240 @@ IsSpecialFilename(const char *s) noexcept
 	return s[0] == '.' && (s[1] == 0 || (s[1] == '.' && s[2] == 0));
 }
 
+inline bool
+Walk::ShouldYield() noexcept
+{
+	const auto loop_now = event_loop.SteadyNow();
+	if (loop_now != slice_loop_now) {
+		/* the EventLoop has been running since the last call -
+		   begin a new slice */
+		slice_loop_now = loop_now;
+		slice_entries = 0;
+	}
+
+	if (++slice_entries % SLICE_CHECK_INTERVAL != 0) [[likely]]
+		return false;
+
+	return slice_entries >= SLICE_ENTRIES ||
+		Event::Clock::now() - loop_now >= SLICE_DURATION;
+}
+
+inline void
+Walk::OnResumeSlice() noexcept
+{
+	resume_slice.ResumeAll();
+}
+
+inline Co::InvokeTask
+Walk::ScanRoot(WalkDirectoryRef root, UniqueFileDescriptor fd)
+{
+	if (use_bulkstat)
+		co_await CoBulkstat(fd);
+
+	co_await CoScanDirectory(*root, std::move(fd));
+}
+
 inline void
-Walk::ScanDirectory(WalkDirectory &directory, UniqueFileDescriptor &&fd)
+Walk::OnRootScanned(std::exception_ptr &&error) noexcept
 {
-	// TODO eliminate this method, use only CoScanDirectory
+	if (error)
+		fmt::print(stderr, "{}: failed to scan directory: {}\n",
+			   log_prefix, std::move(error));
 
-	DirectoryReader r{std::move(fd)};
-	while (const char *name = r.Read()) {
-		if (IsSpecialFilename(name))
-			continue;
+	root_scanning = false;
+
+	if (stat.empty())
+		/* all StatItems have completed already (or the root
+		   directory was empty), thus OnStatCompletion() will
+		   never be called again and we have to invoke
+		   OnWalkFinished() from here */
+		Finish();
+}
+
+/**
+ * Determine the path of a subdirectory for
+ * WalkCheckpoint::completed.  Returns an empty string if it is too
+ * deep.
+ */
+static std::string
+GetCheckpointPath(const WalkDirectory &parent, std::string_view name) noexcept
+{
+	std::size_t depth = 1;
+	for (const WalkDirectory *i = &parent; i->parent != nullptr; i = i->parent)
+		if (++depth > CHECKPOINT_DEPTH)
+			return {};
+
+	std::string path{name};
+	for (const WalkDirectory *i = &parent; i->parent != nullptr; i = i->parent)
+		path = i->name + '/' + path;
+
+	return path;
+}
+
+inline bool
+Walk::IsCompleted(const WalkDirectory &parent, std::string_view name) const noexcept
+{
+	if (completed.empty()) [[likely]]
+		return false;
+
+	const auto path = GetCheckpointPath(parent, name);
+	return !path.empty() && completed.contains(path);
+}
+
+void
+Walk::EndPending(WalkDirectory &directory) noexcept
+{
+	assert(directory.pending > 0);
+
+	if (--directory.pending > 0 || checkpoint_taken)
+		return;
+
+	if (directory.parent == nullptr)
+		/* the root directory is complete when the Walk
+		   finishes */
+		return;
+
+	directory.complete = true;
+
+	if (auto path = GetCheckpointPath(*directory.parent, directory.name);
+	    !path.empty())
+		completed.emplace(std::move(path));
+
+	handler.OnWalkDirectoryComplete(directory);
+
+	EndPending(*directory.parent);
+}
+
+inline void
+Walk::StartStat(WalkDirectory &directory, const char *name) noexcept
+{
+	++directory.pending;
+	++directory.n_entries;
+
+	auto *item = new StatItem(*this, directory, name);
+	stat.push_back(*item);
+	peak_stat = std::max(peak_stat, stat.size());
+
+	item->Start(uring);
+}
+
+inline Co::Task<void>
+Walk::CoBulkstat(FileDescriptor fd)
+{
+	bool failed = false;
+
+	try {
+		/* this runs in a separate thread, because
+		   XFS_IOC_BULKSTAT blocks on disk reads */
+		inodes = co_await CoBulkstatThread{event_loop, fd};
+	} catch (...) {
+		fmt::print(stderr, "{}: bulkstat failed: {}\n",
+			   log_prefix, std::current_exception());
+		failed = true;
+	}
+
+	if (failed) {
+		/* fall back to statx() */
+		use_bulkstat = false;
+		inodes.clear();
+	}
+}
+
+inline Co::Task<void>
+Walk::CoScanDirectoryBulk(WalkDirectory &directory, UniqueFileDescriptor &&fd,
+			  DirectoryListingBuilder *names)
+{
+	DirentReader r{fd};
+	while (const auto *entry = r.Read()) {
+		const char *const name = entry->d_name;
+
+		if (names != nullptr)
+			names->Add(name);
+
+		const InodeTable::Inode *inode = entry->d_type == DT_REG
+			? inodes.Find(entry->d_ino)
+			: nullptr;
+
+		if (inode != nullptr) {
+			/* no statx() needed */
+			++directory.n_entries;
+			AddFile(directory, name, inode->atime, inode->size);
+		} else {
+			while (stat.size() > max_stat) [[unlikely]]
+				co_await resume_stat;
+
+			StartStat(directory, name);
+		}
+
+		/* check the time slice for each entry, even if it
+		   was found in #inodes */
+		if (ShouldYield()) [[unlikely]] {
+			defer_resume_slice.ScheduleNext();
+			co_await resume_slice;
+		}
+	}
+}
+
+inline Co::Task<void>
+Walk::CoScanDirectorySorted(WalkDirectory &directory, UniqueFileDescriptor &&fd,
+			    DirectoryListingBuilder *names)
+{
+	std::vector<InodeName> entries;
+
+	{
+		DirentReader r{fd};
+		while (const auto *entry = r.Read()) {
+			entries.emplace_back(entry->d_ino, entry->d_name);
+
+			if (ShouldYield()) [[unlikely]] {
+				defer_resume_slice.ScheduleNext();
+				co_await resume_slice;
+			}
+		}
+	}
+
+	fd.Close();
+
+	SortByInode(entries);
+
+	if (names != nullptr)
+		/* the DirectoryTracker listing is stored in inode
+		   order, so CoScanListing() benefits as well */
+		names->Reserve(entries.size());
 
-		auto *item = new StatItem(*this, directory, name);
-		stat.push_back(*item);
+	for (auto &i : entries) {
+		while (stat.size() > max_stat) [[unlikely]]
+			co_await resume_stat;
+
+		StartStat(directory, i.name.c_str());
 
-		item->Start(uring);
+		if (names != nullptr)
+			names->Add(std::move(i.name));
+
+		if (ShouldYield()) [[unlikely]] {
+			defer_resume_slice.ScheduleNext();
+			co_await resume_slice;
+		}
 	}
 }
 
 inline Co::Task<void>
-Walk::CoScanDirectory(WalkDirectory &directory, UniqueFileDescriptor &&fd)
+Walk::CoScanDirectory(WalkDirectory &directory, UniqueFileDescriptor &&fd,
+		      DirectoryListingBuilder *names)
 {
+	/* count the file descriptor being read against the budget */
+	const WalkDirectoryFdLease fd_lease{directory};
+
+	if (use_bulkstat) {
+		co_await CoScanDirectoryBulk(directory, std::move(fd), names);
+		co_return;
+	}
+
+	if (config.inode_order) {
+		co_await CoScanDirectorySorted(directory, std::move(fd), names);
+		co_return;
+	}
+
 	DirectoryReader r{std::move(fd)};
 	while (const char *name = r.Read()) {
 		if (IsSpecialFilename(name))
@@ -170,39 +758,157 @@ Walk::CoScanDirectory(WalkDirectory &directory, UniqueFileDescriptor &&fd)
 
 		/* throttle if there are too many concurrent statx
                    system calls */
-		while (stat.size() > MAX_STAT) [[unlikely]]
+		while (stat.size() > max_stat) [[unlikely]]
 			co_await resume_stat;
 
-		auto *item = new StatItem(*this, directory, name);
-		stat.push_back(*item);
+		if (names != nullptr)
+			names->Add(name);
 
-		item->Start(uring);
+		StartStat(directory, name);
+
+		if (ShouldYield()) [[unlikely]] {
+			/* give other events a chance to be handled */
+			defer_resume_slice.ScheduleNext();
+			co_await resume_slice;
+		}
 	}
 }
 
 inline Co::Task<void>
-Walk::AddDirectory(WalkDirectory &parent, std::string &&name)
+Walk::CoScanListing(WalkDirectory &directory,
+		    std::shared_ptr<const std::vector<std::string>> names)
+{
+	for (const auto &name : *names) {
+		while (stat.size() > max_stat) [[unlikely]]
+			co_await resume_stat;
+
+		StartStat(directory, name.c_str());
+
+		if (ShouldYield()) [[unlikely]] {
+			defer_resume_slice.ScheduleNext();
+			co_await resume_slice;
+		}
+	}
+}
+
+/**
+ * Open a file relative to the given #WalkDirectory, keeping its
+ * O_PATH file descriptor pinned while the operation is in flight.
+ */
+static Co::Task<UniqueFileDescriptor>
+CoOpenAt(Uring::Queue &uring, WalkDirectory &directory, const char *name, int flags)
+{
+	const WalkDirectoryPin pin{directory};
+	if (!pin)
+		throw MakeErrno("Failed to reopen directory");
+
+	co_return co_await Uring::CoOpen(uring, pin.GetFileDescriptor(), name, flags, 0);
+}
+
+inline Co::Task<void>
+Walk::CoScanTracked(WalkDirectory &directory, DirectoryTime mtime)
+{
+	std::string key;
+	if (const WalkDirectoryPin pin{directory}; pin)
+		key = DirectoryTracker::GetKey(pin.GetFileDescriptor());
+
+	if (key.empty()) {
+		co_await CoScanDirectory(directory, co_await CoOpenAt(uring, directory, ".", O_DIRECTORY));
+		co_return;
+	}
+
+	if (auto listing = tracker->Lookup(key, mtime)) {
+		/* this directory has not been modified since the
+		   last walk - no need to read it again */
+		co_await CoScanListing(directory, std::move(listing));
+		co_return;
+	}
+
+	tracker->BeginScan(key);
+
+	DirectoryListingBuilder names;
+	co_await CoScanDirectory(directory, co_await CoOpenAt(uring, directory, ".", O_DIRECTORY),
+				 &names);
+
+	if (names.IsOverflow())
+		/* too large to be remembered */
+		tracker->AbortScan(key);
+	else
+		tracker->EndScan(key, mtime, names.Release());
+}
+
+inline Co::Task<void>
+Walk::AddDirectory(WalkDirectory &parent, std::string &&name,
+		   DirectoryTime mtime)
 try {
+	CASH_PROBE(directory_open, &parent, name.c_str());
+
+	auto path_fd = co_await CoOpenAt(uring, parent, name.c_str(), O_PATH|O_DIRECTORY);
+
 	WalkDirectoryRef directory{
 		WalkDirectoryRef::Adopt{},
-		*new WalkDirectory(uring, parent, co_await Uring::CoOpen(uring, parent.fd, name.c_str(), O_PATH|O_DIRECTORY, 0)),
+		*new WalkDirectory(parent, std::move(name), std::move(path_fd)),
 	};
 
-	co_await CoScanDirectory(*directory, co_await Uring::CoOpen(uring, directory->fd, ".", O_DIRECTORY, 0));
+	/* the new subtree is pending in the parent until it has
+	   been scanned completely */
+	++parent.pending;
+	directory->pending = 1;
+
+	CASH_PROBE(directory_scan_begin, &*directory, directory->name.c_str());
+
+	try {
+		if (tracker != nullptr && mtime != DirectoryTime{})
+			co_await CoScanTracked(*directory, mtime);
+		else
+			co_await CoScanDirectory(*directory, co_await CoOpenAt(uring, *directory, ".", O_DIRECTORY));
+	} catch (...) {
+		CASH_PROBE(directory_scan_end, &*directory, directory->n_entries, true);
+		EndPending(*directory);
+		throw;
+	}
+
+	CASH_PROBE(directory_scan_end, &*directory, directory->n_entries, false);
+	EndPending(*directory);
 } catch (...) {
-	fmt::print(stderr, "Failed to scan directory: {}\n", std::current_exception());
+	errors.Add("Failed to scan directory", std::current_exception(),
+		   event_loop.SteadyNow());
 }
 
 inline void
 Walk::OnStatCompletion(StatItem &item) noexcept
 {
-	const bool was_too_many_stat = stat.size() >= RESUME_STAT;
+	const bool was_too_many_stat = stat.size() >= resume_stat_threshold;
+
+	EndPending(item.GetDirectory());
 
 	stat.erase_and_dispose(stat.iterator_to(item), DeleteDisposer{});
 
-	if (was_too_many_stat && stat.size() < RESUME_STAT)
+	if (was_too_many_stat && stat.size() < resume_stat_threshold)
 		resume_stat.ResumeAll();
 
-	if (stat.empty())
-		handler.OnWalkFinished(std::move(result));
+	if (stat.empty() && !root_scanning)
+		Finish();
+}
+
+void
+Walk::Finish() noexcept
+{
+	if (!volumes.empty()) {
+		std::vector<WalkVolume *> v;
+		v.reserve(volumes.size());
+		for (auto &i : volumes)
+			v.push_back(&i.second);
+
+		SelectFairShare(v, collect_files, collect_bytes,
+				FileTime{time(nullptr)}, result, log_prefix);
+
+		last_volume_directory = nullptr;
+		last_volume = nullptr;
+		volumes.clear();
+	}
+
+	errors.LogSummary();
+
+	handler.OnWalkFinished(std::move(result));
 }
@@ -4,18 +4,38 @@
 
 #pragma once
 
+#include "WConfig.hxx"
+#include "Bulkstat.hxx"
+#include "WCheckpoint.hxx"
 #include "WResult.hxx"
+#include "WVolume.hxx"
+#include "WErrors.hxx"
+#include "event/Chrono.hxx"
+#include "event/DeferEvent.hxx"
+#include "co/InvokeTask.hxx"
 #include "co/MultiResume.hxx"
 #include "util/IntrusiveList.hxx"
 
 #include <cstdint>
+#include <exception>
+#include <memory>
 #include <string>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
 
+class EventLoop;
 class FileDescriptor;
 class UniqueFileDescriptor;
 namespace Uring { class Queue; }
 namespace Co { template <typename T> class Task; }
 class WalkHandler;
+class DirectoryTracker;
+class DirectoryListingBuilder;
+class WalkTraceWriter;
+class AccessSketch;
+struct DirectoryTime;
 
 /**
  * Walk a filesystem tree and collect files that have not been access
@@ -24,10 +44,60 @@ class WalkHandler;
  * asynchronously in the #EventLoop (using io_uring).
  */
 class Walk final {
+public:
+	/**
+	 * While walking the filesystem, discard all files that were
+	 * accessed at least this time ago.
+	 */
+	static constexpr FileTime DISCARD_OLDER_THAN = std::chrono::hours{120 * 24};
+
+private:
+	EventLoop &event_loop;
+
 	Uring::Queue &uring;
 
 	WalkHandler &handler;
 
+	const WalkConfig config;
+
+	/**
+	 * The prefix of log messages (see SetLogPrefix()).
+	 */
+	std::string_view log_prefix = "Walk";
+
+	/**
+	 * If set, then directory listings are looked up here (and
+	 * stored here) to avoid reading directories which have not
+	 * been modified since the last walk.
+	 */
+	DirectoryTracker *tracker = nullptr;
+
+	/**
+	 * If set, then all files are recorded here (see
+	 * SetTrace()).  Cleared after a write error.
+	 */
+	WalkTraceWriter *trace = nullptr;
+
+	/**
+	 * If set, then access times are adjusted by the estimated
+	 * access frequency (see SetFrequency()).
+	 */
+	AccessSketch *frequency = nullptr;
+
+	/**
+	 * Files accessed since this time are counted in #frequency
+	 * (only if #update_frequency is set).
+	 */
+	FileTime frequency_since;
+
+	/**
+	 * The time this walk was started (for
+	 * AccessSketch::Adjust()).
+	 */
+	const FileTime start_time;
+
+	bool update_frequency = false;
+
 	class StatItem;
 	IntrusiveList<StatItem, IntrusiveListBaseHookTraits<StatItem>, IntrusiveListOptions{.constant_time_size=true}> stat;
 
@@ -38,10 +108,114 @@ class Walk final {
 	 */
 	Co::MultiResume resume_stat;
 
+	/**
+	 * The current limit on the number of concurrent statx()
+	 * system calls (see SetMaxStat()).  Scanning new directories
+	 * is suspended until we're below #resume_stat_threshold.
+	 */
+	std::size_t max_stat;
+
+	/**
+	 * Resume submitting new statx() system calls when the number
+	 * of pending calls goes below this number.
+	 */
+	std::size_t resume_stat_threshold;
+
+	/**
+	 * The highest number of concurrent statx() system calls
+	 * observed so far (see GetPeakStat()).
+	 */
+	std::size_t peak_stat = 0;
+
+	/**
+	 * Coroutines which have used up the current time slice wait
+	 * here until #defer_resume_slice resumes them in the next
+	 * #EventLoop iteration.
+	 */
+	Co::MultiResume resume_slice;
+
+	DeferEvent defer_resume_slice;
+
+	/**
+	 * The EventLoop::SteadyNow() value of the current time slice.
+	 * If this differs from the current value, the #EventLoop has
+	 * been running in the meantime and a new slice begins.
+	 */
+	Event::TimePoint slice_loop_now;
+
+	/**
+	 * The number of directory entries scanned in the current time
+	 * slice.
+	 */
+	std::size_t slice_entries = 0;
+
+	/**
+	 * Scans the root directory.
+	 */
+	Co::InvokeTask root_task;
+
+	/**
+	 * Is #root_task still running?  As long as it is, the #Walk
+	 * is not finished, even if #stat is empty.
+	 */
+	bool root_scanning = false;
+
 	WalkResult result;
 
 	using File = WalkResult::File;
 
+	WalkErrors errors;
+
+	/**
+	 * Per-volume candidates (only if WalkConfig::fair_share is
+	 * enabled); they are merged into #result when the #Walk
+	 * finishes.
+	 */
+	std::unordered_map<const WalkDirectory *, WalkVolume> volumes;
+
+	/**
+	 * The sum of all WalkVolume::weight values in #volumes.
+	 */
+	uint_least64_t total_weight = 0;
+
+	/**
+	 * The limit passed to SetMaxCandidates().
+	 */
+	std::size_t max_candidates = WalkResult::MAX_FILES;
+
+	/**
+	 * The most recent GetVolume() result; most consecutive files
+	 * belong to the same volume.
+	 */
+	const WalkDirectory *last_volume_directory = nullptr;
+	WalkVolume *last_volume = nullptr;
+
+	/**
+	 * See WalkCheckpoint::completed.  While resuming, these
+	 * directories are skipped.
+	 */
+	std::unordered_set<std::string> completed;
+
+	/**
+	 * Metadata of all regular files, collected with
+	 * XFS_IOC_BULKSTAT before the root directory is scanned (see
+	 * WalkConfig::bulkstat).  Files found here are not passed to
+	 * statx().
+	 */
+	InodeTable inodes;
+
+	/**
+	 * Was WalkConfig::bulkstat enabled and is this an XFS
+	 * filesystem?
+	 */
+	bool use_bulkstat = false;
+
+	/**
+	 * Set by TakeCheckpoint(); from then on, completions are not
+	 * recorded anymore.
+	 */
+	bool checkpoint_taken = false;
+
 	/**
 	 * Collect this number of files.  May collect more than that
 	 * if #collect_bytes has not yet been reached.
@@ -58,24 +232,240 @@ class Walk final {
 	 * Cull all files which havn't been accessed before this time
 	 * stamp.
 	 */
-	const FileTime discard_older_than;
+	FileTime discard_older_than;
+
+	/**
+	 * Ignore all files which have been accessed after this time
+	 * stamp (see SetTimeWindow()).
+	 */
+	FileTime ignore_newer_than = FileTime::max();
 
 public:
 	[[nodiscard]]
-	Walk(Uring::Queue &_uring,
+	Walk(EventLoop &_event_loop, Uring::Queue &_uring,
+	     const WalkConfig &_config,
 	     std::size_t _collect_files, uint_least64_t _collect_bytes,
 	     WalkHandler &_handler);
 	~Walk() noexcept;
 
 	void Start(FileDescriptor root_fd);
 
+	/**
+	 * Like Start(), but resume from a checkpoint obtained by
+	 * TakeCheckpoint() from an earlier #Walk on the same tree
+	 * (with the same settings): subtrees which have been
+	 * scanned completely are skipped, and the files collected
+	 * from them are kept.
+	 */
+	void Resume(FileDescriptor root_fd, WalkCheckpoint &&checkpoint);
+
+	/**
+	 * Like Resume(), but resume from a checkpoint which was saved
+	 * by an earlier process (see SaveWalkCheckpoint()).  The
+	 * directories of the saved files are recreated (and opened
+	 * only when they are needed).
+	 */
+	void Resume(FileDescriptor root_fd, SavedWalkCheckpoint &&checkpoint);
+
+	/**
+	 * Interrupt this #Walk and return its progress, to be passed
+	 * to Resume() of a new #Walk.  After this call, the only
+	 * legal operation on this object is destruction.  Not
+	 * supported in histogram mode (see EnableHistogram()) and
+	 * with WalkConfig::fair_share.
+	 */
+	[[nodiscard]]
+	WalkCheckpoint TakeCheckpoint() noexcept;
+
+	/**
+	 * Change the limit on the number of concurrent statx()
+	 * system calls (default WalkConfig::walk_queue_depth),
+	 * e.g. to throttle the #Walk while the system is under I/O
+	 * pressure.  Zero pauses the #Walk until the limit is raised
+	 * again.
+	 */
+	void SetMaxStat(std::size_t _max_stat) noexcept;
+
+	/**
+	 * Change the maximum number of candidate files kept in memory
+	 * (default WalkResult::MAX_FILES), e.g. under memory
+	 * pressure.  Shrinking evicts the most recently accessed
+	 * candidates; if the limit is below the number of files to
+	 * be collected, the #Walk selects fewer files than
+	 * requested.  With WalkConfig::fair_share, the limit is
+	 * divided among the volumes by their weight.
+	 */
+	void SetMaxCandidates(std::size_t _max_candidates) noexcept;
+
+	/**
+	 * Returns the highest number of concurrent statx() system
+	 * calls so far.
+	 */
+	std::size_t GetPeakStat() const noexcept {
+		return peak_stat;
+	}
+
+	/**
+	 * Do not collect any files; instead, count all files in a
+	 * #WalkHistogram with the given resolution which will be
+	 * passed to the #WalkHandler in WalkResult::histogram.  Must
+	 * be called before Start().
+	 */
+	void EnableHistogram(FileTime resolution);
+
+	/**
+	 * Report all files accessed before #older as "ancient" (see
+	 * WalkHandler::OnWalkAncient()) and ignore all files
+	 * accessed at or after #newer; only files in between are
+	 * collected.  Must be called before Start().
+	 */
+	void SetTimeWindow(FileTime older, FileTime newer) noexcept;
+
+	/**
+	 * Use the given #DirectoryTracker to skip reading
+	 * directories which have not been modified since the last
+	 * walk.  Must be called before Start().
+	 */
+	void SetTracker(DirectoryTracker &_tracker) noexcept {
+		tracker = &_tracker;
+	}
+
+	/**
+	 * Record all files which are found in the given trace (for
+	 * offline simulation of culling policies).  Must be called
+	 * before Start().
+	 */
+	void SetTrace(WalkTraceWriter &_trace) noexcept {
+		trace = &_trace;
+	}
+
+	/**
+	 * Set the prefix of log messages (default "Walk").  Must be
+	 * called before Start().
+	 *
+	 * @param _log_prefix e.g. "Cull [disk1]"; the string is owned
+	 * by the caller
+	 */
+	void SetLogPrefix(std::string_view _log_prefix) noexcept {
+		log_prefix = _log_prefix;
+		errors.SetLogPrefix(_log_prefix);
+	}
+
+	const WalkErrors &GetErrors() const noexcept {
+		return errors;
+	}
+
+	/**
+	 * Select files by their access time adjusted by the
+	 * estimated access frequency (see AccessSketch::Adjust()).
+	 * Must be called before Start().
+	 *
+	 * @param since the time of the previous walk; files
+	 * accessed since then are counted in the #AccessSketch
+	 * @param update false if another #Walk has already counted
+	 * the accesses (the second walk of the approximate
+	 * selection mode)
+	 */
+	void SetFrequency(AccessSketch &sketch, FileTime since,
+			  bool update) noexcept {
+		frequency = &sketch;
+		frequency_since = since;
+		update_frequency = update;
+	}
+
 private:
-	Co::Task<void> AddDirectory(WalkDirectory &parent, std::string &&name);
+	Co::Task<void> AddDirectory(WalkDirectory &parent, std::string &&name,
+				    DirectoryTime mtime);
 	void AddFile(WalkDirectory &parent, std::string &&name,
 		     FileTime atime, uint_least64_t size);
 
-	void ScanDirectory(WalkDirectory &directory, UniqueFileDescriptor &&fd);
-	Co::Task<void> CoScanDirectory(WalkDirectory &directory, UniqueFileDescriptor &&fd);
+	/**
+	 * Count an access to this file in #frequency if it is newer
+	 * than #frequency_since, and return its adjusted access
+	 * time.
+	 */
+	FileTime ApplyFrequency(const WalkDirectory &parent,
+				std::string_view name,
+				FileTime atime) noexcept;
+
+	/**
+	 * Find (or create) the #WalkVolume the given directory
+	 * belongs to.
+	 */
+	WalkVolume &GetVolume(WalkDirectory &directory) noexcept;
+
+	/**
+	 * Divide #max_candidates among the #volumes (see
+	 * SetMaxCandidates()).
+	 */
+	void UpdateVolumeCapacities() noexcept;
+
+	/**
+	 * Merge the #volumes (if any) into #result and pass it to the
+	 * #WalkHandler.
+	 */
+	void Finish() noexcept;
+
+	WalkDirectoryRef OpenRoot(FileDescriptor root_fd);
+	void StartRoot(WalkDirectoryRef &&root, FileDescriptor root_fd);
+
+	/**
+	 * Discard the most recently accessed files if the #result
+	 * exceeds what this #Walk shall collect (after resuming a
+	 * checkpoint of a larger #Walk).
+	 */
+	void TrimResult() noexcept;
+
+	Co::InvokeTask ScanRoot(WalkDirectoryRef root, UniqueFileDescriptor fd);
+	Co::Task<void> CoScanDirectory(WalkDirectory &directory, UniqueFileDescriptor &&fd,
+				       DirectoryListingBuilder *names=nullptr);
+
+	/**
+	 * Like CoScanDirectory(), but look up regular files in
+	 * #inodes instead of submitting statx() calls.
+	 */
+	Co::Task<void> CoScanDirectoryBulk(WalkDirectory &directory, UniqueFileDescriptor &&fd,
+					   DirectoryListingBuilder *names);
+
+	/**
+	 * Like CoScanDirectory(), but read the whole directory first
+	 * and submit statx() in inode number order (see
+	 * WalkConfig::inode_order).
+	 */
+	Co::Task<void> CoScanDirectorySorted(WalkDirectory &directory, UniqueFileDescriptor &&fd,
+					     DirectoryListingBuilder *names);
+
+	/**
+	 * Fill #inodes.
+	 */
+	Co::Task<void> CoBulkstat(FileDescriptor fd);
+	Co::Task<void> CoScanListing(WalkDirectory &directory,
+				     std::shared_ptr<const std::vector<std::string>> names);
+	Co::Task<void> CoScanTracked(WalkDirectory &directory, DirectoryTime mtime);
+	void StartStat(WalkDirectory &directory, const char *name) noexcept;
+
+	/**
+	 * Has the specified subdirectory been scanned completely by
+	 * the #Walk we're resuming?
+	 */
+	[[gnu::pure]]
+	bool IsCompleted(const WalkDirectory &parent, std::string_view name) const noexcept;
+
+	/**
+	 * Decrement WalkDirectory::pending and record the completion
+	 * of the subtree if it drops to zero.
+	 */
+	void EndPending(WalkDirectory &directory) noexcept;
+
+	/**
+	 * Count one directory entry and check whether the current
+	 * time slice has been used up, i.e. whether the caller shall
+	 * yield to the #EventLoop.
+	 */
+	[[nodiscard]]
+	bool ShouldYield() noexcept;
 
+	void OnResumeSlice() noexcept;
+	void OnRootScanned(std::exception_ptr &&error) noexcept;
 	void OnStatCompletion(StatItem &item) noexcept;
 };
@@ -0,0 +1,148 @@
+// SPDX-License-Identifier: BSD-2-Clause OR GPL-2.0-or-later
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+/*
+ * Benchmark for #Cull end to end (walk, Chdir, cull commands)
+ * against #FakeCachefiles instead of the kernel.
+ */
+
+#include "FakeCachefiles.hxx"
+#include "Cull.hxx"
+#include "Chdir.hxx"
+#include "DevCachefiles.hxx"
+#include "WConfig.hxx"
+#include "UringConfig.hxx"
+#include "TempDirectory.hxx"
+#include "event/Loop.hxx"
+#include "system/Error.hxx"
+#include "system/SetupProcess.hxx"
+#include "io/FileAt.hxx"
+#include "io/Open.hxx"
+#include "io/UniqueFileDescriptor.hxx"
+#include "util/PrintException.hxx"
+
+#include <fmt/core.h>
+
+#include <chrono>
+#include <optional>
+
+#include <fcntl.h> // for O_CREAT
+#include <stdlib.h> // for strtoul(), strtod()
+#include <sys/stat.h> // for mkdirat()
+
+/**
+ * The number of files per fan-out directory.
+ */
+static constexpr std::size_t FILES_PER_DIRECTORY = 256;
+
+static void
+CreateTree(FileDescriptor root, std::size_t n_files)
+{
+	for (std::size_t i = 0; i * FILES_PER_DIRECTORY < n_files; ++i) {
+		char name[64];
+		*fmt::format_to(name, "@{}", i) = 0;
+		if (mkdirat(root.Get(), name, 0700) < 0)
+			throw MakeErrno("Failed to create directory");
+
+		const auto fanout = OpenDirectoryPath({root, name});
+
+		for (std::size_t j = 0; j < FILES_PER_DIRECTORY &&
+			     i * FILES_PER_DIRECTORY + j < n_files; ++j) {
+			*fmt::format_to(name, "{}", j) = 0;
+			const auto fd = OpenWriteOnly({fanout, name}, O_CREAT);
+		}
+	}
+}
+
+struct Instance final : DevCachefilesHandler {
+	EventLoop event_loop;
+
+	std::optional<FakeCachefiles> fake;
+	std::optional<DevCachefiles> dev_cachefiles;
+
+	Chdir chdir{event_loop};
+
+	std::optional<Cull> cull;
+
+	std::size_t deleted_files = 0, n_chdir = 0;
+
+	explicit Instance(const FakeCachefiles::Options &options) {
+		EnableUring(event_loop, UringConfig{});
+		fake.emplace(*event_loop.GetUring(), options);
+		dev_cachefiles.emplace(event_loop, fake->OpenDevice(), *this);
+		dev_cachefiles->SetBackend(*fake);
+	}
+
+	void OnCullComplete() noexcept {
+		deleted_files = cull->GetDeletedFiles();
+		n_chdir = cull->GetChdirCount();
+		cull.reset();
+		event_loop.Break();
+	}
+
+	// virtual methods from DevCachefilesHandler
+	void OnDevCachefilesStartCull() noexcept override {}
+
+	void OnDevCachefilesError(std::exception_ptr &&error) noexcept override {
+		PrintException(std::move(error));
+	}
+};
+
+int
+main(int argc, char **argv) noexcept
+try {
+	if (argc < 2 || argc > 4) {
+		fmt::print(stderr, "Usage: BenchCull N_FILES [BUSY_RATE [STALE_RATE]]\n");
+		return EXIT_FAILURE;
+	}
+
+	const std::size_t n_files = strtoul(argv[1], nullptr, 10);
+
+	FakeCachefiles::Options options;
+	if (argc >= 3)
+		options.busy_rate = strtod(argv[2], nullptr);
+	if (argc >= 4)
+		options.stale_rate = strtod(argv[3], nullptr);
+
+	SetupProcess();
+
+	const TempDirectory tmp;
+	const auto directory = tmp.GetFileDescriptor();
+	CreateTree(directory, n_files);
+
+	Instance instance{options};
+
+	/* all files are empty, so the byte limit is never reached
+	   and all of them are culled */
+	instance.cull.emplace(instance.event_loop, *instance.event_loop.GetUring(),
+			      *instance.dev_cachefiles, instance.chdir, WalkConfig{}, "Cull",
+			      n_files, 1024 * 1024,
+			      BIND_METHOD(instance, &Instance::OnCullComplete));
+
+	const auto start_time = std::chrono::steady_clock::now();
+	instance.cull->Start(directory);
+	instance.event_loop.Run();
+	const auto duration = std::chrono::steady_clock::now() - start_time;
+
+	const double seconds = std::chrono::duration<double>(duration).count();
+	const auto &stats = instance.fake->stats;
+
+	fmt::print("files: {}\n", n_files);
+	fmt::print("duration: {:.3f}s\n", seconds);
+	fmt::print("culled: {} ({:.0f}/s)\n",
+		   instance.deleted_files, instance.deleted_files / seconds);
+	fmt::print("commands: {}; busy: {}; stale: {}; errors: {}\n",
+		   stats.n_commands, stats.n_busy, stats.n_stale, stats.n_errors);
+	fmt::print("fchdir: {}\n", instance.n_chdir);
+
+	if (stats.n_unlinked + stats.n_errors > 0)
+		fmt::print("unlink latency: avg {}us; max {}us\n",
+			   std::chrono::duration_cast<std::chrono::microseconds>(stats.total_latency).count() / static_cast<long long>(stats.n_unlinked + stats.n_errors),
+			   std::chrono::duration_cast<std::chrono::microseconds>(stats.max_latency).count());
+
+	return EXIT_SUCCESS;
+} catch (...) {
+	PrintException(std::current_exception());
+	return EXIT_FAILURE;
+}
@@ -0,0 +1,145 @@
+// SPDX-License-Identifier: BSD-2-Clause OR GPL-2.0-or-later
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+/*
+ * Benchmark for #Walk: walk an existing directory tree in readdir
+ * order and in inode order (WalkConfig::inode_order), and with each
+ * io_uring setup preset (#UringConfig), each with a cold
+ * dentry/inode cache if the process may write to
+ * /proc/sys/vm/drop_caches.
+ */
+
+#include "Walk.hxx"
+#include "WConfig.hxx"
+#include "WHandler.hxx"
+#include "UringConfig.hxx"
+#include "event/Loop.hxx"
+#include "system/SetupProcess.hxx"
+#include "io/Open.hxx"
+#include "io/UniqueFileDescriptor.hxx"
+#include "lib/fmt/ExceptionFormatter.hxx"
+#include "util/PrintException.hxx"
+
+#include <fmt/core.h>
+
+#include <chrono>
+#include <memory>
+#include <span>
+#include <string_view>
+
+#include <stdlib.h> // for EXIT_SUCCESS
+#include <unistd.h> // for sync()
+
+/**
+ * Drop the dentry and inode caches.  Returns false if that is not
+ * allowed (needs root).
+ */
+static bool
+DropCaches() noexcept
+try {
+	sync();
+
+	static constexpr std::string_view value = "2\n";
+	const auto fd = OpenWriteOnly("/proc/sys/vm/drop_caches");
+	return fd.Write(std::as_bytes(std::span{value})) == static_cast<ssize_t>(value.size());
+} catch (...) {
+	return false;
+}
+
+struct Instance final : WalkHandler {
+	EventLoop event_loop;
+
+	std::unique_ptr<Walk> walk;
+
+	std::size_t files = 0;
+
+	explicit Instance(const UringConfig &uring_config) {
+		EnableUring(event_loop, uring_config);
+	}
+
+	// virtual methods from WalkHandler
+	void OnWalkAncient([[maybe_unused]] WalkDirectory &directory,
+			   [[maybe_unused]] std::string &&filename,
+			   [[maybe_unused]] uint_least64_t size) noexcept override {
+		++files;
+	}
+
+	void OnWalkFinished(WalkResult &&result) noexcept override {
+		files += result.files.size();
+		walk.reset();
+		event_loop.Break();
+	}
+};
+
+static void
+Run(const char *path, const char *label, const WalkConfig &config,
+    const UringConfig &uring_config={})
+try {
+	const bool cold = DropCaches();
+
+	Instance instance{uring_config};
+
+	/* with these limits, no file is ever dropped from the heap */
+	instance.walk = std::make_unique<Walk>(instance.event_loop,
+					       *instance.event_loop.GetUring(),
+					       config,
+					       WalkResult::MAX_FILES, 0,
+					       instance);
+
+	const auto start_time = std::chrono::steady_clock::now();
+	instance.walk->Start(OpenDirectory(path));
+	if (instance.walk)
+		instance.event_loop.Run();
+	const auto duration = std::chrono::steady_clock::now() - start_time;
+
+	const double seconds = std::chrono::duration<double>(duration).count();
+	fmt::print("{}: {} files in {:.3f}s ({:.0f}/s){}\n",
+		   label, instance.files, seconds, instance.files / seconds,
+		   cold ? "" : " (warm cache)");
+} catch (...) {
+	/* probably not supported by this kernel (or not permitted);
+	   continue with the next preset */
+	fmt::print("{}: {}\n", label, std::current_exception());
+}
+
+/**
+ * The io_uring setups to be compared with the defaults (the
+ * "readdir order" run).  Few io-wq workers may be better for
+ * rotating disks, many for NVMe.
+ */
+static constexpr struct {
+	const char *label;
+	UringConfig config;
+} uring_presets[] = {
+	{"defer_taskrun", {.defer_taskrun = true}},
+	{"sqpoll", {.sqpoll = true, .sqpoll_idle_ms = 100}},
+	{"sqpoll cpu0", {.sqpoll = true, .sqpoll_idle_ms = 100, .sqpoll_cpu = 0}},
+	{"4 workers", {.max_bounded_workers = 4, .max_unbounded_workers = 4}},
+	{"64 workers", {.max_bounded_workers = 64, .max_unbounded_workers = 64}},
+	{"kernel default workers", {.max_bounded_workers = 0, .max_unbounded_workers = 0}},
+};
+
+int
+main(int argc, char **argv) noexcept
+try {
+	if (argc != 2) {
+		fmt::print(stderr, "Usage: BenchWalk PATH\n");
+		return EXIT_FAILURE;
+	}
+
+	const char *const path = argv[1];
+
+	SetupProcess();
+
+	Run(path, "readdir order", WalkConfig{});
+	Run(path, "inode order", WalkConfig{.inode_order = true});
+
+	for (const auto &i : uring_presets)
+		Run(path, i.label, WalkConfig{}, i.config);
+
+	return EXIT_SUCCESS;
+} catch (...) {
+	PrintException(std::current_exception());
+	return EXIT_FAILURE;
+}
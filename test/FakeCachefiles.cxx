@@ -0,0 +1,94 @@
+// SPDX-License-Identifier: BSD-2-Clause OR GPL-2.0-or-later
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#include "FakeCachefiles.hxx"
+#include "CoUnlink.hxx"
+#include "system/Error.hxx"
+#include "util/SpanCast.hxx"
+
+#include <algorithm> // for std::max()
+#include <cassert>
+#include <string>
+
+#include <errno.h>
+#include <fcntl.h> // for AT_FDCWD
+#include <sys/socket.h>
+
+using std::string_view_literals::operator""sv;
+
+FakeCachefiles::FakeCachefiles(Uring::Queue &_uring, const Options &options)
+	:uring(_uring),
+	 random(options.seed),
+	 busy(options.busy_rate), stale(options.stale_rate)
+{
+}
+
+FakeCachefiles::~FakeCachefiles() noexcept = default;
+
+UniqueFileDescriptor
+FakeCachefiles::OpenDevice()
+{
+	assert(!socket.IsDefined());
+
+	/* SOCK_SEQPACKET preserves the boundaries between status
+	   messages, like reads from /dev/cachefiles */
+	int fds[2];
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET|SOCK_CLOEXEC|SOCK_NONBLOCK, 0, fds) < 0)
+		throw MakeErrno("socketpair() failed");
+
+	socket = UniqueFileDescriptor{fds[0]};
+	return UniqueFileDescriptor{fds[1]};
+}
+
+void
+FakeCachefiles::RequestCull()
+{
+	socket.FullWrite(AsBytes("cull=1"sv));
+}
+
+Co::Task<int>
+FakeCachefiles::CullFile(std::span<const std::byte> command) noexcept
+{
+	++stats.n_commands;
+
+	const std::string_view line = ToStringView(command);
+	if (!line.starts_with("cull "sv)) {
+		++stats.n_errors;
+		co_return -EINVAL;
+	}
+
+	if (busy(random)) {
+		++stats.n_busy;
+		co_return -EBUSY;
+	}
+
+	/* the name is not null-terminated in the command buffer */
+	const std::string name{line.substr(5)};
+
+	const auto start_time = std::chrono::steady_clock::now();
+
+	/* io-wq workers share our working directory, so this is
+	   relative to the directory selected by #Chdir */
+	const int result = co_await Uring::CoUnlink(uring, FileDescriptor{AT_FDCWD},
+						     name.c_str(), 0);
+
+	const auto latency = std::chrono::steady_clock::now() - start_time;
+	stats.total_latency += latency;
+	stats.max_latency = std::max(stats.max_latency, latency);
+
+	if (result < 0) {
+		++stats.n_errors;
+		co_return result;
+	}
+
+	++stats.n_unlinked;
+
+	if (stale(random)) {
+		/* pretend the file has vanished meanwhile */
+		++stats.n_stale;
+		co_return -ESTALE;
+	}
+
+	co_return static_cast<int>(command.size());
+}
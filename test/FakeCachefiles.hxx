@@ -0,0 +1,78 @@
+// SPDX-License-Identifier: BSD-2-Clause OR GPL-2.0-or-later
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#pragma once
+
+#include "DevCachefiles.hxx"
+#include "io/UniqueFileDescriptor.hxx"
+
+#include <chrono>
+#include <cstdint>
+#include <random>
+
+namespace Uring { class Queue; }
+
+/**
+ * A stand-in for the kernel's /dev/cachefiles for benchmarks and
+ * tests.  It executes "cull" commands by unlinking the file relative
+ * to the current working directory (instead of moving it to the
+ * graveyard) and can inject EBUSY/ESTALE errors.
+ */
+class FakeCachefiles final : public DevCachefilesBackend {
+	Uring::Queue &uring;
+
+	/**
+	 * Our end of the socket pair; the other end is returned by
+	 * OpenDevice().
+	 */
+	UniqueFileDescriptor socket;
+
+	std::mt19937 random;
+	std::bernoulli_distribution busy, stale;
+
+public:
+	struct Options {
+		/**
+		 * The probability of a "cull" command failing with
+		 * EBUSY (file in use).
+		 */
+		double busy_rate = 0;
+
+		/**
+		 * The probability of a "cull" command reporting
+		 * ESTALE (after the file has been removed).
+		 */
+		double stale_rate = 0;
+
+		unsigned seed = 0;
+	};
+
+	struct Stats {
+		std::size_t n_commands = 0, n_unlinked = 0;
+		std::size_t n_busy = 0, n_stale = 0, n_errors = 0;
+
+		/**
+		 * Sum and maximum of the unlink() latencies.
+		 */
+		std::chrono::steady_clock::duration total_latency{}, max_latency{};
+	} stats;
+
+	FakeCachefiles(Uring::Queue &_uring, const Options &options);
+	~FakeCachefiles() noexcept;
+
+	/**
+	 * Create the file descriptor to be passed to the
+	 * #DevCachefiles constructor.  May be called only once.
+	 */
+	UniqueFileDescriptor OpenDevice();
+
+	/**
+	 * Tell the daemon that culling is necessary, like the kernel
+	 * does when the "bcull"/"fcull" threshold is reached.
+	 */
+	void RequestCull();
+
+	// virtual methods from DevCachefilesBackend
+	Co::Task<int> CullFile(std::span<const std::byte> command) noexcept override;
+};
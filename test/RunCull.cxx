@@ -3,7 +3,10 @@
 // author: Max Kellermann <max.kellermann@ionos.com>
 
 #include "Cull.hxx"
+#include "Chdir.hxx"
 #include "DevCachefiles.hxx"
+#include "WConfig.hxx"
+#include "UringConfig.hxx"
 #include "event/Loop.hxx"
 #include "event/ShutdownListener.hxx"
 #include "system/Error.hxx"
@@ -16,7 +19,6 @@
 #include "util/StringBuffer.hxx"
 
 #include <fmt/core.h>
-#include <liburing.h>
 
 #include <optional>
 
@@ -42,13 +44,15 @@ struct Instance final : DevCachefilesHandler {
 
 	DevCachefiles dev_cachefiles{event_loop, OpenDevCachefiles(), *this};
 
+	Chdir chdir{event_loop};
+
 	std::optional<Cull> cull;
 
 	Instance(uint_least64_t cull_files, uint_least64_t cull_bytes)
 	{
-		event_loop.EnableUring(16384, IORING_SETUP_SINGLE_ISSUER|IORING_SETUP_COOP_TASKRUN);
+		EnableUring(event_loop, UringConfig{});
 		cull.emplace(event_loop, *event_loop.GetUring(),
-			     dev_cachefiles,
+			     dev_cachefiles, chdir, WalkConfig{}, "Cull",
 			     cull_files, cull_bytes,
 			     BIND_THIS_METHOD(OnCullComplete));
 	}
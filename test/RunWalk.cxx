@@ -5,6 +5,8 @@
 #include "Walk.hxx"
 #include "WHandler.hxx"
 #include "WResult.hxx"
+#include "WTrace.hxx"
+#include "UringConfig.hxx"
 #include "event/Loop.hxx"
 #include "event/ShutdownListener.hxx"
 #include "system/SetupProcess.hxx"
@@ -15,7 +17,6 @@
 #include "util/StringBuffer.hxx"
 
 #include <fmt/core.h>
-#include <liburing.h>
 
 #include <memory>
 #include <optional>
@@ -26,8 +27,10 @@ struct Instance final : WalkHandler {
 
 	std::unique_ptr<Walk> walk;
 
+	std::unique_ptr<WalkTraceWriter> trace;
+
 	Instance() {
-		event_loop.EnableUring(16384, IORING_SETUP_SINGLE_ISSUER|IORING_SETUP_COOP_TASKRUN);
+		EnableUring(event_loop, UringConfig{});
 		shutdown_listener.Enable();
 	}
 
@@ -45,6 +48,14 @@ struct Instance final : WalkHandler {
 	void OnWalkFinished(WalkResult &&result) noexcept override {
 		shutdown_listener.Disable();
 
+		if (trace && trace->IsFailed())
+			fmt::print(stderr, "Discarding the incomplete trace\n");
+		else if (trace) {
+			/* errors are logged by the trace thread */
+			trace->Commit();
+			trace->Wait();
+		}
+
 		fmt::print("{} files, {} bytes\n", result.files.size(), result.total_bytes);
 
 		for (const auto &file : result.files)
@@ -62,9 +73,10 @@ main(int argc, char **argv) noexcept
 try {
 	const char *path = ".";
 	uint_least64_t collect_files = 64, collect_bytes = 1024 * 1024;
+	const char *trace_path = nullptr;
 
-	if (argc > 4) {
-		fmt::print(stderr, "Usage: RunWalk [PATH [COLLECT_FILES [COLLECT_BYTES]]]\n");
+	if (argc > 5) {
+		fmt::print(stderr, "Usage: RunWalk [PATH [COLLECT_FILES [COLLECT_BYTES [TRACE]]]]\n");
 		return EXIT_FAILURE;
 	}
 
@@ -77,13 +89,25 @@ try {
 	if (argc > 3)
 		collect_bytes = strtoul(argv[3], nullptr, 10);
 
+	if (argc > 4)
+		trace_path = argv[4];
+
 	SetupProcess();
 
 	Instance instance;
 
-	instance.walk = std::make_unique<Walk>(*instance.event_loop.GetUring(),
+	instance.walk = std::make_unique<Walk>(instance.event_loop,
+					       *instance.event_loop.GetUring(),
+					       WalkConfig{},
 					       collect_files, collect_bytes,
 					       instance);
+
+	if (trace_path != nullptr) {
+		instance.trace = std::make_unique<WalkTraceWriter>(trace_path,
+								   FileTime{time(nullptr)});
+		instance.walk->SetTrace(*instance.trace);
+	}
+
 	instance.walk->Start(OpenDirectory(path));
 
 	if (instance.walk)
@@ -0,0 +1,241 @@
+// SPDX-License-Identifier: BSD-2-Clause OR GPL-2.0-or-later
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+/*
+ * Replays a sequence of walk traces (see WalkTraceWriter) through
+ * the file selection policies of #Cull.  For each trace, it reports
+ * the number of cull commands and bytes freed.  If there is a next
+ * trace, it also estimates the hit rate loss: a file which was
+ * selected but was accessed again before the next trace would have
+ * been a cache miss.
+ */
+
+#include "Walk.hxx"
+#include "WDirectory.hxx"
+#include "WHistogram.hxx"
+#include "WResult.hxx"
+#include "WTrace.hxx"
+#include "io/UniqueFileDescriptor.hxx"
+#include "io/uring/Queue.hxx"
+#include "util/PrintException.hxx"
+
+#include <fmt/core.h>
+
+#include <chrono>
+#include <cstring> // for std::memcpy()
+#include <optional>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+#include <stdlib.h> // for strtoul()
+
+struct Trace {
+	FileTime time;
+
+	std::vector<WalkTraceRecord> records;
+
+	uint_least64_t total_bytes = 0;
+};
+
+static Trace
+LoadTrace(const char *path)
+{
+	WalkTraceReader reader{path};
+
+	Trace trace;
+	trace.time = reader.GetTime();
+
+	WalkTraceRecord record;
+	while (reader.Read(record)) {
+		trace.records.push_back(record);
+		trace.total_bytes += record.size;
+	}
+
+	return trace;
+}
+
+/**
+ * Identifies a file across traces.
+ */
+[[gnu::pure]]
+static uint_least64_t
+ToKey(const WalkTraceRecord &record) noexcept
+{
+	return record.directory * 0x9e3779b97f4a7c15 ^ record.name;
+}
+
+/**
+ * The files selected by a policy.
+ */
+struct Selection {
+	std::unordered_set<uint_least64_t> keys;
+
+	uint_least64_t bytes = 0;
+
+	void Add(uint_least64_t key, uint_least64_t size) noexcept {
+		if (keys.emplace(key).second)
+			bytes += size;
+	}
+};
+
+/**
+ * Select files exactly like Walk::AddFile() does, using the real
+ * #WalkResult heap.  The file name is the key (8 bytes, which fits
+ * into the std::string small buffer).
+ */
+static void
+SelectExact(Selection &selection, WalkDirectory &root, const Trace &trace,
+	    uint_least64_t cull_files, uint_least64_t cull_bytes,
+	    FileTime older=FileTime::min(), FileTime newer=FileTime::max())
+{
+	const FileTime discard_older_than =
+		std::max(trace.time - Walk::DISCARD_OLDER_THAN, older);
+
+	WalkResult result;
+
+	for (const auto &record : trace.records) {
+		const uint_least64_t key = ToKey(record);
+
+		if (record.atime < discard_older_than) {
+			selection.Add(key, record.size);
+			continue;
+		}
+
+		if (record.atime >= newer || !result.PreparePush(record.atime))
+			continue;
+
+		std::string name(sizeof(key), '\0');
+		std::memcpy(name.data(), &key, sizeof(key));
+		result.Emplace(root, std::move(name), record.atime, record.size);
+
+		while (result.files.size() > cull_files && result.total_bytes > cull_bytes)
+			result.Pop();
+	}
+
+	for (const auto &file : result.files) {
+		uint_least64_t key;
+		std::memcpy(&key, file.name.data(), sizeof(key));
+		selection.Add(key, file.size);
+	}
+}
+
+/**
+ * Select files like the approximate selection mode of #Cull (see
+ * WalkConfig::approx_resolution).
+ */
+static void
+SelectApprox(Selection &selection, WalkDirectory &root, const Trace &trace,
+	     uint_least64_t cull_files, uint_least64_t cull_bytes,
+	     FileTime resolution)
+{
+	const FileTime discard_older_than = trace.time - Walk::DISCARD_OLDER_THAN;
+
+	WalkHistogram histogram{discard_older_than, trace.time, resolution};
+	for (const auto &record : trace.records) {
+		if (record.atime < discard_older_than)
+			selection.Add(ToKey(record), record.size);
+		else
+			histogram.Add(record.atime, record.size);
+	}
+
+	const auto boundary = histogram.FindBoundary(cull_files, cull_bytes);
+
+	SelectExact(selection, root, trace,
+		    cull_files > boundary.files_below ? cull_files - boundary.files_below : 0,
+		    cull_bytes > boundary.bytes_below ? cull_bytes - boundary.bytes_below : 0,
+		    boundary.older, boundary.newer);
+}
+
+struct Policy {
+	const char *name;
+
+	/**
+	 * Zero means exact selection.
+	 */
+	FileTime approx_resolution;
+};
+
+static constexpr Policy policies[] = {
+	{"exact", {}},
+	{"approx-1h", std::chrono::hours{1}},
+	{"approx-1d", std::chrono::hours{24}},
+};
+
+int
+main(int argc, char **argv) noexcept
+try {
+	if (argc < 3) {
+		fmt::print(stderr, "Usage: SimulateCull PERCENT TRACE...\n");
+		return EXIT_FAILURE;
+	}
+
+	const unsigned percent = strtoul(argv[1], nullptr, 10);
+
+	/* the #WalkDirectory root needs a Uring::Queue, but it has
+	   no file descriptor and will never submit anything */
+	Uring::Queue uring{16, 0};
+	WalkDirectoryRef root{
+		WalkDirectoryRef::Adopt{},
+		*new WalkDirectory(uring, 1, WalkDirectory::RootTag{}, UniqueFileDescriptor{}),
+	};
+
+	std::optional<Trace> next = LoadTrace(argv[2]);
+
+	for (int i = 2; i < argc; ++i) {
+		const Trace current = std::move(*next);
+		next.reset();
+		if (i + 1 < argc)
+			next = LoadTrace(argv[i + 1]);
+
+		/* free this percentage of the bytes; the file limit
+		   is never the constraint */
+		const uint_least64_t cull_bytes = current.total_bytes * percent / 100;
+
+		fmt::print("{}: {} files, {} bytes; cull {} bytes\n",
+			   argv[i], current.records.size(),
+			   current.total_bytes, cull_bytes);
+
+		for (const auto &policy : policies) {
+			Selection selection;
+
+			const auto start_time = std::chrono::steady_clock::now();
+
+			if (policy.approx_resolution > FileTime{})
+				SelectApprox(selection, *root, current, 0, cull_bytes,
+					     policy.approx_resolution);
+			else
+				SelectExact(selection, *root, current, 0, cull_bytes);
+
+			const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+
+			fmt::print("  {:10}: {} commands, {} bytes freed; {:.1f}M entries/s\n",
+				   policy.name, selection.keys.size(), selection.bytes,
+				   current.records.size() / seconds / 1e6);
+
+			if (!next)
+				continue;
+
+			/* files which were accessed after the cull
+			   would have been misses */
+			std::size_t lost_files = 0;
+			uint_least64_t lost_bytes = 0;
+			for (const auto &record : next->records) {
+				if (record.atime > current.time &&
+				    selection.keys.contains(ToKey(record))) {
+					++lost_files;
+					lost_bytes += record.size;
+				}
+			}
+
+			fmt::print("  {:10}  estimated hit loss: {} files, {} bytes\n",
+				   "", lost_files, lost_bytes);
+		}
+	}
+
+	return EXIT_SUCCESS;
+} catch (...) {
+	PrintException(std::current_exception());
+	return EXIT_FAILURE;
+}
@@ -0,0 +1,77 @@
+// SPDX-License-Identifier: BSD-2-Clause OR GPL-2.0-or-later
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#pragma once
+
+#include "io/FileAt.hxx"
+#include "io/Open.hxx"
+#include "io/RecursiveDelete.hxx"
+#include "io/Temp.hxx"
+#include "io/UniqueFileDescriptor.hxx"
+
+#include <fmt/core.h>
+
+#include <string>
+
+#include <fcntl.h> // for O_PATH
+
+/**
+ * A new empty directory for tests which is deleted recursively (with
+ * all its contents) when this object is destroyed.
+ */
+class TempDirectory {
+	const UniqueFileDescriptor parent;
+
+	const std::string name;
+
+	const UniqueFileDescriptor fd;
+
+public:
+	/**
+	 * Create the directory in the default temporary directory
+	 * (see OpenTmpDir()).  Throws on error.
+	 */
+	TempDirectory()
+		:TempDirectory(OpenTmpDir(O_PATH)) {}
+
+	/**
+	 * Create the directory inside the given directory.  Throws
+	 * on error.
+	 */
+	explicit TempDirectory(UniqueFileDescriptor &&_parent)
+		:parent(std::move(_parent)),
+		 name(MakeTempDirectory(parent, 0700).c_str()),
+		 fd(OpenDirectoryPath({parent, name.c_str()})) {}
+
+	~TempDirectory() noexcept {
+		RecursiveDelete({parent, name.c_str()});
+	}
+
+	TempDirectory(const TempDirectory &) = delete;
+	TempDirectory &operator=(const TempDirectory &) = delete;
+
+	/**
+	 * Returns an O_PATH file descriptor of the directory.
+	 */
+	FileDescriptor GetFileDescriptor() const noexcept {
+		return fd;
+	}
+
+	/**
+	 * Returns a path of the directory, for functions which take a
+	 * path instead of a file descriptor.
+	 */
+	std::string GetPath() const noexcept {
+		return fmt::format("/proc/self/fd/{}", fd.Get());
+	}
+
+	/**
+	 * Returns a path of the given file inside the directory, for
+	 * functions which take a path instead of a directory file
+	 * descriptor.
+	 */
+	std::string GetPath(const char *filename) const noexcept {
+		return fmt::format("/proc/self/fd/{}/{}", fd.Get(), filename);
+	}
+};
@@ -0,0 +1,100 @@
+// SPDX-License-Identifier: BSD-2-Clause OR GPL-2.0-or-later
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#include "Bulkstat.hxx"
+#include "Walk.hxx"
+#include "WalkCollector.hxx"
+#include "TempDirectory.hxx"
+#include "event/Loop.hxx"
+#include "io/FileAt.hxx"
+#include "io/Open.hxx"
+#include "io/UniqueFileDescriptor.hxx"
+
+#include <gtest/gtest.h>
+#include <liburing.h>
+
+#include <fmt/core.h>
+
+#include <fcntl.h> // for O_DIRECTORY, O_CREAT
+#include <stdlib.h> // for getenv()
+#include <sys/stat.h> // for mkdirat()
+
+TEST(Bulkstat, InodeTable)
+{
+	InodeTable table;
+	EXPECT_TRUE(table.empty());
+	EXPECT_EQ(table.Find(1), nullptr);
+
+	table.Append({.ino = 10, .atime = FileTime{100}, .size = 4096});
+	table.Append({.ino = 20, .atime = FileTime{200}, .size = 8192});
+	table.Append({.ino = 35, .atime = FileTime{300}, .size = 0});
+	EXPECT_EQ(table.size(), 3u);
+
+	EXPECT_EQ(table.Find(0), nullptr);
+	EXPECT_EQ(table.Find(11), nullptr);
+	EXPECT_EQ(table.Find(36), nullptr);
+
+	const auto *inode = table.Find(20);
+	ASSERT_NE(inode, nullptr);
+	EXPECT_EQ(inode->atime, FileTime{200});
+	EXPECT_EQ(inode->size, 8192u);
+
+	ASSERT_NE(table.Find(35), nullptr);
+	ASSERT_NE(table.Find(10), nullptr);
+}
+
+/**
+ * Compare a walk with bulkstat to one without.  This needs an XFS
+ * filesystem and CAP_SYS_ADMIN, e.g. a loopback image:
+ *
+ *   truncate -s 1G /tmp/xfs.img && mkfs.xfs /tmp/xfs.img
+ *   mount -o loop /tmp/xfs.img /mnt/xfs
+ *   CASH_TEST_XFS=/mnt/xfs ./TestCash
+ */
+TEST(Bulkstat, Walk)
+{
+	const char *const xfs_path = getenv("CASH_TEST_XFS");
+	if (xfs_path == nullptr)
+		GTEST_SKIP() << "CASH_TEST_XFS not set";
+
+	auto xfs = OpenPath(xfs_path, O_DIRECTORY);
+	ASSERT_TRUE(IsXFS(xfs));
+
+	const TempDirectory tmp{std::move(xfs)};
+	const auto directory = tmp.GetFileDescriptor();
+
+	static constexpr std::size_t N_DIRECTORIES = 16, N_FILES = 100;
+	for (std::size_t i = 0; i < N_DIRECTORIES; ++i) {
+		char name[32];
+		*fmt::format_to(name, "d{}", i) = 0;
+		ASSERT_EQ(mkdirat(directory.Get(), name, 0700), 0);
+
+		const auto subdirectory = OpenDirectoryPath({directory, name});
+		for (std::size_t j = 0; j < N_FILES; ++j) {
+			*fmt::format_to(name, "f{}", j) = 0;
+			const auto fd = OpenWriteOnly({subdirectory, name}, O_CREAT);
+			fd.FullWrite(std::as_bytes(std::span{name}));
+		}
+	}
+
+	EventLoop event_loop;
+	event_loop.EnableUring(16384, IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_COOP_TASKRUN);
+
+	uint_least64_t total_bytes[2];
+
+	for (const bool bulkstat : {false, true}) {
+		WalkCollector handler{event_loop};
+		Walk walk{event_loop, *event_loop.GetUring(),
+			  WalkConfig{.bulkstat = bulkstat},
+			  N_DIRECTORIES * N_FILES, 1ULL << 40, handler};
+		walk.Start(directory);
+		event_loop.Run();
+
+		ASSERT_TRUE(handler.result);
+		EXPECT_EQ(handler.result->files.size(), N_DIRECTORIES * N_FILES);
+		total_bytes[bulkstat] = handler.result->total_bytes;
+	}
+
+	EXPECT_EQ(total_bytes[true], total_bytes[false]);
+}
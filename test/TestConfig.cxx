@@ -0,0 +1,213 @@
+// SPDX-License-Identifier: BSD-2-Clause OR GPL-2.0-or-later
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#include "Config.hxx"
+#include "io/UniqueFileDescriptor.hxx"
+#include "util/SpanCast.hxx"
+
+#include <gtest/gtest.h>
+
+#include <fmt/core.h>
+
+#include <forward_list>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
+#include <sys/mman.h> // for memfd_create()
+
+/**
+ * Parse the given configuration file contents with
+ * LoadConfigFile().
+ */
+static Config
+LoadConfigString(std::string_view contents)
+{
+	const UniqueFileDescriptor fd{memfd_create("cash.conf", MFD_CLOEXEC)};
+	if (!fd.IsDefined())
+		throw std::runtime_error{"memfd_create() failed"};
+
+	fd.FullWrite(AsBytes(contents));
+
+	return LoadConfigFile(fmt::format("/proc/self/fd/{}", fd.Get()).c_str());
+}
+
+static Config
+MakeConfig()
+{
+	Config config;
+	auto &cache = config.caches.emplace_back();
+	cache.dir = "/var/cache/fscache";
+	cache.kernel_config = {"tag mycache", "brun 10%", "frun 10%", "bcull 7%"};
+	return config;
+}
+
+TEST(Config, ReloadUnchanged)
+{
+	const auto config = MakeConfig();
+	EXPECT_NO_THROW(CheckReloadConfig(config, config));
+}
+
+TEST(Config, ReloadDaemonSettings)
+{
+	const auto old_config = MakeConfig();
+
+	auto new_config = MakeConfig();
+	auto &cache = new_config.caches.front();
+	cache.brun = cache.frun = 20;
+	cache.kernel_config = {"tag mycache", "brun 20%", "frun 20%", "bcull 7%"};
+	cache.cull_lead = std::chrono::seconds{600};
+	cache.culling_disabled = true;
+	cache.walk.walk_queue_depth = 1024;
+	cache.walk.cull_queue_depth = 16;
+
+	EXPECT_NO_THROW(CheckReloadConfig(old_config, new_config));
+}
+
+TEST(Config, ReloadKernelSettings)
+{
+	const auto old_config = MakeConfig();
+
+	auto new_config = MakeConfig();
+	new_config.caches.front().kernel_config = {"tag mycache", "brun 10%", "frun 10%", "bcull 5%"};
+	EXPECT_THROW(CheckReloadConfig(old_config, new_config), std::runtime_error);
+
+	new_config = MakeConfig();
+	new_config.caches.front().kernel_config.pop_front();
+	EXPECT_THROW(CheckReloadConfig(old_config, new_config), std::runtime_error);
+
+	new_config = MakeConfig();
+	new_config.caches.front().dir = "/srv/fscache";
+	EXPECT_THROW(CheckReloadConfig(old_config, new_config), std::runtime_error);
+
+	new_config = MakeConfig();
+	new_config.caches.front().track_changes = true;
+	EXPECT_THROW(CheckReloadConfig(old_config, new_config), std::runtime_error);
+}
+
+TEST(Config, ReloadSections)
+{
+	const auto old_config = MakeConfig();
+
+	auto new_config = MakeConfig();
+	new_config.caches.emplace_back(new_config.caches.front());
+	EXPECT_THROW(CheckReloadConfig(old_config, new_config), std::runtime_error);
+
+	new_config = MakeConfig();
+	new_config.caches.front().name = "foo";
+	EXPECT_THROW(CheckReloadConfig(old_config, new_config), std::runtime_error);
+}
+
+TEST(Config, ReloadUring)
+{
+	const auto old_config = MakeConfig();
+
+	auto new_config = MakeConfig();
+	new_config.uring.max_bounded_workers = 4;
+	EXPECT_THROW(CheckReloadConfig(old_config, new_config), std::runtime_error);
+
+	new_config = MakeConfig();
+	new_config.uring.sqpoll = true;
+	EXPECT_THROW(CheckReloadConfig(old_config, new_config), std::runtime_error);
+}
+
+TEST(Config, Sections)
+{
+	const auto config = LoadConfigString("brun 10%\n"
+					     "bcull 7%\n"
+					     "walk_fd_budget 1024\n"
+					     "\n"
+					     "[disk1]\n"
+					     "dir /var/cache/fscache1\n"
+					     "tag cache1\n"
+					     "\n"
+					     "[disk2]\n"
+					     "dir /var/cache/fscache2\n"
+					     "tag cache2\n"
+					     "brun 20%\n"
+					     "walk_fd_budget 256\n");
+	ASSERT_EQ(config.caches.size(), 2u);
+
+	const auto &disk1 = config.caches.front();
+	EXPECT_EQ(disk1.name, "disk1");
+	EXPECT_EQ(disk1.dir, "/var/cache/fscache1");
+	EXPECT_EQ(disk1.brun, 10u);
+	EXPECT_EQ(disk1.walk.fd_budget, 1024u);
+	EXPECT_EQ(disk1.kernel_config,
+		  (std::forward_list<std::string>{"brun 10%", "bcull 7%", "dir /var/cache/fscache1",
+						  "tag cache1"}));
+
+	const auto &disk2 = config.caches.back();
+	EXPECT_EQ(disk2.name, "disk2");
+	EXPECT_EQ(disk2.dir, "/var/cache/fscache2");
+	EXPECT_EQ(disk2.brun, 20u);
+	EXPECT_EQ(disk2.bcull, 7u);
+	EXPECT_EQ(disk2.walk.fd_budget, 256u);
+	EXPECT_EQ(disk2.kernel_config,
+		  (std::forward_list<std::string>{"brun 10%", "bcull 7%", "dir /var/cache/fscache2",
+						  "tag cache2", "brun 20%"}));
+
+	/* each cache needs its own "dir" and "tag" */
+	EXPECT_THROW(LoadConfigString("dir /var/cache/fscache\n"
+				      "[disk1]\n"),
+		     std::runtime_error);
+	EXPECT_THROW(LoadConfigString("tag cache\n"
+				      "[disk1]\n"
+				      "dir /var/cache/fscache1\n"),
+		     std::runtime_error);
+
+	EXPECT_THROW(LoadConfigString("[disk1]\n"
+				      "dir /var/cache/fscache1\n"
+				      "[disk1]\n"
+				      "dir /var/cache/fscache2\n"),
+		     std::runtime_error);
+	EXPECT_THROW(LoadConfigString("[disk1]\n"
+				      "tag cache1\n"),
+		     std::runtime_error);
+	EXPECT_THROW(LoadConfigString("[]\n"
+				      "dir /var/cache/fscache1\n"),
+		     std::runtime_error);
+
+	/* global settings only before the first section */
+	EXPECT_THROW(LoadConfigString("[disk1]\n"
+				      "dir /var/cache/fscache1\n"
+				      "control_socket /run/cash\n"),
+		     std::runtime_error);
+}
+
+TEST(Config, WalkQueueDepth)
+{
+	EXPECT_NO_THROW(LoadConfigString("dir /var/cache/fscache\n"
+					 "walk_queue_depth 64\n"));
+	EXPECT_THROW(LoadConfigString("dir /var/cache/fscache\n"
+				      "walk_queue_depth 63\n"),
+		     std::runtime_error);
+}
+
+TEST(Config, FrequencySketch)
+{
+	const auto config = LoadConfigString("dir /var/cache/fscache\n"
+					     "walk_frequency_sketch 16777216\n");
+	EXPECT_EQ(config.caches.front().walk.frequency_sketch, 16777216u);
+
+	EXPECT_THROW(LoadConfigString("dir /var/cache/fscache\n"
+				      "walk_frequency_sketch 16777217\n"),
+		     std::runtime_error);
+}
+
+TEST(Config, ApproxResolution)
+{
+	auto config = LoadConfigString("dir /var/cache/fscache\n"
+				       "walk_approx_resolution 3600\n");
+	EXPECT_EQ(config.caches.front().walk.approx_resolution,
+		  std::chrono::seconds{3600});
+
+	config = LoadConfigString("dir /var/cache/fscache\n"
+				  "walk_approx_resolution 0\n");
+	EXPECT_EQ(config.caches.front().walk.approx_resolution.count(), 0);
+
+	EXPECT_THROW(LoadConfigString("dir /var/cache/fscache\n"
+				      "walk_approx_resolution 1\n"),
+		     std::runtime_error);
+}
@@ -0,0 +1,68 @@
+// SPDX-License-Identifier: BSD-2-Clause OR GPL-2.0-or-later
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#include "ControlCommand.hxx"
+
+#include <gtest/gtest.h>
+
+#include <stdexcept>
+
+TEST(ControlCommand, Cull)
+{
+	auto c = ParseControlCommand("cull 1000 1073741824");
+	EXPECT_EQ(c.type, ControlCommand::Type::CULL);
+	EXPECT_EQ(c.files, 1000u);
+	EXPECT_EQ(c.bytes, 1073741824u);
+	EXPECT_TRUE(c.section.empty());
+
+	c = ParseControlCommand("  cull 0  42   disk1\n");
+	EXPECT_EQ(c.type, ControlCommand::Type::CULL);
+	EXPECT_EQ(c.files, 0u);
+	EXPECT_EQ(c.bytes, 42u);
+	EXPECT_EQ(c.section, "disk1");
+
+	EXPECT_THROW(ParseControlCommand("cull"), std::runtime_error);
+	EXPECT_THROW(ParseControlCommand("cull 1"), std::runtime_error);
+	EXPECT_THROW(ParseControlCommand("cull 0 0"), std::runtime_error);
+	EXPECT_THROW(ParseControlCommand("cull 1 2x"), std::runtime_error);
+	EXPECT_THROW(ParseControlCommand("cull -1 2"), std::runtime_error);
+	EXPECT_THROW(ParseControlCommand("cull 1 2 disk1 disk2"), std::runtime_error);
+}
+
+TEST(ControlCommand, DryRun)
+{
+	auto c = ParseControlCommand("dry_run 10");
+	EXPECT_EQ(c.type, ControlCommand::Type::DRY_RUN);
+	EXPECT_EQ(c.files, 10u);
+	EXPECT_TRUE(c.section.empty());
+
+	c = ParseControlCommand("dry_run 256 disk2");
+	EXPECT_EQ(c.files, MAX_DRY_RUN_FILES);
+	EXPECT_EQ(c.section, "disk2");
+
+	EXPECT_THROW(ParseControlCommand("dry_run"), std::runtime_error);
+	EXPECT_THROW(ParseControlCommand("dry_run 0"), std::runtime_error);
+	EXPECT_THROW(ParseControlCommand("dry_run 257"), std::runtime_error);
+}
+
+TEST(ControlCommand, PauseResume)
+{
+	auto c = ParseControlCommand("pause");
+	EXPECT_EQ(c.type, ControlCommand::Type::PAUSE);
+	EXPECT_TRUE(c.section.empty());
+
+	c = ParseControlCommand("resume disk1");
+	EXPECT_EQ(c.type, ControlCommand::Type::RESUME);
+	EXPECT_EQ(c.section, "disk1");
+
+	EXPECT_THROW(ParseControlCommand("pause disk1 disk2"), std::runtime_error);
+}
+
+TEST(ControlCommand, Malformed)
+{
+	EXPECT_THROW(ParseControlCommand(""), std::runtime_error);
+	EXPECT_THROW(ParseControlCommand("   "), std::runtime_error);
+	EXPECT_THROW(ParseControlCommand("foo"), std::runtime_error);
+	EXPECT_THROW(ParseControlCommand("CULL 1 2"), std::runtime_error);
+}
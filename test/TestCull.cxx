@@ -0,0 +1,251 @@
+// SPDX-License-Identifier: BSD-2-Clause OR GPL-2.0-or-later
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#include "FakeCachefiles.hxx"
+#include "Cull.hxx"
+#include "Chdir.hxx"
+#include "DevCachefiles.hxx"
+#include "WConfig.hxx"
+#include "TempDirectory.hxx"
+#include "event/Loop.hxx"
+#include "io/FileAt.hxx"
+#include "io/Open.hxx"
+#include "io/UniqueFileDescriptor.hxx"
+#include "util/ScopeExit.hxx"
+
+#include <gtest/gtest.h>
+#include <liburing.h>
+
+#include <chrono>
+#include <optional>
+
+#include <fmt/core.h>
+
+#include <fcntl.h> // for O_CREAT
+#include <sys/stat.h> // for mkdirat(), fstatat(), futimens()
+#include <unistd.h> // for fchdir(), ftruncate()
+
+static constexpr std::size_t N_FANOUT = 8, N_FILES = 100;
+
+/**
+ * Create a cachefiles-like tree: fan-out directories containing
+ * files.
+ */
+static void
+CreateTree(FileDescriptor root)
+{
+	for (std::size_t i = 0; i < N_FANOUT; ++i) {
+		char name[64];
+		*fmt::format_to(name, "@{}", i) = 0;
+		ASSERT_EQ(mkdirat(root.Get(), name, 0700), 0);
+		const auto fanout = OpenDirectoryPath({root, name});
+
+		for (std::size_t j = 0; j < N_FILES; ++j) {
+			*fmt::format_to(name, "{}-{}", i, j) = 0;
+			const auto fd = OpenWriteOnly({fanout, name}, O_CREAT);
+		}
+	}
+}
+
+static std::size_t
+CountFiles(FileDescriptor root)
+{
+	std::size_t n = 0;
+
+	for (std::size_t i = 0; i < N_FANOUT; ++i) {
+		for (std::size_t j = 0; j < N_FILES; ++j) {
+			char name[64];
+			*fmt::format_to(name, "@{}/{}-{}", i, i, j) = 0;
+
+			struct stat st;
+			if (fstatat(root.Get(), name, &st, AT_SYMLINK_NOFOLLOW) == 0)
+				++n;
+		}
+	}
+
+	return n;
+}
+
+struct CullContext final : DevCachefilesHandler {
+	EventLoop event_loop;
+
+	std::optional<FakeCachefiles> fake;
+	std::optional<DevCachefiles> dev_cachefiles;
+
+	std::optional<Cull> cull;
+	std::size_t deleted_files = 0;
+
+	explicit CullContext(const FakeCachefiles::Options &options) {
+		event_loop.EnableUring(16384, IORING_SETUP_SINGLE_ISSUER|IORING_SETUP_COOP_TASKRUN);
+		fake.emplace(*event_loop.GetUring(), options);
+		dev_cachefiles.emplace(event_loop, fake->OpenDevice(), *this);
+		dev_cachefiles->SetBackend(*fake);
+	}
+
+	void Run(FileDescriptor root, const WalkConfig &walk_config={},
+		 uint_least64_t cull_files=N_FANOUT * N_FILES,
+		 std::size_t cull_bytes=1024 * 1024) {
+		/* Chdir changes the working directory of the whole
+		   process; restore it afterwards */
+		const auto old_cwd = OpenPath(".", O_DIRECTORY);
+		AtScopeExit(&old_cwd) { (void)fchdir(old_cwd.Get()); };
+
+		Chdir chdir{event_loop};
+
+		/* by default, all files are empty, so the byte limit
+		   is never reached and all of them are culled */
+		cull.emplace(event_loop, *event_loop.GetUring(),
+			     *dev_cachefiles, chdir, walk_config, "Cull",
+			     cull_files, cull_bytes,
+			     BIND_THIS_METHOD(OnCullComplete));
+		cull->Start(root);
+		event_loop.Run();
+	}
+
+	void OnCullComplete() noexcept {
+		deleted_files = cull->GetDeletedFiles();
+		cull.reset();
+		event_loop.Break();
+	}
+
+	// virtual methods from DevCachefilesHandler
+	void OnDevCachefilesStartCull() noexcept override {}
+	void OnDevCachefilesError(std::exception_ptr &&) noexcept override {}
+};
+
+TEST(Cull, FakeDevice)
+{
+	const TempDirectory tmp;
+	const auto directory = tmp.GetFileDescriptor();
+	CreateTree(directory);
+
+	CullContext context{{.stale_rate = 0.25}};
+	context.Run(directory);
+
+	/* ESTALE means the file is gone, which counts as success */
+	EXPECT_EQ(context.deleted_files, N_FANOUT * N_FILES);
+	EXPECT_EQ(context.fake->stats.n_unlinked, N_FANOUT * N_FILES);
+	EXPECT_GT(context.fake->stats.n_stale, 0u);
+	EXPECT_EQ(context.fake->stats.n_errors, 0u);
+	EXPECT_EQ(CountFiles(directory), 0u);
+}
+
+TEST(Cull, FakeDeviceBusy)
+{
+	const TempDirectory tmp;
+	const auto directory = tmp.GetFileDescriptor();
+	CreateTree(directory);
+
+	CullContext context{{.busy_rate = 1}};
+	context.Run(directory);
+
+	EXPECT_EQ(context.deleted_files, 0u);
+	EXPECT_EQ(context.fake->stats.n_busy, N_FANOUT * N_FILES);
+	EXPECT_EQ(CountFiles(directory), N_FANOUT * N_FILES);
+}
+
+/**
+ * Create a directory with #N_FILES one-byte files which were last
+ * accessed the given time ago.
+ */
+static void
+CreateAgedDirectory(FileDescriptor parent, const char *name,
+		    std::chrono::seconds age)
+{
+	ASSERT_EQ(mkdirat(parent.Get(), name, 0700), 0);
+	const auto directory = OpenDirectoryPath({parent, name});
+
+	const struct timespec times[2]{
+		{.tv_sec = time(nullptr) - age.count(), .tv_nsec = 0},
+		{.tv_sec = 0, .tv_nsec = UTIME_OMIT},
+	};
+
+	for (std::size_t i = 0; i < N_FILES; ++i) {
+		char filename[64];
+		*fmt::format_to(filename, "{}", i) = 0;
+		const auto fd = OpenWriteOnly({directory, filename}, O_CREAT);
+		ASSERT_EQ(ftruncate(fd.Get(), 1), 0);
+		ASSERT_EQ(futimens(fd.Get(), times), 0);
+	}
+}
+
+static bool
+Exists(FileDescriptor directory, const char *name) noexcept
+{
+	struct stat st;
+	return fstatat(directory.Get(), name, &st, AT_SYMLINK_NOFOLLOW) == 0;
+}
+
+TEST(Cull, PruneEmptyDirectories)
+{
+	using namespace std::chrono_literals;
+
+	const TempDirectory tmp;
+	const auto directory = tmp.GetFileDescriptor();
+
+	/* "ancient" files are culled while the walk is still
+	   running */
+	CreateAgedDirectory(directory, "ancient", 200 * 24h);
+	ASSERT_EQ(mkdirat(directory.Get(), "nested", 0700), 0);
+	CreateAgedDirectory(OpenDirectoryPath({directory, "nested"}), "ancient",
+			    200 * 24h);
+
+	/* the oldest regular files are culled after the walk */
+	CreateAgedDirectory(directory, "old", 48h);
+	CreateAgedDirectory(directory, "new", 0s);
+
+	/* not emptied by the cull */
+	ASSERT_EQ(mkdirat(directory.Get(), "empty", 0700), 0);
+
+	WalkConfig walk_config;
+	walk_config.prune_empty_directories = true;
+
+	CullContext context{{}};
+	context.Run(directory, walk_config, N_FILES, 0);
+
+	EXPECT_EQ(context.deleted_files, 3 * N_FILES);
+	EXPECT_EQ(context.fake->stats.n_errors, 0u);
+
+	EXPECT_FALSE(Exists(directory, "ancient"));
+	EXPECT_FALSE(Exists(directory, "nested"));
+	EXPECT_FALSE(Exists(directory, "old"));
+
+	EXPECT_TRUE(Exists(directory, "new"));
+	EXPECT_TRUE(Exists(directory, "new/0"));
+	EXPECT_TRUE(Exists(directory, "empty"));
+}
+
+/**
+ * The approximate selection mode with a tiny cull queue: the files
+ * below the boundary are queued compactly (and the walk is paused
+ * while that queue is full) instead of becoming one coroutine
+ * each.
+ */
+TEST(Cull, ApproxSmallQueue)
+{
+	using namespace std::chrono_literals;
+
+	const TempDirectory tmp;
+	const auto directory = tmp.GetFileDescriptor();
+
+	CreateAgedDirectory(directory, "a", 30 * 24h);
+	CreateAgedDirectory(directory, "b", 20 * 24h);
+	CreateAgedDirectory(directory, "c", 10 * 24h);
+	CreateAgedDirectory(directory, "new", 0s);
+
+	WalkConfig walk_config;
+	walk_config.approx_resolution = 1h;
+	walk_config.cull_queue_depth = 1;
+
+	CullContext context{{}};
+	context.Run(directory, walk_config, 2 * N_FILES, 0);
+
+	EXPECT_EQ(context.deleted_files, 2 * N_FILES);
+	EXPECT_EQ(context.fake->stats.n_errors, 0u);
+
+	EXPECT_FALSE(Exists(directory, "a/0"));
+	EXPECT_FALSE(Exists(directory, "b/0"));
+	EXPECT_TRUE(Exists(directory, "c/0"));
+	EXPECT_TRUE(Exists(directory, "new/0"));
+}
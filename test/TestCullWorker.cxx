@@ -0,0 +1,380 @@
+// SPDX-License-Identifier: BSD-2-Clause OR GPL-2.0-or-later
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#include "CullWorker.hxx"
+#include "event/Loop.hxx"
+#include "co/InvokeTask.hxx"
+#include "system/Error.hxx"
+#include "io/Open.hxx"
+#include "io/UniqueFileDescriptor.hxx"
+
+#include <gtest/gtest.h>
+
+#include <array>
+#include <chrono>
+#include <memory>
+#include <set>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include <dirent.h>
+#include <sys/socket.h>
+#include <unistd.h> // for getcwd(), readlink()
+
+/**
+ * Counts finished tasks and stops the #EventLoop after the last
+ * one.
+ */
+struct Completions {
+	EventLoop &event_loop;
+	std::size_t remaining;
+
+	void Callback(std::exception_ptr &&error) noexcept {
+		EXPECT_FALSE(error);
+
+		if (--remaining == 0)
+			event_loop.Break();
+	}
+};
+
+static Co::InvokeTask
+CullFile(CullWorkerPool &pool, FileDescriptor directory,
+	 const std::string &command, int &result) noexcept
+{
+	result = co_await pool.CullFile(directory, std::as_bytes(std::span{command}));
+}
+
+/**
+ * Create a SOCK_SEQPACKET pair which replaces /dev/cachefiles: each
+ * command arrives as one datagram.  It is non-blocking, so a full
+ * socket buffer fails the test instead of hanging it.
+ */
+static std::array<UniqueFileDescriptor, 2>
+CreateDevicePair(bool non_block=true)
+{
+	int fds[2];
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET|SOCK_CLOEXEC|(non_block ? SOCK_NONBLOCK : 0),
+		       0, fds) < 0)
+		throw MakeErrno("socketpair() failed");
+
+	return {UniqueFileDescriptor{fds[0]}, UniqueFileDescriptor{fds[1]}};
+}
+
+TEST(CullWorker, Basic)
+{
+	auto [device, peer] = CreateDevicePair();
+
+	const std::array directories{
+		OpenDirectory("."),
+		OpenDirectory("/"),
+	};
+
+	static constexpr std::size_t N = 64;
+
+	std::vector<std::string> commands;
+	std::array<int, N> results;
+	results.fill(0);
+
+	EventLoop event_loop;
+	Completions completions{event_loop, N};
+
+	std::vector<Co::InvokeTask> tasks;
+
+	{
+		CullWorkerPool pool{event_loop, device, 4};
+
+		for (std::size_t i = 0; i < N; ++i)
+			commands.emplace_back("cull " + std::to_string(i));
+
+		for (std::size_t i = 0; i < N; ++i) {
+			auto &task = tasks.emplace_back(CullFile(pool, directories[i % directories.size()],
+								 commands[i], results[i]));
+			task.Start(BIND_METHOD(completions, &Completions::Callback));
+		}
+
+		event_loop.Run();
+
+		EXPECT_EQ(completions.remaining, 0u);
+		EXPECT_GE(pool.GetChdirCount(), directories.size());
+		EXPECT_LE(pool.GetChdirCount(), N);
+
+		tasks.clear();
+	}
+
+	for (std::size_t i = 0; i < N; ++i)
+		EXPECT_EQ(results[i], static_cast<int>(commands[i].size()));
+
+	std::set<std::string> received;
+	for (std::size_t i = 0; i < N; ++i) {
+		char buffer[64];
+		const auto nbytes = recv(peer.Get(), buffer, sizeof(buffer), MSG_DONTWAIT);
+		ASSERT_GT(nbytes, 0);
+		received.emplace(buffer, nbytes);
+	}
+
+	EXPECT_EQ(received, std::set<std::string>(commands.begin(), commands.end()));
+}
+
+/**
+ * Destroying pending jobs (queued, running or complete) must be
+ * safe.
+ */
+TEST(CullWorker, Cancel)
+{
+	auto [device, peer] = CreateDevicePair();
+
+	const auto directory = OpenDirectory(".");
+	const std::string command = "cull x";
+
+	static constexpr std::size_t N = 64;
+	std::array<int, N> results;
+
+	EventLoop event_loop;
+	Completions completions{event_loop, N};
+
+	CullWorkerPool pool{event_loop, device, 2};
+
+	std::vector<Co::InvokeTask> tasks;
+	for (std::size_t i = 0; i < N; ++i) {
+		auto &task = tasks.emplace_back(CullFile(pool, directory, command, results[i]));
+		task.Start(BIND_METHOD(completions, &Completions::Callback));
+	}
+
+	tasks.clear();
+
+	EXPECT_EQ(completions.remaining, N);
+}
+
+/**
+ * Resuming the last job may destroy the pool (like
+ * Cull::Finish() does indirectly); CullWorkerPool::OnEventReady()
+ * must not touch the pool after that.
+ */
+TEST(CullWorker, DestroyFromCallback)
+{
+	auto [device, peer] = CreateDevicePair();
+
+	const auto directory = OpenDirectory(".");
+	const std::string command = "cull x";
+
+	static constexpr std::size_t N = 16;
+	std::array<int, N> results;
+
+	EventLoop event_loop;
+	auto pool = std::make_unique<CullWorkerPool>(event_loop, device, 2);
+
+	struct Destroyer {
+		EventLoop &event_loop;
+		std::unique_ptr<CullWorkerPool> &pool;
+		std::size_t remaining;
+
+		void Callback(std::exception_ptr &&error) noexcept {
+			EXPECT_FALSE(error);
+
+			if (--remaining == 0) {
+				pool.reset();
+				event_loop.Break();
+			}
+		}
+	} destroyer{event_loop, pool, N};
+
+	std::vector<Co::InvokeTask> tasks;
+	for (std::size_t i = 0; i < N; ++i) {
+		auto &task = tasks.emplace_back(CullFile(*pool, directory, command, results[i]));
+		task.Start(BIND_METHOD(destroyer, &Destroyer::Callback));
+	}
+
+	event_loop.Run();
+
+	EXPECT_EQ(destroyer.remaining, 0u);
+	EXPECT_FALSE(pool);
+
+	for (const int result : results)
+		EXPECT_EQ(result, static_cast<int>(command.size()));
+}
+
+static std::string
+ReadLink(const char *path) noexcept
+{
+	char buffer[4096];
+	const auto length = readlink(path, buffer, sizeof(buffer));
+	if (length < 0)
+		return {};
+
+	return {buffer, static_cast<std::size_t>(length)};
+}
+
+/**
+ * Collect the working directories of all threads of this process.
+ */
+static std::multiset<std::string>
+GetThreadWorkingDirectories() noexcept
+{
+	std::multiset<std::string> result;
+
+	DIR *dir = opendir("/proc/self/task");
+	if (dir == nullptr)
+		return result;
+
+	while (const auto *e = readdir(dir)) {
+		if (e->d_name[0] == '.')
+			continue;
+
+		result.emplace(ReadLink((std::string{"/proc/self/task/"} + e->d_name + "/cwd").c_str()));
+	}
+
+	closedir(dir);
+	return result;
+}
+
+/**
+ * Each worker has its own working directory, and none of them
+ * affects the working directory of the process (the #EventLoop
+ * thread).
+ *
+ * The fake device is blocking and its peer's receive queue is
+ * filled up, so the workers block in write() right after their
+ * fchdir(); while they're blocked, their working directories are
+ * inspected through /proc.
+ */
+TEST(CullWorker, SeparateWorkingDirectories)
+{
+	auto [device, peer] = CreateDevicePair(false);
+
+	const std::array directories{
+		OpenDirectory("/proc"),
+		OpenDirectory("/dev"),
+	};
+
+	static constexpr std::size_t N_WORKERS = 4;
+	ASSERT_NE(directories[0].Get() % N_WORKERS,
+		  directories[1].Get() % N_WORKERS);
+
+	char cwd_buffer[4096];
+	ASSERT_NE(getcwd(cwd_buffer, sizeof(cwd_buffer)), nullptr);
+	const std::string cwd{cwd_buffer};
+	ASSERT_NE(cwd, "/proc");
+	ASSERT_NE(cwd, "/dev");
+
+	/* fill the peer's receive queue */
+	std::size_t n_filler = 0;
+	while (send(device.Get(), "x", 1, MSG_DONTWAIT) == 1)
+		++n_filler;
+	ASSERT_EQ(errno, EAGAIN);
+
+	const std::string command = "cull x";
+	std::array<int, 2> results;
+	results.fill(0);
+
+	EventLoop event_loop;
+	Completions completions{event_loop, directories.size()};
+
+	CullWorkerPool pool{event_loop, device, N_WORKERS};
+
+	std::vector<Co::InvokeTask> tasks;
+	for (std::size_t i = 0; i < directories.size(); ++i) {
+		auto &task = tasks.emplace_back(CullFile(pool, directories[i],
+							 command, results[i]));
+		task.Start(BIND_METHOD(completions, &Completions::Callback));
+	}
+
+	/* wait until both workers are blocked in their
+	   directories */
+	std::multiset<std::string> cwds;
+	for (unsigned i = 0; i < 500; ++i) {
+		cwds = GetThreadWorkingDirectories();
+		if (cwds.contains("/proc") && cwds.contains("/dev"))
+			break;
+
+		std::this_thread::sleep_for(std::chrono::milliseconds{10});
+	}
+
+	EXPECT_EQ(cwds.count("/proc"), 1u);
+	EXPECT_EQ(cwds.count("/dev"), 1u);
+	EXPECT_EQ(ReadLink("/proc/thread-self/cwd"), cwd);
+
+	/* unblock the workers */
+	for (std::size_t i = 0; i < n_filler + directories.size(); ++i) {
+		char buffer[64];
+		ASSERT_GT(recv(peer.Get(), buffer, sizeof(buffer), 0), 0);
+	}
+
+	event_loop.Run();
+
+	EXPECT_EQ(completions.remaining, 0u);
+	for (const int result : results)
+		EXPECT_EQ(result, static_cast<int>(command.size()));
+
+	ASSERT_NE(getcwd(cwd_buffer, sizeof(cwd_buffer)), nullptr);
+	EXPECT_EQ(cwd, cwd_buffer);
+}
+
+/**
+ * Destroying a job while a worker is blocked writing it must not
+ * block; the job is detached and freed after the worker has
+ * finished it.
+ */
+TEST(CullWorker, CancelRunning)
+{
+	auto [device, peer] = CreateDevicePair(false);
+
+	const auto directory = OpenDirectory("/proc");
+
+	/* fill the peer's receive queue, so the worker blocks in
+	   write() */
+	std::size_t n_filler = 0;
+	while (send(device.Get(), "x", 1, MSG_DONTWAIT) == 1)
+		++n_filler;
+	ASSERT_EQ(errno, EAGAIN);
+
+	auto command = std::make_unique<std::string>("cull running");
+	int result = 0;
+
+	EventLoop event_loop;
+	Completions completions{event_loop, 1};
+
+	{
+		CullWorkerPool pool{event_loop, device, 1};
+
+		auto task = CullFile(pool, directory, *command, result);
+		task.Start(BIND_METHOD(completions, &Completions::Callback));
+
+		/* wait until the worker is blocked in the
+		   directory */
+		for (unsigned i = 0; i < 500; ++i) {
+			if (GetThreadWorkingDirectories().contains("/proc"))
+				break;
+
+			std::this_thread::sleep_for(std::chrono::milliseconds{10});
+		}
+
+		ASSERT_TRUE(GetThreadWorkingDirectories().contains("/proc"));
+
+		const auto start = std::chrono::steady_clock::now();
+		task = {};
+		EXPECT_LT(std::chrono::steady_clock::now() - start,
+			  std::chrono::milliseconds{500});
+
+		/* the job has its own copy of the command */
+		command.reset();
+
+		/* unblock the worker */
+		for (std::size_t i = 0; i < n_filler; ++i) {
+			char buffer[64];
+			ASSERT_GT(recv(peer.Get(), buffer, sizeof(buffer), 0), 0);
+		}
+
+		char buffer[64];
+		const auto nbytes = recv(peer.Get(), buffer, sizeof(buffer), 0);
+		ASSERT_GT(nbytes, 0);
+		EXPECT_EQ(std::string_view(buffer, nbytes), "cull running");
+
+		/* the pool destructor frees the detached job */
+	}
+
+	EXPECT_EQ(completions.remaining, 1u);
+	EXPECT_EQ(result, 0);
+}
@@ -0,0 +1,67 @@
+// SPDX-License-Identifier: BSD-2-Clause OR GPL-2.0-or-later
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#include "Dirent.hxx"
+#include "TempDirectory.hxx"
+#include "io/FileAt.hxx"
+#include "io/Open.hxx"
+#include "io/UniqueFileDescriptor.hxx"
+
+#include <gtest/gtest.h>
+
+#include <set>
+
+#include <fmt/core.h>
+
+#include <fcntl.h> // for O_CREAT
+#include <sys/stat.h> // for mkdirat(), fstatat()
+
+TEST(Dirent, ReadSorted)
+{
+	const TempDirectory tmp;
+	const auto directory = tmp.GetFileDescriptor();
+
+	ASSERT_EQ(mkdirat(directory.Get(), "sub", 0700), 0);
+
+	/* more than fits into one getdents64() buffer */
+	static constexpr std::size_t N_FILES = 2000;
+	for (std::size_t i = 0; i < N_FILES; ++i) {
+		char name[32];
+		*fmt::format_to(name, "file{}", i) = 0;
+		OpenWriteOnly({directory, name}, O_CREAT);
+	}
+
+	const auto fd = OpenDirectory({directory, "."});
+
+	std::vector<InodeName> entries;
+	std::set<std::string> names;
+
+	DirentReader r{fd};
+	while (const auto *entry = r.Read()) {
+		struct stat st;
+		ASSERT_EQ(fstatat(directory.Get(), entry->d_name, &st, AT_SYMLINK_NOFOLLOW), 0);
+		EXPECT_EQ(entry->d_ino, st.st_ino);
+
+		if (entry->d_type != DT_UNKNOWN) {
+			EXPECT_EQ(entry->d_type, S_ISDIR(st.st_mode) ? DT_DIR : DT_REG);
+		}
+
+		EXPECT_TRUE(names.emplace(entry->d_name).second);
+		entries.emplace_back(entry->d_ino, entry->d_name);
+	}
+
+	/* "." and ".." are skipped */
+	EXPECT_EQ(entries.size(), N_FILES + 1);
+	EXPECT_FALSE(names.contains("."));
+	EXPECT_FALSE(names.contains(".."));
+	EXPECT_TRUE(names.contains("sub"));
+
+	SortByInode(entries);
+	EXPECT_EQ(entries.size(), N_FILES + 1);
+	for (std::size_t i = 1; i < entries.size(); ++i)
+		EXPECT_LT(entries[i - 1].ino, entries[i].ino);
+
+	/* the end of the directory is sticky */
+	EXPECT_EQ(r.Read(), nullptr);
+}
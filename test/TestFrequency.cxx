@@ -0,0 +1,70 @@
+// SPDX-License-Identifier: BSD-2-Clause OR GPL-2.0-or-later
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#include "Frequency.hxx"
+
+#include <gtest/gtest.h>
+
+TEST(AccessSketch, Width)
+{
+	EXPECT_EQ(AccessSketch{1000}.GetWidth(), 1024u);
+	EXPECT_EQ(AccessSketch{1024}.GetWidth(), 1024u);
+	EXPECT_EQ(AccessSketch{0}.GetWidth(), 1u);
+}
+
+TEST(AccessSketch, Count)
+{
+	AccessSketch sketch{1024};
+
+	EXPECT_EQ(sketch.Estimate(42), 0u);
+
+	sketch.Increment(42);
+	sketch.Increment(42);
+	sketch.Increment(42);
+	sketch.Increment(0x1234567890abcdef);
+
+	EXPECT_EQ(sketch.Estimate(42), 3u);
+	EXPECT_EQ(sketch.Estimate(0x1234567890abcdef), 1u);
+
+	/* counters saturate */
+	for (unsigned i = 0; i < 100; ++i)
+		sketch.Increment(42);
+
+	EXPECT_EQ(sketch.Estimate(42), AccessSketch::MAX_COUNT);
+}
+
+TEST(AccessSketch, Age)
+{
+	AccessSketch sketch{16};
+
+	for (unsigned i = 0; i < 8; ++i)
+		sketch.Increment(1);
+
+	EXPECT_EQ(sketch.Estimate(1), 8u);
+
+	/* many increments of other keys halve all counters */
+	for (uint_least64_t key = 1000; key < 1160; ++key)
+		sketch.Increment(key * 0x9e3779b97f4a7c15);
+
+	EXPECT_LT(sketch.Estimate(1), 8u);
+}
+
+TEST(AccessSketch, Adjust)
+{
+	static constexpr FileTime now{100000};
+
+	/* not accessed before: no change */
+	EXPECT_EQ(AccessSketch::Adjust(now - FileTime{1000}, 0, now),
+		  now - FileTime{1000});
+
+	/* the age is divided by the count plus one */
+	EXPECT_EQ(AccessSketch::Adjust(now - FileTime{1000}, 1, now),
+		  now - FileTime{500});
+	EXPECT_EQ(AccessSketch::Adjust(now - FileTime{1000}, 3, now),
+		  now - FileTime{250});
+
+	/* files from the future are left alone */
+	EXPECT_EQ(AccessSketch::Adjust(now + FileTime{1}, 3, now),
+		  now + FileTime{1});
+}
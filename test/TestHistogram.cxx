@@ -0,0 +1,67 @@
+// SPDX-License-Identifier: BSD-2-Clause OR GPL-2.0-or-later
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#include "WHistogram.hxx"
+
+#include <gtest/gtest.h>
+
+TEST(WalkHistogram, Empty)
+{
+	const WalkHistogram h{FileTime{1000}, FileTime{2000}, FileTime{100}};
+
+	/* nothing to cull: the boundary is at the end */
+	const auto b = h.FindBoundary(10, 10);
+	EXPECT_EQ(b.older, b.newer);
+	EXPECT_EQ(b.files_below, 0u);
+	EXPECT_EQ(b.bytes_below, 0u);
+}
+
+TEST(WalkHistogram, Boundary)
+{
+	WalkHistogram h{FileTime{1000}, FileTime{2000}, FileTime{100}};
+
+	/* 10 files with 10 bytes each in each bucket */
+	for (unsigned i = 0; i < 100; ++i)
+		h.Add(FileTime{1000 + i * 10}, 10);
+
+	/* the file target is reached in the third bucket */
+	auto b = h.FindBoundary(25, 0);
+	EXPECT_EQ(b.older, FileTime{1200});
+	EXPECT_EQ(b.newer, FileTime{1300});
+	EXPECT_EQ(b.files_below, 20u);
+	EXPECT_EQ(b.bytes_below, 200u);
+
+	/* both targets must be exceeded */
+	b = h.FindBoundary(25, 450);
+	EXPECT_EQ(b.older, FileTime{1400});
+	EXPECT_EQ(b.files_below, 40u);
+
+	/* exact bucket boundary: the next bucket is where we
+	   overshoot */
+	b = h.FindBoundary(20, 0);
+	EXPECT_EQ(b.older, FileTime{1200});
+	EXPECT_EQ(b.files_below, 20u);
+
+	/* more than we have */
+	b = h.FindBoundary(1000, 0);
+	EXPECT_EQ(b.files_below, 100u);
+	EXPECT_EQ(b.older, b.newer);
+}
+
+TEST(WalkHistogram, Clamp)
+{
+	WalkHistogram h{FileTime{1000}, FileTime{2000}, FileTime{100}};
+
+	/* out-of-range times are counted in the first/last bucket */
+	h.Add(FileTime{0}, 1);
+	h.Add(FileTime{5000}, 1);
+
+	auto b = h.FindBoundary(0, 0);
+	EXPECT_EQ(b.older, FileTime{1000});
+	EXPECT_EQ(b.files_below, 0u);
+
+	b = h.FindBoundary(1, 0);
+	EXPECT_GE(b.older, FileTime{2000});
+	EXPECT_EQ(b.files_below, 1u);
+}
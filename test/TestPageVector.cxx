@@ -0,0 +1,80 @@
+// SPDX-License-Identifier: BSD-2-Clause OR GPL-2.0-or-later
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#include "PageVector.hxx"
+
+#include <gtest/gtest.h>
+
+#include <string>
+
+TEST(PageVector, Basic)
+{
+	PageVector<std::string> v{4};
+	EXPECT_TRUE(v.empty());
+	EXPECT_FALSE(v.full());
+	EXPECT_EQ(v.max_size(), 4u);
+
+	v.emplace_back("a");
+	v.emplace_back("a long string which does not fit into the small buffer");
+	v.emplace_back("c");
+	v.emplace_back("d");
+	EXPECT_TRUE(v.full());
+	EXPECT_EQ(v.size(), 4u);
+	EXPECT_EQ(v.front(), "a");
+	EXPECT_EQ(v.back(), "d");
+
+	v.pop_back();
+	EXPECT_FALSE(v.full());
+	EXPECT_EQ(v.back(), "c");
+
+	PageVector<std::string> w{std::move(v)};
+	EXPECT_TRUE(v.empty());
+	EXPECT_EQ(w.size(), 3u);
+	EXPECT_EQ(w[1], "a long string which does not fit into the small buffer");
+
+	std::size_t n = 0;
+	for ([[maybe_unused]] const auto &i : w)
+		++n;
+	EXPECT_EQ(n, 3u);
+}
+
+TEST(PageVector, Large)
+{
+	/* reserves a lot of address space, but touches only a few
+	   pages */
+	PageVector<std::size_t> v{64 * 1024 * 1024};
+	for (std::size_t i = 0; i < 1000; ++i)
+		v.emplace_back(i);
+
+	EXPECT_EQ(v.size(), 1000u);
+	EXPECT_EQ(v[999], 999u);
+}
+
+TEST(PageVector, ShrinkToFit)
+{
+	static constexpr std::size_t N = 64 * 1024;
+
+	PageVector<std::size_t> v{N};
+	v.ShrinkToFit();
+
+	for (std::size_t i = 0; i < N; ++i)
+		v.emplace_back(i);
+
+	while (v.size() > 100)
+		v.pop_back();
+
+	v.ShrinkToFit();
+	EXPECT_EQ(v.size(), 100u);
+	for (std::size_t i = 0; i < v.size(); ++i)
+		EXPECT_EQ(v[i], i);
+
+	/* the discarded pages can be used again */
+	while (!v.full())
+		v.emplace_back(42);
+	EXPECT_EQ(v.back(), 42u);
+
+	v.clear();
+	v.ShrinkToFit();
+	EXPECT_TRUE(v.empty());
+}
@@ -0,0 +1,58 @@
+// SPDX-License-Identifier: BSD-2-Clause OR GPL-2.0-or-later
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#include "Predictor.hxx"
+
+#include <gtest/gtest.h>
+
+using std::chrono_literals::operator""s;
+
+TEST(FillPredictor, Empty)
+{
+	FillPredictor predictor;
+	EXPECT_EQ(predictor.PredictBlocks(3600s), 0u);
+	EXPECT_EQ(predictor.PredictFiles(3600s), 0u);
+
+	/* one sample is not enough for a rate */
+	predictor.Update(Event::TimePoint{}, 1000, 1000);
+	EXPECT_EQ(predictor.PredictBlocks(3600s), 0u);
+	EXPECT_EQ(predictor.PredictFiles(3600s), 0u);
+}
+
+TEST(FillPredictor, Constant)
+{
+	FillPredictor predictor;
+
+	Event::TimePoint now{};
+	uint_least64_t free_blocks = 1000000, free_files = 100000;
+
+	for (unsigned i = 0; i < 100; ++i) {
+		predictor.Update(now, free_blocks, free_files);
+		now += 10s;
+		free_blocks -= 100;
+		free_files -= 10;
+	}
+
+	/* the moving average converges towards 10 blocks/s and
+	   1 file/s */
+	EXPECT_NEAR(static_cast<double>(predictor.PredictBlocks(100s)), 1000., 1.);
+	EXPECT_NEAR(static_cast<double>(predictor.PredictFiles(100s)), 100., 1.);
+}
+
+TEST(FillPredictor, Reset)
+{
+	FillPredictor predictor;
+
+	predictor.Update(Event::TimePoint{}, 1000, 1000);
+	predictor.Reset();
+
+	/* after Reset(), the growth of free space caused by a cull is
+	   not counted */
+	predictor.Update(Event::TimePoint{} + 10s, 2000, 2000);
+	EXPECT_EQ(predictor.PredictBlocks(3600s), 0u);
+
+	predictor.Update(Event::TimePoint{} + 20s, 1000, 2000);
+	EXPECT_GT(predictor.PredictBlocks(3600s), 0u);
+	EXPECT_EQ(predictor.PredictFiles(3600s), 0u);
+}
@@ -0,0 +1,89 @@
+// SPDX-License-Identifier: BSD-2-Clause OR GPL-2.0-or-later
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#include "Pressure.hxx"
+
+#include <gtest/gtest.h>
+
+using std::string_view_literals::operator""sv;
+
+TEST(Pressure, ParseSomeTotal)
+{
+	EXPECT_EQ(ParsePressureSomeTotal("some avg10=0.00 avg60=0.00 avg300=0.00 total=0\n"
+					 "full avg10=0.00 avg60=0.00 avg300=0.00 total=0\n"sv), 0);
+	EXPECT_EQ(ParsePressureSomeTotal("some avg10=1.50 avg60=0.70 avg300=0.20 total=123456789\n"
+					 "full avg10=0.10 avg60=0.00 avg300=0.00 total=42\n"sv), 123456789);
+	EXPECT_EQ(ParsePressureSomeTotal("full avg10=0.10 avg60=0.00 avg300=0.00 total=42\n"
+					 "some avg10=0.00 avg60=0.00 avg300=0.00 total=7\n"sv), 7);
+}
+
+TEST(Pressure, ParseMalformed)
+{
+	EXPECT_EQ(ParsePressureSomeTotal(""sv), -1);
+	EXPECT_EQ(ParsePressureSomeTotal("full avg10=0.00 total=5\n"sv), -1);
+	EXPECT_EQ(ParsePressureSomeTotal("some avg10=0.00 avg60=0.00\n"sv), -1);
+	EXPECT_EQ(ParsePressureSomeTotal("some total=abc\n"sv), -1);
+}
+
+TEST(Pressure, ParseMemoryEvents)
+{
+	const auto events = ParseMemoryEvents("low 0\n"
+					      "high 1234\n"
+					      "max 56\n"
+					      "oom 7\n"
+					      "oom_kill 3\n"
+					      "oom_group_kill 0\n"sv);
+	EXPECT_EQ(events.high, 1234u);
+	EXPECT_EQ(events.max, 56u);
+	EXPECT_EQ(events.oom, 7u);
+
+	const auto empty = ParseMemoryEvents(""sv);
+	EXPECT_EQ(empty.high, 0u);
+	EXPECT_EQ(empty.max, 0u);
+	EXPECT_EQ(empty.oom, 0u);
+
+	EXPECT_EQ(ParseMemoryEvents("high abc\nmax 2\n"sv).high, 0u);
+	EXPECT_EQ(ParseMemoryEvents("high abc\nmax 2\n"sv).max, 2u);
+}
+
+TEST(Pressure, MemoryShift)
+{
+	using Level = MemoryShift::Level;
+
+	MemoryShift shift;
+	EXPECT_FALSE(shift.Update(Level::NORMAL));
+	EXPECT_EQ(shift.Scale(16384), 16384u);
+
+	EXPECT_TRUE(shift.Update(Level::PRESSURE));
+	EXPECT_EQ(shift.Scale(16384), 8192u);
+
+	EXPECT_TRUE(shift.Update(Level::LIMIT));
+	EXPECT_EQ(shift.Scale(16384), 2048u);
+
+	/* saturates */
+	for (unsigned i = 0; i < 10; ++i)
+		shift.Update(Level::LIMIT);
+	EXPECT_EQ(shift.shift, MemoryShift::MAX_SHIFT);
+	EXPECT_EQ(shift.Scale(16384), 16384u >> MemoryShift::MAX_SHIFT);
+	EXPECT_EQ(shift.Scale(4), 1u);
+
+	/* recovers one step after CALM_SAMPLES */
+	for (unsigned i = 1; i < MemoryShift::CALM_SAMPLES; ++i)
+		EXPECT_FALSE(shift.Update(Level::NORMAL));
+	EXPECT_TRUE(shift.Update(Level::NORMAL));
+	EXPECT_EQ(shift.shift, MemoryShift::MAX_SHIFT - 1);
+
+	/* pressure resets the calm counter */
+	for (unsigned i = 1; i < MemoryShift::CALM_SAMPLES; ++i)
+		shift.Update(Level::NORMAL);
+	shift.Update(Level::PRESSURE);
+	EXPECT_EQ(shift.shift, MemoryShift::MAX_SHIFT);
+	for (unsigned i = 1; i < MemoryShift::CALM_SAMPLES; ++i)
+		EXPECT_FALSE(shift.Update(Level::NORMAL));
+
+	for (unsigned i = 0; i < MemoryShift::MAX_SHIFT * MemoryShift::CALM_SAMPLES; ++i)
+		shift.Update(Level::NORMAL);
+	EXPECT_EQ(shift.shift, 0u);
+	EXPECT_EQ(shift.peak, MemoryShift::MAX_SHIFT);
+}
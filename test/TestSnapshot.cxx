@@ -0,0 +1,78 @@
+// SPDX-License-Identifier: BSD-2-Clause OR GPL-2.0-or-later
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#include "Snapshot.hxx"
+#include "TempDirectory.hxx"
+
+#include <gtest/gtest.h>
+
+#include <stdexcept>
+#include <string>
+
+#include <unistd.h> // for access()
+
+TEST(Snapshot, RoundTrip)
+{
+	/* #SnapshotWriter takes a path, not a directory file
+	   descriptor */
+	const TempDirectory tmp;
+	const auto path = tmp.GetPath("snapshot");
+
+	const std::string long_string(100000, 'x');
+
+	{
+		SnapshotWriter w{path};
+		w.WriteU32(42);
+		w.WriteString("foo");
+		w.WriteU64(0x123456789abcdefULL);
+		w.WriteString(long_string);
+		w.WriteString({});
+
+		/* not yet committed */
+		EXPECT_NE(access(path.c_str(), F_OK), 0);
+
+		w.Commit(true);
+	}
+
+	SnapshotReader r{path.c_str()};
+	EXPECT_EQ(r.ReadU32(), 42u);
+	EXPECT_EQ(r.ReadString(16), "foo");
+	EXPECT_EQ(r.ReadU64(), 0x123456789abcdefULL);
+	EXPECT_THROW(r.ReadString(16), std::runtime_error);
+}
+
+TEST(Snapshot, Truncated)
+{
+	/* #SnapshotWriter takes a path, not a directory file
+	   descriptor */
+	const TempDirectory tmp;
+	const auto path = tmp.GetPath("snapshot");
+
+	{
+		SnapshotWriter w{path};
+		w.WriteU32(1);
+		w.Commit(false);
+	}
+
+	SnapshotReader r{path.c_str()};
+	EXPECT_EQ(r.ReadU32(), 1u);
+	EXPECT_THROW(r.ReadU64(), std::runtime_error);
+}
+
+TEST(Snapshot, Discard)
+{
+	/* #SnapshotWriter takes a path, not a directory file
+	   descriptor */
+	const TempDirectory tmp;
+	const auto path = tmp.GetPath("snapshot");
+
+	{
+		SnapshotWriter w{path};
+		w.WriteU32(1);
+	}
+
+	/* neither the snapshot nor the temporary file exist */
+	EXPECT_NE(access(path.c_str(), F_OK), 0);
+	EXPECT_NE(access((path + ".tmp").c_str(), F_OK), 0);
+}
@@ -0,0 +1,280 @@
+// SPDX-License-Identifier: BSD-2-Clause OR GPL-2.0-or-later
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#include "Tracker.hxx"
+#include "TempDirectory.hxx"
+#include "event/FineTimerEvent.hxx"
+#include "event/Loop.hxx"
+#include "io/FileAt.hxx"
+#include "io/Open.hxx"
+#include "io/UniqueFileDescriptor.hxx"
+
+#include <gtest/gtest.h>
+
+#include <fmt/format.h>
+
+#include <chrono>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <fcntl.h> // for O_CREAT
+#include <sys/stat.h> // for mkdirat(), stat()
+#include <unistd.h> // for truncate()
+
+/**
+ * Create a #DirectoryTracker.  Returns false if fanotify is not
+ * available (it needs CAP_SYS_ADMIN), and the caller should skip the
+ * test.
+ */
+static bool
+CreateTracker(std::optional<DirectoryTracker> &tracker,
+	      EventLoop &event_loop, FileDescriptor directory) noexcept
+try {
+	tracker.emplace(event_loop, directory);
+	return true;
+} catch (...) {
+	return false;
+}
+
+static std::string
+GetSubdirectoryKey(FileDescriptor parent, const char *name) noexcept
+{
+	if (mkdirat(parent.Get(), name, 0700) < 0)
+		return {};
+
+	return DirectoryTracker::GetKey(OpenDirectoryPath({parent, name}));
+}
+
+/**
+ * Create a file in the given directory, which generates a fanotify
+ * event.
+ */
+static void
+CreateFile(FileDescriptor directory, const char *name)
+{
+	OpenWriteOnly({directory, name}, O_CREAT);
+}
+
+/**
+ * Run the #EventLoop until the listing of the given directory has
+ * been invalidated by a fanotify event (or until a timeout).
+ */
+static bool
+WaitInvalidated(EventLoop &event_loop, DirectoryTracker &tracker,
+		const std::string &key, DirectoryTime mtime) noexcept
+{
+	FineTimerEvent timer{event_loop, BIND_METHOD(event_loop, &EventLoop::Break)};
+
+	for (unsigned i = 0; i < 500; ++i) {
+		if (!tracker.Lookup(key, mtime))
+			return true;
+
+		timer.Schedule(std::chrono::milliseconds{10});
+		event_loop.Run();
+	}
+
+	return false;
+}
+
+TEST(Tracker, ListingBuilder)
+{
+	DirectoryListingBuilder small;
+	small.Add("a");
+	small.Add(std::string{"b"});
+	ASSERT_FALSE(small.IsOverflow());
+	EXPECT_EQ(small.Release(), (std::vector<std::string>{"a", "b"}));
+
+	DirectoryListingBuilder large;
+	for (std::size_t i = 0; i < DirectoryListingBuilder::MAX_NAMES; ++i)
+		large.Add(fmt::format("{}", i));
+	EXPECT_FALSE(large.IsOverflow());
+	large.Add("overflow");
+	EXPECT_TRUE(large.IsOverflow());
+
+	DirectoryListingBuilder reserved;
+	reserved.Add("a");
+	reserved.Reserve(DirectoryListingBuilder::MAX_NAMES);
+	EXPECT_TRUE(reserved.IsOverflow());
+}
+
+TEST(Tracker, Lookup)
+{
+	const TempDirectory tmp;
+	const auto directory = tmp.GetFileDescriptor();
+
+	const auto key = GetSubdirectoryKey(directory, "a");
+	const auto other_key = GetSubdirectoryKey(directory, "b");
+	ASSERT_FALSE(key.empty());
+	ASSERT_FALSE(other_key.empty());
+
+	static constexpr DirectoryTime mtime{1234567890, 42};
+
+	EventLoop event_loop;
+	std::optional<DirectoryTracker> tracker;
+	if (!CreateTracker(tracker, event_loop, directory))
+		GTEST_SKIP() << "fanotify not available";
+
+	/* never scanned */
+	EXPECT_FALSE(tracker->Lookup(key, mtime));
+
+	/* being scanned */
+	tracker->BeginScan(key);
+	EXPECT_FALSE(tracker->Lookup(key, mtime));
+
+	tracker->EndScan(key, mtime, {"x", "y"});
+
+	const auto listing = tracker->Lookup(key, mtime);
+	ASSERT_TRUE(listing);
+	EXPECT_EQ(*listing, (std::vector<std::string>{"x", "y"}));
+
+	/* the modification time has changed (e.g. while the daemon
+	   wasn't running) */
+	EXPECT_FALSE(tracker->Lookup(key, {mtime.sec + 1, mtime.nsec}));
+	EXPECT_FALSE(tracker->Lookup(key, {mtime.sec, mtime.nsec + 1}));
+
+	/* a mismatch doesn't discard the listing */
+	EXPECT_TRUE(tracker->Lookup(key, mtime));
+
+	EXPECT_FALSE(tracker->Lookup(other_key, mtime));
+
+	/* scanning again discards the old listing */
+	tracker->BeginScan(key);
+	EXPECT_FALSE(tracker->Lookup(key, mtime));
+
+	tracker->EndScan(key, mtime, {"z"});
+	const auto new_listing = tracker->Lookup(key, mtime);
+	ASSERT_TRUE(new_listing);
+	EXPECT_EQ(*new_listing, (std::vector<std::string>{"z"}));
+
+	/* the old listing remains valid for its users */
+	EXPECT_EQ(listing->size(), 2u);
+}
+
+TEST(Tracker, Invalidate)
+{
+	const TempDirectory tmp;
+	const auto directory = tmp.GetFileDescriptor();
+
+	const auto key_a = GetSubdirectoryKey(directory, "a");
+	const auto key_b = GetSubdirectoryKey(directory, "b");
+	ASSERT_FALSE(key_a.empty());
+	ASSERT_FALSE(key_b.empty());
+
+	const auto a = OpenDirectoryPath({directory, "a"});
+	const auto b = OpenDirectoryPath({directory, "b"});
+
+	static constexpr DirectoryTime mtime{1234567890, 42};
+
+	EventLoop event_loop;
+	std::optional<DirectoryTracker> tracker;
+	if (!CreateTracker(tracker, event_loop, directory))
+		GTEST_SKIP() << "fanotify not available";
+
+	/* a change after EndScan() invalidates the listing */
+	tracker->BeginScan(key_a);
+	tracker->EndScan(key_a, mtime, {});
+	ASSERT_TRUE(tracker->Lookup(key_a, mtime));
+
+	CreateFile(a, "f1");
+	EXPECT_TRUE(WaitInvalidated(event_loop, *tracker, key_a, mtime));
+
+	/* a change between BeginScan() and EndScan() cancels
+	   EndScan() */
+	tracker->BeginScan(key_a);
+	tracker->EndScan(key_a, mtime, {"f1"});
+	ASSERT_TRUE(tracker->Lookup(key_a, mtime));
+
+	tracker->BeginScan(key_b);
+	CreateFile(b, "f2");
+
+	/* events are delivered in order; once "a" has been
+	   invalidated, the event for "b" has been handled, too */
+	CreateFile(a, "f3");
+	ASSERT_TRUE(WaitInvalidated(event_loop, *tracker, key_a, mtime));
+
+	tracker->EndScan(key_b, mtime, {});
+	EXPECT_FALSE(tracker->Lookup(key_b, mtime));
+}
+
+TEST(Tracker, SnapshotRoundTrip)
+{
+	const TempDirectory tmp;
+	const auto directory = tmp.GetFileDescriptor();
+	const auto path = tmp.GetPath("snapshot");
+
+	const auto key_a = GetSubdirectoryKey(directory, "a");
+	const auto key_b = GetSubdirectoryKey(directory, "b");
+	ASSERT_FALSE(key_a.empty());
+	ASSERT_FALSE(key_b.empty());
+	ASSERT_NE(key_a, key_b);
+
+	static constexpr DirectoryTime mtime{1234567890, 42};
+
+	EventLoop event_loop;
+
+	{
+		std::optional<DirectoryTracker> tracker;
+		if (!CreateTracker(tracker, event_loop, directory))
+			GTEST_SKIP() << "fanotify not available";
+
+		tracker->BeginScan(key_a);
+		tracker->EndScan(key_a, mtime, {"x", "y"});
+
+		/* still being scanned: not saved */
+		tracker->BeginScan(key_b);
+
+		tracker->SaveSnapshot(path, false);
+	}
+
+	std::optional<DirectoryTracker> tracker;
+	ASSERT_TRUE(CreateTracker(tracker, event_loop, directory));
+	tracker->LoadSnapshot(path.c_str());
+
+	const auto listing = tracker->Lookup(key_a, mtime);
+	ASSERT_TRUE(listing);
+	EXPECT_EQ(*listing, (std::vector<std::string>{"x", "y"}));
+
+	/* the directory has been modified since */
+	EXPECT_FALSE(tracker->Lookup(key_a, {mtime.sec, mtime.nsec + 1}));
+
+	EXPECT_FALSE(tracker->Lookup(key_b, mtime));
+	EXPECT_FALSE(tracker->Lookup(key_b, {}));
+}
+
+TEST(Tracker, SnapshotTruncated)
+{
+	const TempDirectory tmp;
+	const auto directory = tmp.GetFileDescriptor();
+	const auto path = tmp.GetPath("snapshot");
+
+	const auto key = GetSubdirectoryKey(directory, "a");
+	ASSERT_FALSE(key.empty());
+
+	static constexpr DirectoryTime mtime{1234567890, 42};
+
+	EventLoop event_loop;
+
+	{
+		std::optional<DirectoryTracker> tracker;
+		if (!CreateTracker(tracker, event_loop, directory))
+			GTEST_SKIP() << "fanotify not available";
+
+		tracker->BeginScan(key);
+		tracker->EndScan(key, mtime, {"x", "y"});
+		tracker->SaveSnapshot(path, false);
+	}
+
+	struct stat st;
+	ASSERT_EQ(stat(path.c_str(), &st), 0);
+	ASSERT_EQ(truncate(path.c_str(), st.st_size - 1), 0);
+
+	std::optional<DirectoryTracker> tracker;
+	ASSERT_TRUE(CreateTracker(tracker, event_loop, directory));
+	EXPECT_THROW(tracker->LoadSnapshot(path.c_str()), std::runtime_error);
+
+	/* nothing from the broken snapshot was loaded */
+	EXPECT_FALSE(tracker->Lookup(key, mtime));
+}
@@ -0,0 +1,151 @@
+// SPDX-License-Identifier: BSD-2-Clause OR GPL-2.0-or-later
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#include "WVolume.hxx"
+#include "WConfig.hxx"
+#include "event/Loop.hxx"
+#include "io/UniqueFileDescriptor.hxx"
+
+#include <gtest/gtest.h>
+#include <liburing.h>
+
+#include <array>
+#include <string>
+
+static constexpr FileTime now{1'000'000};
+
+/**
+ * Add #n files of 1000 bytes each, with access times starting at
+ * #first_time.
+ */
+static void
+Fill(WalkVolume &volume, WalkDirectory &directory,
+     std::size_t n, FileTime first_time)
+{
+	for (std::size_t i = 0; i < n; ++i)
+		volume.Add(directory, std::to_string(i),
+			   first_time + FileTime{i}, 1000,
+			   0, 1000 * 1000);
+}
+
+static uint_least64_t
+SelectedBytes(const WalkResult &result, const WalkDirectory &directory) noexcept
+{
+	uint_least64_t bytes = 0;
+	for (const auto &i : result.files)
+		if (&*i.parent == &directory)
+			bytes += i.size;
+	return bytes;
+}
+
+static EventLoop &
+EnableUring(EventLoop &event_loop)
+{
+	event_loop.EnableUring(16, IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_COOP_TASKRUN);
+	return event_loop;
+}
+
+struct VolumeFixture {
+	EventLoop event_loop;
+
+	WalkDirectoryRef root{
+		WalkDirectoryRef::Adopt{},
+		*new WalkDirectory(*EnableUring(event_loop).GetUring(), 1,
+				   WalkDirectory::RootTag{},
+				   UniqueFileDescriptor{}),
+	};
+
+	WalkDirectoryRef big_directory{
+		WalkDirectoryRef::Adopt{},
+		*new WalkDirectory(*root, std::string{"big"}, {}),
+	};
+
+	WalkDirectoryRef small_directory{
+		WalkDirectoryRef::Adopt{},
+		*new WalkDirectory(*root, std::string{"small"}, {}),
+	};
+};
+
+/**
+ * A plain LRU selection would empty the small volume, because its
+ * files are the oldest; the fair-share selection takes everything
+ * from the volume which exceeds its share.
+ */
+TEST(Volume, FairShare)
+{
+	VolumeFixture f;
+
+	WalkVolume big{*f.big_directory, nullptr};
+	WalkVolume small{*f.small_directory, nullptr};
+
+	Fill(big, *f.big_directory, 90, now - FileTime{10000});
+	Fill(small, *f.small_directory, 10, now - FileTime{20000});
+
+	const std::array<WalkVolume *, 2> volumes{&big, &small};
+
+	WalkResult result;
+	SelectFairShare(volumes, 0, 20 * 1000, now, result, "Cull");
+
+	EXPECT_EQ(result.files.size(), 20u);
+	EXPECT_EQ(result.total_bytes, 20u * 1000);
+	EXPECT_EQ(SelectedBytes(result, *f.big_directory), 20u * 1000);
+	EXPECT_EQ(SelectedBytes(result, *f.small_directory), 0u);
+}
+
+/**
+ * The minimum share protects a volume even if the cull target
+ * cannot be reached without it.
+ */
+TEST(Volume, MinShare)
+{
+	VolumeFixture f;
+
+	const VolumeShare small_share{
+		.name = "small",
+		.min_share = 10,
+	};
+
+	WalkVolume big{*f.big_directory, nullptr};
+	WalkVolume small{*f.small_directory, &small_share};
+
+	Fill(big, *f.big_directory, 90, now - FileTime{10000});
+	Fill(small, *f.small_directory, 10, now - FileTime{20000});
+
+	const std::array<WalkVolume *, 2> volumes{&big, &small};
+
+	WalkResult result;
+	SelectFairShare(volumes, 0, 95 * 1000, now, result, "Cull");
+
+	EXPECT_EQ(SelectedBytes(result, *f.big_directory), 90u * 1000);
+	EXPECT_EQ(SelectedBytes(result, *f.small_directory), 0u);
+}
+
+/**
+ * Two volumes of the same size: the one with the lower weight
+ * exceeds its share and is culled first.
+ */
+TEST(Volume, Weight)
+{
+	VolumeFixture f;
+
+	const VolumeShare big_share{
+		.name = "big",
+		.weight = 4,
+	};
+
+	WalkVolume big{*f.big_directory, &big_share};
+	WalkVolume small{*f.small_directory, nullptr};
+
+	Fill(big, *f.big_directory, 50, now - FileTime{10000});
+	Fill(small, *f.small_directory, 50, now - FileTime{10000});
+
+	const std::array<WalkVolume *, 2> volumes{&big, &small};
+
+	WalkResult result;
+	SelectFairShare(volumes, 0, 10 * 1000, now, result, "Cull");
+
+	EXPECT_EQ(result.total_bytes, 10u * 1000);
+	EXPECT_GT(SelectedBytes(result, *f.small_directory),
+		  SelectedBytes(result, *f.big_directory));
+}
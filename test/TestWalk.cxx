@@ -2,23 +2,34 @@
 // Copyright CM4all GmbH
 // author: Max Kellermann <max.kellermann@ionos.com>
 
+#include "Tracker.hxx"
 #include "Walk.hxx"
+#include "WCheckpointFile.hxx"
+#include "WalkCollector.hxx"
 #include "WHandler.hxx"
+#include "WTrace.hxx"
+#include "TempDirectory.hxx"
+#include "event/FineTimerEvent.hxx"
 #include "event/Loop.hxx"
 #include "io/FileAt.hxx"
 #include "io/Open.hxx"
-#include "io/RecursiveDelete.hxx"
-#include "io/Temp.hxx"
 #include "io/UniqueFileDescriptor.hxx"
-#include "util/ScopeExit.hxx"
 
 #include <gtest/gtest.h>
 #include <liburing.h>
 
 #include <array>
+#include <chrono>
 #include <memory>
+#include <optional>
+#include <set>
+#include <thread>
 
-#include <fcntl.h> // for O_PATH
+#include <fmt/core.h>
+
+#include <fcntl.h> // for O_CREAT
+#include <sys/stat.h> // for mkdirat(), fstat(), fstatat()
+#include <unistd.h> // for unlinkat(), faccessat()
 
 struct WalkCompletion final : WalkHandler {
 	EventLoop &event_loop;
@@ -46,19 +57,14 @@ struct WalkCompletion final : WalkHandler {
 
 TEST(Walk, EmptyRootFinishes)
 {
-	const auto tmp = OpenTmpDir(O_PATH);
-	const auto directory_name = MakeTempDirectory(tmp, 0700);
-	AtScopeExit(&tmp, &directory_name) {
-		RecursiveDelete({tmp, directory_name});
-	};
-
-	const auto directory = OpenDirectoryPath({tmp, directory_name});
+	const TempDirectory tmp;
+	const auto directory = tmp.GetFileDescriptor();
 
 	EventLoop event_loop;
 	event_loop.EnableUring(16384, IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_COOP_TASKRUN);
 
 	WalkCompletion completion{event_loop};
-	auto walk = std::make_unique<Walk>(*event_loop.GetUring(), 64, 1024 * 1024, completion);
+	auto walk = std::make_unique<Walk>(event_loop, *event_loop.GetUring(), WalkConfig{}, 64, 1024 * 1024, completion);
 	walk->Start(directory);
 
 	event_loop.Run();
@@ -68,3 +74,520 @@ TEST(Walk, EmptyRootFinishes)
 	EXPECT_EQ(completion.files, 0u);
 	EXPECT_EQ(completion.total_bytes, 0u);
 }
+
+TEST(Walk, ManyFiles)
+{
+	const TempDirectory tmp;
+	const auto directory = tmp.GetFileDescriptor();
+
+	/* more files than fit into one time slice */
+	static constexpr std::size_t N_FILES = 10000;
+	for (std::size_t i = 0; i < N_FILES; ++i) {
+		char name[32];
+		*fmt::format_to(name, "{}", i) = 0;
+		const auto fd = OpenWriteOnly({directory, name}, O_CREAT);
+	}
+
+	EventLoop event_loop;
+	event_loop.EnableUring(16384, IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_COOP_TASKRUN);
+
+	WalkCompletion completion{event_loop};
+	auto walk = std::make_unique<Walk>(event_loop, *event_loop.GetUring(), WalkConfig{}, 64, 1024 * 1024, completion);
+	walk->Start(directory);
+
+	event_loop.Run();
+
+	/* all files are empty, so the byte limit is never reached and
+	   all of them are collected */
+	EXPECT_TRUE(completion.finished);
+	EXPECT_EQ(completion.ancient, 0u);
+	EXPECT_EQ(completion.files, N_FILES);
+	EXPECT_EQ(completion.total_bytes, 0u);
+}
+
+/**
+ * A statx() limit below RESUME_STAT_DIVISOR must not stall the walk.
+ */
+TEST(Walk, SmallQueueDepth)
+{
+	const TempDirectory tmp;
+	const auto directory = tmp.GetFileDescriptor();
+
+	static constexpr std::size_t N_FILES = 100;
+	for (std::size_t i = 0; i < N_FILES; ++i) {
+		char name[32];
+		*fmt::format_to(name, "{}", i) = 0;
+		const auto fd = OpenWriteOnly({directory, name}, O_CREAT);
+	}
+
+	EventLoop event_loop;
+	event_loop.EnableUring(16384, IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_COOP_TASKRUN);
+
+	/* fail instead of hanging */
+	FineTimerEvent timeout{event_loop, BIND_METHOD(event_loop, &EventLoop::Break)};
+	timeout.Schedule(std::chrono::seconds{10});
+
+	WalkCompletion completion{event_loop};
+	auto walk = std::make_unique<Walk>(event_loop, *event_loop.GetUring(), WalkConfig{}, N_FILES, 1024 * 1024, completion);
+	walk->SetMaxStat(2);
+	walk->Start(directory);
+
+	event_loop.Run();
+
+	EXPECT_TRUE(completion.finished);
+	EXPECT_EQ(completion.files, N_FILES);
+}
+
+TEST(Walk, InodeOrder)
+{
+	const TempDirectory tmp;
+	const auto directory = tmp.GetFileDescriptor();
+
+	/* a subdirectory which is scanned while statx() of the
+	   parent's files are still in flight */
+	ASSERT_EQ(mkdirat(directory.Get(), "sub", 0700), 0);
+	const auto sub = OpenDirectoryPath({directory, "sub"});
+
+	static constexpr std::size_t N_FILES = 5000;
+	for (std::size_t i = 0; i < N_FILES; ++i) {
+		char name[32];
+		*fmt::format_to(name, "{}", i) = 0;
+		const auto fd = OpenWriteOnly({i % 2 == 0 ? directory : sub, name}, O_CREAT);
+	}
+
+	EventLoop event_loop;
+	event_loop.EnableUring(16384, IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_COOP_TASKRUN);
+
+	/* the DirectoryTracker listing records the order in which
+	   statx() was submitted; fanotify needs CAP_SYS_ADMIN */
+	std::optional<DirectoryTracker> tracker;
+	try {
+		tracker.emplace(event_loop, directory);
+	} catch (...) {
+	}
+
+	WalkConfig config;
+	config.inode_order = true;
+
+	WalkCompletion completion{event_loop};
+	auto walk = std::make_unique<Walk>(event_loop, *event_loop.GetUring(), config, 64, 1024 * 1024, completion);
+	if (tracker)
+		walk->SetTracker(*tracker);
+	walk->Start(directory);
+
+	event_loop.Run();
+	walk.reset();
+
+	EXPECT_TRUE(completion.finished);
+	EXPECT_EQ(completion.ancient, 0u);
+	EXPECT_EQ(completion.files, N_FILES);
+	EXPECT_EQ(completion.total_bytes, 0u);
+
+	if (!tracker)
+		GTEST_SKIP() << "fanotify not available, submission order not checked";
+
+	struct stat st;
+	ASSERT_EQ(fstat(sub.Get(), &st), 0);
+
+	const auto listing = tracker->Lookup(DirectoryTracker::GetKey(sub),
+					     {st.st_mtim.tv_sec, static_cast<uint_least32_t>(st.st_mtim.tv_nsec)});
+	ASSERT_TRUE(listing);
+	ASSERT_EQ(listing->size(), N_FILES / 2);
+
+	ino_t previous = 0;
+	for (const auto &name : *listing) {
+		ASSERT_EQ(fstatat(sub.Get(), name.c_str(), &st, AT_SYMLINK_NOFOLLOW), 0);
+		EXPECT_GT(st.st_ino, previous);
+		previous = st.st_ino;
+	}
+}
+
+/**
+ * Delete files and directories from another thread while the #Walk
+ * is running: vanished entries must be counted silently, all
+ * surviving files must be found, and the walk must not be slowed
+ * down by logging.
+ */
+TEST(Walk, Churn)
+{
+	const TempDirectory tmp;
+	const auto directory = tmp.GetFileDescriptor();
+
+	static constexpr std::size_t N_DIRECTORIES = 20, FILES_PER_DIRECTORY = 500;
+	static constexpr std::size_t N_FILES = N_DIRECTORIES * FILES_PER_DIRECTORY;
+
+	/* the last directories are deleted completely */
+	static constexpr std::size_t N_DELETED_DIRECTORIES = 2;
+
+	std::array<UniqueFileDescriptor, N_DIRECTORIES> directories;
+
+	for (std::size_t i = 0; i < N_DIRECTORIES; ++i) {
+		char name[32];
+		*fmt::format_to(name, "{}", i) = 0;
+		ASSERT_EQ(mkdirat(directory.Get(), name, 0700), 0);
+		directories[i] = OpenDirectoryPath({directory, name});
+
+		for (std::size_t j = 0; j < FILES_PER_DIRECTORY; ++j) {
+			*fmt::format_to(name, "{}", j) = 0;
+			const auto fd = OpenWriteOnly({directories[i], name}, O_CREAT);
+		}
+	}
+
+	EventLoop event_loop;
+	event_loop.EnableUring(16384, IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_COOP_TASKRUN);
+
+	WalkCompletion completion{event_loop};
+	auto walk = std::make_unique<Walk>(event_loop, *event_loop.GetUring(), WalkConfig{}, 64, 1024 * 1024, completion);
+
+	std::size_t n_deleted = 0;
+	std::thread deleter{[&directory, &directories, &n_deleted]{
+		char name[32];
+
+		/* every other file */
+		for (std::size_t j = 1; j < FILES_PER_DIRECTORY; j += 2) {
+			for (std::size_t i = 0; i < N_DIRECTORIES - N_DELETED_DIRECTORIES; ++i) {
+				*fmt::format_to(name, "{}", j) = 0;
+				if (unlinkat(directories[i].Get(), name, 0) == 0)
+					++n_deleted;
+			}
+		}
+
+		/* whole directories */
+		for (std::size_t i = N_DIRECTORIES - N_DELETED_DIRECTORIES; i < N_DIRECTORIES; ++i) {
+			for (std::size_t j = 0; j < FILES_PER_DIRECTORY; ++j) {
+				*fmt::format_to(name, "{}", j) = 0;
+				if (unlinkat(directories[i].Get(), name, 0) == 0)
+					++n_deleted;
+			}
+
+			*fmt::format_to(name, "{}", i) = 0;
+			unlinkat(directory.Get(), name, AT_REMOVEDIR);
+		}
+	}};
+
+	const auto start_time = std::chrono::steady_clock::now();
+	walk->Start(directory);
+	event_loop.Run();
+	const auto duration = std::chrono::steady_clock::now() - start_time;
+
+	deleter.join();
+
+	EXPECT_TRUE(completion.finished);
+	EXPECT_EQ(completion.ancient, 0u);
+
+	/* all surviving files have been found; deleted files may or
+	   may not have been seen */
+	EXPECT_GE(completion.files, N_FILES - n_deleted);
+	EXPECT_LE(completion.files, N_FILES);
+	EXPECT_LE(completion.files + walk->GetErrors().GetVanished(),
+		  N_FILES + N_DIRECTORIES);
+
+	/* vanishing files are not errors */
+	EXPECT_EQ(walk->GetErrors().GetUnexpected(), 0u);
+
+	EXPECT_LT(duration, std::chrono::seconds{10});
+}
+
+TEST(Walk, Trace)
+{
+	const TempDirectory tmp;
+	const auto directory = tmp.GetFileDescriptor();
+
+	/* the trace file lives outside of the tree */
+	const TempDirectory trace_directory;
+
+	static constexpr std::size_t N_DIRECTORIES = 4, N_FILES = 10;
+	for (std::size_t i = 0; i < N_DIRECTORIES; ++i) {
+		char name[32];
+		*fmt::format_to(name, "d{}", i) = 0;
+		ASSERT_EQ(mkdirat(directory.Get(), name, 0700), 0);
+
+		const auto subdirectory = OpenDirectoryPath({directory, name});
+		for (std::size_t j = 0; j < N_FILES; ++j) {
+			*fmt::format_to(name, "f{}", j) = 0;
+			const auto fd = OpenWriteOnly({subdirectory, name}, O_CREAT);
+		}
+	}
+
+	const std::string trace_path = trace_directory.GetPath("trace");
+
+	EventLoop event_loop;
+	event_loop.EnableUring(16384, IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_COOP_TASKRUN);
+
+	const FileTime now{time(nullptr)};
+	WalkTraceWriter trace{trace_path, now};
+
+	WalkCompletion completion{event_loop};
+	auto walk = std::make_unique<Walk>(event_loop, *event_loop.GetUring(), WalkConfig{}, 64, 1024 * 1024, completion);
+	walk->SetTrace(trace);
+	walk->Start(directory);
+
+	event_loop.Run();
+	walk.reset();
+
+	ASSERT_TRUE(completion.finished);
+	ASSERT_FALSE(trace.IsFailed());
+	trace.Commit();
+	ASSERT_TRUE(trace.Wait());
+
+	WalkTraceReader reader{trace_path.c_str()};
+	EXPECT_EQ(reader.GetTime(), now);
+
+	/* the same name in different directories has different
+	   keys */
+	std::set<std::pair<uint_least64_t, uint_least64_t>> keys;
+	std::set<uint_least64_t> directories;
+
+	WalkTraceRecord record;
+	while (reader.Read(record)) {
+		EXPECT_TRUE(keys.emplace(record.directory, record.name).second);
+		directories.emplace(record.directory);
+		EXPECT_EQ(record.size, 0u);
+	}
+
+	EXPECT_EQ(keys.size(), N_DIRECTORIES * N_FILES);
+	EXPECT_EQ(directories.size(), N_DIRECTORIES);
+}
+
+TEST(Walk, TraceRetention)
+{
+	const TempDirectory tmp;
+	const auto directory = tmp.GetFileDescriptor();
+
+	for (const char *name : {"100.trace", "9.trace", "200.trace",
+				 "50.trace", "300.trace.tmp", "other"})
+		OpenWriteOnly({directory, name}, O_CREAT);
+
+	DeleteOldTraces(tmp.GetPath().c_str(), 2);
+
+	/* only the two newest traces are kept, and other files are
+	   ignored */
+	for (const char *name : {"100.trace", "200.trace",
+				 "300.trace.tmp", "other"})
+		EXPECT_EQ(faccessat(directory.Get(), name, F_OK, 0), 0) << name;
+
+	for (const char *name : {"9.trace", "50.trace"})
+		EXPECT_NE(faccessat(directory.Get(), name, F_OK, 0), 0) << name;
+}
+
+TEST(Walk, FdBudget)
+{
+	const TempDirectory tmp;
+	const auto directory = tmp.GetFileDescriptor();
+
+	static constexpr std::size_t N_DIRECTORIES = 20, N_FILES = 3;
+	for (std::size_t i = 0; i < N_DIRECTORIES; ++i) {
+		char name[32];
+		*fmt::format_to(name, "d{}", i) = 0;
+		ASSERT_EQ(mkdirat(directory.Get(), name, 0700), 0);
+
+		const auto subdirectory = OpenDirectoryPath({directory, name});
+		for (std::size_t j = 0; j < N_FILES; ++j) {
+			*fmt::format_to(name, "f{}", j) = 0;
+			const auto fd = OpenWriteOnly({subdirectory, name}, O_CREAT);
+		}
+	}
+
+	EventLoop event_loop;
+	event_loop.EnableUring(16384, IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_COOP_TASKRUN);
+
+	static constexpr std::size_t FD_BUDGET = 2;
+
+	WalkCollector handler{event_loop};
+	auto walk = std::make_unique<Walk>(event_loop, *event_loop.GetUring(),
+					   WalkConfig{.fd_budget = FD_BUDGET},
+					   64, 1024 * 1024, handler);
+	walk->Start(directory);
+
+	event_loop.Run();
+	walk.reset();
+
+	ASSERT_TRUE(handler.result);
+	ASSERT_EQ(handler.result->files.size(), N_DIRECTORIES * N_FILES);
+
+	for (const auto &file : handler.result->files) {
+		EXPECT_LE(file.parent->cache.n_open, FD_BUDGET);
+
+		/* evicted directories are reopened on demand */
+		const WalkDirectoryPin pin{*file.parent};
+		ASSERT_TRUE(pin);
+
+		struct stat st;
+		EXPECT_EQ(fstatat(pin.GetFileDescriptor().Get(), file.name.c_str(),
+				  &st, AT_SYMLINK_NOFOLLOW), 0);
+	}
+}
+
+/**
+ * Walk the given tree, interrupt the walk, resume it and verify that
+ * every file was found exactly once.
+ *
+ * @param save pass the checkpoint through a file (see
+ * SaveWalkCheckpoint()), as if the process had been restarted
+ */
+static void
+TestCheckpoint(FileDescriptor directory, std::size_t n_files, bool save=false)
+{
+	EventLoop event_loop;
+	event_loop.EnableUring(16384, IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_COOP_TASKRUN);
+
+	WalkCollector handler{event_loop};
+
+	/* interrupt the first walk after a few event loop
+	   iterations */
+	auto walk = std::make_unique<Walk>(event_loop, *event_loop.GetUring(),
+					   WalkConfig{},
+					   n_files, 1024 * 1024,
+					   handler);
+	walk->SetMaxStat(16);
+	walk->Start(directory);
+
+	FineTimerEvent interrupt{event_loop, BIND_METHOD(event_loop, &EventLoop::Break)};
+	interrupt.Schedule(std::chrono::milliseconds{1});
+	event_loop.Run();
+
+	if (handler.result)
+		GTEST_SKIP() << "Walk finished before it could be interrupted";
+
+	auto checkpoint = walk->TakeCheckpoint();
+
+	std::optional<SavedWalkCheckpoint> saved;
+	if (save) {
+		const TempDirectory tmp;
+		const auto path = tmp.GetPath("checkpoint");
+		const auto taken = std::chrono::system_clock::now();
+		SaveWalkCheckpoint(path, checkpoint, taken);
+
+		std::chrono::system_clock::time_point loaded_taken;
+		saved.emplace(LoadWalkCheckpoint(path.c_str(), loaded_taken));
+		EXPECT_EQ(std::chrono::system_clock::to_time_t(loaded_taken),
+			  std::chrono::system_clock::to_time_t(taken));
+		EXPECT_EQ(saved->completed, checkpoint.completed);
+		EXPECT_EQ(saved->files.size(), checkpoint.result.files.size());
+	}
+
+	walk.reset();
+
+	walk = std::make_unique<Walk>(event_loop, *event_loop.GetUring(),
+				      WalkConfig{},
+				      n_files, 1024 * 1024,
+				      handler);
+	if (saved) {
+		/* the directories of the previous walk are gone */
+		{
+			const auto discard = std::move(checkpoint);
+		}
+
+		walk->Resume(directory, std::move(*saved));
+	} else
+		walk->Resume(directory, std::move(checkpoint));
+	event_loop.Run();
+	walk.reset();
+
+	/* every file was found exactly once, and the recreated
+	   directories are usable */
+	ASSERT_TRUE(handler.result);
+	std::set<std::string> names;
+	for (const auto &file : handler.result->files) {
+		EXPECT_TRUE(names.emplace(file.name).second);
+
+		const WalkDirectoryPin pin{*file.parent};
+		ASSERT_TRUE(pin);
+
+		struct stat st;
+		EXPECT_EQ(fstatat(pin.GetFileDescriptor().Get(), file.name.c_str(),
+				  &st, AT_SYMLINK_NOFOLLOW), 0);
+	}
+	EXPECT_EQ(names.size(), n_files);
+}
+
+/**
+ * Create the cachefiles layout for TestCheckpoint(): volumes
+ * containing fan-out directories containing files.
+ */
+static void
+MakeCheckpointTree(FileDescriptor directory,
+		   std::size_t n_volumes, std::size_t n_fanout, std::size_t n_files)
+{
+	for (std::size_t i = 0; i < n_volumes; ++i) {
+		char name[64];
+		*fmt::format_to(name, "v{}", i) = 0;
+		ASSERT_EQ(mkdirat(directory.Get(), name, 0700), 0);
+		const auto volume = OpenDirectoryPath({directory, name});
+
+		for (std::size_t j = 0; j < n_fanout; ++j) {
+			*fmt::format_to(name, "@{}", j) = 0;
+			ASSERT_EQ(mkdirat(volume.Get(), name, 0700), 0);
+			const auto fanout = OpenDirectoryPath({volume, name});
+
+			for (std::size_t k = 0; k < n_files; ++k) {
+				*fmt::format_to(name, "{}-{}-{}", i, j, k) = 0;
+				const auto fd = OpenWriteOnly({fanout, name}, O_CREAT);
+			}
+		}
+	}
+}
+
+TEST(Walk, Checkpoint)
+{
+	const TempDirectory tmp;
+	const auto directory = tmp.GetFileDescriptor();
+
+	static constexpr std::size_t N_VOLUMES = 4, N_FANOUT = 8, N_FILES = 50;
+	MakeCheckpointTree(directory, N_VOLUMES, N_FANOUT, N_FILES);
+
+	TestCheckpoint(directory, N_VOLUMES * N_FANOUT * N_FILES);
+}
+
+/**
+ * Resume a checkpoint which has been saved to a file by an earlier
+ * process.
+ */
+TEST(Walk, CheckpointSaved)
+{
+	const TempDirectory tmp;
+	const auto directory = tmp.GetFileDescriptor();
+
+	static constexpr std::size_t N_VOLUMES = 4, N_FANOUT = 8, N_FILES = 50;
+	MakeCheckpointTree(directory, N_VOLUMES, N_FANOUT, N_FILES);
+
+	TestCheckpoint(directory, N_VOLUMES * N_FANOUT * N_FILES, true);
+}
+
+/**
+ * Subtrees below the levels recorded in WalkCheckpoint::completed
+ * are scanned again after resuming; files collected from them before
+ * the checkpoint must not be kept.
+ */
+TEST(Walk, CheckpointDeep)
+{
+	const TempDirectory tmp;
+	const auto directory = tmp.GetFileDescriptor();
+
+	static constexpr std::size_t N_VOLUMES = 2, N_FANOUT = 4, N_SUB = 8, N_FILES = 20;
+	for (std::size_t i = 0; i < N_VOLUMES; ++i) {
+		char name[64];
+		*fmt::format_to(name, "v{}", i) = 0;
+		ASSERT_EQ(mkdirat(directory.Get(), name, 0700), 0);
+		const auto volume = OpenDirectoryPath({directory, name});
+
+		for (std::size_t j = 0; j < N_FANOUT; ++j) {
+			*fmt::format_to(name, "@{}", j) = 0;
+			ASSERT_EQ(mkdirat(volume.Get(), name, 0700), 0);
+			const auto fanout = OpenDirectoryPath({volume, name});
+
+			for (std::size_t k = 0; k < N_SUB; ++k) {
+				*fmt::format_to(name, "s{}", k) = 0;
+				ASSERT_EQ(mkdirat(fanout.Get(), name, 0700), 0);
+				const auto sub = OpenDirectoryPath({fanout, name});
+
+				for (std::size_t l = 0; l < N_FILES; ++l) {
+					*fmt::format_to(name, "{}-{}-{}-{}", i, j, k, l) = 0;
+					const auto fd = OpenWriteOnly({sub, name}, O_CREAT);
+				}
+			}
+		}
+	}
+
+	TestCheckpoint(directory, N_VOLUMES * N_FANOUT * N_SUB * N_FILES);
+}
@@ -0,0 +1,57 @@
+// SPDX-License-Identifier: BSD-2-Clause OR GPL-2.0-or-later
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#include "WErrors.hxx"
+#include "system/Error.hxx"
+
+#include <gtest/gtest.h>
+
+#include <cerrno>
+
+TEST(WalkErrors, Errno)
+{
+	const Event::TimePoint now{};
+
+	WalkErrors errors;
+	errors.AddErrno("Stat error", ENOENT, now);
+	errors.AddErrno("Stat error", ENOENT, now);
+	errors.AddErrno("Stat error", ESTALE, now);
+	EXPECT_EQ(errors.GetVanished(), 2u);
+	EXPECT_EQ(errors.GetStale(), 1u);
+	EXPECT_EQ(errors.GetUnexpected(), 0u);
+
+	errors.AddErrno("Stat error", EACCES, now);
+	EXPECT_EQ(errors.GetVanished(), 2u);
+	EXPECT_EQ(errors.GetUnexpected(), 1u);
+}
+
+TEST(WalkErrors, Exception)
+{
+	const Event::TimePoint now{};
+
+	WalkErrors errors;
+	errors.Add("Stat error", std::make_exception_ptr(MakeErrno(ENOENT, "x")), now);
+	errors.Add("Stat error", std::make_exception_ptr(MakeErrno(ESTALE, "x")), now);
+	errors.Add("Stat error", std::make_exception_ptr(std::runtime_error{"x"}), now);
+	EXPECT_EQ(errors.GetVanished(), 1u);
+	EXPECT_EQ(errors.GetStale(), 1u);
+	EXPECT_EQ(errors.GetUnexpected(), 1u);
+}
+
+TEST(WalkErrors, RateLimit)
+{
+	const Event::TimePoint now{};
+
+	WalkErrors errors;
+	for (unsigned i = 0; i < 15; ++i)
+		errors.AddErrno("Stat error", EIO, now);
+
+	EXPECT_EQ(errors.GetUnexpected(), 15u);
+	EXPECT_EQ(errors.GetSuppressed(), 5u);
+
+	/* the next interval logs again */
+	errors.AddErrno("Stat error", EIO, now + std::chrono::seconds{1});
+	EXPECT_EQ(errors.GetUnexpected(), 16u);
+	EXPECT_EQ(errors.GetSuppressed(), 5u);
+}
@@ -0,0 +1,35 @@
+// SPDX-License-Identifier: BSD-2-Clause OR GPL-2.0-or-later
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#pragma once
+
+#include "WHandler.hxx"
+#include "WResult.hxx"
+#include "event/Loop.hxx"
+
+#include <optional>
+
+/**
+ * A #WalkHandler for tests which keeps the #WalkResult and breaks
+ * the #EventLoop when the #Walk finishes.
+ */
+struct WalkCollector final : WalkHandler {
+	EventLoop &event_loop;
+	std::optional<WalkResult> result;
+	std::size_t ancient = 0;
+
+	explicit WalkCollector(EventLoop &_event_loop) noexcept
+		:event_loop(_event_loop) {}
+
+	void OnWalkAncient([[maybe_unused]] WalkDirectory &directory,
+			   [[maybe_unused]] std::string &&filename,
+			   [[maybe_unused]] uint_least64_t size) noexcept override {
+		++ancient;
+	}
+
+	void OnWalkFinished(WalkResult &&_result) noexcept override {
+		result.emplace(std::move(_result));
+		event_loop.Break();
+	}
+};